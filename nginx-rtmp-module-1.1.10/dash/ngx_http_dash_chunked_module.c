@@ -0,0 +1,394 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+static char * ngx_http_dash_chunked(ngx_conf_t *cf, ngx_command_t *cmd,
+       void *conf);
+static void * ngx_http_dash_chunked_create_loc_conf(ngx_conf_t *cf);
+static char * ngx_http_dash_chunked_merge_loc_conf(ngx_conf_t *cf,
+       void *parent, void *child);
+
+
+/* 正在写的切片轮询文件长度的间隔 */
+#define NGX_HTTP_DASH_CHUNKED_POLL      20
+
+
+typedef struct {
+    ngx_flag_t                          enable;
+    ngx_msec_t                          timeout;
+} ngx_http_dash_chunked_loc_conf_t;
+
+
+/* 切片还在以.part文件逐块写入, 新写入的部分按HTTP chunked发送 */
+typedef struct {
+    ngx_str_t                           path;
+    ngx_file_t                          file;
+    off_t                               offset;
+    ngx_event_t                         poll;
+    ngx_msec_t                          deadline;
+    unsigned                            done:1;
+} ngx_http_dash_chunked_ctx_t;
+
+
+static ngx_command_t  ngx_http_dash_chunked_commands[] = {
+
+    { ngx_string("dash_chunked"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_dash_chunked,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dash_chunked_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_dash_chunked_loc_conf_t, timeout),
+      NULL },
+
+    ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_dash_chunked_module_ctx = {
+    NULL,                               /* preconfiguration */
+    NULL,                               /* postconfiguration */
+
+    NULL,                               /* create main configuration */
+    NULL,                               /* init main configuration */
+
+    NULL,                               /* create server configuration */
+    NULL,                               /* merge server configuration */
+
+    ngx_http_dash_chunked_create_loc_conf,  /* create location configuration */
+    ngx_http_dash_chunked_merge_loc_conf,   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_dash_chunked_module = {
+    NGX_MODULE_V1,
+    &ngx_http_dash_chunked_module_ctx,  /* module context */
+    ngx_http_dash_chunked_commands,     /* module directives */
+    NGX_HTTP_MODULE,                    /* module type */
+    NULL,                               /* init master */
+    NULL,                               /* init module */
+    NULL,                               /* init process */
+    NULL,                               /* init thread */
+    NULL,                               /* exit thread */
+    NULL,                               /* exit process */
+    NULL,                               /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * 发送.part文件中新写入的部分, 正式文件出现(切片已经改名)后发送剩余部分
+ * 并结束响应; 没有置done时返回NGX_AGAIN表示继续轮询, 置done之后
+ * 返回值是输出过滤器的结果, 不能再轮询以免重复发送结束块
+ */
+static ngx_int_t
+ngx_http_dash_chunked_send(ngx_http_request_t *r,
+    ngx_http_dash_chunked_ctx_t *ctx)
+{
+    ngx_http_dash_chunked_loc_conf_t   *dclf;
+    ngx_file_info_t                     fi;
+    ngx_chain_t                         out;
+    ngx_buf_t                          *b;
+    ngx_uint_t                          complete;
+    ngx_int_t                           rc;
+    off_t                               size;
+
+    dclf = ngx_http_get_module_loc_conf(r, ngx_http_dash_chunked_module);
+
+    if (r->connection->buffered) {
+
+        /* 上次的数据还没发完, 先不读新数据 */
+
+        rc = ngx_http_output_filter(r, NULL);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (r->connection->buffered) {
+            return NGX_AGAIN;
+        }
+    }
+
+    /* 改名发生在最后一块写完之后, 先判断是否完成再取长度 */
+
+    complete = (ngx_file_info(ctx->path.data, &fi) != NGX_FILE_ERROR);
+
+    if (ngx_fd_info(ctx->file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", &ctx->file.name);
+        return NGX_ERROR;
+    }
+
+    size = ngx_file_size(&fi);
+
+    if (size <= ctx->offset && !complete) {
+
+        if ((ngx_msec_int_t) (ctx->deadline - ngx_current_msec) > 0) {
+            return NGX_AGAIN;
+        }
+
+        /* 推流中断, 切片不会再增长, 按已有的内容结束 */
+
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "dash chunked: \"%V\" timed out", &ctx->file.name);
+
+        complete = 1;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (size > ctx->offset) {
+        b->file = &ctx->file;
+        b->in_file = 1;
+        b->file_pos = ctx->offset;
+        b->file_last = size;
+
+        ctx->offset = size;
+        ctx->deadline = ngx_current_msec + dclf->timeout;
+    }
+
+    b->flush = 1;
+    b->last_buf = complete;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    rc = ngx_http_output_filter(r, &out);
+
+    if (complete) {
+        ctx->done = 1;
+        return rc;
+    }
+
+    if (rc == NGX_ERROR) {
+        return rc;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_http_dash_chunked_poll_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t             *r;
+    ngx_http_dash_chunked_ctx_t    *ctx;
+    ngx_connection_t               *c;
+    ngx_int_t                       rc;
+
+    r = ev->data;
+    c = r->connection;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_dash_chunked_module);
+
+    rc = ngx_http_dash_chunked_send(r, ctx);
+
+    if (rc == NGX_AGAIN && !ctx->done) {
+        ngx_add_timer(ev, NGX_HTTP_DASH_CHUNKED_POLL);
+        return;
+    }
+
+    /* 结束块没写完时由ngx_http_writer继续 */
+
+    ngx_http_finalize_request(r, rc);
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_dash_chunked_poll_cleanup(void *data)
+{
+    ngx_event_t  *ev = data;
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+}
+
+
+/*
+ * 正式切片文件存在时交给static模块, 否则找同名的.part文件,
+ * 不带Content-Length发送, HTTP/1.1下由chunked过滤模块分块
+ */
+static ngx_int_t
+ngx_http_dash_chunked_handler(ngx_http_request_t *r)
+{
+    ngx_http_dash_chunked_loc_conf_t   *dclf;
+    ngx_http_dash_chunked_ctx_t        *ctx;
+    ngx_pool_cleanup_t                 *cln;
+    ngx_pool_cleanup_file_t            *clnf;
+    ngx_file_info_t                     fi;
+    ngx_int_t                           rc;
+    size_t                              root;
+    u_char                             *last, *part;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (r->uri.data[r->uri.len - 1] == '/') {
+        return NGX_DECLINED;
+    }
+
+    dclf = ngx_http_get_module_loc_conf(r, ngx_http_dash_chunked_module);
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_dash_chunked_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    last = ngx_http_map_uri_to_path(r, &ctx->path, &root, sizeof(".part"));
+    if (last == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx->path.len = last - ctx->path.data;
+
+    if (ngx_file_info(ctx->path.data, &fi) != NGX_FILE_ERROR) {
+        return NGX_DECLINED;
+    }
+
+    part = ngx_pnalloc(r->pool, ctx->path.len + sizeof(".part"));
+    if (part == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    last = ngx_cpymem(part, ctx->path.data, ctx->path.len);
+    *ngx_cpymem(last, ".part", sizeof(".part") - 1) = 0;
+
+    ctx->file.name.data = part;
+    ctx->file.name.len = ctx->path.len + sizeof(".part") - 1;
+    ctx->file.log = r->connection->log;
+
+    ctx->file.fd = ngx_open_file(part, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (ctx->file.fd == NGX_INVALID_FILE) {
+
+        /* 切片还没开始写或者已经改名, 由static模块处理 */
+
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "dash chunked: open \"%V\"", &ctx->file.name);
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        ngx_close_file(ctx->file.fd);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+    clnf->fd = ctx->file.fd;
+    clnf->name = part;
+    clnf->log = r->pool->log;
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = -1;
+    r->headers_out.last_modified_time = -1;
+
+    if (ngx_http_set_content_type(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_http_dash_chunked_poll_cleanup;
+    cln->data = &ctx->poll;
+
+    ctx->poll.handler = ngx_http_dash_chunked_poll_handler;
+    ctx->poll.data = r;
+    ctx->poll.log = r->connection->log;
+    ctx->deadline = ngx_current_msec + dclf->timeout;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_dash_chunked_module);
+
+    rc = ngx_http_dash_chunked_send(r, ctx);
+    if (rc != NGX_AGAIN || ctx->done) {
+        return rc;
+    }
+
+    /* 挂起请求, 由定时器轮询切片的增长 */
+
+    ngx_add_timer(&ctx->poll, NGX_HTTP_DASH_CHUNKED_POLL);
+
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    r->main->count++;
+
+    return NGX_DONE;
+}
+
+
+static char *
+ngx_http_dash_chunked(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_dash_chunked_loc_conf_t   *dclf = conf;
+    ngx_http_core_loc_conf_t           *clcf;
+
+    if (dclf->enable != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    dclf->enable = 1;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_dash_chunked_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_dash_chunked_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_dash_chunked_loc_conf_t   *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_dash_chunked_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->enable = NGX_CONF_UNSET;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_dash_chunked_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_dash_chunked_loc_conf_t   *prev = parent;
+    ngx_http_dash_chunked_loc_conf_t   *conf = child;
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+    ngx_conf_merge_msec_value(conf->timeout, prev->timeout, 10000);
+
+    return NGX_CONF_OK;
+}
@@ -6,6 +6,7 @@
 #include <ngx_rtmp_codec_module.h>
 #include "ngx_rtmp_live_module.h"
 #include "ngx_rtmp_mp4.h"
+#include "ngx_rtmp_thread.h"
 
 
 static ngx_rtmp_publish_pt              next_publish;
@@ -19,6 +20,7 @@ static void * ngx_rtmp_dash_create_app_conf(ngx_conf_t *cf);
 static char * ngx_rtmp_dash_merge_app_conf(ngx_conf_t *cf,
        void *parent, void *child);
 static ngx_int_t ngx_rtmp_dash_write_init_segments(ngx_rtmp_session_t *s);
+static ngx_int_t ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s);
 
 
 #define NGX_RTMP_DASH_BUFSIZE           (1024*1024)
@@ -43,6 +45,16 @@ typedef struct {
     char                                type;
     uint32_t                            earliest_pres_time;
     uint32_t                            latest_pres_time;
+
+    /*
+     * CMAF分块: 当前块从第chunk_start个样本开始, 样本数据暂存在chunk中,
+     * 切片以.part文件逐块写出, fd为.part文件
+     */
+    ngx_uint_t                          chunk_start;
+    ngx_uint_t                          chunk_seq;
+    size_t                              chunk_size;
+    u_char                             *chunk;
+
     ngx_rtmp_mp4_sample_t               samples[NGX_RTMP_DASH_MAX_SAMPLES];
 } ngx_rtmp_dash_track_t;
 
@@ -69,9 +81,29 @@ typedef struct {
 
     ngx_rtmp_dash_track_t               audio;
     ngx_rtmp_dash_track_t               video;
+
+#if (NGX_THREADS)
+    /* 切片拼接在线程池中完成, 播放列表改名排在其后 */
+    ngx_rtmp_thread_queue_t            *queue;
+    ngx_uint_t                          renaming;
+    unsigned                            playlist_pending:1;
+#endif
 } ngx_rtmp_dash_ctx_t;
 
 
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_rtmp_thread_job_t               job;
+    ngx_fd_t                            raw;
+    size_t                              mdat_size;
+    size_t                              header_size;
+    u_char                             *path;
+} ngx_rtmp_dash_job_t;
+
+#endif
+
+
 typedef struct {
     ngx_str_t                           path;
     ngx_msec_t                          playlen;
@@ -87,6 +119,10 @@ typedef struct {
     ngx_uint_t                          winfrags;
     ngx_flag_t                          cleanup;
     ngx_path_t                         *slot;
+    ngx_msec_t                          chunk;
+#if (NGX_THREADS)
+    ngx_thread_pool_t                  *thread_pool;
+#endif
 } ngx_rtmp_dash_app_conf_t;
 
 
@@ -134,6 +170,22 @@ static ngx_command_t ngx_rtmp_dash_commands[] = {
       offsetof(ngx_rtmp_dash_app_conf_t, nested),
       NULL },
 
+    { ngx_string("dash_chunk"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_dash_app_conf_t, chunk),
+      NULL },
+
+#if (NGX_THREADS)
+    { ngx_string("dash_thread_pool"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_rtmp_thread_pool_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_dash_app_conf_t, thread_pool),
+      NULL },
+#endif
+
     ngx_null_command
 };
 
@@ -212,6 +264,35 @@ ngx_rtmp_dash_rename_file(u_char *src, u_char *dst)
 }
 
 
+#if (NGX_THREADS)
+
+/* 播放列表已经发布, 期间的更新此时再写一次 */
+static void
+ngx_rtmp_dash_renamed(ngx_rtmp_thread_job_t *job, void *data)
+{
+    ngx_rtmp_session_t   *s = data;
+    ngx_rtmp_dash_ctx_t  *ctx;
+
+    if (s == NULL) {
+        return;
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+    if (ctx == NULL) {
+        return;
+    }
+
+    ctx->renaming = 0;
+
+    if (ctx->playlist_pending) {
+        ctx->playlist_pending = 0;
+        ngx_rtmp_dash_write_playlist(s);
+    }
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
 {
@@ -221,7 +302,7 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
     ngx_fd_t                   fd;
     struct tm                  tm;
     ngx_str_t                  noname, *name;
-    ngx_uint_t                 i;
+    ngx_uint_t                 i, nfrags;
     ngx_rtmp_dash_ctx_t       *ctx;
     ngx_rtmp_codec_ctx_t      *codec_ctx;
     ngx_rtmp_dash_frag_t      *f;
@@ -230,6 +311,7 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
     static u_char              buffer[NGX_RTMP_DASH_BUFSIZE];
     static u_char              start_time[sizeof("1970-09-28T12:00:00+06:00")];
     static u_char              end_time[sizeof("1970-09-28T12:00:00+06:00")];
+    static u_char              avail[128];
 
     dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
@@ -239,6 +321,13 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
         return NGX_ERROR;
     }
 
+#if (NGX_THREADS)
+    if (ctx->renaming) {
+        ctx->playlist_pending = 1;
+        return NGX_OK;
+    }
+#endif
+
     if (ctx->id == 0) {
         ngx_rtmp_dash_write_init_segments(s);
     }
@@ -290,6 +379,7 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
     "          bandwidth=\"%ui\">\n"                                           \
     "        <SegmentTemplate\n"                                               \
     "            presentationTimeOffset=\"0\"\n"                               \
+    "%s"                                                                       \
     "            timescale=\"1000\"\n"                                         \
     "            media=\"%V%s$Time$.m4v\"\n"                                   \
     "            initialization=\"%V%sinit.m4v\">\n"                           \
@@ -324,6 +414,7 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
     "          bandwidth=\"%ui\">\n"                                           \
     "        <SegmentTemplate\n"                                               \
     "            presentationTimeOffset=\"0\"\n"                               \
+    "%s"                                                                       \
     "            timescale=\"1000\"\n"                                         \
     "            media=\"%V%s$Time$.m4a\"\n"                                   \
     "            initialization=\"%V%sinit.m4a\">\n"                           \
@@ -341,6 +432,29 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
     "  </Period>\n"                                                            \
     "</MPD>\n"
 
+
+#define NGX_RTMP_DASH_MANIFEST_AVAILABILITY                                    \
+    "            availabilityTimeOffset=\"%.3f\"\n"                           \
+    "            availabilityTimeComplete=\"false\"\n"
+
+    /* 分块模式下正在写的切片也列出, 客户端提前请求, 边写边下载 */
+
+    nfrags = ctx->nfrags;
+
+    if (dacf->chunk && ctx->opened) {
+        f = ngx_rtmp_dash_get_frag(s, nfrags);
+        f->duration = (uint32_t) dacf->fraglen;
+        nfrags++;
+
+        *ngx_slprintf(avail, avail + sizeof(avail) - 1,
+                      NGX_RTMP_DASH_MANIFEST_AVAILABILITY,
+                      (double) (dacf->fraglen > dacf->chunk ?
+                                dacf->fraglen - dacf->chunk : 0) / 1000) = 0;
+
+    } else {
+        avail[0] = 0;
+    }
+
     ngx_libc_localtime(ctx->start_time.sec +
                        ngx_rtmp_dash_get_frag(s, 0)->timestamp / 1000, &tm);
 
@@ -353,8 +467,8 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
                  ngx_abs(ctx->start_time.gmtoff % 60)) = 0;
 
     ngx_libc_localtime(ctx->start_time.sec +
-                       (ngx_rtmp_dash_get_frag(s, ctx->nfrags - 1)->timestamp +
-                        ngx_rtmp_dash_get_frag(s, ctx->nfrags - 1)->duration) /
+                       (ngx_rtmp_dash_get_frag(s, nfrags - 1)->timestamp +
+                        ngx_rtmp_dash_get_frag(s, nfrags - 1)->duration) /
                        1000, &tm);
 
     *ngx_sprintf(end_time, "%4d-%02d-%02dT%02d:%02d:%02d%c%02d:%02d",
@@ -394,10 +508,11 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
                          codec_ctx->height,
                          codec_ctx->frame_rate,
                          (ngx_uint_t) (codec_ctx->video_data_rate * 1000),
+                         avail,
                          name, sep,
                          name, sep);
 
-        for (i = 0; i < ctx->nfrags; i++) {
+        for (i = 0; i < nfrags; i++) {
             f = ngx_rtmp_dash_get_frag(s, i);
             p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_TIME,
                              f->timestamp, f->duration);
@@ -415,10 +530,11 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
                          (codec_ctx->aac_sbr ? "40.5" : "40.2") : "6b",
                          codec_ctx->sample_rate,
                          (ngx_uint_t) (codec_ctx->audio_data_rate * 1000),
+                         avail,
                          name, sep,
                          name, sep);
 
-        for (i = 0; i < ctx->nfrags; i++) {
+        for (i = 0; i < nfrags; i++) {
             f = ngx_rtmp_dash_get_frag(s, i);
             p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_TIME,
                              f->timestamp, f->duration);
@@ -441,6 +557,22 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
 
     ngx_close_file(fd);
 
+#if (NGX_THREADS)
+    if (ctx->queue) {
+        if (ngx_rtmp_thread_rename(ctx->queue, &ctx->playlist_bak,
+                                   &ctx->playlist, ngx_rtmp_dash_renamed,
+                                   s->connection->log)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        ctx->renaming = 1;
+
+        return NGX_OK;
+    }
+#endif
+
     if (ngx_rtmp_dash_rename_file(ctx->playlist_bak.data, ctx->playlist.data)
         == NGX_FILE_ERROR)
     {
@@ -530,13 +662,247 @@ ngx_rtmp_dash_write_init_segments(ngx_rtmp_session_t *s)
 }
 
 
+/* 写入头部, 再把临时文件中的mdat数据拷贝到切片文件中 */
+static ngx_int_t
+ngx_rtmp_dash_copy_fragment(u_char *path, u_char *header, size_t header_size,
+    ngx_fd_t raw, size_t left, u_char *buffer, size_t size, ngx_log_t *log)
+{
+    ssize_t                    n;
+    ngx_fd_t                   fd;
+    ngx_int_t                  rc;
+
+    fd = ngx_open_file(path, NGX_FILE_RDWR,
+                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      "dash: error creating dash temp video file");
+        return NGX_ERROR;
+    }
+
+    rc = NGX_ERROR;
+
+    if (ngx_write_fd(fd, header, header_size) == NGX_ERROR) {
+        goto done;
+    }
+
+#if (NGX_WIN32)
+    if (SetFilePointer(raw, 0, 0, FILE_BEGIN) == INVALID_SET_FILE_POINTER) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "dash: SetFilePointer error");
+        goto done;
+    }
+#else
+    if (lseek(raw, 0, SEEK_SET) == -1) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      "dash: lseek error");
+        goto done;
+    }
+#endif
+
+    while (left > 0) {
+
+        n = ngx_read_fd(raw, buffer, ngx_min(size, left));
+        if (n == NGX_ERROR || n == 0) {
+            goto done;
+        }
+
+        n = ngx_write_fd(fd, buffer, (size_t) n);
+        if (n == NGX_ERROR) {
+            goto done;
+        }
+
+        left -= n;
+    }
+
+    rc = NGX_OK;
+
+done:
+
+    ngx_close_file(fd);
+
+    return rc;
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_rtmp_dash_job_handler(ngx_rtmp_thread_job_t *job, ngx_log_t *log)
+{
+    ngx_rtmp_dash_job_t       *dj = (ngx_rtmp_dash_job_t *) job;
+    u_char                    *buffer;
+    size_t                     size;
+
+    size = ngx_min(dj->mdat_size, NGX_RTMP_DASH_BUFSIZE);
+
+    buffer = ngx_alloc(size ? size : 1, log);
+
+    if (buffer) {
+        job->rc = ngx_rtmp_dash_copy_fragment(dj->path, (u_char *) &dj[1],
+                                              dj->header_size, dj->raw,
+                                              dj->mdat_size, buffer, size,
+                                              log);
+        ngx_free(buffer);
+    }
+
+    ngx_close_file(dj->raw);
+}
+
+
+/* 临时文件交给线程池, 下一个切片重新创建同名的临时文件 */
+static ngx_int_t
+ngx_rtmp_dash_post_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
+    ngx_buf_t *b)
+{
+    ngx_rtmp_dash_ctx_t       *ctx;
+    ngx_rtmp_dash_job_t       *dj;
+    size_t                     len;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+
+    len = ngx_strlen(ctx->stream.data);
+
+    dj = ngx_rtmp_thread_job_alloc(sizeof(ngx_rtmp_dash_job_t)
+                                   + (b->last - b->pos) + len + 1,
+                                   s->connection->log);
+    if (dj == NULL) {
+        return NGX_ERROR;
+    }
+
+    dj->raw = t->fd;
+    dj->mdat_size = t->mdat_size;
+    dj->header_size = b->last - b->pos;
+    dj->path = ngx_cpymem((u_char *) &dj[1], b->pos, dj->header_size);
+    ngx_memcpy(dj->path, ctx->stream.data, len);
+
+    dj->job.handler = ngx_rtmp_dash_job_handler;
+    dj->job.rc = NGX_ERROR;
+
+    ngx_rtmp_thread_job_post(ctx->queue, &dj->job);
+
+    return NGX_OK;
+}
+
+#endif
+
+
+/*
+ * 把暂存的样本写成一个moof+mdat块追加到.part文件,
+ * 第一个块之前写styp, 切片关闭时.part改名为正式文件名
+ */
+static ngx_int_t
+ngx_rtmp_dash_write_chunk(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
+{
+    ngx_buf_t                  b;
+    ngx_uint_t                 n;
+    ngx_rtmp_dash_ctx_t       *ctx;
+    ngx_rtmp_dash_frag_t      *f;
+
+    static u_char              buffer[NGX_RTMP_DASH_BUFSIZE];
+
+    n = t->sample_count - t->chunk_start;
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+
+    b.start = buffer;
+    b.end = buffer + sizeof(buffer);
+    b.pos = b.last = b.start;
+
+    if (t->fd == NGX_INVALID_FILE) {
+        f = ngx_rtmp_dash_get_frag(s, ctx->nfrags);
+
+        *ngx_sprintf(ctx->stream.data + ctx->stream.len, "%uD.m4%c.part",
+                     f->timestamp, t->type) = 0;
+
+        t->fd = ngx_open_file(ctx->stream.data, NGX_FILE_WRONLY,
+                              NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+        if (t->fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                          "dash: error creating chunked fragment file");
+            return NGX_ERROR;
+        }
+
+        ngx_rtmp_mp4_write_styp(&b);
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "dash: write chunk type=%c, samples=%ui, size=%uz",
+                   t->type, n, t->chunk_size);
+
+    ngx_rtmp_mp4_write_moof(&b, t->samples[t->chunk_start].timestamp,
+                            (uint32_t) n, &t->samples[t->chunk_start],
+                            t->sample_mask, (uint32_t) ++t->chunk_seq);
+    ngx_rtmp_mp4_write_mdat(&b, t->chunk_size + 8);
+
+    t->chunk_start = t->sample_count;
+
+    /* 写了一半的块会让后面的moof错位, 按失败处理 */
+
+    if (ngx_write_fd(t->fd, b.pos, (size_t) (b.last - b.pos))
+        != b.last - b.pos
+        || ngx_write_fd(t->fd, t->chunk, t->chunk_size)
+           != (ssize_t) t->chunk_size)
+    {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "dash: " ngx_write_fd_n " chunk failed");
+        t->chunk_size = 0;
+        return NGX_ERROR;
+    }
+
+    t->chunk_size = 0;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_dash_close_chunked_fragment(ngx_rtmp_session_t *s,
+    ngx_rtmp_dash_track_t *t)
+{
+    u_char                    *part;
+    ngx_rtmp_dash_ctx_t       *ctx;
+    ngx_rtmp_dash_frag_t      *f;
+
+    static u_char              path[NGX_MAX_PATH + 1];
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+
+    (void) ngx_rtmp_dash_write_chunk(s, t);
+
+    t->opened = 0;
+
+    if (t->fd == NGX_INVALID_FILE) {
+        return;
+    }
+
+    ngx_close_file(t->fd);
+    t->fd = NGX_INVALID_FILE;
+
+    f = ngx_rtmp_dash_get_frag(s, ctx->nfrags);
+
+    part = ngx_sprintf(ctx->stream.data + ctx->stream.len, "%uD.m4%c",
+                       f->timestamp, t->type);
+
+    *ngx_cpymem(path, ctx->stream.data, part - ctx->stream.data) = 0;
+    *ngx_cpymem(part, ".part", sizeof(".part") - 1) = 0;
+
+    if (ngx_rtmp_dash_rename_file(ctx->stream.data, path) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "dash: rename failed: '%s'->'%s'",
+                      ctx->stream.data, path);
+    }
+}
+
+
 static void
 ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
 {
     u_char                    *pos, *pos1;
-    size_t                     left;
-    ssize_t                    n;
-    ngx_fd_t                   fd;
     ngx_buf_t                  b;
     ngx_rtmp_dash_ctx_t       *ctx;
     ngx_rtmp_dash_frag_t      *f;
@@ -551,6 +917,11 @@ ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
                    "dash: close fragment id=%ui, type=%c, pts=%uD",
                    t->id, t->type, t->earliest_pres_time);
 
+    if (t->chunk) {
+        ngx_rtmp_dash_close_chunked_fragment(s, t);
+        return;
+    }
+
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
 
     b.start = buffer;
@@ -579,55 +950,18 @@ ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
     *ngx_sprintf(ctx->stream.data + ctx->stream.len, "%uD.m4%c",
                  f->timestamp, t->type) = 0;
 
-    fd = ngx_open_file(ctx->stream.data, NGX_FILE_RDWR,
-                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
-
-    if (fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: error creating dash temp video file");
-        goto done;
-    }
-
-    if (ngx_write_fd(fd, b.pos, (size_t) (b.last - b.pos)) == NGX_ERROR) {
-        goto done;
-    }
-
-    left = (size_t) t->mdat_size;
-
-#if (NGX_WIN32)
-    if (SetFilePointer(t->fd, 0, 0, FILE_BEGIN) == INVALID_SET_FILE_POINTER) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                      "dash: SetFilePointer error");
-        goto done;
-    }
-#else
-    if (lseek(t->fd, 0, SEEK_SET) == -1) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: lseek error");
-        goto done;
+#if (NGX_THREADS)
+    if (ctx->queue && ngx_rtmp_dash_post_fragment(s, t, &b) == NGX_OK) {
+        t->fd = NGX_INVALID_FILE;
+        t->opened = 0;
+        return;
     }
 #endif
 
-    while (left > 0) {
-
-        n = ngx_read_fd(t->fd, buffer, ngx_min(sizeof(buffer), left));
-        if (n == NGX_ERROR) {
-            break;
-        }
-
-        n = ngx_write_fd(fd, buffer, (size_t) n);
-        if (n == NGX_ERROR) {
-            break;
-        }
-
-        left -= n;
-    }
-
-done:
-
-    if (fd != NGX_INVALID_FILE) {
-        ngx_close_file(fd);
-    }
+    (void) ngx_rtmp_dash_copy_fragment(ctx->stream.data, b.pos,
+                                       (size_t) (b.last - b.pos), t->fd,
+                                       (size_t) t->mdat_size, buffer,
+                                       sizeof(buffer), s->connection->log);
 
     ngx_close_file(t->fd);
 
@@ -654,10 +988,11 @@ ngx_rtmp_dash_close_fragments(ngx_rtmp_session_t *s)
 
     ngx_rtmp_dash_next_frag(s);
 
+    ctx->opened = 0;
+
     ngx_rtmp_dash_write_playlist(s);
 
     ctx->id++;
-    ctx->opened = 0;
 
     return NGX_OK;
 }
@@ -678,8 +1013,25 @@ ngx_rtmp_dash_open_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
 
+    /* 分块模式不需要临时文件, .part文件在写第一个块时创建 */
+
+    if (t->chunk) {
+        t->fd = NGX_INVALID_FILE;
+        goto opened;
+    }
+
     *ngx_sprintf(ctx->stream.data + ctx->stream.len, "raw.m4%c", type) = 0;
 
+#if (NGX_THREADS)
+
+    /* 上一个临时文件可能还在线程中读取, 删除后创建新文件 */
+
+    if (ctx->queue) {
+        (void) ngx_delete_file(ctx->stream.data);
+    }
+
+#endif
+
     t->fd = ngx_open_file(ctx->stream.data, NGX_FILE_RDWR,
                           NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
 
@@ -689,12 +1041,16 @@ ngx_rtmp_dash_open_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
         return NGX_ERROR;
     }
 
+opened:
+
     t->id = id;
     t->type = type;
     t->sample_count = 0;
     t->earliest_pres_time = 0;
     t->latest_pres_time = 0;
     t->mdat_size = 0;
+    t->chunk_start = 0;
+    t->chunk_size = 0;
     t->opened = 1;
 
     if (type == 'v') {
@@ -840,6 +1196,11 @@ ngx_rtmp_dash_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
     ngx_rtmp_dash_ctx_t       *ctx;
     ngx_rtmp_dash_frag_t      *f;
     ngx_rtmp_dash_app_conf_t  *dacf;
+    u_char                    *vchunk, *achunk;
+#if (NGX_THREADS)
+    ngx_rtmp_thread_queue_t   *q;
+    ngx_uint_t                 renaming;
+#endif
 
     dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
     if (dacf == NULL || !dacf->dash || dacf->path.len == 0) {
@@ -868,8 +1229,23 @@ ngx_rtmp_dash_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
         }
 
         f = ctx->frags;
+        vchunk = ctx->video.chunk;
+        achunk = ctx->audio.chunk;
+#if (NGX_THREADS)
+        q = ctx->queue;
+        renaming = ctx->renaming;
+#endif
         ngx_memzero(ctx, sizeof(ngx_rtmp_dash_ctx_t));
         ctx->frags = f;
+
+        if (dacf->chunk) {
+            ctx->video.chunk = vchunk;
+            ctx->audio.chunk = achunk;
+        }
+#if (NGX_THREADS)
+        ctx->queue = q;
+        ctx->renaming = renaming;
+#endif
     }
 
     if (ctx->frags == NULL) {
@@ -883,6 +1259,27 @@ ngx_rtmp_dash_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
 
     ctx->id = 0;
 
+    if (dacf->chunk && ctx->video.chunk == NULL) {
+        ctx->video.chunk = ngx_palloc(s->connection->pool,
+                                      NGX_RTMP_DASH_BUFSIZE);
+        ctx->audio.chunk = ngx_palloc(s->connection->pool,
+                                      NGX_RTMP_DASH_BUFSIZE);
+
+        if (ctx->video.chunk == NULL || ctx->audio.chunk == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+#if (NGX_THREADS)
+    if (dacf->thread_pool && ctx->queue == NULL) {
+        ctx->queue = ngx_rtmp_thread_queue_create(dacf->thread_pool, s,
+                                                  s->connection->pool);
+        if (ctx->queue == NULL) {
+            return NGX_ERROR;
+        }
+    }
+#endif
+
     if (ngx_strstr(v->name, "..")) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                       "dash: bad stream name: '%s'", v->name);
@@ -921,7 +1318,7 @@ ngx_rtmp_dash_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
     ctx->stream.len = p - ctx->playlist.data + 1;
     ctx->stream.data = ngx_palloc(s->connection->pool,
                                   ctx->stream.len + NGX_INT32_LEN +
-                                  sizeof(".m4x"));
+                                  sizeof(".m4x.part"));
 
     ngx_memcpy(ctx->stream.data, ctx->playlist.data, ctx->stream.len - 1);
     ctx->stream.data[ctx->stream.len - 1] = (dacf->nested ? '/' : '-');
@@ -1041,31 +1438,53 @@ ngx_rtmp_dash_update_fragments(ngx_rtmp_session_t *s, ngx_int_t boundary,
 
         f = ngx_rtmp_dash_get_frag(s, ctx->nfrags);
         f->timestamp = timestamp;
+
+        if (dacf->chunk && ctx->nfrags) {
+            ngx_rtmp_dash_write_playlist(s);
+        }
     }
 }
 
 
 static ngx_int_t
-ngx_rtmp_dash_append(ngx_rtmp_session_t *s, ngx_chain_t *in,
+ngx_rtmp_dash_append(ngx_rtmp_session_t *s, ngx_chain_t *in, size_t skip,
     ngx_rtmp_dash_track_t *t, ngx_int_t key, uint32_t timestamp, uint32_t delay)
 {
-    u_char                 *p;
+    u_char                 *p, *pos;
     size_t                  size, bsize;
-    ngx_rtmp_mp4_sample_t  *smpl;
+    ngx_rtmp_mp4_sample_t     *smpl;
+    ngx_rtmp_dash_app_conf_t  *dacf;
 
     static u_char           buffer[NGX_RTMP_DASH_BUFSIZE];
 
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
+
     p = buffer;
     size = 0;
 
+    /* 跳过FLV音视频头, 共享的消息缓冲不能修改 */
+
     for (; in && size < sizeof(buffer); in = in->next) {
 
-        bsize = (size_t) (in->buf->last - in->buf->pos);
+        pos = in->buf->pos;
+        bsize = (size_t) (in->buf->last - pos);
+
+        if (skip) {
+            if (bsize <= skip) {
+                skip -= bsize;
+                continue;
+            }
+
+            pos += skip;
+            bsize -= skip;
+            skip = 0;
+        }
+
         if (size + bsize > sizeof(buffer)) {
             bsize = (size_t) (sizeof(buffer) - size);
         }
 
-        p = ngx_cpymem(p, in->buf->pos, bsize);
+        p = ngx_cpymem(p, pos, bsize);
         size += bsize;
     }
 
@@ -1079,7 +1498,29 @@ ngx_rtmp_dash_append(ngx_rtmp_session_t *s, ngx_chain_t *in,
 
     if (t->sample_count < NGX_RTMP_DASH_MAX_SAMPLES) {
 
-        if (ngx_write_fd(t->fd, buffer, size) == NGX_ERROR) {
+        if (t->sample_count > 0) {
+            smpl = &t->samples[t->sample_count - 1];
+            smpl->duration = timestamp - smpl->timestamp;
+        }
+
+        if (t->chunk) {
+
+            /* 新样本到达时前面样本的时长都已确定, 块时长够了就写出 */
+
+            if (t->sample_count > t->chunk_start
+                && (timestamp - t->samples[t->chunk_start].timestamp
+                    >= dacf->chunk
+                    || t->chunk_size + size > NGX_RTMP_DASH_BUFSIZE))
+            {
+                if (ngx_rtmp_dash_write_chunk(s, t) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+            }
+
+            ngx_memcpy(t->chunk + t->chunk_size, buffer, size);
+            t->chunk_size += size;
+
+        } else if (ngx_write_fd(t->fd, buffer, size) == NGX_ERROR) {
             ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
                           "dash: " ngx_write_fd_n " failed");
             return NGX_ERROR;
@@ -1093,11 +1534,6 @@ ngx_rtmp_dash_append(ngx_rtmp_session_t *s, ngx_chain_t *in,
         smpl->timestamp = timestamp;
         smpl->key = (key ? 1 : 0);
 
-        if (t->sample_count > 0) {
-            smpl = &t->samples[t->sample_count - 1];
-            smpl->duration = timestamp - smpl->timestamp;
-        }
-
         t->sample_count++;
         t->mdat_size += (ngx_uint_t) size;
     }
@@ -1110,9 +1546,9 @@ static ngx_int_t
 ngx_rtmp_dash_audio(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_chain_t *in)
 {
-    u_char                     htype;
     ngx_rtmp_dash_ctx_t       *ctx;
     ngx_rtmp_codec_ctx_t      *codec_ctx;
+    ngx_rtmp_codec_au_t       *au;
     ngx_rtmp_dash_app_conf_t  *dacf;
 
     dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
@@ -1133,14 +1569,14 @@ ngx_rtmp_dash_audio(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         return NGX_OK;
     }
 
-    if (in->buf->last - in->buf->pos < 2) {
+    au = ngx_rtmp_codec_get_au(s, h, in);
+    if (au == NULL || au->data != 2) {
         return NGX_ERROR;
     }
 
     /* skip AAC config */
 
-    htype = in->buf->pos[1];
-    if (htype != 1) {
+    if (au->header) {
         return NGX_OK;
     }
 
@@ -1148,9 +1584,8 @@ ngx_rtmp_dash_audio(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
     /* skip RTMP & AAC headers */
 
-    in->buf->pos += 2;
-
-    return ngx_rtmp_dash_append(s, in, &ctx->audio, 0, h->timestamp, 0);
+    return ngx_rtmp_dash_append(s, in, au->data, &ctx->audio, 0,
+                                h->timestamp, 0);
 }
 
 
@@ -1158,11 +1593,9 @@ static ngx_int_t
 ngx_rtmp_dash_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_chain_t *in)
 {
-    u_char                    *p;
-    uint8_t                    ftype, htype;
-    uint32_t                   delay;
     ngx_rtmp_dash_ctx_t       *ctx;
     ngx_rtmp_codec_ctx_t      *codec_ctx;
+    ngx_rtmp_codec_au_t       *au;
     ngx_rtmp_dash_app_conf_t  *dacf;
 
     dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
@@ -1181,34 +1614,23 @@ ngx_rtmp_dash_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         return NGX_OK;
     }
 
-    if (in->buf->last - in->buf->pos < 5) {
+    au = ngx_rtmp_codec_get_au(s, h, in);
+    if (au == NULL || au->data != 5) {
         return NGX_ERROR;
     }
 
-    ftype = (in->buf->pos[0] & 0xf0) >> 4;
-
     /* skip AVC config */
 
-    htype = in->buf->pos[1];
-    if (htype != 1) {
+    if (au->nals.nelts == 0) {
         return NGX_OK;
     }
 
-    p = (u_char *) &delay;
-
-    p[0] = in->buf->pos[4];
-    p[1] = in->buf->pos[3];
-    p[2] = in->buf->pos[2];
-    p[3] = 0;
-
     ctx->has_video = 1;
 
     /* skip RTMP & H264 headers */
 
-    in->buf->pos += 5;
-
-    return ngx_rtmp_dash_append(s, in, &ctx->video, ftype == 1, h->timestamp,
-                                delay);
+    return ngx_rtmp_dash_append(s, in, au->data, &ctx->video, au->key,
+                                h->timestamp, au->cts);
 }
 
 
@@ -1447,6 +1869,10 @@ ngx_rtmp_dash_create_app_conf(ngx_conf_t *cf)
     conf->playlen = NGX_CONF_UNSET_MSEC;
     conf->cleanup = NGX_CONF_UNSET;
     conf->nested = NGX_CONF_UNSET;
+    conf->chunk = NGX_CONF_UNSET_MSEC;
+#if (NGX_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
 
     return conf;
 }
@@ -1464,6 +1890,10 @@ ngx_rtmp_dash_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_msec_value(conf->playlen, prev->playlen, 30000);
     ngx_conf_merge_value(conf->cleanup, prev->cleanup, 1);
     ngx_conf_merge_value(conf->nested, prev->nested, 0);
+    ngx_conf_merge_msec_value(conf->chunk, prev->chunk, 0);
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
 
     if (conf->fraglen) {
         conf->winfrags = conf->playlen / conf->fraglen;
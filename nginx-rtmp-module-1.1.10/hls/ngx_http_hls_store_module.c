@@ -0,0 +1,477 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_rtmp_hls_store.h"
+
+
+static char * ngx_http_hls_store(ngx_conf_t *cf, ngx_command_t *cmd,
+       void *conf);
+static void * ngx_http_hls_store_create_loc_conf(ngx_conf_t *cf);
+static char * ngx_http_hls_store_merge_loc_conf(ngx_conf_t *cf,
+       void *parent, void *child);
+
+
+extern ngx_module_t  ngx_rtmp_hls_module;
+
+
+static ngx_str_t  ngx_http_hls_store_shm_name = ngx_string("hls_store");
+
+
+/* 等待中的请求轮询共享内存的间隔 */
+#define NGX_HTTP_HLS_STORE_POLL         10
+
+
+typedef struct {
+    ngx_shm_zone_t                     *shm_zone;
+    ngx_msec_t                          block_timeout;
+} ngx_http_hls_store_loc_conf_t;
+
+
+/* LL-HLS阻塞请求: _HLS_msn/_HLS_part指定的部分切片出现之前挂起 */
+typedef struct {
+    ngx_str_t                           path;
+    ngx_event_t                         poll;
+    ngx_msec_t                          deadline;
+    uint64_t                            msn;
+    ngx_int_t                           part;
+    unsigned                            blocking:1;
+} ngx_http_hls_store_ctx_t;
+
+
+typedef struct {
+    ngx_shm_zone_t                     *shm_zone;
+    ngx_rtmp_hls_store_file_t          *file;
+} ngx_http_hls_store_cleanup_t;
+
+
+static ngx_command_t  ngx_http_hls_store_commands[] = {
+
+    { ngx_string("hls_store"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_hls_store,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("hls_store_block_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_hls_store_loc_conf_t, block_timeout),
+      NULL },
+
+    ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_hls_store_module_ctx = {
+    NULL,                               /* preconfiguration */
+    NULL,                               /* postconfiguration */
+
+    NULL,                               /* create main configuration */
+    NULL,                               /* init main configuration */
+
+    NULL,                               /* create server configuration */
+    NULL,                               /* merge server configuration */
+
+    ngx_http_hls_store_create_loc_conf, /* create location configuration */
+    ngx_http_hls_store_merge_loc_conf,  /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_hls_store_module = {
+    NGX_MODULE_V1,
+    &ngx_http_hls_store_module_ctx,     /* module context */
+    ngx_http_hls_store_commands,        /* module directives */
+    NGX_HTTP_MODULE,                    /* module type */
+    NULL,                               /* init master */
+    NULL,                               /* init module */
+    NULL,                               /* init process */
+    NULL,                               /* init thread */
+    NULL,                               /* exit thread */
+    NULL,                               /* exit process */
+    NULL,                               /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void
+ngx_http_hls_store_cleanup(void *data)
+{
+    ngx_http_hls_store_cleanup_t   *cln = data;
+
+    ngx_rtmp_hls_store_release(cln->shm_zone, cln->file);
+}
+
+
+/*
+ * mtime只精确到秒, LL-HLS的播放列表和部分切片一秒内会重写多次,
+ * ETag改用每次写入都变化的version
+ */
+static ngx_int_t
+ngx_http_hls_store_set_etag(ngx_http_request_t *r,
+    ngx_rtmp_hls_store_file_t *file)
+{
+    ngx_table_elt_t                *etag;
+    ngx_http_core_loc_conf_t       *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (!clcf->etag) {
+        return NGX_OK;
+    }
+
+    etag = ngx_list_push(&r->headers_out.headers);
+    if (etag == NULL) {
+        return NGX_ERROR;
+    }
+
+    etag->hash = 1;
+    ngx_str_set(&etag->key, "ETag");
+
+    etag->value.data = ngx_pnalloc(r->pool, NGX_INT64_LEN + NGX_OFF_T_LEN + 3);
+    if (etag->value.data == NULL) {
+        etag->hash = 0;
+        return NGX_ERROR;
+    }
+
+    etag->value.len = ngx_sprintf(etag->value.data, "\"%xL-%xO\"",
+                                  file->version,
+                                  r->headers_out.content_length_n)
+                      - etag->value.data;
+
+    r->headers_out.etag = etag;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_hls_store_send(ngx_http_request_t *r, ngx_rtmp_hls_store_file_t *file)
+{
+    ngx_chain_t                     out;
+    ngx_buf_t                      *b;
+    ngx_int_t                       rc;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = file->size;
+    r->headers_out.last_modified_time = file->mtime;
+
+    /* 播放列表总是返回完整内容, 不做304 */
+    if (file->type == NGX_RTMP_HLS_STORE_PLAYLIST) {
+        r->disable_not_modified = 1;
+
+    } else if (ngx_http_hls_store_set_etag(r, file) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ngx_http_set_content_type(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->allow_ranges = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->pos = file->data;
+    b->last = file->data + file->size;
+    b->memory = file->size ? 1 : 0;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/*
+ * 文件还没有生成或播放列表还不包含请求的部分切片时返回NGX_DECLINED;
+ * 其他返回值是发送的结果, NGX_AGAIN表示数据已交给输出过滤器但没有写完
+ */
+static ngx_int_t
+ngx_http_hls_store_lookup(ngx_http_request_t *r, ngx_http_hls_store_ctx_t *ctx)
+{
+    ngx_http_hls_store_loc_conf_t  *hlcf;
+    ngx_http_hls_store_cleanup_t   *hc;
+    ngx_rtmp_hls_store_file_t      *file;
+    ngx_pool_cleanup_t             *cln;
+    ngx_uint_t                      ready;
+
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_http_hls_store_module);
+
+    file = ngx_rtmp_hls_store_get(hlcf->shm_zone, &ctx->path);
+    if (file == NULL) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    ready = !file->pending;
+
+    if (ready && ctx->blocking) {
+
+        /* 请求的序号超出当前切片两个以上时不等待 */
+
+        if (ctx->msn > file->msn + 2) {
+            ngx_rtmp_hls_store_release(hlcf->shm_zone, file);
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        if (ctx->part < 0) {
+            ready = (file->msn > ctx->msn);
+
+        } else {
+            ready = (file->msn > ctx->msn
+                     || (file->msn == ctx->msn
+                         && file->part > (ngx_uint_t) ctx->part));
+        }
+    }
+
+    if (!ready) {
+        ngx_rtmp_hls_store_release(hlcf->shm_zone, file);
+        return NGX_DECLINED;
+    }
+
+    /* 发送完成之前文件不会被释放 */
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_hls_store_cleanup_t));
+    if (cln == NULL) {
+        ngx_rtmp_hls_store_release(hlcf->shm_zone, file);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    hc = cln->data;
+    hc->shm_zone = hlcf->shm_zone;
+    hc->file = file;
+    cln->handler = ngx_http_hls_store_cleanup;
+
+    return ngx_http_hls_store_send(r, file);
+}
+
+
+static void
+ngx_http_hls_store_poll_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t             *r;
+    ngx_http_hls_store_ctx_t       *ctx;
+    ngx_connection_t               *c;
+    ngx_int_t                       rc;
+
+    r = ev->data;
+    c = r->connection;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_hls_store_module);
+
+    rc = ngx_http_hls_store_lookup(r, ctx);
+
+    if (rc == NGX_DECLINED) {
+        if ((ngx_msec_int_t) (ctx->deadline - ngx_current_msec) > 0) {
+            ngx_add_timer(ev, NGX_HTTP_HLS_STORE_POLL);
+            return;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "hls store: block timeout \"%V\"", &ctx->path);
+
+        rc = ctx->blocking ? NGX_HTTP_SERVICE_UNAVAILABLE : NGX_HTTP_NOT_FOUND;
+    }
+
+    /* 已发送时rc是发送结果, NGX_AGAIN由ngx_http_writer继续写完 */
+
+    ngx_http_finalize_request(r, rc);
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_hls_store_poll_cleanup(void *data)
+{
+    ngx_event_t  *ev = data;
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_hls_store_parse_args(ngx_http_request_t *r,
+    ngx_http_hls_store_ctx_t *ctx)
+{
+    ngx_str_t                       value;
+    ngx_int_t                       n;
+
+    ctx->part = -1;
+
+    if (ngx_http_arg(r, (u_char *) "_HLS_part", sizeof("_HLS_part") - 1,
+                     &value) == NGX_OK)
+    {
+        ctx->part = ngx_atoi(value.data, value.len);
+        if (ctx->part == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_http_arg(r, (u_char *) "_HLS_msn", sizeof("_HLS_msn") - 1,
+                     &value) != NGX_OK)
+    {
+        return ctx->part < 0 ? NGX_OK : NGX_ERROR;
+    }
+
+    n = ngx_atoi(value.data, value.len);
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    ctx->msn = (uint64_t) n;
+    ctx->blocking = 1;
+
+    return NGX_OK;
+}
+
+
+/*
+ * 按root/alias把uri映射成文件路径, 与磁盘模式下hls_path中的路径一致,
+ * 数据直接从共享内存发送, Range和条件请求交给标准过滤模块处理
+ */
+static ngx_int_t
+ngx_http_hls_store_handler(ngx_http_request_t *r)
+{
+    ngx_http_hls_store_loc_conf_t  *hlcf;
+    ngx_http_hls_store_ctx_t       *ctx;
+    ngx_pool_cleanup_t             *cln;
+    ngx_int_t                       rc;
+    size_t                          root;
+    u_char                         *last;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (r->uri.data[r->uri.len - 1] == '/') {
+        return NGX_DECLINED;
+    }
+
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_http_hls_store_module);
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_hls_store_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    last = ngx_http_map_uri_to_path(r, &ctx->path, &root, 0);
+    if (last == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx->path.len = last - ctx->path.data;
+
+    if (ngx_http_hls_store_parse_args(r, ctx) != NGX_OK) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "hls store: get \"%V\" msn=%uL part=%i",
+                   &ctx->path, ctx->msn, ctx->part);
+
+    rc = ngx_http_hls_store_lookup(r, ctx);
+    if (rc != NGX_DECLINED) {
+        return rc;
+    }
+
+    /* 挂起请求, 由定时器轮询直到部分切片生成或超时 */
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_http_hls_store_poll_cleanup;
+    cln->data = &ctx->poll;
+
+    ctx->poll.handler = ngx_http_hls_store_poll_handler;
+    ctx->poll.data = r;
+    ctx->poll.log = r->connection->log;
+    ctx->deadline = ngx_current_msec + hlcf->block_timeout;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_hls_store_module);
+
+    ngx_add_timer(&ctx->poll, NGX_HTTP_HLS_STORE_POLL);
+
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    r->main->count++;
+
+    return NGX_DONE;
+}
+
+
+static char *
+ngx_http_hls_store(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_hls_store_loc_conf_t  *hlcf = conf;
+    ngx_http_core_loc_conf_t       *clcf;
+
+    if (hlcf->shm_zone) {
+        return "is duplicate";
+    }
+
+    /* 大小由rtmp块中的hls_store_zone设置 */
+
+    hlcf->shm_zone = ngx_shared_memory_add(cf, &ngx_http_hls_store_shm_name, 0,
+                                           &ngx_rtmp_hls_module);
+    if (hlcf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_hls_store_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_hls_store_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_hls_store_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_hls_store_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->block_timeout = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_hls_store_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_hls_store_loc_conf_t  *prev = parent;
+    ngx_http_hls_store_loc_conf_t  *conf = child;
+
+    if (conf->shm_zone == NULL) {
+        conf->shm_zone = prev->shm_zone;
+    }
+
+    ngx_conf_merge_msec_value(conf->block_timeout, prev->block_timeout, 10000);
+
+    return NGX_CONF_OK;
+}
@@ -10,6 +10,7 @@
 #include <ngx_rtmp_cmd_module.h>
 #include <ngx_rtmp_codec_module.h>
 #include "ngx_rtmp_mpegts.h"
+#include "ngx_rtmp_hls_store.h"
 
 
 static ngx_rtmp_publish_pt              next_publish;
@@ -21,10 +22,13 @@ static ngx_rtmp_stream_eof_pt           next_stream_eof;
 static char * ngx_rtmp_hls_variant(ngx_conf_t *cf, ngx_command_t *cmd,
        void *conf);
 static ngx_int_t ngx_rtmp_hls_postconfiguration(ngx_conf_t *cf);
+static void * ngx_rtmp_hls_create_main_conf(ngx_conf_t *cf);
+static char * ngx_rtmp_hls_init_main_conf(ngx_conf_t *cf, void *conf);
 static void * ngx_rtmp_hls_create_app_conf(ngx_conf_t *cf);
 static char * ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf,
        void *parent, void *child);
 static ngx_int_t ngx_rtmp_hls_flush_audio(ngx_rtmp_session_t *s);
+static ngx_int_t ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s);
 static ngx_int_t ngx_rtmp_hls_ensure_directory(ngx_rtmp_session_t *s,
        ngx_str_t *path);
 
@@ -32,6 +36,9 @@ static ngx_int_t ngx_rtmp_hls_ensure_directory(ngx_rtmp_session_t *s,
 #define NGX_RTMP_HLS_BUFSIZE            (1024*1024)
 #define NGX_RTMP_HLS_DIR_ACCESS         0744
 
+/* 每个切片最多的部分切片个数, independent按位记录 */
+#define NGX_RTMP_HLS_MAX_PARTS          64
+
 
 typedef struct {
     uint64_t                            id;
@@ -39,6 +46,10 @@ typedef struct {
     double                              duration;
     unsigned                            active:1;
     unsigned                            discont:1; /* before */
+
+    ngx_uint_t                          nparts;
+    uint64_t                            independent;
+    double                              parts[NGX_RTMP_HLS_MAX_PARTS];
 } ngx_rtmp_hls_frag_t;
 
 
@@ -78,7 +89,25 @@ typedef struct {
     ngx_buf_t                          *aframe;
     uint64_t                            aframe_pts;
 
+    ngx_buf_t                          *fragbuf;
+    ngx_buf_t                          *mem;        /* hls_store */
+    ngx_buf_t                          *plbuf;
+
+    /* hls_partial, ctx->part保存部分切片路径的前缀 */
+    ngx_msec_t                          partial;
+    ngx_str_t                           part;
+    size_t                              part_offset;
+    uint64_t                            part_ts;
+    unsigned                            part_independent:1;
+
     ngx_rtmp_hls_variant_t             *var;
+
+#if (NGX_THREADS)
+    /* 播放列表改名排在切片写入之后, 改名完成前的更新合并为一次 */
+    ngx_rtmp_thread_queue_t            *queue;
+    ngx_uint_t                          renaming;
+    unsigned                            playlist_pending:1;
+#endif
 } ngx_rtmp_hls_ctx_t;
 
 
@@ -89,6 +118,15 @@ typedef struct {
 } ngx_rtmp_hls_cleanup_t;
 
 
+typedef struct {
+    size_t                              store_zone;
+    ngx_shm_zone_t                     *shm_zone;
+} ngx_rtmp_hls_main_conf_t;
+
+
+static ngx_str_t  ngx_rtmp_hls_store_shm_name = ngx_string("hls_store");
+
+
 typedef struct {
     ngx_flag_t                          hls;
     ngx_msec_t                          fraglen;
@@ -106,6 +144,12 @@ typedef struct {
     ngx_path_t                         *slot;
     ngx_msec_t                          max_audio_delay;
     size_t                              audio_buffer_size;
+    size_t                              fragment_buffer;
+#if (NGX_THREADS)
+    ngx_thread_pool_t                  *thread_pool;
+#endif
+    ngx_flag_t                          store;
+    ngx_msec_t                          partial;
     ngx_flag_t                          cleanup;
     ngx_array_t                        *variant;
     ngx_str_t                           base_url;
@@ -252,6 +296,43 @@ static ngx_command_t ngx_rtmp_hls_commands[] = {
       offsetof(ngx_rtmp_hls_app_conf_t, audio_buffer_size),
       NULL },
 
+    { ngx_string("hls_fragment_buffer"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, fragment_buffer),
+      NULL },
+
+#if (NGX_THREADS)
+    { ngx_string("hls_thread_pool"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_rtmp_thread_pool_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, thread_pool),
+      NULL },
+#endif
+
+    { ngx_string("hls_store_zone"),
+      NGX_RTMP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_MAIN_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_main_conf_t, store_zone),
+      NULL },
+
+    { ngx_string("hls_store"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, store),
+      NULL },
+
+    { ngx_string("hls_partial"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, partial),
+      NULL },
+
     { ngx_string("hls_cleanup"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_flag_slot,
@@ -316,8 +397,8 @@ static ngx_rtmp_module_t  ngx_rtmp_hls_module_ctx = {
     NULL,                               /* preconfiguration */
     ngx_rtmp_hls_postconfiguration,     /* postconfiguration */
 
-    NULL,                               /* create main configuration */
-    NULL,                               /* init main configuration */
+    ngx_rtmp_hls_create_main_conf,      /* create main configuration */
+    ngx_rtmp_hls_init_main_conf,        /* init main configuration */
 
     NULL,                               /* create server configuration */
     NULL,                               /* merge server configuration */
@@ -386,6 +467,92 @@ ngx_rtmp_hls_rename_file(u_char *src, u_char *dst)
 }
 
 
+/* hls_store模式下文件写入共享内存, 文件名仍是磁盘模式下的完整路径 */
+static ngx_int_t
+ngx_rtmp_hls_write_store(ngx_rtmp_session_t *s, u_char *path,
+    ngx_uint_t type, u_char *data, size_t size)
+{
+    ngx_rtmp_hls_ctx_t         *ctx;
+    ngx_rtmp_hls_app_conf_t    *hacf;
+    ngx_rtmp_hls_main_conf_t   *hmcf;
+    ngx_str_t                   name;
+    ngx_uint_t                  keep, part;
+
+    hmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_hls_module);
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    name.data = path;
+    name.len = ngx_strlen(path);
+
+    /*
+     * 切片和密钥保留的个数与ctx->frags环一致, 部分切片只在最近的几个切片中
+     * 列出, 播放列表记录正在生成的切片序号和已完成的部分切片个数
+     */
+
+    switch (type) {
+
+    case NGX_RTMP_HLS_STORE_PLAYLIST:
+        keep = 0;
+        break;
+
+    case NGX_RTMP_HLS_STORE_PART:
+        keep = NGX_RTMP_HLS_MAX_PARTS * 4;
+        break;
+
+    default:
+        keep = hacf->winfrags * 2 + 1;
+    }
+
+    part = ctx->opened ? ngx_rtmp_hls_get_frag(s, ctx->nfrags)->nparts : 0;
+
+    return ngx_rtmp_hls_store_put(hmcf->shm_zone, &ctx->playlist, &name, type,
+                                  data, size, keep,
+                                  (time_t) (hacf->playlen * 2 / 1000) + 1,
+                                  ctx->frag + ctx->nfrags, part,
+                                  s->connection->log);
+}
+
+
+static ssize_t
+ngx_rtmp_hls_write(ngx_rtmp_session_t *s, ngx_fd_t fd, u_char *p, size_t n)
+{
+    ngx_buf_t                  *b, *nb;
+    ngx_rtmp_hls_ctx_t         *ctx;
+    size_t                      size;
+
+    if (fd != NGX_INVALID_FILE) {
+        return ngx_write_fd(fd, p, n);
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+    b = ctx->plbuf;
+
+    /* 预估的大小不够时扩大缓冲, 不能发布截断的播放列表 */
+
+    if ((size_t) (b->end - b->last) < n) {
+        size = ngx_max((size_t) (b->end - b->start) * 2,
+                       (size_t) (b->last - b->pos) + n);
+
+        nb = ngx_create_temp_buf(s->connection->pool, size);
+        if (nb == NULL) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                          "hls: failed to grow playlist buffer to %uz", size);
+            return -1;
+        }
+
+        nb->last = ngx_cpymem(nb->pos, b->pos, b->last - b->pos);
+
+        ngx_pfree(s->connection->pool, b->start);
+        ctx->plbuf = b = nb;
+    }
+
+    b->last = ngx_cpymem(b->last, p, n);
+
+    return n;
+}
+
+
 static ngx_int_t
 ngx_rtmp_hls_write_variant_playlist(ngx_rtmp_session_t *s)
 {
@@ -403,21 +570,27 @@ ngx_rtmp_hls_write_variant_playlist(ngx_rtmp_session_t *s)
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
 
-    fd = ngx_open_file(ctx->var_playlist_bak.data, NGX_FILE_WRONLY,
-                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+    if (hacf->store) {
+        fd = NGX_INVALID_FILE;
+        ctx->plbuf->last = ctx->plbuf->pos;
 
-    if (fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: " ngx_open_file_n " failed: '%V'",
-                      &ctx->var_playlist_bak);
+    } else {
+        fd = ngx_open_file(ctx->var_playlist_bak.data, NGX_FILE_WRONLY,
+                           NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
 
-        return NGX_ERROR;
+        if (fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                          "hls: " ngx_open_file_n " failed: '%V'",
+                          &ctx->var_playlist_bak);
+
+            return NGX_ERROR;
+        }
     }
 
 #define NGX_RTMP_HLS_VAR_HEADER "#EXTM3U\n#EXT-X-VERSION:3\n"
 
-    rc = ngx_write_fd(fd, NGX_RTMP_HLS_VAR_HEADER,
-                      sizeof(NGX_RTMP_HLS_VAR_HEADER) - 1);
+    rc = ngx_rtmp_hls_write(s, fd, (u_char *) NGX_RTMP_HLS_VAR_HEADER,
+                            sizeof(NGX_RTMP_HLS_VAR_HEADER) - 1);
     if (rc < 0) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
                       "hls: " ngx_write_fd_n " failed: '%V'",
@@ -453,7 +626,7 @@ ngx_rtmp_hls_write_variant_playlist(ngx_rtmp_session_t *s)
 
         p = ngx_slprintf(p, last, "%s", ".m3u8\n");
 
-        rc = ngx_write_fd(fd, buffer, p - buffer);
+        rc = ngx_rtmp_hls_write(s, fd, buffer, p - buffer);
         if (rc < 0) {
             ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
                           "hls: " ngx_write_fd_n " failed '%V'",
@@ -463,6 +636,13 @@ ngx_rtmp_hls_write_variant_playlist(ngx_rtmp_session_t *s)
         }
     }
 
+    if (fd == NGX_INVALID_FILE) {
+        return ngx_rtmp_hls_write_store(s, ctx->var_playlist.data,
+                                        NGX_RTMP_HLS_STORE_PLAYLIST,
+                                        ctx->plbuf->pos,
+                                        ctx->plbuf->last - ctx->plbuf->pos);
+    }
+
     ngx_close_file(fd);
 
     if (ngx_rtmp_hls_rename_file(ctx->var_playlist_bak.data,
@@ -479,6 +659,64 @@ ngx_rtmp_hls_write_variant_playlist(ngx_rtmp_session_t *s)
 }
 
 
+/* LL-HLS的部分切片只在hls_store模式下生成, 直接写入ctx->plbuf */
+static ngx_int_t
+ngx_rtmp_hls_write_parts(ngx_rtmp_session_t *s, ngx_rtmp_hls_frag_t *f,
+    ngx_str_t *name_part, const char *sep)
+{
+    u_char                          buffer[256], *p;
+    ngx_uint_t                      n;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+
+    for (n = 0; n < f->nparts; n++) {
+        p = ngx_snprintf(buffer, sizeof(buffer),
+                         "#EXT-X-PART:DURATION=%.3f,"
+                         "URI=\"%V%V%s%uL.%ui.ts\"%s\n",
+                         f->parts[n], &hacf->base_url, name_part, sep,
+                         f->id, n,
+                         (f->independent & ((uint64_t) 1 << n))
+                         ? ",INDEPENDENT=YES" : "");
+
+        if (ngx_rtmp_hls_write(s, NGX_INVALID_FILE, buffer, p - buffer) < 0) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+#if (NGX_THREADS)
+
+/* 播放列表已经发布, 期间的更新此时再写一次 */
+static void
+ngx_rtmp_hls_renamed(ngx_rtmp_thread_job_t *job, void *data)
+{
+    ngx_rtmp_session_t             *s = data;
+    ngx_rtmp_hls_ctx_t             *ctx;
+
+    if (s == NULL) {
+        return;
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+    if (ctx == NULL) {
+        return;
+    }
+
+    ctx->renaming = 0;
+
+    if (ctx->playlist_pending) {
+        ctx->playlist_pending = 0;
+        ngx_rtmp_hls_write_playlist(s);
+    }
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s)
 {
@@ -489,32 +727,57 @@ ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s)
     ssize_t                         n;
     ngx_rtmp_hls_app_conf_t        *hacf;
     ngx_rtmp_hls_frag_t            *f;
-    ngx_uint_t                      i, max_frag;
+    ngx_uint_t                      i, k, max_frag;
     ngx_str_t                       name_part, key_name_part;
     uint64_t                        prev_key_id;
     const char                     *sep, *key_sep;
+    double                          part_target;
 
 
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
 
-    fd = ngx_open_file(ctx->playlist_bak.data, NGX_FILE_WRONLY,
-                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+#if (NGX_THREADS)
+    if (ctx->renaming) {
+        ctx->playlist_pending = 1;
+        return NGX_OK;
+    }
+#endif
 
-    if (fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: " ngx_open_file_n " failed: '%V'",
-                      &ctx->playlist_bak);
-        return NGX_ERROR;
+    if (hacf->store) {
+        fd = NGX_INVALID_FILE;
+        ctx->plbuf->last = ctx->plbuf->pos;
+
+    } else {
+        fd = ngx_open_file(ctx->playlist_bak.data, NGX_FILE_WRONLY,
+                           NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+        if (fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                          "hls: " ngx_open_file_n " failed: '%V'",
+                          &ctx->playlist_bak);
+            return NGX_ERROR;
+        }
     }
 
     max_frag = hacf->fraglen / 1000;
+    part_target = ctx->partial / 1000.;
+
+    for (i = 0; i <= ctx->nfrags; i++) {
+        if (i == ctx->nfrags && !ctx->opened) {
+            break;
+        }
 
-    for (i = 0; i < ctx->nfrags; i++) {
         f = ngx_rtmp_hls_get_frag(s, i);
-        if (f->duration > max_frag) {
+        if (i < ctx->nfrags && f->duration > max_frag) {
             max_frag = (ngx_uint_t) (f->duration + .5);
         }
+
+        for (k = 0; k < f->nparts; k++) {
+            if (f->parts[k] > part_target) {
+                part_target = f->parts[k];
+            }
+        }
     }
 
     p = buffer;
@@ -522,22 +785,26 @@ ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s)
 
     p = ngx_slprintf(p, end,
                      "#EXTM3U\n"
-                     "#EXT-X-VERSION:3\n"
+                     "#EXT-X-VERSION:%ui\n"
                      "#EXT-X-MEDIA-SEQUENCE:%uL\n"
                      "#EXT-X-TARGETDURATION:%ui\n",
-                     ctx->frag, max_frag);
+                     (ngx_uint_t) (ctx->partial ? 6 : 3), ctx->frag, max_frag);
+
+    if (ctx->partial) {
+        p = ngx_slprintf(p, end,
+                         "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,"
+                         "PART-HOLD-BACK=%.3f\n"
+                         "#EXT-X-PART-INF:PART-TARGET=%.3f\n",
+                         part_target * 3, part_target);
+    }
 
     if (hacf->type == NGX_RTMP_HLS_TYPE_EVENT) {
         p = ngx_slprintf(p, end, "#EXT-X-PLAYLIST-TYPE: EVENT\n");
     }
 
-    n = ngx_write_fd(fd, buffer, p - buffer);
+    n = ngx_rtmp_hls_write(s, fd, buffer, p - buffer);
     if (n < 0) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: " ngx_write_fd_n " failed: '%V'",
-                      &ctx->playlist_bak);
-        ngx_close_file(fd);
-        return NGX_ERROR;
+        goto failed;
     }
 
     sep = hacf->nested ? (hacf->base_url.len ? "/" : "") : "-";
@@ -574,6 +841,18 @@ ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s)
 
         prev_key_id = f->key_id;
 
+        /* 最近两个切片同时列出部分切片 */
+
+        if (ctx->partial && i + 2 >= ctx->nfrags && f->nparts) {
+            if (ngx_rtmp_hls_write(s, fd, buffer, p - buffer) < 0
+                || ngx_rtmp_hls_write_parts(s, f, &name_part, sep) != NGX_OK)
+            {
+                goto failed;
+            }
+
+            p = buffer;
+        }
+
         p = ngx_slprintf(p, end,
                          "#EXTINF:%.3f,\n"
                          "%V%V%s%uL.ts\n",
@@ -584,32 +863,104 @@ ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s)
                        "discont=%i",
                        ctx->frag, i + 1, ctx->nfrags, f->duration, f->discont);
 
-        n = ngx_write_fd(fd, buffer, p - buffer);
+        n = ngx_rtmp_hls_write(s, fd, buffer, p - buffer);
         if (n < 0) {
-            ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                          "hls: " ngx_write_fd_n " failed '%V'",
-                          &ctx->playlist_bak);
-            ngx_close_file(fd);
-            return NGX_ERROR;
+            goto failed;
         }
     }
 
-    ngx_close_file(fd);
+    /* 正在生成的切片只列出已完成的部分切片, 并预告下一个 */
 
-    if (ngx_rtmp_hls_rename_file(ctx->playlist_bak.data, ctx->playlist.data)
-        == NGX_FILE_ERROR)
-    {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: rename failed: '%V'->'%V'",
-                      &ctx->playlist_bak, &ctx->playlist);
-        return NGX_ERROR;
+    if (ctx->partial && ctx->opened) {
+        f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
+
+        p = buffer;
+        end = p + sizeof(buffer);
+
+        if (f->discont) {
+            p = ngx_slprintf(p, end, "#EXT-X-DISCONTINUITY\n");
+
+            if (ngx_rtmp_hls_write(s, fd, buffer, p - buffer) < 0) {
+                goto failed;
+            }
+        }
+
+        if (ngx_rtmp_hls_write_parts(s, f, &name_part, sep) != NGX_OK) {
+            goto failed;
+        }
+
+        p = ngx_slprintf(buffer, end,
+                         "#EXT-X-PRELOAD-HINT:TYPE=PART,"
+                         "URI=\"%V%V%s%uL.%ui.ts\"\n",
+                         &hacf->base_url, &name_part, sep, f->id, f->nparts);
+
+        if (ngx_rtmp_hls_write(s, fd, buffer, p - buffer) < 0) {
+            goto failed;
+        }
     }
 
+    if (fd == NGX_INVALID_FILE) {
+        if (ngx_rtmp_hls_write_store(s, ctx->playlist.data,
+                                     NGX_RTMP_HLS_STORE_PLAYLIST,
+                                     ctx->plbuf->pos,
+                                     ctx->plbuf->last - ctx->plbuf->pos)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+    } else {
+        ngx_close_file(fd);
+
+#if (NGX_THREADS)
+        if (ctx->queue) {
+            if (ngx_rtmp_thread_rename(ctx->queue, &ctx->playlist_bak,
+                                       &ctx->playlist, ngx_rtmp_hls_renamed,
+                                       s->connection->log)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            ctx->renaming = 1;
+
+            goto variant;
+        }
+#endif
+
+        if (ngx_rtmp_hls_rename_file(ctx->playlist_bak.data,
+                                     ctx->playlist.data)
+            == NGX_FILE_ERROR)
+        {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                          "hls: rename failed: '%V'->'%V'",
+                          &ctx->playlist_bak, &ctx->playlist);
+            return NGX_ERROR;
+        }
+    }
+
+#if (NGX_THREADS)
+variant:
+#endif
+
     if (ctx->var) {
         return ngx_rtmp_hls_write_variant_playlist(s);
     }
 
     return NGX_OK;
+
+
+failed:
+
+    ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                  "hls: " ngx_write_fd_n " failed: '%V'",
+                  &ctx->playlist_bak);
+
+    if (fd != NGX_INVALID_FILE) {
+        ngx_close_file(fd);
+    }
+
+    return NGX_ERROR;
 }
 
 
@@ -815,10 +1166,70 @@ ngx_rtmp_hls_get_fragment_id(ngx_rtmp_session_t *s, uint64_t ts)
 }
 
 
+/*
+ * 部分切片是当前切片内存缓冲中上一次切分之后的数据, 单独写入hls_store,
+ * 完整的切片关闭时仍然整体写入一次
+ */
+static void
+ngx_rtmp_hls_close_part(ngx_rtmp_session_t *s, double duration)
+{
+    ngx_rtmp_hls_ctx_t             *ctx;
+    ngx_rtmp_hls_frag_t            *f;
+    ngx_buf_t                      *b;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
+    b = ctx->file.mem;
+
+    ngx_sprintf(ctx->part.data + ctx->part.len, "%uL.%ui.ts%Z",
+                f->id, f->nparts);
+
+    if (ngx_rtmp_hls_write_store(s, ctx->part.data, NGX_RTMP_HLS_STORE_PART,
+                                 b->pos + ctx->part_offset,
+                                 b->last - b->pos - ctx->part_offset)
+        != NGX_OK)
+    {
+        return;
+    }
+
+    f->parts[f->nparts] = duration;
+
+    if (ctx->part_independent) {
+        f->independent |= (uint64_t) 1 << f->nparts;
+    }
+
+    f->nparts++;
+
+    ctx->part_offset = b->last - b->pos;
+}
+
+
+/* 预告的部分切片先写入一个占位, 请求会等到它生成 */
+static void
+ngx_rtmp_hls_write_hint(ngx_rtmp_session_t *s)
+{
+    ngx_rtmp_hls_ctx_t             *ctx;
+    ngx_rtmp_hls_frag_t            *f;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
+
+    ngx_sprintf(ctx->part.data + ctx->part.len, "%uL.%ui.ts%Z",
+                f->id, f->nparts);
+
+    (void) ngx_rtmp_hls_write_store(s, ctx->part.data,
+                                    NGX_RTMP_HLS_STORE_PART, NULL, 0);
+}
+
+
 static ngx_int_t
 ngx_rtmp_hls_close_fragment(ngx_rtmp_session_t *s)
 {
     ngx_rtmp_hls_ctx_t         *ctx;
+    ngx_rtmp_hls_frag_t        *f;
+    double                      d;
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
     if (ctx == NULL || !ctx->opened) {
@@ -828,7 +1239,19 @@ ngx_rtmp_hls_close_fragment(ngx_rtmp_session_t *s)
     ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "hls: close fragment n=%uL", ctx->frag);
 
-    ngx_rtmp_mpegts_close_file(&ctx->file);
+    if (ngx_rtmp_mpegts_close_file(&ctx->file) == NGX_OK && ctx->file.mem) {
+
+        if (ctx->partial) {
+            f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
+            d = f->duration - (double) (ctx->part_ts - ctx->frag_ts) / 90000;
+            ngx_rtmp_hls_close_part(s, d > 0 ? d : 0);
+        }
+
+        ngx_rtmp_hls_write_store(s, ctx->stream.data,
+                                 NGX_RTMP_HLS_STORE_FRAGMENT,
+                                 ctx->file.mem->pos,
+                                 ctx->file.mem->last - ctx->file.mem->pos);
+    }
 
     ctx->opened = 0;
 
@@ -840,12 +1263,50 @@ ngx_rtmp_hls_close_fragment(ngx_rtmp_session_t *s)
 }
 
 
+static ngx_int_t
+ngx_rtmp_hls_write_key(ngx_rtmp_session_t *s)
+{
+    ngx_fd_t                  fd;
+    ngx_rtmp_hls_ctx_t       *ctx;
+    ngx_rtmp_hls_app_conf_t  *hacf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    if (hacf->store) {
+        return ngx_rtmp_hls_write_store(s, ctx->keyfile.data,
+                                        NGX_RTMP_HLS_STORE_KEY, ctx->key, 16);
+    }
+
+    fd = ngx_open_file(ctx->keyfile.data, NGX_FILE_WRONLY,
+                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "hls: failed to open key file '%s'",
+                      ctx->keyfile.data);
+        return NGX_ERROR;
+    }
+
+    if (ngx_write_fd(fd, ctx->key, 16) != 16) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "hls: failed to write key file '%s'",
+                      ctx->keyfile.data);
+        ngx_close_file(fd);
+        return NGX_ERROR;
+    }
+
+    ngx_close_file(fd);
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
     ngx_int_t discont)
 {
     uint64_t                  id;
-    ngx_fd_t                  fd;
     ngx_uint_t                g;
     ngx_rtmp_hls_ctx_t       *ctx;
     ngx_rtmp_hls_frag_t      *f;
@@ -859,11 +1320,13 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
 
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
 
-    if (ngx_rtmp_hls_ensure_directory(s, &hacf->path) != NGX_OK) {
+    if (!hacf->store
+        && ngx_rtmp_hls_ensure_directory(s, &hacf->path) != NGX_OK)
+    {
         return NGX_ERROR;
     }
 
-    if (hacf->keys &&
+    if (hacf->keys && !hacf->store &&
         ngx_rtmp_hls_ensure_directory(s, &hacf->key_path) != NGX_OK)
     {
         return NGX_ERROR;
@@ -892,32 +1355,17 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
 
             ngx_sprintf(ctx->keyfile.data + ctx->keyfile.len, "%uL.key%Z", id);
 
-            fd = ngx_open_file(ctx->keyfile.data, NGX_FILE_WRONLY,
-                               NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
-
-            if (fd == NGX_INVALID_FILE) {
-                ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                              "hls: failed to open key file '%s'",
-                              ctx->keyfile.data);
-                return NGX_ERROR;
-            }
-
-            if (ngx_write_fd(fd, ctx->key, 16) != 16) {
-                ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                              "hls: failed to write key file '%s'",
-                              ctx->keyfile.data);
-                ngx_close_file(fd);
+            if (ngx_rtmp_hls_write_key(s) != NGX_OK) {
                 return NGX_ERROR;
             }
 
-            ngx_close_file(fd);
-
         } else {
             if (hacf->frags_per_key) {
                 ctx->key_frags--;
             }
 
-            if (ngx_set_file_time(ctx->keyfile.data, 0, ngx_cached_time->sec)
+            if (!hacf->store &&
+                ngx_set_file_time(ctx->keyfile.data, 0, ngx_cached_time->sec)
                 != NGX_OK)
             {
                 ngx_log_error(NGX_LOG_ALERT, s->connection->log, ngx_errno,
@@ -943,6 +1391,23 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
         return NGX_ERROR;
     }
 
+    /* whole TS packets are collected here and written once per buffer */
+
+    if (ctx->fragbuf == NULL && hacf->fragment_buffer) {
+        ctx->fragbuf = ngx_create_temp_buf(s->connection->pool,
+                                           hacf->fragment_buffer +
+                                           2 * NGX_RTMP_MPEGTS_BUF_RESERVE);
+        if (ctx->fragbuf == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    ctx->file.out = ctx->fragbuf;
+    ctx->file.mem = ctx->mem;
+#if (NGX_THREADS)
+    ctx->file.queue = ctx->queue;
+#endif
+
     if (ngx_rtmp_mpegts_open_file(&ctx->file, ctx->stream.data,
                                   s->connection->log)
         != NGX_OK)
@@ -967,6 +1432,15 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
 
     ngx_rtmp_hls_flush_audio(s);
 
+    if (ctx->partial) {
+        ctx->part_offset = 0;
+        ctx->part_ts = ts;
+        ctx->part_independent = 1;
+
+        ngx_rtmp_hls_write_hint(s);
+        ngx_rtmp_hls_write_playlist(s);
+    }
+
     return NGX_OK;
 }
 
@@ -1270,6 +1744,71 @@ ngx_rtmp_hls_ensure_directory(ngx_rtmp_session_t *s, ngx_str_t *path)
 }
 
 
+static void
+ngx_rtmp_hls_free_store(void *data)
+{
+    ngx_buf_t  *b = data;
+
+    if (b->start) {
+        ngx_free(b->start);
+    }
+}
+
+
+/* 切片在内存中拼好后整体写入hls_store, 缓冲随切片大小增长, 会话结束时释放 */
+static ngx_int_t
+ngx_rtmp_hls_alloc_store(ngx_rtmp_session_t *s, ngx_rtmp_hls_ctx_t *ctx)
+{
+    ngx_rtmp_hls_app_conf_t        *hacf;
+    ngx_rtmp_hls_main_conf_t       *hmcf;
+    ngx_pool_cleanup_t             *cln;
+    size_t                          size;
+
+    hmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_hls_module);
+    if (hmcf->shm_zone == NULL) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "hls: hls_store requires hls_store_zone");
+        return NGX_ERROR;
+    }
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+
+    if (ctx->mem == NULL) {
+        cln = ngx_pool_cleanup_add(s->connection->pool, sizeof(ngx_buf_t));
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->mem = cln->data;
+        ngx_memzero(ctx->mem, sizeof(ngx_buf_t));
+
+        cln->handler = ngx_rtmp_hls_free_store;
+    }
+
+    if (ctx->plbuf == NULL) {
+
+        /* 每行在1024字节的缓冲中生成, 见ngx_rtmp_hls_write_playlist */
+
+        size = 1024 * (hacf->winfrags + 1);
+
+        if (hacf->partial) {
+            size += 3 * NGX_RTMP_HLS_MAX_PARTS * 256;
+        }
+
+        if (hacf->variant) {
+            size = ngx_max(size, 1024 * (hacf->variant->nelts + 1));
+        }
+
+        ctx->plbuf = ngx_create_temp_buf(s->connection->pool, size);
+        if (ctx->plbuf == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
 {
@@ -1277,10 +1816,14 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
     ngx_rtmp_hls_ctx_t             *ctx;
     u_char                         *p, *pp;
     ngx_rtmp_hls_frag_t            *f;
-    ngx_buf_t                      *b;
+    ngx_buf_t                      *b, *fb, *mb, *pb;
     size_t                          len;
     ngx_rtmp_hls_variant_t         *var;
     ngx_uint_t                      n;
+#if (NGX_THREADS)
+    ngx_rtmp_thread_queue_t        *q;
+    ngx_uint_t                      renaming;
+#endif
 
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
     if (hacf == NULL || !hacf->hls || hacf->path.len == 0) {
@@ -1306,11 +1849,25 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
 
         f = ctx->frags;
         b = ctx->aframe;
+        fb = ctx->fragbuf;
+        mb = ctx->mem;
+        pb = ctx->plbuf;
+#if (NGX_THREADS)
+        q = ctx->queue;
+        renaming = ctx->renaming;
+#endif
 
         ngx_memzero(ctx, sizeof(ngx_rtmp_hls_ctx_t));
 
         ctx->frags = f;
         ctx->aframe = b;
+        ctx->fragbuf = fb;
+        ctx->mem = mb;
+        ctx->plbuf = pb;
+#if (NGX_THREADS)
+        ctx->queue = q;
+        ctx->renaming = renaming;
+#endif
 
         if (b) {
             b->pos = b->last = b->start;
@@ -1326,6 +1883,26 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
         }
     }
 
+    if (hacf->store && ngx_rtmp_hls_alloc_store(s, ctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+#if (NGX_THREADS)
+
+    /* 写切片和加密交给线程池, hls_store模式只是内存拷贝, 不需要 */
+
+    if (hacf->thread_pool && hacf->fragment_buffer && !hacf->store
+        && ctx->queue == NULL)
+    {
+        ctx->queue = ngx_rtmp_thread_queue_create(hacf->thread_pool, s,
+                                                  s->connection->pool);
+        if (ctx->queue == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+#endif
+
     if (ngx_strstr(v->name, "..")) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                       "hls: bad stream name: '%s'", v->name);
@@ -1369,6 +1946,29 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
     ngx_memcpy(ctx->stream.data, ctx->playlist.data, ctx->stream.len - 1);
     ctx->stream.data[ctx->stream.len - 1] = (hacf->nested ? '/' : '-');
 
+    /* 部分切片只能放在hls_store中, 加密时需要按字节范围切分, 暂不支持 */
+
+    if (hacf->partial) {
+        if (!hacf->store || hacf->keys) {
+            ngx_log_error(NGX_LOG_WARN, s->connection->log, 0,
+                          "hls: hls_partial ignored, "
+                          "requires hls_store and no hls_keys");
+
+        } else {
+            ctx->partial = hacf->partial;
+
+            ctx->part.len = ctx->stream.len;
+            ctx->part.data = ngx_palloc(s->connection->pool,
+                                        ctx->part.len + 2 * NGX_INT64_LEN
+                                        + sizeof(".ts") + 1);
+            if (ctx->part.data == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(ctx->part.data, ctx->stream.data, ctx->part.len);
+        }
+    }
+
     /* varint playlist path */
 
     if (hacf->variant) {
@@ -1465,7 +2065,7 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
                    &ctx->playlist, &ctx->playlist_bak,
                    &ctx->stream, &ctx->keyfile);
 
-    if (hacf->continuous) {
+    if (hacf->continuous && !hacf->store) {
         ngx_rtmp_hls_restore_stream(s);
     }
 
@@ -1566,7 +2166,7 @@ ngx_rtmp_hls_update_fragment(ngx_rtmp_session_t *s, uint64_t ts,
     ngx_rtmp_hls_app_conf_t    *hacf;
     ngx_rtmp_hls_frag_t        *f;
     ngx_msec_t                  ts_frag_len;
-    ngx_int_t                   same_frag, force,discont;
+    ngx_int_t                   same_frag, force,discont, key;
     ngx_buf_t                  *b;
     int64_t                     d;
 
@@ -1575,6 +2175,7 @@ ngx_rtmp_hls_update_fragment(ngx_rtmp_session_t *s, uint64_t ts,
     f = NULL;
     force = 0;
     discont = 1;
+    key = boundary;
 
     if (ctx->opened) {
         f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
@@ -1618,6 +2219,22 @@ ngx_rtmp_hls_update_fragment(ngx_rtmp_session_t *s, uint64_t ts,
     if (boundary || force) {
         ngx_rtmp_hls_close_fragment(s);
         ngx_rtmp_hls_open_fragment(s, ts, discont);
+
+    } else if (f && ctx->partial && f->nparts < NGX_RTMP_HLS_MAX_PARTS - 1
+               && ts > ctx->part_ts
+               && ts - ctx->part_ts >= (uint64_t) ctx->partial * 90)
+    {
+        /* 最后一个部分切片留到切片关闭时生成 */
+
+        if (ngx_rtmp_mpegts_flush_file(&ctx->file) == NGX_OK) {
+            ngx_rtmp_hls_close_part(s, (double) (ts - ctx->part_ts) / 90000);
+
+            ctx->part_ts = ts;
+            ctx->part_independent = key ? 1 : 0;
+
+            ngx_rtmp_hls_write_hint(s);
+            ngx_rtmp_hls_write_playlist(s);
+        }
     }
 
     b = ctx->aframe;
@@ -1843,13 +2460,14 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_rtmp_hls_app_conf_t        *hacf;
     ngx_rtmp_hls_ctx_t             *ctx;
     ngx_rtmp_codec_ctx_t           *codec_ctx;
+    ngx_rtmp_codec_au_t            *au;
+    ngx_rtmp_codec_nal_t           *nal;
     u_char                         *p;
-    uint8_t                         fmt, ftype, htype, nal_type, src_nal_type;
-    uint32_t                        len, rlen;
+    uint8_t                         nal_type;
+    uint32_t                        len, pos;
     ngx_buf_t                       out, *b;
-    uint32_t                        cts;
     ngx_rtmp_mpegts_frame_t         frame;
-    ngx_uint_t                      nal_bytes;
+    ngx_uint_t                      i;
     ngx_int_t                       aud_sent, sps_pps_sent, boundary;
     static u_char                   buffer[NGX_RTMP_HLS_BUFSIZE];
 
@@ -1870,38 +2488,16 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         return NGX_OK;
     }
 
-    p = in->buf->pos;
-    if (ngx_rtmp_hls_copy(s, &fmt, &p, 1, &in) != NGX_OK) {
-        return NGX_ERROR;
-    }
-
-    /* 1: keyframe (IDR)
-     * 2: inter frame
-     * 3: disposable inter frame */
-
-    ftype = (fmt & 0xf0) >> 4;
+    /* NAL已经在codec模块中解析过, 这里只拷贝NAL数据 */
 
-    /* H264 HDR/PICT */
-
-    if (ngx_rtmp_hls_copy(s, &htype, &p, 1, &in) != NGX_OK) {
-        return NGX_ERROR;
-    }
+    au = ngx_rtmp_codec_get_au(s, h, in);
 
     /* proceed only with PICT */
 
-    if (htype != 1) {
+    if (au == NULL || au->nals.nelts == 0) {
         return NGX_OK;
     }
 
-    /* 3 bytes: decoder delay */
-
-    if (ngx_rtmp_hls_copy(s, &cts, &p, 3, &in) != NGX_OK) {
-        return NGX_ERROR;
-    }
-
-    cts = ((cts & 0x00FF0000) >> 16) | ((cts & 0x000000FF) << 16) |
-          (cts & 0x0000FF00);
-
     ngx_memzero(&out, sizeof(out));
 
     out.start = buffer;
@@ -1909,36 +2505,22 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     out.pos = out.start;
     out.last = out.pos;
 
-    nal_bytes = codec_ctx->avc_nal_bytes;
     aud_sent = 0;
     sps_pps_sent = 0;
 
-    while (in) {
-        if (ngx_rtmp_hls_copy(s, &rlen, &p, nal_bytes, &in) != NGX_OK) {
-            return NGX_OK;
-        }
-
-        len = 0;
-        ngx_rtmp_rmemcpy(&len, &rlen, nal_bytes);
-
-        if (len == 0) {
-            continue;
-        }
-
-        if (ngx_rtmp_hls_copy(s, &src_nal_type, &p, 1, &in) != NGX_OK) {
-            return NGX_OK;
-        }
+    p = in->buf->pos;
+    pos = 0;
+    nal = au->nals.elts;
 
-        nal_type = src_nal_type & 0x1f;
+    for (i = 0; i < au->nals.nelts; i++) {
+        len = nal[i].size;
+        nal_type = nal[i].type & 0x1f;
 
         ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                        "hls: h264 NAL type=%ui, len=%uD",
                        (ngx_uint_t) nal_type, len);
 
         if (nal_type >= 7 && nal_type <= 9) {
-            if (ngx_rtmp_hls_copy(s, NULL, &p, len - 1, &in) != NGX_OK) {
-                return NGX_ERROR;
-            }
             continue;
         }
 
@@ -1990,7 +2572,7 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         *out.last++ = 0;
         *out.last++ = 0;
         *out.last++ = 1;
-        *out.last++ = src_nal_type;
+        *out.last++ = nal[i].type;
 
         /* NAL body */
 
@@ -2000,21 +2582,29 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
             return NGX_OK;
         }
 
-        if (ngx_rtmp_hls_copy(s, out.last, &p, len - 1, &in) != NGX_OK) {
+        if (len == 1) {
+            continue;
+        }
+
+        if (ngx_rtmp_hls_copy(s, NULL, &p, nal[i].offset + 1 - pos, &in)
+            != NGX_OK
+            || ngx_rtmp_hls_copy(s, out.last, &p, len - 1, &in) != NGX_OK)
+        {
             return NGX_ERROR;
         }
 
         out.last += (len - 1);
+        pos = nal[i].offset + len;
     }
 
     ngx_memzero(&frame, sizeof(frame));
 
     frame.cc = ctx->video_cc;
     frame.dts = (uint64_t) h->timestamp * 90;
-    frame.pts = frame.dts + cts * 90;
+    frame.pts = frame.dts + au->cts * 90;
     frame.pid = 0x100;
     frame.sid = 0xe0;
-    frame.key = (ftype == 1);
+    frame.key = au->key;
 
     /*
      * start new fragment if
@@ -2304,6 +2894,12 @@ ngx_rtmp_hls_create_app_conf(ngx_conf_t *cf)
     conf->type = NGX_CONF_UNSET_UINT;
     conf->max_audio_delay = NGX_CONF_UNSET_MSEC;
     conf->audio_buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->fragment_buffer = NGX_CONF_UNSET_SIZE;
+#if (NGX_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
+    conf->store = NGX_CONF_UNSET;
+    conf->partial = NGX_CONF_UNSET_MSEC;
     conf->cleanup = NGX_CONF_UNSET;
     conf->granularity = NGX_CONF_UNSET;
     conf->keys = NGX_CONF_UNSET;
@@ -2339,6 +2935,13 @@ ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
                               300);
     ngx_conf_merge_size_value(conf->audio_buffer_size, prev->audio_buffer_size,
                               NGX_RTMP_HLS_BUFSIZE);
+    ngx_conf_merge_size_value(conf->fragment_buffer, prev->fragment_buffer,
+                              65536);
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+    ngx_conf_merge_value(conf->store, prev->store, 0);
+    ngx_conf_merge_msec_value(conf->partial, prev->partial, 0);
     ngx_conf_merge_value(conf->cleanup, prev->cleanup, 1);
     ngx_conf_merge_str_value(conf->base_url, prev->base_url, "");
     ngx_conf_merge_value(conf->granularity, prev->granularity, 0);
@@ -2351,9 +2954,9 @@ ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
         conf->winfrags = conf->playlen / conf->fraglen;
     }
 
-    /* schedule cleanup */
+    /* schedule cleanup, hls_store evicts fragments by itself */
 
-    if (conf->hls && conf->path.len && conf->cleanup &&
+    if (conf->hls && conf->path.len && conf->cleanup && !conf->store &&
         conf->type != NGX_RTMP_HLS_TYPE_EVENT)
     {
         if (conf->path.data[conf->path.len - 1] == '/') {
@@ -2386,7 +2989,7 @@ ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_str_value(conf->path, prev->path, "");
 
-    if (conf->keys && conf->cleanup && conf->key_path.len &&
+    if (conf->keys && conf->cleanup && !conf->store && conf->key_path.len &&
         ngx_strcmp(conf->key_path.data, conf->path.data) != 0 &&
         conf->type != NGX_RTMP_HLS_TYPE_EVENT)
     {
@@ -2428,10 +3031,38 @@ ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
 }
 
 
+static void *
+ngx_rtmp_hls_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_rtmp_hls_main_conf_t   *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_hls_main_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->store_zone = NGX_CONF_UNSET_SIZE;
+
+    return conf;
+}
+
+
+static char *
+ngx_rtmp_hls_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_rtmp_hls_main_conf_t   *hmcf = conf;
+
+    ngx_conf_init_size_value(hmcf->store_zone, 0);
+
+    return NGX_CONF_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_hls_postconfiguration(ngx_conf_t *cf)
 {
     ngx_rtmp_core_main_conf_t   *cmcf;
+    ngx_rtmp_hls_main_conf_t    *hmcf;
     ngx_rtmp_handler_pt         *h;
 
     cmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_core_module);
@@ -2454,5 +3085,21 @@ ngx_rtmp_hls_postconfiguration(ngx_conf_t *cf)
     next_stream_eof = ngx_rtmp_stream_eof;
     ngx_rtmp_stream_eof = ngx_rtmp_hls_stream_eof;
 
+    /* 与http的hls_store指令共用同一块共享内存 */
+
+    hmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_hls_module);
+    if (hmcf->store_zone == 0) {
+        return NGX_OK;
+    }
+
+    hmcf->shm_zone = ngx_shared_memory_add(cf, &ngx_rtmp_hls_store_shm_name,
+                                           hmcf->store_zone,
+                                           &ngx_rtmp_hls_module);
+    if (hmcf->shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    hmcf->shm_zone->init = ngx_rtmp_hls_store_init_zone;
+
     return NGX_OK;
 }
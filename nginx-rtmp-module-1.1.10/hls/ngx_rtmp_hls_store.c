@@ -0,0 +1,368 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp_hls_store.h"
+
+
+typedef struct {
+    ngx_rbtree_t                        files;
+    ngx_rbtree_node_t                   files_sentinel;
+    ngx_rbtree_t                        streams;
+    ngx_rbtree_node_t                   streams_sentinel;
+    ngx_queue_t                         expire;     /* 流按最近写入排序 */
+    time_t                              next_expire;
+    uint64_t                            version;    /* 每次写入加一 */
+} ngx_rtmp_hls_store_shctx_t;
+
+
+typedef struct {
+    ngx_rtmp_hls_store_stream_t         stream;
+    ngx_queue_t                         queue;
+} ngx_rtmp_hls_store_stream_node_t;
+
+
+#define ngx_rtmp_hls_store_stream_node(st)                                    \
+    ((ngx_rtmp_hls_store_stream_node_t *) (st))
+
+
+static void
+ngx_rtmp_hls_store_free(ngx_slab_pool_t *shpool,
+    ngx_rtmp_hls_store_file_t *file)
+{
+    if (file->data) {
+        ngx_slab_free_locked(shpool, file->data);
+    }
+
+    if (file->sn.str.data) {
+        ngx_slab_free_locked(shpool, file->sn.str.data);
+    }
+
+    ngx_slab_free_locked(shpool, file);
+}
+
+
+/* 从索引中摘除, 还有读者在发送时由最后一个读者释放 */
+static void
+ngx_rtmp_hls_store_unlink(ngx_rtmp_hls_store_shctx_t *shctx,
+    ngx_slab_pool_t *shpool, ngx_rtmp_hls_store_file_t *file)
+{
+    ngx_rbtree_delete(&shctx->files, &file->sn.node);
+    ngx_queue_remove(&file->queue);
+
+    file->stream->n[file->type]--;
+    file->stream = NULL;
+
+    if (file->refs) {
+        file->dead = 1;
+        return;
+    }
+
+    ngx_rtmp_hls_store_free(shpool, file);
+}
+
+
+static ngx_uint_t
+ngx_rtmp_hls_store_evict(ngx_rtmp_hls_store_shctx_t *shctx,
+    ngx_slab_pool_t *shpool, ngx_rtmp_hls_store_stream_t *st, ngx_uint_t type)
+{
+    ngx_queue_t                    *q;
+    ngx_rtmp_hls_store_file_t      *file;
+
+    for (q = ngx_queue_head(&st->files);
+         q != ngx_queue_sentinel(&st->files);
+         q = ngx_queue_next(q))
+    {
+        file = ngx_queue_data(q, ngx_rtmp_hls_store_file_t, queue);
+
+        if (file->type == type) {
+            ngx_rtmp_hls_store_unlink(shctx, shpool, file);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_rtmp_hls_store_drop_stream(ngx_rtmp_hls_store_shctx_t *shctx,
+    ngx_slab_pool_t *shpool, ngx_rtmp_hls_store_stream_t *st)
+{
+    ngx_queue_t                    *q;
+    ngx_rtmp_hls_store_file_t      *file;
+
+    while (!ngx_queue_empty(&st->files)) {
+        q = ngx_queue_head(&st->files);
+        file = ngx_queue_data(q, ngx_rtmp_hls_store_file_t, queue);
+        ngx_rtmp_hls_store_unlink(shctx, shpool, file);
+    }
+
+    ngx_rbtree_delete(&shctx->streams, &st->sn.node);
+    ngx_queue_remove(&ngx_rtmp_hls_store_stream_node(st)->queue);
+
+    ngx_slab_free_locked(shpool, st->sn.str.data);
+    ngx_slab_free_locked(shpool, st);
+}
+
+
+/* 释放长时间没有写入的流, 相当于磁盘模式下的hls_cleanup */
+static void
+ngx_rtmp_hls_store_expire(ngx_rtmp_hls_store_shctx_t *shctx,
+    ngx_slab_pool_t *shpool, time_t now)
+{
+    ngx_queue_t                        *q;
+    ngx_rtmp_hls_store_stream_node_t   *sn;
+
+    if (now < shctx->next_expire) {
+        return;
+    }
+
+    shctx->next_expire = now + 1;
+
+    while (!ngx_queue_empty(&shctx->expire)) {
+        q = ngx_queue_head(&shctx->expire);
+        sn = ngx_queue_data(q, ngx_rtmp_hls_store_stream_node_t, queue);
+
+        if (sn->stream.expire > now) {
+            break;
+        }
+
+        ngx_rtmp_hls_store_drop_stream(shctx, shpool, &sn->stream);
+    }
+}
+
+
+static ngx_rtmp_hls_store_stream_t *
+ngx_rtmp_hls_store_stream(ngx_rtmp_hls_store_shctx_t *shctx,
+    ngx_slab_pool_t *shpool, ngx_str_t *name, uint32_t hash, ngx_uint_t create)
+{
+    ngx_rtmp_hls_store_stream_t        *st;
+    ngx_rtmp_hls_store_stream_node_t   *sn;
+
+    st = (ngx_rtmp_hls_store_stream_t *)
+         ngx_str_rbtree_lookup(&shctx->streams, name, hash);
+
+    if (st || !create) {
+        return st;
+    }
+
+    sn = ngx_slab_calloc_locked(shpool,
+                                sizeof(ngx_rtmp_hls_store_stream_node_t));
+    if (sn == NULL) {
+        return NULL;
+    }
+
+    st = &sn->stream;
+
+    st->sn.str.data = ngx_slab_alloc_locked(shpool, name->len);
+    if (st->sn.str.data == NULL) {
+        ngx_slab_free_locked(shpool, sn);
+        return NULL;
+    }
+
+    ngx_memcpy(st->sn.str.data, name->data, name->len);
+    st->sn.str.len = name->len;
+    st->sn.node.key = hash;
+
+    ngx_queue_init(&st->files);
+    ngx_rbtree_insert(&shctx->streams, &st->sn.node);
+    ngx_queue_insert_tail(&shctx->expire, &sn->queue);
+
+    return st;
+}
+
+
+ngx_int_t
+ngx_rtmp_hls_store_put(ngx_shm_zone_t *zone, ngx_str_t *stream,
+    ngx_str_t *name, ngx_uint_t type, u_char *data, size_t size,
+    ngx_uint_t keep, time_t inactive, uint64_t msn, ngx_uint_t part,
+    ngx_log_t *log)
+{
+    ngx_slab_pool_t                *shpool;
+    ngx_rtmp_hls_store_shctx_t     *shctx;
+    ngx_rtmp_hls_store_stream_t    *st;
+    ngx_rtmp_hls_store_file_t      *file, *old;
+    uint32_t                        shash, fhash;
+    time_t                          now;
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+    shctx = zone->data;
+
+    now = ngx_time();
+    shash = ngx_crc32_short(stream->data, stream->len);
+    fhash = ngx_crc32_short(name->data, name->len);
+
+    /* 先分配内存, 拷贝数据时不持锁 */
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    ngx_rtmp_hls_store_expire(shctx, shpool, now);
+
+    for ( ;; ) {
+        file = ngx_slab_calloc_locked(shpool,
+                                      sizeof(ngx_rtmp_hls_store_file_t));
+        if (file) {
+            file->sn.str.data = ngx_slab_alloc_locked(shpool, name->len);
+            file->data = ngx_slab_alloc_locked(shpool, size ? size : 1);
+
+            if (file->sn.str.data && file->data) {
+                break;
+            }
+
+            ngx_rtmp_hls_store_free(shpool, file);
+        }
+
+        /* 内存不够时先淘汰本流最老的切片 */
+
+        st = ngx_rtmp_hls_store_stream(shctx, shpool, stream, shash, 0);
+        if (st == NULL
+            || !ngx_rtmp_hls_store_evict(shctx, shpool, st,
+                                         NGX_RTMP_HLS_STORE_FRAGMENT))
+        {
+            ngx_shmtx_unlock(&shpool->mutex);
+
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "hls store: no memory for '%V', %uz bytes",
+                          name, size);
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_memcpy(file->sn.str.data, name->data, name->len);
+    file->sn.str.len = name->len;
+    file->sn.node.key = fhash;
+    file->type = type;
+    file->pending = (data == NULL);
+    file->msn = msn;
+    file->part = part;
+    file->mtime = now;
+    file->size = size;
+
+    if (data) {
+        ngx_memcpy(file->data, data, size);
+    }
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    st = ngx_rtmp_hls_store_stream(shctx, shpool, stream, shash, 1);
+    if (st == NULL) {
+        ngx_rtmp_hls_store_free(shpool, file);
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "hls store: no memory for stream '%V'", stream);
+        return NGX_ERROR;
+    }
+
+    old = (ngx_rtmp_hls_store_file_t *)
+          ngx_str_rbtree_lookup(&shctx->files, name, fhash);
+    if (old) {
+        ngx_rtmp_hls_store_unlink(shctx, shpool, old);
+    }
+
+    file->version = ++shctx->version;
+    file->stream = st;
+    ngx_rbtree_insert(&shctx->files, &file->sn.node);
+    ngx_queue_insert_tail(&st->files, &file->queue);
+    st->n[type]++;
+
+    while (keep && st->n[type] > keep) {
+        ngx_rtmp_hls_store_evict(shctx, shpool, st, type);
+    }
+
+    st->expire = now + inactive;
+    ngx_queue_remove(&ngx_rtmp_hls_store_stream_node(st)->queue);
+    ngx_queue_insert_tail(&shctx->expire,
+                          &ngx_rtmp_hls_store_stream_node(st)->queue);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+ngx_rtmp_hls_store_file_t *
+ngx_rtmp_hls_store_get(ngx_shm_zone_t *zone, ngx_str_t *name)
+{
+    ngx_slab_pool_t                *shpool;
+    ngx_rtmp_hls_store_shctx_t     *shctx;
+    ngx_rtmp_hls_store_file_t      *file;
+    uint32_t                        hash;
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+    shctx = zone->data;
+
+    hash = ngx_crc32_short(name->data, name->len);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    ngx_rtmp_hls_store_expire(shctx, shpool, ngx_time());
+
+    file = (ngx_rtmp_hls_store_file_t *)
+           ngx_str_rbtree_lookup(&shctx->files, name, hash);
+    if (file) {
+        file->refs++;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return file;
+}
+
+
+void
+ngx_rtmp_hls_store_release(ngx_shm_zone_t *zone,
+    ngx_rtmp_hls_store_file_t *file)
+{
+    ngx_slab_pool_t                *shpool;
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (--file->refs == 0 && file->dead) {
+        ngx_rtmp_hls_store_free(shpool, file);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+ngx_int_t
+ngx_rtmp_hls_store_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_slab_pool_t                *shpool;
+    ngx_rtmp_hls_store_shctx_t     *shctx;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    shctx = ngx_slab_calloc(shpool, sizeof(ngx_rtmp_hls_store_shctx_t));
+    if (shctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_rbtree_init(&shctx->files, &shctx->files_sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_rbtree_init(&shctx->streams, &shctx->streams_sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_queue_init(&shctx->expire);
+
+    shpool->data = shctx;
+    shm_zone->data = shctx;
+
+    /* 写满时由写入方淘汰, 不需要slab打印no memory */
+    shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
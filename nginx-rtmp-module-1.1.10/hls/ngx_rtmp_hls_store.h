@@ -0,0 +1,73 @@
+
+#ifndef _NGX_RTMP_HLS_STORE_H_INCLUDED_
+#define _NGX_RTMP_HLS_STORE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/* 播放列表按名字覆盖, 切片、密钥和部分切片在流内按个数淘汰 */
+#define NGX_RTMP_HLS_STORE_PLAYLIST     0
+#define NGX_RTMP_HLS_STORE_FRAGMENT     1
+#define NGX_RTMP_HLS_STORE_KEY          2
+#define NGX_RTMP_HLS_STORE_PART         3
+#define NGX_RTMP_HLS_STORE_NTYPES       4
+
+
+typedef struct ngx_rtmp_hls_store_stream_s  ngx_rtmp_hls_store_stream_t;
+
+
+/* 共享内存中的一个文件, 引用计数不为0时只从索引摘除, 最后一个读者释放 */
+typedef struct {
+    ngx_str_node_t                      sn;     /* 磁盘模式下的完整路径 */
+    ngx_queue_t                         queue;
+    ngx_rtmp_hls_store_stream_t        *stream;
+    ngx_uint_t                          type;
+    ngx_uint_t                          refs;
+    ngx_uint_t                          dead;
+    ngx_uint_t                          pending;    /* 预告的部分切片 */
+
+    /* 播放列表中正在生成的切片序号和已经完成的部分切片个数 */
+    uint64_t                            msn;
+    ngx_uint_t                          part;
+
+    time_t                              mtime;
+    uint64_t                            version;    /* 用于ETag, 一秒内多次写入也不同 */
+    size_t                              size;
+    u_char                             *data;
+} ngx_rtmp_hls_store_file_t;
+
+
+struct ngx_rtmp_hls_store_stream_s {
+    ngx_str_node_t                      sn;     /* 流的播放列表路径 */
+    ngx_queue_t                         files;  /* 按写入先后 */
+    ngx_uint_t                          n[NGX_RTMP_HLS_STORE_NTYPES];
+    time_t                              expire;
+};
+
+
+ngx_int_t
+ngx_rtmp_hls_store_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+/*
+ * 写入一个文件, 同名文件被替换; keep为流内同类文件保留的个数(0表示不淘汰),
+ * inactive为流没有写入后整体释放的时间, data为NULL时写入一个等待中的占位,
+ * msn和part只对播放列表有意义
+ */
+ngx_int_t
+ngx_rtmp_hls_store_put(ngx_shm_zone_t *zone, ngx_str_t *stream,
+        ngx_str_t *name, ngx_uint_t type, u_char *data, size_t size,
+        ngx_uint_t keep, time_t inactive, uint64_t msn, ngx_uint_t part,
+        ngx_log_t *log);
+
+/* 按文件名查找并增加引用计数, 用完调用ngx_rtmp_hls_store_release */
+ngx_rtmp_hls_store_file_t *
+ngx_rtmp_hls_store_get(ngx_shm_zone_t *zone, ngx_str_t *name);
+
+void
+ngx_rtmp_hls_store_release(ngx_shm_zone_t *zone,
+        ngx_rtmp_hls_store_file_t *file);
+
+
+#endif /* _NGX_RTMP_HLS_STORE_H_INCLUDED_ */
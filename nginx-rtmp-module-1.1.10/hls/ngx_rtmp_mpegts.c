@@ -75,13 +75,138 @@ static u_char ngx_rtmp_mpegts_header[] = {
 #define NGX_RTMP_HLS_DELAY  63000
 
 
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_rtmp_thread_job_t    job;
+    ngx_rtmp_mpegts_file_t  *file;
+    size_t                   size;
+    ngx_uint_t               close;
+} ngx_rtmp_mpegts_job_t;
+
+
+static ngx_int_t ngx_rtmp_mpegts_post(ngx_rtmp_mpegts_file_t *file,
+    ngx_uint_t close);
+
+#endif
+
+
+/* CBC without padding, in may be equal to out */
 static ngx_int_t
-ngx_rtmp_mpegts_write_file(ngx_rtmp_mpegts_file_t *file, u_char *in,
+ngx_rtmp_mpegts_encrypt(ngx_rtmp_mpegts_file_t *file, u_char *in,
+    u_char *out, size_t n)
+{
+    int  len;
+
+    if (EVP_EncryptUpdate(file->cipher, out, &len, in, (int) n) != 1
+        || (size_t) len != n)
+    {
+        ngx_log_error(NGX_LOG_ERR, file->log, 0,
+                      "mpegts: EVP_EncryptUpdate() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_mpegts_init_cipher(ngx_rtmp_mpegts_file_t *file)
+{
+    const EVP_CIPHER  *cipher;
+
+    switch (file->key_len) {
+
+    case 16:
+        cipher = EVP_aes_128_cbc();
+        break;
+
+    case 24:
+        cipher = EVP_aes_192_cbc();
+        break;
+
+    default: /* 32 */
+        cipher = EVP_aes_256_cbc();
+    }
+
+    file->cipher = EVP_CIPHER_CTX_new();
+    if (file->cipher == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (EVP_EncryptInit_ex(file->cipher, cipher, NULL, file->key, file->iv)
+        != 1)
+    {
+        EVP_CIPHER_CTX_free(file->cipher);
+        file->cipher = NULL;
+        return NGX_ERROR;
+    }
+
+    EVP_CIPHER_CTX_set_padding(file->cipher, 0);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_mpegts_free_cipher(ngx_rtmp_mpegts_file_t *file)
+{
+    if (file->cipher) {
+        EVP_CIPHER_CTX_free(file->cipher);
+        file->cipher = NULL;
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_mpegts_output(ngx_rtmp_mpegts_file_t *file, u_char *in, size_t n)
+{
+    u_char     *p;
+    size_t      size;
+    ssize_t     rc;
+    ngx_buf_t  *b;
+
+    b = file->mem;
+
+    if (b == NULL) {
+        rc = ngx_write_fd(file->fd, in, n);
+        if (rc < 0 || (size_t) rc != n) {
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    if ((size_t) (b->end - b->last) < n) {
+        size = ngx_max((size_t) (b->end - b->start) * 2,
+                       (size_t) (b->last - b->start) + n);
+
+        p = ngx_alloc(size, file->log);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->last = ngx_cpymem(p, b->start, b->last - b->start);
+
+        ngx_free(b->start);
+
+        b->start = p;
+        b->pos = p;
+        b->end = p + size;
+    }
+
+    b->last = ngx_cpymem(b->last, in, n);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_mpegts_write_raw(ngx_rtmp_mpegts_file_t *file, u_char *in,
     size_t in_size)
 {
     u_char   *out;
     size_t    out_size, n;
-    ssize_t   rc;
 
     static u_char  buf[1024];
 
@@ -89,12 +214,7 @@ ngx_rtmp_mpegts_write_file(ngx_rtmp_mpegts_file_t *file, u_char *in,
         ngx_log_debug1(NGX_LOG_DEBUG_CORE, file->log, 0,
                        "mpegts: write %uz bytes", in_size);
 
-        rc = ngx_write_fd(file->fd, in, in_size);
-        if (rc < 0) {
-            return NGX_ERROR;
-        }
-
-        return NGX_OK;
+        return ngx_rtmp_mpegts_output(file, in, in_size);
     }
 
     /* encrypt */
@@ -111,7 +231,9 @@ ngx_rtmp_mpegts_write_file(ngx_rtmp_mpegts_file_t *file, u_char *in,
         in += 16 - file->size;
         in_size -= 16 - file->size;
 
-        AES_cbc_encrypt(file->buf, out, 16, &file->key, file->iv, AES_ENCRYPT);
+        if (ngx_rtmp_mpegts_encrypt(file, file->buf, out, 16) != NGX_OK) {
+            return NGX_ERROR;
+        }
 
         out += 16;
         out_size -= 16;
@@ -127,7 +249,9 @@ ngx_rtmp_mpegts_write_file(ngx_rtmp_mpegts_file_t *file, u_char *in,
                 n = out_size;
             }
 
-            AES_cbc_encrypt(in, out, n, &file->key, file->iv, AES_ENCRYPT);
+            if (ngx_rtmp_mpegts_encrypt(file, in, out, n) != NGX_OK) {
+                return NGX_ERROR;
+            }
 
             in += n;
             in_size -= n;
@@ -136,8 +260,7 @@ ngx_rtmp_mpegts_write_file(ngx_rtmp_mpegts_file_t *file, u_char *in,
             break;
         }
 
-        rc = ngx_write_fd(file->fd, buf, out - buf + n);
-        if (rc < 0) {
+        if (ngx_rtmp_mpegts_output(file, buf, out - buf + n) != NGX_OK) {
             return NGX_ERROR;
         }
 
@@ -154,6 +277,99 @@ ngx_rtmp_mpegts_write_file(ngx_rtmp_mpegts_file_t *file, u_char *in,
 }
 
 
+static ngx_int_t
+ngx_rtmp_mpegts_flush(ngx_rtmp_mpegts_file_t *file)
+{
+    u_char     *p;
+    size_t      n;
+    ngx_buf_t  *b;
+
+#if (NGX_THREADS)
+    if (file->thread) {
+        return ngx_rtmp_mpegts_post(file, 0);
+    }
+#endif
+
+    b = file->out;
+    p = b->start + NGX_RTMP_MPEGTS_BUF_RESERVE;
+
+    if (file->encrypt) {
+
+        /* encrypt in place, keep the incomplete block for the next flush */
+
+        p -= file->size;
+        ngx_memcpy(p, file->buf, file->size);
+
+        n = (size_t) (b->last - p) & ~0x0f;
+
+        if (ngx_rtmp_mpegts_encrypt(file, p, p, n) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        file->size = (size_t) (b->last - p) - n;
+        ngx_memcpy(file->buf, p + n, file->size);
+
+    } else {
+        n = (size_t) (b->last - p);
+    }
+
+    b->last = b->start + NGX_RTMP_MPEGTS_BUF_RESERVE;
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, file->log, 0,
+                   "mpegts: flush %uz bytes", n);
+
+    return ngx_rtmp_mpegts_output(file, p, n);
+}
+
+
+static ngx_int_t
+ngx_rtmp_mpegts_write_file(ngx_rtmp_mpegts_file_t *file, u_char *in,
+    size_t in_size)
+{
+    size_t      n;
+    ngx_buf_t  *b;
+
+    b = file->out;
+
+    if (b == NULL) {
+        return ngx_rtmp_mpegts_write_raw(file, in, in_size);
+    }
+
+    if ((size_t) (b->end - NGX_RTMP_MPEGTS_BUF_RESERVE - b->last) < in_size) {
+        if (ngx_rtmp_mpegts_flush(file) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        /*
+         * More than the whole buffer goes through it in parts: a job in
+         * the thread pool may still own the descriptor and the cipher
+         */
+
+        while ((size_t) (b->end - NGX_RTMP_MPEGTS_BUF_RESERVE - b->last)
+               < in_size)
+        {
+            n = (size_t) (b->end - NGX_RTMP_MPEGTS_BUF_RESERVE - b->last);
+
+            b->last = ngx_cpymem(b->last, in, n);
+            in += n;
+            in_size -= n;
+
+            if (ngx_rtmp_mpegts_flush(file) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    b->last = ngx_cpymem(b->last, in, in_size);
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_mpegts_write_header(ngx_rtmp_mpegts_file_t *file)
 {
@@ -327,10 +543,13 @@ ngx_int_t
 ngx_rtmp_mpegts_init_encryption(ngx_rtmp_mpegts_file_t *file,
     u_char *key, size_t key_len, uint64_t iv)
 {
-    if (AES_set_encrypt_key(key, key_len * 8, &file->key)) {
+    if (key_len != 16 && key_len != 24 && key_len != 32) {
         return NGX_ERROR;
     }
 
+    ngx_memcpy(file->key, key, key_len);
+    file->key_len = key_len;
+
     ngx_memzero(file->iv, 8);
 
     file->iv[8]  = (u_char) (iv >> 56);
@@ -354,46 +573,280 @@ ngx_rtmp_mpegts_open_file(ngx_rtmp_mpegts_file_t *file, u_char *path,
 {
     file->log = log;
 
-    file->fd = ngx_open_file(path, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
-                             NGX_FILE_DEFAULT_ACCESS);
+    if (file->mem) {
+        file->fd = NGX_INVALID_FILE;
+        file->mem->pos = file->mem->start;
+        file->mem->last = file->mem->start;
 
-    if (file->fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
-                      "hls: error creating fragment file");
-        return NGX_ERROR;
+    } else {
+        file->fd = ngx_open_file(path, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                                 NGX_FILE_DEFAULT_ACCESS);
+
+        if (file->fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                          "hls: error creating fragment file");
+            return NGX_ERROR;
+        }
     }
 
     file->size = 0;
+    file->cipher = NULL;
+
+#if (NGX_THREADS)
+    file->thread = NULL;
+    file->close_job = NULL;
+#endif
+
+    if (file->out) {
+        file->out->pos = file->out->start + NGX_RTMP_MPEGTS_BUF_RESERVE;
+        file->out->last = file->out->pos;
+    }
+
+    if (file->encrypt && ngx_rtmp_mpegts_init_cipher(file) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "hls: failed to initialize fragment encryption");
+        goto failed;
+    }
+
+#if (NGX_THREADS)
+    if (file->queue && file->out && file->mem == NULL) {
+        file->thread = ngx_alloc(sizeof(ngx_rtmp_mpegts_file_t), log);
+        if (file->thread == NULL) {
+            goto failed;
+        }
+
+        file->close_job = ngx_rtmp_thread_job_alloc(
+                                      sizeof(ngx_rtmp_mpegts_job_t)
+                                      + 2 * NGX_RTMP_MPEGTS_BUF_RESERVE, log);
+        if (file->close_job == NULL) {
+            goto failed;
+        }
+
+        *file->thread = *file;
+
+        file->thread->out = NULL;
+        file->thread->queue = NULL;
+        file->thread->thread = NULL;
+        file->thread->close_job = NULL;
+
+        /* the cipher is only used on the thread side */
+        file->cipher = NULL;
+    }
+#endif
 
     if (ngx_rtmp_mpegts_write_header(file) != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
                       "hls: error writing fragment header");
-        ngx_close_file(file->fd);
-        return NGX_ERROR;
+        goto failed;
     }
 
     return NGX_OK;
+
+failed:
+
+    if (file->fd != NGX_INVALID_FILE) {
+        ngx_close_file(file->fd);
+    }
+
+#if (NGX_THREADS)
+    if (file->thread) {
+        ngx_rtmp_mpegts_free_cipher(file->thread);
+        ngx_free(file->thread);
+        file->thread = NULL;
+    }
+
+    if (file->close_job) {
+        ngx_free(file->close_job);
+        file->close_job = NULL;
+    }
+#endif
+
+    ngx_rtmp_mpegts_free_cipher(file);
+
+    return NGX_ERROR;
+}
+
+
+/*
+ * Write out everything collected in the output buffer,
+ * an incomplete AES block is still held back
+ */
+ngx_int_t
+ngx_rtmp_mpegts_flush_file(ngx_rtmp_mpegts_file_t *file)
+{
+    if (file->out == NULL) {
+        return NGX_OK;
+    }
+
+    return ngx_rtmp_mpegts_flush(file);
 }
 
 
 ngx_int_t
 ngx_rtmp_mpegts_close_file(ngx_rtmp_mpegts_file_t *file)
 {
-    u_char   buf[16];
-    ssize_t  rc;
+    u_char      buf[16];
+    size_t      n;
+    ngx_int_t   rc;
+    ngx_buf_t  *b;
+
+#if (NGX_THREADS)
+    if (file->thread) {
+        rc = ngx_rtmp_mpegts_post(file, 1);
+        file->thread = NULL;
+        return rc;
+    }
+#endif
 
-    if (file->encrypt) {
+    b = file->out;
+
+    if (b) {
+        if (file->encrypt) {
+
+            /* PKCS#7 padding goes to the reserved end of the buffer */
+
+            n = 16 - (file->size + (size_t) (b->last - b->pos)) % 16;
+            ngx_memset(b->last, (int) n, n);
+            b->last += n;
+        }
+
+        rc = ngx_rtmp_mpegts_flush(file);
+
+    } else if (file->encrypt) {
         ngx_memset(file->buf + file->size, 16 - file->size, 16 - file->size);
 
-        AES_cbc_encrypt(file->buf, buf, 16, &file->key, file->iv, AES_ENCRYPT);
+        rc = ngx_rtmp_mpegts_encrypt(file, file->buf, buf, 16);
 
-        rc = ngx_write_fd(file->fd, buf, 16);
-        if (rc < 0) {
+        if (rc == NGX_OK) {
+            rc = ngx_rtmp_mpegts_output(file, buf, 16);
+        }
+
+    } else {
+        rc = NGX_OK;
+    }
+
+    ngx_rtmp_mpegts_free_cipher(file);
+
+    if (file->fd != NGX_INVALID_FILE) {
+        ngx_close_file(file->fd);
+    }
+
+    return rc;
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_rtmp_mpegts_job_handler(ngx_rtmp_thread_job_t *job, ngx_log_t *log)
+{
+    ngx_rtmp_mpegts_job_t   *mj = (ngx_rtmp_mpegts_job_t *) job;
+    ngx_rtmp_mpegts_file_t  *file;
+    ngx_buf_t                b;
+
+    file = mj->file;
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
+    b.start = (u_char *) &mj[1];
+    b.pos = b.start + NGX_RTMP_MPEGTS_BUF_RESERVE;
+    b.last = b.pos + mj->size;
+    b.end = b.last + NGX_RTMP_MPEGTS_BUF_RESERVE;
+
+    file->log = log;
+    file->out = &b;
+
+    if (mj->close) {
+        job->rc = ngx_rtmp_mpegts_close_file(file);
+
+    } else {
+        job->rc = ngx_rtmp_mpegts_flush(file);
+    }
+
+    file->out = NULL;
+
+    if (job->rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      "hls: error writing fragment");
+    }
+}
+
+
+static void
+ngx_rtmp_mpegts_job_done(ngx_rtmp_thread_job_t *job, void *data)
+{
+    ngx_rtmp_mpegts_job_t   *mj = (ngx_rtmp_mpegts_job_t *) job;
+
+    if (mj->close) {
+        ngx_free(mj->file);
+    }
+}
+
+
+/*
+ * Hand the collected packets over to the thread pool, encryption and
+ * writing are done there in queue order, the buffer is reused at once
+ */
+static ngx_int_t
+ngx_rtmp_mpegts_post(ngx_rtmp_mpegts_file_t *file, ngx_uint_t close)
+{
+    u_char                  *p;
+    size_t                   n;
+    ngx_buf_t               *b;
+    ngx_rtmp_mpegts_job_t   *mj;
+
+    ngx_int_t                rc;
+
+    b = file->out;
+    p = b->start + NGX_RTMP_MPEGTS_BUF_RESERVE;
+    n = (size_t) (b->last - p);
+
+    b->last = p;
+
+    if (n == 0 && !close) {
+        return NGX_OK;
+    }
+
+    rc = NGX_OK;
+
+    mj = ngx_rtmp_thread_job_alloc(sizeof(ngx_rtmp_mpegts_job_t) + n
+                                   + 2 * NGX_RTMP_MPEGTS_BUF_RESERVE,
+                                   file->log);
+    if (mj == NULL) {
+        if (!close) {
             return NGX_ERROR;
         }
+
+        /* the data is lost, the file is still closed behind earlier jobs */
+
+        mj = (ngx_rtmp_mpegts_job_t *) file->close_job;
+        file->close_job = NULL;
+
+        n = 0;
+        rc = NGX_ERROR;
+
+    } else {
+        ngx_memcpy((u_char *) &mj[1] + NGX_RTMP_MPEGTS_BUF_RESERVE, p, n);
     }
 
-    ngx_close_file(file->fd);
+    if (close && file->close_job) {
+        ngx_free(file->close_job);
+        file->close_job = NULL;
+    }
 
-    return NGX_OK;
+    mj->file = file->thread;
+    mj->size = n;
+    mj->close = close;
+
+    mj->job.handler = ngx_rtmp_mpegts_job_handler;
+    mj->job.done = ngx_rtmp_mpegts_job_done;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, file->log, 0,
+                   "mpegts: post %uz bytes, close=%ui", n, close);
+
+    ngx_rtmp_thread_job_post(file->queue, &mj->job);
+
+    return rc;
 }
+
+#endif
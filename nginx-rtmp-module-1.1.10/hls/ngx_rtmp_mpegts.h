@@ -10,18 +10,43 @@
 
 #include <ngx_config.h>
 #include <ngx_core.h>
-#include <openssl/aes.h>
+#include <openssl/evp.h>
+#include "ngx_rtmp_thread.h"
 
 
-typedef struct {
+/*
+ * One AES block is reserved on each side of the output buffer: the head
+ * takes the unencrypted tail left by the previous flush, the end takes
+ * the padding appended on close
+ */
+#define NGX_RTMP_MPEGTS_BUF_RESERVE  16
+
+
+typedef struct ngx_rtmp_mpegts_file_s  ngx_rtmp_mpegts_file_t;
+
+struct ngx_rtmp_mpegts_file_s {
     ngx_fd_t    fd;
     ngx_log_t  *log;
+    ngx_buf_t  *out;
+    ngx_buf_t  *mem;    /* fragment is kept in memory instead of fd */
     unsigned    encrypt:1;
     unsigned    size:4;
     u_char      buf[16];
     u_char      iv[16];
-    AES_KEY     key;
-} ngx_rtmp_mpegts_file_t;
+    u_char      key[32];
+    size_t      key_len;
+    EVP_CIPHER_CTX  *cipher;    /* CBC state, set up on open */
+#if (NGX_THREADS)
+    /*
+     * Full output buffers are copied to jobs on the queue, the fd and
+     * the encryption state are owned by the thread-side copy of the file;
+     * the close job is allocated on open so that it can always be queued
+     */
+    ngx_rtmp_thread_queue_t  *queue;
+    ngx_rtmp_mpegts_file_t   *thread;
+    ngx_rtmp_thread_job_t    *close_job;
+#endif
+};
 
 
 typedef struct {
@@ -39,6 +64,7 @@ ngx_int_t ngx_rtmp_mpegts_init_encryption(ngx_rtmp_mpegts_file_t *file,
 ngx_int_t ngx_rtmp_mpegts_open_file(ngx_rtmp_mpegts_file_t *file, u_char *path,
     ngx_log_t *log);
 ngx_int_t ngx_rtmp_mpegts_close_file(ngx_rtmp_mpegts_file_t *file);
+ngx_int_t ngx_rtmp_mpegts_flush_file(ngx_rtmp_mpegts_file_t *file);
 ngx_int_t ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
     ngx_rtmp_mpegts_frame_t *f, ngx_buf_t *b);
 
@@ -0,0 +1,886 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_connect.h>
+#include "ngx_http_flv_relay.h"
+#include "ngx_rtmp_cmd_module.h"
+#include "ngx_rtmp_live_module.h"
+#include "ngx_rtmp_edge_log.h"
+
+
+// 文件头加第一个上一个tag长度
+#define NGX_HTTP_FLV_RELAY_HEADER       13
+#define NGX_HTTP_FLV_RELAY_TAG_HEADER   11
+
+#define NGX_HTTP_FLV_RELAY_BUFSIZE      (64 * 1024)
+#define NGX_HTTP_FLV_RELAY_MAX_TAG      (4 * 1024 * 1024)
+
+#define NGX_HTTP_FLV_RELAY_HTTP         0   // 等待响应头
+#define NGX_HTTP_FLV_RELAY_FLV          1   // 等待flv文件头
+#define NGX_HTTP_FLV_RELAY_TAG          2
+
+// 热备保存的最新metadata和音视频序列头, 切换时先下发
+#define NGX_HTTP_FLV_RELAY_HDR_META     0
+#define NGX_HTTP_FLV_RELAY_HDR_VIDEO    1
+#define NGX_HTTP_FLV_RELAY_HDR_AUDIO    2
+#define NGX_HTTP_FLV_RELAY_NHDR         3
+
+
+typedef struct ngx_http_flv_relay_ctx_s  ngx_http_flv_relay_ctx_t;
+
+struct ngx_http_flv_relay_ctx_s {
+    ngx_rtmp_session_t                 *session;
+    ngx_http_live_play_relay_ctx_t     *relay_ctx;     // 为NULL时relay ctx已经释放
+    ngx_buf_t                          *request;
+    ngx_buf_t                          *buf;
+    ngx_uint_t                          state;
+    size_t                              need;          // 下一个完整单元需要的字节数
+    ngx_msec_t                          timeout;
+    u_char                              name[NGX_RTMP_MAX_NAME];
+
+    unsigned                            standby:1;     // 只收不推
+    unsigned                            wait_key:1;    // 刚切换, 等视频关键帧
+
+    u_char                             *hdr[NGX_HTTP_FLV_RELAY_NHDR];
+    size_t                              hdr_len[NGX_HTTP_FLV_RELAY_NHDR];
+    size_t                              hdr_size[NGX_HTTP_FLV_RELAY_NHDR];
+};
+
+
+static ngx_rtmp_module_t  ngx_http_flv_relay_module_ctx = {
+    NULL,                                   /* preconfiguration */
+    NULL,                                   /* postconfiguration */
+    NULL,                                   /* create main configuration */
+    NULL,                                   /* init main configuration */
+    NULL,                                   /* create server configuration */
+    NULL,                                   /* merge server configuration */
+    NULL,                                   /* create app configuration */
+    NULL                                    /* merge app configuration */
+};
+
+
+// 只用来在回源会话上保存上下文
+ngx_module_t  ngx_http_flv_relay_module = {
+    NGX_MODULE_V1,
+    &ngx_http_flv_relay_module_ctx,         /* module context */
+    NULL,                                   /* module directives */
+    NGX_RTMP_MODULE,                        /* module type */
+    NULL,                                   /* init master */
+    NULL,                                   /* init module */
+    NULL,                                   /* init process */
+    NULL,                                   /* init thread */
+    NULL,                                   /* exit thread */
+    NULL,                                   /* exit process */
+    NULL,                                   /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void ngx_http_flv_relay_recv(ngx_event_t *rev);
+
+
+static void
+ngx_http_flv_relay_cleanup(void *data)
+{
+    ngx_http_flv_relay_ctx_t   *fr = data;
+
+    if (fr->relay_ctx == NULL) {
+        return;
+    }
+
+    if (fr->relay_ctx->flv_relay == fr) {
+        fr->relay_ctx->flv_relay = NULL;
+    }
+
+    if (fr->relay_ctx->flv_standby == fr) {
+        fr->relay_ctx->flv_standby = NULL;
+    }
+}
+
+
+static void
+ngx_http_flv_relay_dummy(ngx_event_t *ev)
+{
+}
+
+
+static ngx_int_t
+ngx_http_flv_relay_publish(ngx_rtmp_session_t *s, ngx_http_flv_relay_ctx_t *fr)
+{
+    ngx_rtmp_publish_t          v;
+    ngx_rtmp_live_ctx_t        *lctx;
+
+    ngx_memzero(&v, sizeof(v));
+    ngx_cpystrn(v.name, fr->name, NGX_RTMP_MAX_NAME);
+    ngx_cpystrn(v.type, (u_char *) "live", sizeof(v.type));
+    v.silent = 1;
+
+    if (ngx_rtmp_publish(s, &v) != NGX_OK || s->connection->destroyed) {
+        return NGX_ERROR;
+    }
+
+    // 本地已经有推流端时live模块不会让回源会话推流
+    lctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_module);
+    if (lctx == NULL || !lctx->publishing) {
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                      "flv relay: '%s' already published", fr->name);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_flv_relay_deliver(ngx_rtmp_session_t *s, u_char *p, size_t size)
+{
+    ngx_rtmp_header_t           h;
+    ngx_chain_t                 cl;
+    ngx_buf_t                   b;
+
+    ngx_memzero(&h, sizeof(h));
+    h.type = p[0] & 0x1f;
+    h.mlen = size;
+    h.timestamp = ((uint32_t) p[7] << 24) | ((uint32_t) p[4] << 16)
+                  | ((uint32_t) p[5] << 8) | p[6];
+    h.msid = NGX_RTMP_MSID;
+
+    switch (h.type) {
+
+    case NGX_RTMP_MSG_VIDEO:
+        h.csid = NGX_RTMP_CSID_VIDEO;
+        break;
+
+    case NGX_RTMP_MSG_AUDIO:
+        h.csid = NGX_RTMP_CSID_AUDIO;
+        break;
+
+    case NGX_RTMP_MSG_AMF_META:
+        h.csid = NGX_RTMP_CSID_AMF;
+        break;
+
+    default:
+        return NGX_OK;
+    }
+
+    if (size == 0) {
+        return NGX_OK;
+    }
+
+    ngx_memzero(&b, sizeof(b));
+    b.start = b.pos = p + NGX_HTTP_FLV_RELAY_TAG_HEADER;
+    b.end = b.last = b.pos + size;
+    b.memory = 1;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    return ngx_rtmp_receive_message(s, &h, &cl);
+}
+
+
+// 返回tag对应的头部下标, 不是metadata或序列头时返回NGX_HTTP_FLV_RELAY_NHDR
+static ngx_uint_t
+ngx_http_flv_relay_header_index(u_char *p, size_t size)
+{
+    u_char     *d;
+
+    d = p + NGX_HTTP_FLV_RELAY_TAG_HEADER;
+
+    switch (p[0] & 0x1f) {
+
+    case NGX_RTMP_MSG_AMF_META:
+        return NGX_HTTP_FLV_RELAY_HDR_META;
+
+    case NGX_RTMP_MSG_VIDEO:
+        if (size >= 2 && ((d[0] & 0x0f) == 7 || (d[0] & 0x0f) == 12)
+            && d[1] == 0)
+        {
+            return NGX_HTTP_FLV_RELAY_HDR_VIDEO;
+        }
+        break;
+
+    case NGX_RTMP_MSG_AUDIO:
+        if (size >= 2 && (d[0] >> 4) == 10 && d[1] == 0) {
+            return NGX_HTTP_FLV_RELAY_HDR_AUDIO;
+        }
+        break;
+    }
+
+    return NGX_HTTP_FLV_RELAY_NHDR;
+}
+
+
+static ngx_int_t
+ngx_http_flv_relay_save_header(ngx_http_flv_relay_ctx_t *fr, ngx_pool_t *pool,
+    u_char *p, size_t size)
+{
+    ngx_uint_t      n;
+    size_t          len;
+
+    n = ngx_http_flv_relay_header_index(p, size);
+    if (n == NGX_HTTP_FLV_RELAY_NHDR) {
+        return NGX_OK;
+    }
+
+    len = NGX_HTTP_FLV_RELAY_TAG_HEADER + size;
+
+    if (len > fr->hdr_size[n]) {
+        if (fr->hdr[n]) {
+            ngx_pfree(pool, fr->hdr[n]);
+        }
+
+        fr->hdr[n] = ngx_palloc(pool, len);
+        if (fr->hdr[n] == NULL) {
+            fr->hdr_size[n] = 0;
+            return NGX_ERROR;
+        }
+
+        fr->hdr_size[n] = len;
+    }
+
+    ngx_memcpy(fr->hdr[n], p, len);
+    fr->hdr_len[n] = len;
+
+    return NGX_OK;
+}
+
+
+// 解析缓冲中完整的响应头/flv头/tag, 不完整的部分留到下次
+static ngx_int_t
+ngx_http_flv_relay_parse(ngx_rtmp_session_t *s, ngx_http_flv_relay_ctx_t *fr)
+{
+    ngx_buf_t                  *b;
+    u_char                     *p, *last;
+    size_t                      size, avail;
+
+    b = fr->buf;
+
+    for ( ;; ) {
+        p = b->pos;
+        avail = b->last - b->pos;
+
+        switch (fr->state) {
+
+        case NGX_HTTP_FLV_RELAY_HTTP:
+            last = ngx_strlcasestrn(p, b->last, (u_char *) "\r\n\r\n", 4 - 1);
+            if (last == NULL) {
+                if (avail >= NGX_HTTP_FLV_RELAY_BUFSIZE) {
+                    ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                                  "flv relay: response header too big");
+                    return NGX_ERROR;
+                }
+
+                fr->need = avail + 1;
+                return NGX_OK;
+            }
+
+            if (avail < 12
+                || ngx_strncmp(p, "HTTP/1.", 7) != 0
+                || ngx_strncmp(p + 9, "200", 3) != 0)
+            {
+                last = ngx_strlchr(p, b->last, '\r');
+                ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                              "flv relay: origin returned \"%*s\"",
+                              last - p, p);
+                return NGX_ERROR;
+            }
+
+            b->pos = last + 4;
+            fr->state = NGX_HTTP_FLV_RELAY_FLV;
+
+            if (!fr->standby && ngx_http_flv_relay_publish(s, fr) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            break;
+
+        case NGX_HTTP_FLV_RELAY_FLV:
+            if (avail < NGX_HTTP_FLV_RELAY_HEADER) {
+                fr->need = NGX_HTTP_FLV_RELAY_HEADER;
+                return NGX_OK;
+            }
+
+            if (ngx_strncmp(p, "FLV", 3) != 0) {
+                ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                              "flv relay: bad flv header");
+                return NGX_ERROR;
+            }
+
+            // DataOffset之后还有4字节的上一个tag长度
+            size = ((size_t) p[5] << 24) | ((size_t) p[6] << 16)
+                   | ((size_t) p[7] << 8) | p[8];
+
+            if (size < 9 || size > NGX_HTTP_FLV_RELAY_BUFSIZE) {
+                ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                              "flv relay: bad flv header size %uz", size);
+                return NGX_ERROR;
+            }
+
+            if (avail < size + 4) {
+                fr->need = size + 4;
+                return NGX_OK;
+            }
+
+            b->pos += size + 4;
+            fr->state = NGX_HTTP_FLV_RELAY_TAG;
+            break;
+
+        default:
+            if (avail < NGX_HTTP_FLV_RELAY_TAG_HEADER) {
+                fr->need = NGX_HTTP_FLV_RELAY_TAG_HEADER;
+                return NGX_OK;
+            }
+
+            size = ((size_t) p[1] << 16) | ((size_t) p[2] << 8) | p[3];
+
+            if (size > NGX_HTTP_FLV_RELAY_MAX_TAG) {
+                ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                              "flv relay: tag too big %uz", size);
+                return NGX_ERROR;
+            }
+
+            if (avail < NGX_HTTP_FLV_RELAY_TAG_HEADER + size + 4) {
+                fr->need = NGX_HTTP_FLV_RELAY_TAG_HEADER + size + 4;
+                return NGX_OK;
+            }
+
+            b->pos += NGX_HTTP_FLV_RELAY_TAG_HEADER + size + 4;
+
+            if (fr->standby) {
+                if (ngx_http_flv_relay_save_header(fr, s->connection->pool,
+                                                   p, size)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                break;
+            }
+
+            if (fr->wait_key) {
+                // 切换后从关键帧开始, 之前的音视频都丢掉
+                if ((p[0] & 0x1f) != NGX_RTMP_MSG_VIDEO || size == 0
+                    || (p[NGX_HTTP_FLV_RELAY_TAG_HEADER] >> 4) != 1)
+                {
+                    break;
+                }
+
+                fr->wait_key = 0;
+            }
+
+            if (ngx_http_flv_relay_deliver(s, p, size) != NGX_OK
+                || s->connection->destroyed)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        if (b->pos == b->last) {
+            b->pos = b->last = b->start;
+        }
+    }
+}
+
+
+// 缓冲满时把未解析的数据移到开头, 一个tag放不下时扩大缓冲
+static ngx_int_t
+ngx_http_flv_relay_buffer(ngx_http_flv_relay_ctx_t *fr, ngx_pool_t *pool)
+{
+    ngx_buf_t                  *b;
+    u_char                     *p;
+    size_t                      size, avail;
+
+    b = fr->buf;
+    avail = b->last - b->pos;
+
+    if (fr->need > (size_t) (b->end - b->start)) {
+        size = ngx_max(fr->need, (size_t) (b->end - b->start) * 2);
+
+        p = ngx_palloc(pool, size);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(p, b->pos, avail);
+        ngx_pfree(pool, b->start);
+
+        b->start = p;
+        b->end = p + size;
+
+    } else {
+        ngx_memmove(b->start, b->pos, avail);
+    }
+
+    b->pos = b->start;
+    b->last = b->start + avail;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_flv_relay_recv(ngx_event_t *rev)
+{
+    ngx_connection_t           *c;
+    ngx_rtmp_session_t         *s;
+    ngx_http_flv_relay_ctx_t   *fr;
+    ngx_buf_t                  *b;
+    ssize_t                     n;
+
+    c = rev->data;
+    s = c->data;
+
+    if (c->destroyed) {
+        return;
+    }
+
+    fr = ngx_rtmp_get_module_ctx(s, ngx_http_flv_relay_module);
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "flv relay: origin timed out");
+        c->timedout = 1;
+        goto failed;
+    }
+
+    if (rev->timer_set) {
+        ngx_del_timer(rev);
+    }
+
+    b = fr->buf;
+
+    for ( ;; ) {
+
+        if (b->last == b->end
+            && ngx_http_flv_relay_buffer(fr, c->pool) != NGX_OK)
+        {
+            goto failed;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "flv relay: origin closed connection");
+            goto failed;
+        }
+
+        b->last += n;
+        s->in_bytes += n;
+
+        if (ngx_http_flv_relay_parse(s, fr) != NGX_OK) {
+            goto failed;
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        goto failed;
+    }
+
+    ngx_add_timer(rev, fr->timeout);
+
+    return;
+
+failed:
+
+    ngx_rtmp_finalize_session(s);
+}
+
+
+static void
+ngx_http_flv_relay_send(ngx_event_t *wev)
+{
+    ngx_connection_t           *c;
+    ngx_rtmp_session_t         *s;
+    ngx_http_flv_relay_ctx_t   *fr;
+    ngx_buf_t                  *b;
+    ssize_t                     n;
+
+    c = wev->data;
+    s = c->data;
+
+    if (c->destroyed) {
+        return;
+    }
+
+    fr = ngx_rtmp_get_module_ctx(s, ngx_http_flv_relay_module);
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "flv relay: connect to origin timed out");
+        c->timedout = 1;
+        goto failed;
+    }
+
+    b = fr->request;
+
+    while (b->pos < b->last) {
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if (n == NGX_AGAIN || n == 0) {
+            ngx_add_timer(wev, fr->timeout);
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                goto failed;
+            }
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            goto failed;
+        }
+
+        b->pos += n;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    wev->handler = ngx_http_flv_relay_dummy;
+
+    c->read->handler = ngx_http_flv_relay_recv;
+    ngx_http_flv_relay_recv(c->read);
+
+    return;
+
+failed:
+
+    ngx_rtmp_finalize_session(s);
+}
+
+
+static ngx_buf_t *
+ngx_http_flv_relay_create_request(ngx_pool_t *pool, ngx_url_t *u)
+{
+    ngx_buf_t                  *b;
+    ngx_str_t                   uri;
+    size_t                      len;
+
+    uri = u->uri;
+    if (uri.len == 0) {
+        ngx_str_set(&uri, "/");
+    }
+
+    // 直播响应没有长度, 用HTTP/1.0让源站以关闭连接结束, 不用处理chunked
+    len = sizeof("GET  HTTP/1.0\r\n") - 1 + uri.len
+          + sizeof("Host: :65535\r\n") - 1 + u->host.len
+          + sizeof("User-Agent: ngx-flv-relay\r\n\r\n") - 1;
+
+    b = ngx_create_temp_buf(pool, len);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->last = ngx_sprintf(b->last, "GET %V HTTP/1.0\r\nHost: %V", &uri, &u->host);
+
+    if (u->port != 80) {
+        b->last = ngx_sprintf(b->last, ":%d", (int) u->port);
+    }
+
+    b->last = ngx_cpymem(b->last, "\r\nUser-Agent: ngx-flv-relay\r\n\r\n",
+                         sizeof("\r\nUser-Agent: ngx-flv-relay\r\n\r\n") - 1);
+
+    return b;
+}
+
+
+ngx_int_t
+ngx_http_flv_relay_enabled(ngx_http_live_play_relay_ctx_t *relay_ctx)
+{
+    return relay_ctx->relay_conf
+           && relay_ctx->relay_conf->http_flv_relay
+           && relay_ctx->http_pull_url.len > 7
+           && ngx_strncasecmp(relay_ctx->http_pull_url.data,
+                              (u_char *) "http://", 7) == 0;
+}
+
+
+static ngx_int_t
+ngx_http_flv_relay_create(ngx_http_live_play_relay_ctx_t *relay_ctx,
+    ngx_str_t *url, ngx_uint_t standby)
+{
+    ngx_http_flv_relay_ctx_t       *fr;
+    ngx_http_live_play_relay_loc_conf_t *hrlc;
+    ngx_peer_connection_t          *pc;
+    ngx_rtmp_addr_conf_t           *addr_conf;
+    ngx_rtmp_conf_ctx_t            *addr_ctx;
+    ngx_rtmp_session_t             *rs;
+    ngx_pool_cleanup_t             *cln;
+    ngx_connection_t               *c;
+    ngx_pool_t                     *pool;
+    ngx_log_t                      *log, *rtmp_log;
+    ngx_url_t                       u;
+    ngx_addr_t                     *addr;
+    ngx_str_t                       text;
+    ngx_int_t                       rc;
+
+    hrlc = relay_ctx->relay_conf;
+
+    pool = ngx_create_pool(4096, ngx_cycle->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+    u.url.data = url->data + 7;
+    u.url.len = url->len - 7;
+    u.default_port = 80;
+    u.uri_part = 1;
+
+    if (ngx_parse_url(pool, &u) != NGX_OK || u.naddrs == 0) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "flv relay: bad url \"%V\"", url);
+        goto failed;
+    }
+
+    fr = ngx_pcalloc(pool, sizeof(ngx_http_flv_relay_ctx_t));
+    log = ngx_palloc(pool, sizeof(ngx_log_t));
+    rtmp_log = ngx_palloc(pool, sizeof(ngx_log_t));
+    pc = ngx_pcalloc(pool, sizeof(ngx_peer_connection_t));
+    addr_conf = ngx_pcalloc(pool, sizeof(ngx_rtmp_addr_conf_t));
+    addr_ctx = ngx_pcalloc(pool, sizeof(ngx_rtmp_conf_ctx_t));
+    text.len = url->len;
+    text.data = ngx_pstrdup(pool, url);
+    if (fr == NULL || log == NULL || rtmp_log == NULL || pc == NULL
+        || addr_conf == NULL || addr_ctx == NULL || text.data == NULL)
+    {
+        goto failed;
+    }
+
+    fr->request = ngx_http_flv_relay_create_request(pool, &u);
+    fr->buf = ngx_create_temp_buf(pool, NGX_HTTP_FLV_RELAY_BUFSIZE);
+    if (fr->request == NULL || fr->buf == NULL) {
+        goto failed;
+    }
+
+    fr->timeout = hrlc->http_flv_relay_timeout;
+    ngx_memcpy(fr->name, relay_ctx->stream.data,
+               ngx_min(relay_ctx->stream.len, NGX_RTMP_MAX_NAME - 1));
+
+    *log = *ngx_cycle->log;
+    *rtmp_log = *ngx_cycle->log;
+
+    addr = &u.addrs[relay_ctx->reconnect_count % u.naddrs];
+
+    pc->log = log;
+    pc->get = ngx_event_get_peer;
+    pc->name = &addr->name;
+    pc->sockaddr = addr->sockaddr;
+    pc->socklen = addr->socklen;
+
+    rc = ngx_event_connect_peer(pc);
+    if (rc != NGX_OK && rc != NGX_AGAIN) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "flv relay: connect to %V failed", pc->name);
+        goto failed;
+    }
+
+    c = pc->connection;
+    c->pool = pool;
+    c->rtmp_log = rtmp_log;
+    c->addr_text = text;
+
+    addr_conf->ctx = addr_ctx;
+    addr_ctx->main_conf = relay_ctx->main_conf;
+    addr_ctx->srv_conf = relay_ctx->srv_conf;
+    ngx_str_set(&addr_conf->addr_text, "ngx-flv-relay");
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
+#endif
+
+    rs = ngx_rtmp_init_session(c, addr_conf);
+    if (rs == NULL) {
+        /* init_session关闭了连接 */
+        return NGX_ERROR;
+    }
+
+    rs->app_conf = relay_ctx->app_conf;
+    rs->relay = 1;
+    ngx_str_set(&rs->flashver, "ngx-flv-relay");
+
+    rs->app.len = relay_ctx->app.len;
+    rs->app.data = ngx_pstrdup(pool, &relay_ctx->app);
+    rs->pull_url = text;
+    if (rs->app.data == NULL) {
+        ngx_rtmp_finalize_session(rs);
+        return NGX_ERROR;
+    }
+
+    // 回源会话可能比relay ctx活得久, 两边互相解除引用
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        ngx_rtmp_finalize_session(rs);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_flv_relay_cleanup;
+    cln->data = fr;
+
+    fr->session = rs;
+    fr->relay_ctx = relay_ctx;
+    fr->standby = standby;
+    ngx_rtmp_set_ctx(rs, fr, ngx_http_flv_relay_module);
+
+    if (standby) {
+        relay_ctx->flv_standby = fr;
+
+    } else {
+        relay_ctx->flv_relay = fr;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, log, 0,
+                  "flv relay: %s '%V/%s' from %V",
+                  standby ? "standby" : "pull", &rs->app, fr->name, url);
+
+    c->read->handler = ngx_http_flv_relay_dummy;
+    c->write->handler = ngx_http_flv_relay_send;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, fr->timeout);
+        return NGX_OK;
+    }
+
+    ngx_http_flv_relay_send(c->write);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_http_flv_relay_pull(ngx_http_live_play_relay_ctx_t *relay_ctx)
+{
+    ngx_http_flv_relay_ctx_t   *fr;
+
+    if (relay_ctx->flv_relay) {
+        return NGX_OK;
+    }
+
+    // 没能接替的热备由新的回源代替
+    fr = relay_ctx->flv_standby;
+    if (fr) {
+        relay_ctx->flv_standby = NULL;
+        fr->relay_ctx = NULL;
+        ngx_rtmp_finalize_session(fr->session);
+    }
+
+    return ngx_http_flv_relay_create(relay_ctx, &relay_ctx->http_pull_url, 0);
+}
+
+
+ngx_int_t
+ngx_http_flv_relay_standby(ngx_http_live_play_relay_ctx_t *relay_ctx,
+    ngx_str_t *url)
+{
+    if (relay_ctx->flv_standby) {
+        return NGX_OK;
+    }
+
+    return ngx_http_flv_relay_create(relay_ctx, url, 1);
+}
+
+
+ngx_int_t
+ngx_http_flv_relay_promote(ngx_http_live_play_relay_ctx_t *relay_ctx)
+{
+    ngx_http_flv_relay_ctx_t   *fr;
+    ngx_rtmp_session_t         *s;
+    ngx_uint_t                  n;
+
+    fr = relay_ctx->flv_standby;
+
+    // 还没收到响应头的热备不比重新连接快
+    if (fr == NULL || relay_ctx->flv_relay
+        || fr->state != NGX_HTTP_FLV_RELAY_TAG)
+    {
+        return NGX_DECLINED;
+    }
+
+    s = fr->session;
+
+    relay_ctx->flv_standby = NULL;
+    relay_ctx->flv_relay = fr;
+
+    fr->standby = 0;
+    fr->wait_key = 1;
+
+    if (ngx_http_flv_relay_publish(s, fr) != NGX_OK) {
+        goto failed;
+    }
+
+    for (n = 0; n < NGX_HTTP_FLV_RELAY_NHDR; n++) {
+        if (fr->hdr_len[n] == 0) {
+            continue;
+        }
+
+        if (ngx_http_flv_relay_deliver(s, fr->hdr[n],
+                                       fr->hdr_len[n]
+                                       - NGX_HTTP_FLV_RELAY_TAG_HEADER)
+            != NGX_OK
+            || s->connection->destroyed)
+        {
+            goto failed;
+        }
+    }
+
+    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                  "flv relay: standby '%V/%s' promoted", &s->app, fr->name);
+
+    return NGX_OK;
+
+failed:
+
+    relay_ctx->flv_relay = NULL;
+    fr->relay_ctx = NULL;
+    ngx_rtmp_finalize_session(s);
+
+    return NGX_ERROR;
+}
+
+
+void
+ngx_http_flv_relay_close(ngx_http_live_play_relay_ctx_t *relay_ctx)
+{
+    ngx_http_flv_relay_ctx_t   *fr;
+
+    fr = relay_ctx->flv_relay;
+    if (fr == NULL) {
+        return;
+    }
+
+    relay_ctx->flv_relay = NULL;
+    fr->relay_ctx = NULL;
+
+    ngx_rtmp_finalize_session(fr->session);
+}
+
+
+void
+ngx_http_flv_relay_detach(ngx_http_live_play_relay_ctx_t *relay_ctx)
+{
+    ngx_http_flv_relay_ctx_t   *fr;
+
+    if (relay_ctx->flv_relay) {
+        relay_ctx->flv_relay->relay_ctx = NULL;
+        relay_ctx->flv_relay = NULL;
+    }
+
+    // 热备没有推流, 不会因为空闲断开
+    fr = relay_ctx->flv_standby;
+    if (fr) {
+        relay_ctx->flv_standby = NULL;
+        fr->relay_ctx = NULL;
+        ngx_rtmp_finalize_session(fr->session);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef NGX_HTTP_FLV_RELAY_H
+#define NGX_HTTP_FLV_RELAY_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp.h"
+#include "ngx_http_live_play_relay_module.h"
+
+
+extern ngx_module_t  ngx_http_flv_relay_module;
+
+// 开启了http_flv_relay且http_pull_url是http地址
+ngx_int_t ngx_http_flv_relay_enabled(ngx_http_live_play_relay_ctx_t *relay_ctx);
+
+// 按http_pull_url以HTTP-FLV回源: 连接源站的会话作为本地推流端,
+// 收到的flv tag直接进入分发, 没有rtmp握手、分块和connect/play命令
+ngx_int_t ngx_http_flv_relay_pull(ngx_http_live_play_relay_ctx_t *relay_ctx);
+
+// 以热备方式连接url, 只接收并保存序列头, 不推流
+ngx_int_t ngx_http_flv_relay_standby(ngx_http_live_play_relay_ctx_t *relay_ctx,
+        ngx_str_t *url);
+
+// 热备变为推流端, 先下发保存的序列头, 再从下一个视频关键帧开始分发;
+// 热备不可用时返回NGX_DECLINED
+ngx_int_t ngx_http_flv_relay_promote(ngx_http_live_play_relay_ctx_t *relay_ctx);
+
+// 断开当前的HTTP-FLV回源会话
+void ngx_http_flv_relay_close(ngx_http_live_play_relay_ctx_t *relay_ctx);
+
+// relay ctx释放前调用, 回源会话继续运行直到空闲断开, 热备直接断开
+void ngx_http_flv_relay_detach(ngx_http_live_play_relay_ctx_t *relay_ctx);
+
+#endif
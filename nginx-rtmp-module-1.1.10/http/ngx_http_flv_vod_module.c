@@ -0,0 +1,344 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_rtmp_record_module.h"
+
+
+static char * ngx_http_flv_vod(ngx_conf_t *cf, ngx_command_t *cmd,
+       void *conf);
+
+
+// 文件头和上一个tag长度
+#define NGX_HTTP_FLV_VOD_HEADER         13
+#define NGX_HTTP_FLV_VOD_TAG_HEADER     11
+
+// seek前缀最多包含的tag数(onMetaData和音视频序列头)
+#define NGX_HTTP_FLV_VOD_MAX_PREFIX     8
+
+
+static ngx_command_t  ngx_http_flv_vod_commands[] = {
+
+    { ngx_string("flv_vod"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_flv_vod,
+      0,
+      0,
+      NULL },
+
+    ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_flv_vod_module_ctx = {
+    NULL,                               /* preconfiguration */
+    NULL,                               /* postconfiguration */
+
+    NULL,                               /* create main configuration */
+    NULL,                               /* init main configuration */
+
+    NULL,                               /* create server configuration */
+    NULL,                               /* merge server configuration */
+
+    NULL,                               /* create location configuration */
+    NULL                                /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_flv_vod_module = {
+    NGX_MODULE_V1,
+    &ngx_http_flv_vod_module_ctx,       /* module context */
+    ngx_http_flv_vod_commands,          /* module directives */
+    NGX_HTTP_MODULE,                    /* module type */
+    NULL,                               /* init master */
+    NULL,                               /* init module */
+    NULL,                               /* init process */
+    NULL,                               /* init thread */
+    NULL,                               /* exit thread */
+    NULL,                               /* exit process */
+    NULL,                               /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+// 文件开头的头部tag(onMetaData、AAC/AVC/HEVC序列头)的结束位置,
+// 作为seek后的前缀原样发送; 不是flv文件时返回0
+static off_t
+ngx_http_flv_vod_prefix(ngx_file_t *file, off_t limit)
+{
+    u_char      buf[NGX_HTTP_FLV_VOD_TAG_HEADER + 2];
+    off_t       pos;
+    size_t      size;
+    ngx_uint_t  n, type, codec;
+
+    if (ngx_read_file(file, buf, 3, 0) != 3
+        || ngx_strncmp(buf, "FLV", 3) != 0)
+    {
+        return 0;
+    }
+
+    pos = NGX_HTTP_FLV_VOD_HEADER;
+
+    for (n = 0; n < NGX_HTTP_FLV_VOD_MAX_PREFIX; n++) {
+        if (pos + (off_t) sizeof(buf) > limit) {
+            break;
+        }
+
+        if (ngx_read_file(file, buf, sizeof(buf), pos)
+            != (ssize_t) sizeof(buf))
+        {
+            break;
+        }
+
+        type = buf[0] & 0x1f;
+        size = ((size_t) buf[1] << 16) | ((size_t) buf[2] << 8) | buf[3];
+
+        if (type == NGX_RTMP_MSG_AUDIO) {
+            // AAC且是序列头
+            if ((buf[11] >> 4) != 10 || buf[12] != 0) {
+                break;
+            }
+
+        } else if (type == NGX_RTMP_MSG_VIDEO) {
+            codec = buf[11] & 0x0f;
+
+            if ((codec != 7 && codec != 12) || buf[12] != 0) {
+                break;
+            }
+
+        } else if (type != NGX_RTMP_MSG_AMF_META) {
+            break;
+        }
+
+        if (pos + NGX_HTTP_FLV_VOD_TAG_HEADER + (off_t) size + 4 > limit) {
+            break;
+        }
+
+        pos += NGX_HTTP_FLV_VOD_TAG_HEADER + size + 4;
+    }
+
+    return pos;
+}
+
+
+static ngx_int_t
+ngx_http_flv_vod_handler(ngx_http_request_t *r)
+{
+    u_char                    *last;
+    off_t                      start, prefix, len;
+    size_t                     root;
+    ngx_int_t                  rc, ms;
+    ngx_uint_t                 level, i;
+    ngx_str_t                  path, value;
+    ngx_log_t                 *log;
+    ngx_buf_t                 *b;
+    ngx_file_t                *file;
+    ngx_chain_t                out[2];
+    ngx_open_file_info_t       of;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (r->uri.data[r->uri.len - 1] == '/') {
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    last = ngx_http_map_uri_to_path(r, &path, &root, 0);
+    if (last == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    log = r->connection->log;
+
+    path.len = last - path.data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http flv vod filename: \"%V\"", &path);
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+    of.read_ahead = clcf->read_ahead;
+    of.directio = clcf->directio;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+
+    if (ngx_http_set_disable_symlinks(r, clcf, &path, &of) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool)
+        != NGX_OK)
+    {
+        switch (of.err) {
+
+        case 0:
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        case NGX_ENOENT:
+        case NGX_ENOTDIR:
+        case NGX_ENAMETOOLONG:
+
+            level = NGX_LOG_ERR;
+            rc = NGX_HTTP_NOT_FOUND;
+            break;
+
+        case NGX_EACCES:
+#if (NGX_HAVE_OPENAT)
+        case NGX_EMLINK:
+        case NGX_ELOOP:
+#endif
+
+            level = NGX_LOG_ERR;
+            rc = NGX_HTTP_FORBIDDEN;
+            break;
+
+        default:
+
+            level = NGX_LOG_CRIT;
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            break;
+        }
+
+        if (rc != NGX_HTTP_NOT_FOUND || clcf->log_not_found) {
+            ngx_log_error(level, log, of.err,
+                          "%s \"%s\" failed", of.failed, path.data);
+        }
+
+        return rc;
+    }
+
+    if (!of.is_file) {
+
+        if (ngx_close_file(of.fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          ngx_close_file_n " \"%s\" failed", path.data);
+        }
+
+        return NGX_DECLINED;
+    }
+
+    r->root_tested = !r->error_page;
+
+    file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (file == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    file->fd = of.fd;
+    file->name = path;
+    file->log = log;
+    file->directio = of.is_directio;
+
+    // start为秒数(可带小数), 用录制时写的关键帧索引找到不晚于它的关键帧
+    start = 0;
+    prefix = 0;
+
+    if (r->args.len
+        && ngx_http_arg(r, (u_char *) "start", 5, &value) == NGX_OK)
+    {
+        ms = ngx_atofp(value.data, value.len, 3);
+
+        if (ms > 0
+            && ngx_rtmp_record_index_lookup(&path, (uint32_t) ms, &start, log)
+               == NGX_OK
+            && start < of.size)
+        {
+            prefix = ngx_http_flv_vod_prefix(file, start);
+        }
+
+        // 前缀找不到或关键帧就在前缀中时从头发送
+        if (prefix == 0 || start <= prefix) {
+            start = 0;
+            prefix = 0;
+        }
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "http flv vod start=%i offset=%O prefix=%O",
+                       ms, start, prefix);
+    }
+
+    log->action = "sending flv to client";
+
+    len = prefix + of.size - start;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = len;
+    r->headers_out.last_modified_time = of.mtime;
+
+    if (ngx_http_set_etag(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ngx_http_set_content_type(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->allow_ranges = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    // 前缀和关键帧之后的内容都是文件中的原始区间, 走sendfile不经过用户态
+    i = 1;
+
+    if (prefix) {
+        b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+        if (b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        b->file_pos = 0;
+        b->file_last = prefix;
+        b->in_file = 1;
+        b->file = file;
+
+        out[0].buf = b;
+        out[0].next = &out[1];
+
+        i = 0;
+    }
+
+    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->file_pos = start;
+    b->file_last = of.size;
+
+    b->in_file = b->file_last - b->file_pos ? 1 : 0;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+    b->file = file;
+
+    out[1].buf = b;
+    out[1].next = NULL;
+
+    return ngx_http_output_filter(r, &out[i]);
+}
+
+
+static char *
+ngx_http_flv_vod(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_flv_vod_handler;
+
+    return NGX_CONF_OK;
+}
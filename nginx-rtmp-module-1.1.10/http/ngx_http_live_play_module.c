@@ -4,6 +4,9 @@
 #include "ngx_http_play_scheduler.h"
 #include "ngx_rtmp_edge_log.h"
 
+static void * ngx_http_live_play_create_main_conf(ngx_conf_t * cf);
+static char * ngx_http_live_play_init_main_conf(ngx_conf_t *cf, void *conf);
+static ngx_int_t ngx_http_live_play_init_process(ngx_cycle_t *cycle);
 static char * ngx_http_live_play_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child);
 static void * ngx_http_live_play_create_srv_conf(ngx_conf_t * cf);
 static void * ngx_http_live_play_create_loc_conf(ngx_conf_t * cf);
@@ -18,6 +21,11 @@ static void ngx_http_live_play_send_header_ev(ngx_event_t *ev);
 
 static void ngx_http_live_play_send_data_timeout_ev(ngx_event_t *ev);
 
+static void ngx_http_live_play_write_handler(ngx_event_t *ev);
+
+// 令牌不足时补充令牌的间隔
+#define NGX_HTTP_LIVE_PACING_TICK   20
+
 static ngx_command_t  ngx_http_live_play_commands[] = {
     { ngx_string("http_live"),
         NGX_HTTP_LOC_CONF |NGX_CONF_FLAG,
@@ -110,6 +118,55 @@ static ngx_command_t  ngx_http_live_play_commands[] = {
         offsetof(ngx_http_live_play_loc_conf_t,http_play_cahce_frame_num),//default NGX_HTTP_PULL_KEEPALIVE_TIMEOUT
         NULL},
 
+    {ngx_string("http_send_vector"),
+        NGX_HTTP_LOC_CONF |NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_live_play_loc_conf_t,http_send_vector), 
+        NULL },
+
+    {ngx_string("http_send_max_bytes"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_live_play_loc_conf_t,http_send_max_bytes),
+        NULL},
+
+    {ngx_string("http_send_pacing"),
+        NGX_HTTP_LOC_CONF |NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_live_play_loc_conf_t,http_send_pacing), 
+        NULL },
+
+    {ngx_string("http_send_pacing_burst"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_live_play_loc_conf_t,http_send_pacing_burst),
+        NULL},
+
+    {ngx_string("http_send_pacing_min_rate"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_live_play_loc_conf_t,http_send_pacing_min_rate),
+        NULL},
+
+    {ngx_string("http_play_affinity"),
+        NGX_HTTP_MAIN_CONF |NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_live_play_main_conf_t,http_play_affinity), 
+        NULL },
+
+    {ngx_string("http_play_socket_dir"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_str_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_live_play_main_conf_t,http_play_socket_dir),
+        NULL},
+
          {ngx_string("cut_play_before_drop_num"),
         NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
         ngx_conf_set_num_slot,
@@ -124,8 +181,8 @@ static ngx_http_module_t  ngx_http_live_play_module_ctx = {
     NULL,                                     /* preconfiguration */
     NULL,                                     /* postconfiguration */
 
-    NULL,                                     /* create main configuration */
-    NULL,                                     /* init main configuration */
+    ngx_http_live_play_create_main_conf,      /* create main configuration */
+    ngx_http_live_play_init_main_conf,        /* init main configuration */
 
     ngx_http_live_play_create_srv_conf,    /* create server configuration */
     ngx_http_live_play_merge_srv_conf,     /* merge server configuration */
@@ -142,7 +199,7 @@ ngx_module_t  ngx_http_live_play_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_live_play_init_process,       /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -151,34 +208,91 @@ ngx_module_t  ngx_http_live_play_module = {
 };
 
 
+// 帧节点按块申请, 释放后进入worker级空闲链表, 在所有请求和流之间复用
+#define NGX_HTTP_FLV_FRAME_CHUNK    64
+
+static ngx_http_flv_frame_t *ngx_http_flv_frame_free;
+
 ngx_http_flv_frame_t * 
 alloc_http_flv_frame(ngx_http_live_play_request_ctx_t *s)
 {
     ngx_http_flv_frame_t * node = NULL;
-    if (s && s->s) {
-        ngx_pool_t   * pool = s->s->pool; 
-        if (s->frame_free) {
-            node = s->frame_free;
-            s->frame_free = node->next;
-            node->next = NULL;
-        } else {
-            if (pool)
-                node = (ngx_http_flv_frame_t*)ngx_palloc(pool, sizeof(ngx_http_flv_frame_t));
+    ngx_uint_t             i;
+
+    if (s == NULL) {
+        return NULL;
+    }
+
+    ngx_http_flv_pool_stat.frame_alloc++;
+    if (ngx_http_flv_frame_free) {
+        ngx_http_flv_pool_stat.frame_hit++;
+    } else {
+        node = ngx_alloc(sizeof(ngx_http_flv_frame_t) * NGX_HTTP_FLV_FRAME_CHUNK, ngx_cycle->log);
+        if (node == NULL) {
+            return NULL;
         }
-        if (node) {
-            memset(node,0,sizeof(ngx_http_flv_frame_t));
+        for (i = 0; i < NGX_HTTP_FLV_FRAME_CHUNK; i++) {
+            node[i].next = ngx_http_flv_frame_free;
+            ngx_http_flv_frame_free = &node[i];
         }
     }
+
+    node = ngx_http_flv_frame_free;
+    ngx_http_flv_frame_free = node->next;
+    memset(node,0,sizeof(ngx_http_flv_frame_t));
+
+    ngx_http_flv_pool_stat.frames_in_use++;
+    if (ngx_http_flv_pool_stat.frames_in_use > ngx_http_flv_pool_stat.frames_in_use_max) {
+        ngx_http_flv_pool_stat.frames_in_use_max = ngx_http_flv_pool_stat.frames_in_use;
+    }
     return node;
 }
 
 void 
 free_http_flv_frame(ngx_http_live_play_request_ctx_t *s,ngx_http_flv_frame_t *frame)
 {
-    if (s && s->frame_free && frame) {
+    if (s && frame) {
         memset(frame,0,sizeof(ngx_http_flv_frame_t));
-        frame->next = s->frame_free;
-        s->frame_free = frame;
+        frame->next = ngx_http_flv_frame_free;
+        ngx_http_flv_frame_free = frame;
+        ngx_http_flv_pool_stat.frames_in_use--;
+    }
+}
+
+static u_char *
+ngx_http_live_play_frame_data(ngx_http_flv_frame_t *frame, ngx_uint_t offset, ngx_uint_t *len)
+{
+    // 先发送私有tag头, 再发送共享数据
+    if (offset < frame->hdr_len) {
+        *len = frame->hdr_len - offset;
+        return frame->hdr + offset;
+    }
+    *len = frame->out->buf->last - frame->out->buf->pos - offset;
+    return frame->out->buf->pos + offset;
+}
+
+// tag被所有观众共享, 时间戳需要修正时只改写私有的tag头
+static void
+ngx_http_live_play_frame_stamp(ngx_http_flv_frame_t *frame, unsigned int pts)
+{
+    ngx_buf_t      *b = frame->out->buf;
+    unsigned int    tag_pts = 0;
+    u_char         *stamp;
+
+    frame->hdr_len = 0;
+    if (frame->mtype < HTTP_FLV_AUDIO_TAG
+            || b->last - b->pos <= NGX_HTTP_FLV_TAG_HEADER_SIZE)
+    {
+        return;
+    }
+
+    stamp = b->pos + 4;
+    FLVFILE_COPYSTAMP_INT(tag_pts, stamp);
+    if (tag_pts != pts) {
+        stamp = frame->hdr + 4;
+        ngx_memcpy(frame->hdr, b->pos, NGX_HTTP_FLV_TAG_HEADER_SIZE);
+        FLVFILECOPYSTMP(pts, stamp);
+        frame->hdr_len = NGX_HTTP_FLV_TAG_HEADER_SIZE;
     }
 }
 
@@ -191,6 +305,63 @@ ngx_http_live_play_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 	return NGX_CONF_OK;
 }
 
+static void * 
+ngx_http_live_play_create_main_conf(ngx_conf_t * cf)
+{
+	ngx_http_live_play_main_conf_t * conf;
+
+	conf = (ngx_http_live_play_main_conf_t*)ngx_pcalloc(cf->pool,sizeof(*conf));
+	if (conf == NULL) {
+		return NULL;
+	}
+    conf->http_play_affinity = NGX_CONF_UNSET;
+    return conf;
+}
+
+static char *
+ngx_http_live_play_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_live_play_main_conf_t * hlpmc = (ngx_http_live_play_main_conf_t*)conf;
+    ngx_path_t                     * path;
+
+    ngx_conf_init_value(hlpmc->http_play_affinity, 0);
+    if (hlpmc->http_play_socket_dir.len == 0) {
+        ngx_str_set(&hlpmc->http_play_socket_dir, NGX_HTTP_PLAY_SCHEDULER_PATH);
+    }
+
+    if (!hlpmc->http_play_affinity) {
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_conf_full_name(cf->cycle, &hlpmc->http_play_socket_dir, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    // 和临时目录一样交给ngx_create_paths创建, 权限0700且属于worker用户, 其他本地用户无法连接
+    path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+    if (path == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    path->name = hlpmc->http_play_socket_dir;
+
+    if (ngx_add_path(cf, &path) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_live_play_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_live_play_main_conf_t * hlpmc;
+
+    hlpmc = (ngx_http_live_play_main_conf_t*)ngx_http_cycle_get_module_main_conf(cycle, ngx_http_live_play_module);
+    if (hlpmc == NULL || !hlpmc->http_play_affinity) {
+        return NGX_OK;
+    }
+    return ngx_http_play_scheduler_init_process(cycle, &hlpmc->http_play_socket_dir);
+}
+
 static void * 
 ngx_http_live_play_create_srv_conf(ngx_conf_t * cf)
 {
@@ -219,6 +390,11 @@ ngx_http_live_play_create_loc_conf(ngx_conf_t * cf)
     conf->http_send_header_timeout = NGX_CONF_UNSET_MSEC; 
     conf->http_send_max_chunk_count = NGX_CONF_UNSET_UINT;
     conf->http_send_chunk_size = NGX_CONF_UNSET_UINT;
+    conf->http_send_vector = NGX_CONF_UNSET;
+    conf->http_send_max_bytes = NGX_CONF_UNSET_SIZE;
+    conf->http_send_pacing = NGX_CONF_UNSET;
+    conf->http_send_pacing_burst = NGX_CONF_UNSET_UINT;
+    conf->http_send_pacing_min_rate = NGX_CONF_UNSET_SIZE;
     conf->http_idle_timeout = NGX_CONF_UNSET_MSEC;
     conf->http_play_cahce_frame_num = NGX_CONF_UNSET_UINT;
     conf->http_play_cahce_time_duration = NGX_CONF_UNSET_MSEC;
@@ -243,6 +419,17 @@ ngx_http_live_play_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     
     ngx_conf_merge_uint_value(conf->http_send_chunk_size,prev->http_send_chunk_size,4096);
     ngx_conf_merge_uint_value(conf->http_send_max_chunk_count,prev->http_send_max_chunk_count,256);
+    ngx_conf_merge_value(conf->http_send_vector,prev->http_send_vector, 0);
+    ngx_conf_merge_size_value(conf->http_send_max_bytes,prev->http_send_max_bytes,512 * 1024);
+    if (conf->http_send_max_bytes == 0) {
+        conf->http_send_max_bytes = conf->http_send_chunk_size;
+    }
+    ngx_conf_merge_value(conf->http_send_pacing,prev->http_send_pacing, 0);
+    ngx_conf_merge_uint_value(conf->http_send_pacing_burst,prev->http_send_pacing_burst,4);
+    if (conf->http_send_pacing_burst == 0) {
+        conf->http_send_pacing_burst = 1;
+    }
+    ngx_conf_merge_size_value(conf->http_send_pacing_min_rate,prev->http_send_pacing_min_rate,64 * 1024);
     ngx_conf_merge_msec_value(conf->http_idle_timeout, prev->http_idle_timeout, 0);
 
     ngx_conf_merge_value(conf->http_play_cache_on,prev->http_play_cache_on, 0);
@@ -420,6 +607,13 @@ ngx_http_live_play_close_request(ngx_http_request_t * r)
     if (pr->idle_evt.timer_set) {
         ngx_del_timer(&pr->idle_evt);
     }
+
+    if (pr->pacing_evt.timer_set) {
+        ngx_del_timer(&pr->pacing_evt);
+    }
+
+    ngx_rtmp_counter_release(pr->counter, NGX_RTMP_COUNTER_ROLE_PLAYER);
+    pr->counter = NULL;
     
 
     pr->current_ts = ngx_rtmp_live_current_msec();
@@ -430,22 +624,23 @@ ngx_http_live_play_close_request(ngx_http_request_t * r)
     //删除
     ngx_http_rtmp_live_close_play_stream((void*)pr);
     
-    if (pr->frame_chain_head) {
+    while (pr->frame_chain_head) {
         ngx_http_flv_frame_t *frame = pr->frame_chain_head;
-        while (frame) {
-            ngx_http_flv_free_tag_mem(frame->out);
-            frame->out = NULL;
-            if (pr->frame_chain_head) {
-                frame = pr->frame_chain_head->next;
-                if(frame)
-                    pr->frame_chain_head = frame->next;
-            }
-            else
-                break;
-        }
+        pr->frame_chain_head = frame->next;
+        ngx_http_flv_free_tag_mem(frame->out);
+        frame->out = NULL;
+        free_http_flv_frame(pr, frame);
     }
     pr->frame_chain_head = pr->frame_chain_tail = NULL;
 
+    if (pr->ring_cur) {
+        ngx_http_flv_free_tag_mem(pr->ring_cur->out);
+        pr->ring_cur->out = NULL;
+        free_http_flv_frame(pr, pr->ring_cur);
+        pr->ring_cur = NULL;
+    }
+    pr->ring = NULL;
+
     r->connection->destroyed = 1;
     if(r->connection->write != NULL && r->connection->write->timer_set)
 		ngx_del_timer(r->connection->write);
@@ -549,6 +744,528 @@ ngx_http_live_play_recv_handler(ngx_event_t *ev)
     ngx_http_live_play_close_request(r);
 }
 
+static void
+ngx_http_live_play_tag_stat(ngx_http_live_play_request_ctx_t *hctx, u_char mtype, unsigned int mpts, unsigned int mlen)
+{
+    if(mtype >= HTTP_FLV_VIDEO_TAG)
+    {
+        hctx->video_pts = mpts;
+        hctx->recv_video_size += mlen;
+        ngx_rtmp_counter_add(hctx->counter, NGX_RTMP_COUNTER_OUT_VIDEO_BYTES, mlen);
+        ngx_rtmp_counter_add(hctx->counter, NGX_RTMP_COUNTER_OUT_VIDEO_FRAMES, 1);
+        if(hctx->first_tag && mtype == HTTP_FLV_VIDEO_KEY_FRAME_TAG){
+            hctx->first_tag = 0;
+            hctx->system_first_pts = hctx->current_ts;
+            hctx->data_first_pts = mpts;
+        }
+    }else{
+        hctx->audio_pts = mpts;
+        hctx->recv_audio_size += mlen;
+        ngx_rtmp_counter_add(hctx->counter, NGX_RTMP_COUNTER_OUT_AUDIO_BYTES, mlen);
+    }
+    hctx->recv_video_frame += 1;
+}
+
+static void
+ngx_http_live_play_frame_done(ngx_http_live_play_request_ctx_t *hctx, ngx_http_flv_frame_t *frame)
+{
+    if(frame->mtype >= HTTP_FLV_VIDEO_TAG)
+    {
+        hctx->cache_frame_num--;
+        hctx->cache_time_duration -= frame->mdelte;
+    }
+    ngx_http_live_play_tag_stat(hctx, frame->mtype, frame->mpts, frame->mlen);
+
+    ngx_http_flv_free_tag_mem(frame->out);
+    frame->out = NULL;
+    free_http_flv_frame(hctx,frame);
+}
+
+static void
+ngx_http_live_play_pacing_handler(ngx_event_t *ev)
+{
+    ngx_connection_t    *c = (ngx_connection_t*)ev->data;
+
+    ngx_http_live_play_write_handler(c->write);
+}
+
+// 按流的入码率补充令牌, 返回本次写事件最多可以发送的字节数
+static ngx_uint_t
+ngx_http_live_play_pacing_budget(ngx_http_live_play_request_ctx_t *hctx, ngx_http_live_play_loc_conf_t *hlplc)
+{
+    ngx_uint_t      rate, capacity;
+    ngx_msec_t      elapsed;
+
+    if (!hlplc->http_send_pacing) {
+        return hlplc->http_send_max_bytes;
+    }
+
+    // 比入码率多25%, 落后的观众可以追上来
+    rate = ngx_http_rtmp_live_bw_in((void*)hctx) * 5 / 4;
+    if (rate < hlplc->http_send_pacing_min_rate) {
+        rate = hlplc->http_send_pacing_min_rate;
+    }
+    capacity = rate * hlplc->http_send_pacing_burst;
+
+    if (hctx->pacing_rate == 0) {
+        // 起播时令牌桶是满的, 秒开缓存可以突发发送
+        hctx->pacing_tokens = capacity;
+    } else {
+        elapsed = ngx_current_msec - hctx->pacing_last;
+        hctx->pacing_tokens += (uint64_t) rate * elapsed / 1000;
+        if (hctx->pacing_tokens > capacity) {
+            hctx->pacing_tokens = capacity;
+        }
+    }
+    hctx->pacing_rate = rate;
+    hctx->pacing_last = ngx_current_msec;
+
+#if (NGX_LINUX && defined SO_MAX_PACING_RATE)
+    // 起播突发发完后把速率交给内核按包平滑发送, 码率变化超过1/8才重新设置
+    if (hctx->pacing_started
+            && (rate > hctx->pacing_sock_rate + hctx->pacing_sock_rate / 8
+                || rate < hctx->pacing_sock_rate - hctx->pacing_sock_rate / 8))
+    {
+        unsigned int sock_rate = rate > NGX_MAX_UINT32_VALUE ? NGX_MAX_UINT32_VALUE : rate;
+        if (setsockopt(hctx->s->connection->fd, SOL_SOCKET, SO_MAX_PACING_RATE,
+                    &sock_rate, sizeof(sock_rate)) == -1)
+        {
+            ngx_log_error(NGX_LOG_INFO, hctx->s->connection->log, ngx_socket_errno,
+                    "setsockopt(SO_MAX_PACING_RATE) failed");
+        }
+        hctx->pacing_sock_rate = rate;
+    }
+#endif
+
+    return ngx_min(hctx->pacing_tokens, hlplc->http_send_max_bytes);
+}
+
+static void
+ngx_http_live_play_pacing_consume(ngx_http_live_play_request_ctx_t *hctx, ngx_uint_t n)
+{
+    hctx->pacing_tokens -= ngx_min(hctx->pacing_tokens, n);
+}
+
+// 预算用完还有数据: 令牌不足时等定时器补充, 否则让出给其他连接
+static void
+ngx_http_live_play_pacing_wait(ngx_http_live_play_request_ctx_t *hctx, ngx_http_live_play_loc_conf_t *hlplc)
+{
+    ngx_connection_t    *c = hctx->s->connection;
+    ngx_event_t         *e = &hctx->pacing_evt;
+
+    if (!hlplc->http_send_pacing || hctx->pacing_tokens >= hlplc->http_send_max_bytes) {
+        ngx_post_event(c->write, &ngx_posted_events);
+        return;
+    }
+
+    if (!e->timer_set) {
+        e->data = c;
+        e->log = c->log;
+        e->handler = ngx_http_live_play_pacing_handler;
+        ngx_add_timer(e, NGX_HTTP_LIVE_PACING_TICK);
+    }
+}
+
+// 把队列中的多个帧组装成一次writev发送, 每次写事件最多发送http_send_max_bytes字节
+static ngx_int_t
+ngx_http_live_play_send_vector(ngx_http_live_play_request_ctx_t *hctx, ngx_http_live_play_loc_conf_t *hlplc)
+{
+    ngx_http_request_t      *r = hctx->s;
+    ngx_connection_t        *c = r->connection;
+    ngx_http_flv_frame_t    *frame;
+    struct iovec             iovs[NGX_IOVS_PREALLOCATE];
+    ngx_iovec_t              vec;
+    ngx_uint_t               budget, max_bytes, offset, len, frame_len;
+    u_char                  *data;
+    ssize_t                  n;
+
+    budget = 0;
+    max_bytes = ngx_http_live_play_pacing_budget(hctx, hlplc);
+    if (max_bytes == 0) {
+        ngx_http_live_play_pacing_wait(hctx, hlplc);
+        return NGX_AGAIN;
+    }
+    vec.iovs = iovs;
+    vec.nalloc = NGX_IOVS_PREALLOCATE;
+
+    while (hctx->frame_chain_head) {
+        vec.count = 0;
+        vec.size = 0;
+
+        for (frame = hctx->frame_chain_head; frame; frame = frame->next) {
+            offset = frame->sent;
+            while (vec.count < vec.nalloc && budget + vec.size < max_bytes) {
+                data = ngx_http_live_play_frame_data(frame, offset, &len);
+                if (len == 0) {
+                    break;
+                }
+                if (len > max_bytes - budget - vec.size) {
+                    len = max_bytes - budget - vec.size;
+                }
+                iovs[vec.count].iov_base = (void *) data;
+                iovs[vec.count].iov_len = len;
+                vec.count++;
+                vec.size += len;
+                offset += len;
+            }
+            if (vec.count == vec.nalloc || budget + vec.size >= max_bytes) {
+                break;
+            }
+        }
+
+        n = ngx_writev(c, &vec);
+        hctx->send_syscalls++;
+
+        if (n == NGX_ERROR) {
+            r->status_code = ngx_http_live_send_data_err; 
+            ngx_http_live_play_close_request(r);
+            return NGX_ERROR;
+        }
+
+        if (n == NGX_AGAIN) {
+            n = 0;
+        }
+        hctx->send_bytes += n;
+        budget += n;
+        ngx_http_live_play_pacing_consume(hctx, n);
+
+        // 根据实际发送的字节数移动各帧的发送位置
+        len = n;
+        while (len > 0 && hctx->frame_chain_head) {
+            frame = hctx->frame_chain_head;
+            frame_len = frame->out->buf->last - frame->out->buf->pos;
+            if (len < frame_len - frame->sent) {
+                frame->sent += len;
+                break;
+            }
+            len -= frame_len - frame->sent;
+            frame->sent = frame_len;
+            hctx->frame_chain_head = frame->next;
+            if (hctx->frame_chain_head == NULL) {
+                hctx->frame_chain_tail = NULL;
+            }
+            frame->next = NULL;
+            ngx_http_live_play_frame_done(hctx, frame);
+        }
+
+        if ((size_t) n < vec.size) {
+            c->write->ready = 0;
+            ngx_add_timer(c->write, hlplc->http_send_timeout);
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                r->status_code = ngx_http_live_write_event_err; 
+                ngx_http_live_play_close_request(r);
+                return NGX_ERROR;
+            }
+            return NGX_AGAIN;
+        }
+
+        if (budget >= max_bytes && hctx->frame_chain_head) {
+            // 本次写事件的预算用完, 等令牌补充或让出给其他连接, 下一轮继续发送
+            ngx_http_live_play_pacing_wait(hctx, hlplc);
+            return NGX_AGAIN;
+        }
+    }
+    return NGX_OK;
+}
+
+// 游标处的tag离开环: 提交时间戳, 需要私有tag头或只发送了一部分时转成ring_cur
+static ngx_int_t
+ngx_http_live_play_ring_detach(ngx_http_live_play_request_ctx_t *hctx, ngx_uint_t pts, ngx_uint_t sent)
+{
+    ngx_http_flv_ring_slot_t   *slot;
+    ngx_http_flv_frame_t       *frame;
+    ngx_uint_t                  idx;
+
+    slot = ngx_http_flv_ring_slot(hctx->ring, hctx->ring_seq);
+    idx = (slot->mtype >= HTTP_FLV_VIDEO_TAG ? 0 : 1);
+
+    frame = alloc_http_flv_frame(hctx);
+    if (frame == NULL) {
+        return NGX_ERROR;
+    }
+    frame->mtype = slot->mtype;
+    frame->mlen = slot->mlen;
+    frame->mpts = pts;
+    frame->mdelte = slot->mdelte;
+    frame->out = ngx_http_flv_acquire_tag_mem(slot->out);
+    frame->sent = sent;
+    ngx_http_live_play_frame_stamp(frame, pts);
+
+    hctx->ring_cur = frame;
+    hctx->ring_ts[idx] += slot->mdelte;
+    hctx->current_time = hctx->ring_ts[idx];
+    hctx->ring_seq++;
+    return NGX_OK;
+}
+
+// 落后超过max_lag_bytes/max_lag_time或已被覆盖时把游标移到最近的关键帧, 只在tag边界调用
+static void
+ngx_http_live_play_ring_skip(ngx_http_live_play_request_ctx_t *hctx)
+{
+    ngx_http_flv_ring_t        *ring = hctx->ring;
+    ngx_http_flv_ring_slot_t   *slot;
+    ngx_uint_t                  behind, from, target, i;
+    ngx_uint_t                  from_cum[2], from_offset;
+    ngx_int_t                   lag_time;
+
+    behind = ring->seq - hctx->ring_seq;
+    if (behind == 0) {
+        return;
+    }
+
+    if (behind <= ring->count) {
+        slot = ngx_http_flv_ring_slot(ring, hctx->ring_seq);
+        lag_time = (int32_t) (ring->last_pts - slot->mpts);
+        if (!(ring->max_lag_bytes && ring->bytes - slot->offset > ring->max_lag_bytes)
+                && !(ring->max_lag_time && lag_time > (ngx_int_t) ring->max_lag_time))
+        {
+            return;
+        }
+        from = hctx->ring_seq;
+    } else {
+        // 游标已被覆盖, 从环中最老的tag算起
+        from = ring->seq - ring->count;
+    }
+
+    if (ring->count) {
+        slot = ngx_http_flv_ring_slot(ring, from);
+        from_cum[0] = slot->cum[0];
+        from_cum[1] = slot->cum[1];
+        from_offset = slot->offset;
+    } else {
+        from_cum[0] = ring->cum[0];
+        from_cum[1] = ring->cum[1];
+        from_offset = ring->bytes;
+    }
+
+    if (ring->has_key && ring->seq - ring->key_seq < behind
+            && ring->seq - ring->key_seq <= ring->count)
+    {
+        target = ring->key_seq;
+        slot = ngx_http_flv_ring_slot(ring, target);
+        for (i = 0; i < 2; i++) {
+            hctx->ring_ts[i] += slot->cum[i] - from_cum[i];
+        }
+        hctx->drop_video_size += slot->offset - from_offset;
+        hctx->ring_wait_key = 0;
+    } else {
+        // 前面没有关键帧, 丢掉环中的数据等待下一个关键帧
+        target = ring->seq;
+        for (i = 0; i < 2; i++) {
+            hctx->ring_ts[i] += ring->cum[i] - from_cum[i];
+        }
+        hctx->drop_video_size += ring->bytes - from_offset;
+        hctx->ring_wait_key = 1;
+    }
+
+    hctx->dropVideoFrame += target - hctx->ring_seq;
+    ngx_rtmp_counter_add(hctx->counter, NGX_RTMP_COUNTER_DROP_VIDEO_FRAMES,
+                         target - hctx->ring_seq);
+    hctx->ring_skips++;
+    hctx->ring_seq = target;
+}
+
+// 在游标处找到下一个可以发送的tag: 跳过等关键帧期间的数据, 需要改写时间戳的tag转成ring_cur
+static ngx_int_t
+ngx_http_live_play_ring_prepare(ngx_http_live_play_request_ctx_t *hctx)
+{
+    ngx_http_flv_ring_t        *ring = hctx->ring;
+    ngx_http_flv_ring_slot_t   *slot;
+    ngx_uint_t                  idx, pts;
+
+    ngx_http_live_play_ring_skip(hctx);
+
+    while (hctx->ring_seq != ring->seq) {
+        slot = ngx_http_flv_ring_slot(ring, hctx->ring_seq);
+        idx = (slot->mtype >= HTTP_FLV_VIDEO_TAG ? 0 : 1);
+
+        if (hctx->ring_wait_key) {
+            if (slot->mtype != HTTP_FLV_VIDEO_KEY_FRAME_TAG) {
+                hctx->ring_ts[idx] += slot->mdelte;
+                hctx->drop_video_size += slot->mlen;
+                hctx->dropVideoFrame++;
+                ngx_rtmp_counter_add(hctx->counter, NGX_RTMP_COUNTER_DROP_VIDEO_FRAMES, 1);
+                hctx->ring_seq++;
+                continue;
+            }
+            hctx->ring_wait_key = 0;
+        }
+
+        pts = ngx_http_check_tag_pts(slot->mpts, hctx->ring_ts[idx], slot->mdelte);
+        if (pts != slot->mpts) {
+            return ngx_http_live_play_ring_detach(hctx, pts, 0);
+        }
+        break;
+    }
+    return NGX_OK;
+}
+
+// 根据实际发送的字节数移动ring_cur和游标
+static ngx_int_t
+ngx_http_live_play_ring_consume(ngx_http_live_play_request_ctx_t *hctx, ngx_uint_t n)
+{
+    ngx_http_flv_ring_slot_t   *slot;
+    ngx_http_flv_frame_t       *frame;
+    ngx_uint_t                  len, idx;
+
+    frame = hctx->ring_cur;
+    if (frame) {
+        len = frame->out->buf->last - frame->out->buf->pos - frame->sent;
+        if (n < len) {
+            frame->sent += n;
+            return NGX_OK;
+        }
+        n -= len;
+        ngx_http_live_play_tag_stat(hctx, frame->mtype, frame->mpts, frame->mlen);
+        ngx_http_flv_free_tag_mem(frame->out);
+        frame->out = NULL;
+        free_http_flv_frame(hctx, frame);
+        hctx->ring_cur = NULL;
+    }
+
+    while (n > 0) {
+        slot = ngx_http_flv_ring_slot(hctx->ring, hctx->ring_seq);
+        if (n < slot->mlen) {
+            return ngx_http_live_play_ring_detach(hctx, slot->mpts, n);
+        }
+        n -= slot->mlen;
+
+        idx = (slot->mtype >= HTTP_FLV_VIDEO_TAG ? 0 : 1);
+        hctx->ring_ts[idx] += slot->mdelte;
+        hctx->current_time = hctx->ring_ts[idx];
+        ngx_http_live_play_tag_stat(hctx, slot->mtype, slot->mpts, slot->mlen);
+        hctx->ring_seq++;
+    }
+    return NGX_OK;
+}
+
+// 从环中的读游标开始合并发送, 每个观众只维护游标, 不再为每帧分配节点
+static ngx_int_t
+ngx_http_live_play_send_ring(ngx_http_live_play_request_ctx_t *hctx, ngx_http_live_play_loc_conf_t *hlplc)
+{
+    ngx_http_request_t         *r = hctx->s;
+    ngx_connection_t           *c = r->connection;
+    ngx_http_flv_ring_t        *ring = hctx->ring;
+    ngx_http_flv_ring_slot_t   *slot;
+    ngx_http_flv_frame_t       *frame;
+    struct iovec                iovs[NGX_IOVS_PREALLOCATE];
+    ngx_iovec_t                 vec;
+    ngx_uint_t                  budget, max_bytes, offset, len, seq, idx, ts[2];
+    u_char                     *data;
+    ssize_t                     n;
+
+    budget = 0;
+    max_bytes = ngx_http_live_play_pacing_budget(hctx, hlplc);
+    if (max_bytes == 0) {
+        ngx_http_live_play_pacing_wait(hctx, hlplc);
+        return NGX_AGAIN;
+    }
+    vec.iovs = iovs;
+    vec.nalloc = NGX_IOVS_PREALLOCATE;
+
+    for ( ;; ) {
+        if (hctx->ring_cur == NULL
+                && ngx_http_live_play_ring_prepare(hctx) != NGX_OK)
+        {
+            r->status_code = ngx_http_live_send_data_err; 
+            ngx_http_live_play_close_request(r);
+            return NGX_ERROR;
+        }
+
+        vec.count = 0;
+        vec.size = 0;
+
+        frame = hctx->ring_cur;
+        if (frame) {
+            offset = frame->sent;
+            while (vec.count < vec.nalloc && budget + vec.size < max_bytes) {
+                data = ngx_http_live_play_frame_data(frame, offset, &len);
+                if (len == 0) {
+                    break;
+                }
+                if (len > max_bytes - budget - vec.size) {
+                    len = max_bytes - budget - vec.size;
+                }
+                iovs[vec.count].iov_base = (void *) data;
+                iovs[vec.count].iov_len = len;
+                vec.count++;
+                vec.size += len;
+                offset += len;
+            }
+        }
+
+        seq = hctx->ring_seq;
+        ts[0] = hctx->ring_ts[0];
+        ts[1] = hctx->ring_ts[1];
+        while (seq != ring->seq && vec.count < vec.nalloc
+                && budget + vec.size < max_bytes)
+        {
+            slot = ngx_http_flv_ring_slot(ring, seq);
+            idx = (slot->mtype >= HTTP_FLV_VIDEO_TAG ? 0 : 1);
+            if (ngx_http_check_tag_pts(slot->mpts, ts[idx], slot->mdelte) != slot->mpts) {
+                // 需要改写时间戳, 留到下一轮单独处理
+                break;
+            }
+            ts[idx] += slot->mdelte;
+
+            len = slot->mlen;
+            if (len > max_bytes - budget - vec.size) {
+                len = max_bytes - budget - vec.size;
+            }
+            iovs[vec.count].iov_base = (void *) slot->out->buf->pos;
+            iovs[vec.count].iov_len = len;
+            vec.count++;
+            vec.size += len;
+            seq++;
+        }
+
+        if (vec.count == 0) {
+            return NGX_OK;
+        }
+
+        n = ngx_writev(c, &vec);
+        hctx->send_syscalls++;
+
+        if (n == NGX_ERROR) {
+            r->status_code = ngx_http_live_send_data_err; 
+            ngx_http_live_play_close_request(r);
+            return NGX_ERROR;
+        }
+
+        if (n == NGX_AGAIN) {
+            n = 0;
+        }
+        hctx->send_bytes += n;
+        budget += n;
+        ngx_http_live_play_pacing_consume(hctx, n);
+
+        if (ngx_http_live_play_ring_consume(hctx, n) != NGX_OK) {
+            r->status_code = ngx_http_live_send_data_err; 
+            ngx_http_live_play_close_request(r);
+            return NGX_ERROR;
+        }
+
+        if ((size_t) n < vec.size) {
+            c->write->ready = 0;
+            ngx_add_timer(c->write, hlplc->http_send_timeout);
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                r->status_code = ngx_http_live_write_event_err; 
+                ngx_http_live_play_close_request(r);
+                return NGX_ERROR;
+            }
+            return NGX_AGAIN;
+        }
+
+        if (budget >= max_bytes
+                && (hctx->ring_cur || hctx->ring_seq != ring->seq))
+        {
+            // 本次写事件的预算用完, 等令牌补充或让出给其他连接, 下一轮继续发送
+            ngx_http_live_play_pacing_wait(hctx, hlplc);
+            return NGX_AGAIN;
+        }
+    }
+}
+
 static void 
 ngx_http_live_play_write_handler(ngx_event_t *ev)
 {
@@ -579,17 +1296,27 @@ ngx_http_live_play_write_handler(ngx_event_t *ev)
         ngx_del_timer(ev);
     }
 
-    if (hctx->frame_chain_head) {
+    // 开启限速时由令牌桶代替按包个数的限制
+    if (hlplc->http_send_vector || hlplc->http_send_pacing) {
+        if (ngx_http_live_play_send_vector(hctx, hlplc) != NGX_OK) {
+            return;
+        }
+    } else if (hctx->frame_chain_head) {
         // 取一帧发送
         ngx_http_flv_frame_t *frame = hctx->frame_chain_head;
         hctx->frame_chain_head = frame->next;
         frame->next = NULL;
         while (frame) {
             // 发送大小
-            ngx_uint_t send_len = frame->out->buf->last - frame->out->buf->pos;
+            ngx_uint_t send_len = frame->out->buf->last - frame->out->buf->pos - frame->sent;
             while (send_len > 0) {
-                ngx_int_t send_one_len = hlplc->http_send_chunk_size > send_len ? send_len : hlplc->http_send_chunk_size;
-                n = c->send(c, frame->out->buf->pos,send_one_len); 
+                ngx_uint_t data_len = 0;
+                u_char *data = ngx_http_live_play_frame_data(frame, frame->sent, &data_len);
+                ngx_int_t send_one_len = hlplc->http_send_chunk_size > data_len ? data_len : hlplc->http_send_chunk_size;
+                n = c->send(c, data, send_one_len); 
+                hctx->send_syscalls++;
+                if (n > 0)
+                    hctx->send_bytes += n;
                 
                 if (n == NGX_AGAIN || n == 0 
                         || (n < send_one_len && n > 0 )
@@ -597,7 +1324,7 @@ ngx_http_live_play_write_handler(ngx_event_t *ev)
                     hctx->current_send_count  = 0;
                     printf("send full %ld\n",n);
                     if(n > 0 &&  n <= send_one_len)
-                        frame->out->buf->pos += n;
+                        frame->sent += n;
 
                     frame->next = hctx->frame_chain_head;
                     hctx->frame_chain_head = frame;
@@ -619,32 +1346,13 @@ ngx_http_live_play_write_handler(ngx_event_t *ev)
                         return;
                     }
                     hctx->current_send_count++;
-                    frame->out->buf->pos += n;
+                    frame->sent += n;
                     send_len -= n;
                 }
             }
 
             hctx->current_send_count = 0;
-            if(frame->mtype >= HTTP_FLV_VIDEO_TAG)
-            {
-                hctx->cache_frame_num--;
-                hctx->cache_time_duration -= frame->mdelte;
-                hctx->video_pts = frame->mpts;
-                hctx->recv_video_size += frame->mlen;
-                if(hctx->first_tag && frame->mtype == HTTP_FLV_VIDEO_KEY_FRAME_TAG){
-                    hctx->first_tag = 0;
-                    hctx->system_first_pts = hctx->current_ts;
-                    hctx->data_first_pts = frame->mpts;
-                }
-            }else{
-                hctx->audio_pts = frame->mpts;
-                hctx->recv_audio_size += frame->mlen;
-            }
-             hctx->recv_video_frame += 1;
-
-            ngx_http_flv_free_tag_mem(frame->out);
-            frame->out = NULL;
-            free_http_flv_frame(hctx,frame);
+            ngx_http_live_play_frame_done(hctx, frame);
             frame = NULL;
             
             if (hctx->frame_chain_head) {
@@ -659,6 +1367,16 @@ ngx_http_live_play_write_handler(ngx_event_t *ev)
         }
     }
 
+    // 秒开缓存等私有帧发完后再从环中发送
+    if (hctx->ring && hctx->frame_chain_head == NULL) {
+        if (ngx_http_live_play_send_ring(hctx, hlplc) != NGX_OK) {
+            return;
+        }
+    }
+
+    // 积压的数据都已发完, 起播突发结束
+    hctx->pacing_started = 1;
+
     if (ev->active) {
         ngx_del_event(ev, NGX_WRITE_EVENT, 0);
     }
@@ -873,7 +1591,19 @@ ngx_http_live_play_handler(ngx_http_request_t * r)
     ngx_str_format_string(pr->stream,stream);
     ngx_str_format_string(pr->suffix,suffix);
 
-    ngx_http_live_play_process_slot((u_char*)stream,strlen(stream));
+    // 流不在本worker时按流名转交给固定的worker, 同一个流的观众集中在一个进程里
+    ngx_http_live_play_main_conf_t * hlpmc = (ngx_http_live_play_main_conf_t*)ngx_http_get_module_main_conf(r, ngx_http_live_play_module);
+    ngx_int_t slot = ngx_http_live_play_process_slot((u_char*)stream,strlen(stream));
+    if (hlpmc->http_play_affinity && slot >= 0 && !ngx_http_rtmp_live_has_stream((void*)pr)
+            && ngx_http_play_scheduler_handoff(r, slot) == NGX_OK)
+    {
+        ngx_printf_log("ngx_http_live_play_module","ngx_http_live_play_handler","stream %s handoff to worker %ld", stream, slot);
+        ngx_http_set_ctx(r, NULL, ngx_http_live_play_module);
+        r->keepalive = 0;
+        return NGX_HTTP_CLOSE;
+    }
+
+    pr->counter = ngx_rtmp_counter_acquire(&pr->app, &pr->stream, NGX_RTMP_COUNTER_ROLE_PLAYER);
 
     if(ngx_http_live_authentication(pr) != NGX_OK) //鉴权
     {
@@ -1017,6 +1747,25 @@ ngx_int_t ngx_http_paly_cache_process(ngx_http_live_play_request_ctx_t *s,u_char
     return NGX_OK;
 }
 
+static void
+ngx_http_live_play_watch_log(ngx_http_live_play_request_ctx_t *pr)
+{
+    if (pr->current_ts-pr->log_lts >= global_poll) {
+        if (pr->log_type == 0) { 
+            ngx_rtmp_edge_log(NGX_EDGE_HTTP, NGX_EDGE_PULL_START, pr, pr->current_ts);
+            pr->log_type = 1;
+        } else {
+            ngx_rtmp_edge_log(NGX_EDGE_HTTP, NGX_EDGE_PULL_WATCH, pr, pr->current_ts);
+            pr->lrecv_video_size = pr->recv_video_size;
+            pr->lrecv_audio_size = pr->recv_audio_size;
+            pr->lrecv_video_frame = pr->recv_video_frame;
+            pr->lsend_syscalls = pr->send_syscalls;
+            pr->lsend_bytes = pr->send_bytes;
+        }
+        pr->log_lts = pr->current_ts;
+    }
+}
+
 ngx_int_t 
 ngx_http_live_send_message(ngx_http_live_play_request_ctx_t *pr, ngx_chain_t* out
         ,u_char mtype,unsigned int mlen,unsigned int pts,unsigned int delta)
@@ -1039,6 +1788,7 @@ ngx_http_live_send_message(ngx_http_live_play_request_ctx_t *pr, ngx_chain_t* ou
             pr->drop_vduration += delta;
             pr->drop_vframe_num++;
             pr->dropVideoFrame++; // 总的
+            ngx_rtmp_counter_add(pr->counter, NGX_RTMP_COUNTER_DROP_VIDEO_FRAMES, 1);
             pr->drop_video_size += mlen;
         } else if (mtype == HTTP_FLV_AUDIO_TAG) {
             pr->drop_audio_size += mlen;
@@ -1084,8 +1834,10 @@ ngx_http_live_send_message(ngx_http_live_play_request_ctx_t *pr, ngx_chain_t* ou
     frame->mlen = mlen;
     frame->mpts = pts;
     frame->mdelte = delta;
-    frame->out = ngx_http_flv_copy_tag_mem(out);
+    frame->out = ngx_http_flv_acquire_tag_mem(out);
+    frame->sent = 0;
     frame->next = NULL;
+    ngx_http_live_play_frame_stamp(frame, pts);
 
     if (pr->frame_chain_head == NULL) {
         pr->frame_chain_head = frame;
@@ -1095,26 +1847,34 @@ ngx_http_live_send_message(ngx_http_live_play_request_ctx_t *pr, ngx_chain_t* ou
         pr->frame_chain_tail = frame;
     }
 
-    if (!pr->s->connection->write->active) {
+    if (!pr->s->connection->write->active && !pr->pacing_evt.timer_set) {
         ngx_http_live_play_write_handler(pr->s->connection->write);
     }
     
     pr->stream_ts = pts;
-    if (pr->current_ts-pr->log_lts >= global_poll) {
-        if (pr->log_type == 0) { 
-            ngx_rtmp_edge_log(NGX_EDGE_HTTP, NGX_EDGE_PULL_START, pr, pr->current_ts);
-            pr->log_type = 1;
-        } else {
-            ngx_rtmp_edge_log(NGX_EDGE_HTTP, NGX_EDGE_PULL_WATCH, pr, pr->current_ts);
-            pr->lrecv_video_size = pr->recv_video_size;
-            pr->lrecv_audio_size = pr->recv_audio_size;
-            pr->lrecv_video_frame = pr->recv_video_frame;
-        }
-        pr->log_lts = pr->current_ts;
-    }
+    ngx_http_live_play_watch_log(pr);
     return NGX_OK;
 }
 
+// 环模式下推流端每写一个tag唤醒一次观众, 与tag大小无关
+void
+ngx_http_live_play_ring_notify(ngx_http_live_play_request_ctx_t *pr)
+{
+    ngx_http_live_play_loc_conf_t* lacf = NULL;
+    lacf = (ngx_http_live_play_loc_conf_t*)ngx_http_get_module_loc_conf(pr->s, ngx_http_live_play_module);
+
+    if (pr->idle_evt.timer_set) {
+       ngx_add_timer(&pr->idle_evt, lacf->http_idle_timeout);
+    }
+
+    pr->stream_ts = pr->ring->last_pts;
+    ngx_http_live_play_watch_log(pr);
+
+    if (!pr->s->connection->write->active && !pr->pacing_evt.timer_set) {
+        ngx_http_live_play_write_handler(pr->s->connection->write);
+    }
+}
+
 static void 
 ngx_http_live_play_send_header_ev(ngx_event_t *ev)
 {
@@ -12,6 +12,7 @@
 #include <ngx_http.h>
 #include "ngx_rtmp.h"
 #include "ngx_http_live_play_relay_module.h"
+#include "ngx_rtmp_counter_module.h"
 
 #define HTTP_FLV_META_TAG 0
 #define HTTP_FLV_AVC_TAG 1
@@ -23,11 +24,18 @@
 
 #define NGX_STREAM_REWART   888888
 
+#define NGX_HTTP_FLV_TAG_HEADER_SIZE 11
+
 typedef struct ngx_str_map_list_s ngx_str_map_list_t;
 typedef struct ngx_http_flv_frame_s ngx_http_flv_frame_t;
 
 extern ngx_module_t        ngx_http_live_play_module;
 
+typedef struct {
+    ngx_flag_t       http_play_affinity;    //按流名把播放连接转交给固定的worker
+    ngx_str_t        http_play_socket_dir;  //worker间转交连接的unix socket目录
+}ngx_http_live_play_main_conf_t;
+
 typedef struct {
     ngx_str_t        server;
 }ngx_http_live_play_srv_conf_t;
@@ -43,6 +51,11 @@ typedef struct {
 
     ngx_uint_t  http_send_chunk_size; //每次发送包的大小
     ngx_uint_t  http_send_max_chunk_count; //每次最多发生包的个数
+    ngx_flag_t  http_send_vector; //多帧合并writev发送
+    size_t      http_send_max_bytes; //writev模式下每次写事件最多发送的字节数
+    ngx_flag_t  http_send_pacing; //按流的入码率对每个观众做令牌桶限速
+    ngx_uint_t  http_send_pacing_burst; //起播突发倍数, 令牌桶容量为该倍数秒的码率
+    size_t      http_send_pacing_min_rate; //入码率未知或过低时使用的最小速率(字节/秒)
 
     ngx_str_t  http_live_app;
     ngx_msec_t http_idle_timeout;
@@ -69,11 +82,41 @@ struct ngx_http_flv_frame_s {
     unsigned int mpts;//时间戳
     unsigned int mdelte;//间隔
     unsigned int mlen;//长度
-    ngx_chain_t * out; //数据
+    ngx_chain_t * out; //数据, 多个观众共享引用计数的tag, 不能修改
+    unsigned int sent; //已发送字节数
+    unsigned int hdr_len; //改写时间戳后的私有tag头长度, 0表示不需要
+    u_char hdr[NGX_HTTP_FLV_TAG_HEADER_SIZE]; //私有tag头
     ngx_http_flv_frame_t *next;//下一帧数据
 };
 
+// 每个流一份的tag环, 推流端只写一次, 观众只保存读游标
+typedef struct {
+    ngx_chain_t  *out;      //共享tag, 环持有一个引用
+    u_char        mtype;    //类型
+    unsigned int  mpts;     //时间戳
+    unsigned int  mdelte;   //间隔
+    unsigned int  mlen;     //长度
+    ngx_uint_t    offset;   //写入前环的累计字节数
+    ngx_uint_t    cum[2];   //写入前视频/音频的累计时长
+} ngx_http_flv_ring_slot_t;
+
 typedef struct {
+    ngx_http_flv_ring_slot_t *slots;
+    ngx_uint_t    nslots;   //slot个数, 2的幂
+    ngx_uint_t    seq;      //下一个写入的序号
+    ngx_uint_t    count;    //环中有效的slot数
+    ngx_uint_t    bytes;    //累计写入的字节数
+    ngx_uint_t    cum[2];   //视频/音频累计时长
+    ngx_uint_t    key_seq;  //最近一个关键帧的序号
+    ngx_flag_t    has_key;
+    unsigned int  last_pts; //最近写入的时间戳
+    size_t        max_lag_bytes; //观众落后超过该字节数跳到关键帧, 0表示不限制
+    ngx_msec_t    max_lag_time;  //观众落后超过该时长跳到关键帧, 0表示不限制
+} ngx_http_flv_ring_t;
+
+#define ngx_http_flv_ring_slot(ring, n) (&(ring)->slots[(n) & ((ring)->nslots - 1)])
+
+typedef struct ngx_http_live_play_request_ctx_s {
     ngx_str_t                        stream;
     ngx_str_t                        app;
     ngx_str_t                        suffix;
@@ -102,7 +145,20 @@ typedef struct {
     ngx_http_flv_frame_t            *frame_chain_head; //内容数据，发送就从次链表拿数据发送
     ngx_http_flv_frame_t            *frame_chain_tail; //内容数据，发送就从次链表拿数据发送
 
-    ngx_http_flv_frame_t            *frame_free;
+
+    ngx_http_flv_ring_t             *ring;          //所属流的tag环, NULL表示使用frame_chain
+    ngx_uint_t                       ring_seq;      //环中的读游标
+    ngx_http_flv_frame_t            *ring_cur;      //已离开游标但还没发完或需要改写时间戳的tag
+    ngx_uint_t                       ring_ts[2];    //视频/音频时间戳, 与cs中的timestamp含义相同
+    ngx_flag_t                       ring_wait_key; //等待下一个关键帧
+    ngx_uint_t                       ring_skips;    //跳关键帧次数
+
+    ngx_event_t                      pacing_evt;        //令牌不足时等待补充的定时器
+    ngx_uint_t                       pacing_tokens;     //令牌桶中剩余的字节数
+    ngx_uint_t                       pacing_rate;       //当前限速 字节/秒
+    ngx_msec_t                       pacing_last;       //上次补充令牌的时间
+    ngx_uint_t                       pacing_sock_rate;  //已设置到socket的SO_MAX_PACING_RATE
+    ngx_flag_t                       pacing_started;    //起播突发已经发完
     ngx_int_t                       drop_count;
     ngx_msec_t                      cache_time_duration; //当前缓存时间长度
     ngx_uint_t                      cache_frame_num; //当前缓存的视频帧数
@@ -134,6 +190,11 @@ typedef struct {
     ngx_uint_t                       lrecv_video_size;
     ngx_uint_t                       lrecv_audio_size;
     ngx_uint_t                       lrecv_video_frame; 
+    ngx_uint_t                       send_syscalls;    // 发送数据的系统调用次数
+    ngx_uint_t                       send_bytes;       // 实际写入socket的字节数
+    ngx_uint_t                       lsend_syscalls;
+    ngx_uint_t                       lsend_bytes;
+    ngx_rtmp_counter_slot_t         *counter;          // 共享内存中的流计数
 
     ngx_int_t                       audio_pts;//音频时间戳
     ngx_int_t                       video_pts;//视频时间戳  
@@ -175,6 +236,9 @@ ngx_str_format_string(ngx_str_t str, char *buf);
 ngx_int_t 
 ngx_http_live_send_message(ngx_http_live_play_request_ctx_t *s, ngx_chain_t *out, u_char mtype, unsigned int mlen, unsigned int pts, unsigned int delta);
 
+void
+ngx_http_live_play_ring_notify(ngx_http_live_play_request_ctx_t *pr);
+
 ngx_int_t  
 ngx_http_live_play_send_http_header(void *ptr);
 
@@ -4,10 +4,19 @@
 #include <ngx_md5.h>
 #include "ngx_rtmp_edge_log.h"
 #include "ngx_ipip.h"
+#include "ngx_http_live_relay_cache.h"
+#include "ngx_http_flv_relay.h"
+
+// 等待其他worker的http_on_play查询结果的轮询间隔
+#define NGX_HTTP_LIVE_RELAY_CACHE_POLL  50
 
 char *
 ngx_http_live_get_str_data(ngx_str_t *str);
 
+static ngx_int_t ngx_http_live_play_relay_postconfiguration(ngx_conf_t *cf);
+static void ngx_http_live_netcall_recv(ngx_event_t *rev);
+static void ngx_http_live_netcall_send(ngx_event_t *wev);
+static void * ngx_http_live_play_relay_create_main_conf(ngx_conf_t *cf);
 static void * ngx_http_live_play_relay_create_loc_conf(ngx_conf_t * cf);
 static char * ngx_http_live_play_relay_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
 ngx_str_t   ngx_http_live_notify_urlencoded =
@@ -103,14 +112,77 @@ static ngx_command_t  ngx_http_live_play_relay_commands[] = {
         offsetof(ngx_http_live_play_relay_loc_conf_t,check_ip), 
         NULL},
 
+    { ngx_string("http_on_play_cache_zone"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_live_play_relay_main_conf_t, cache_zone_size),
+        NULL },
+
+    { ngx_string("http_on_play_cache_valid"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_live_play_relay_loc_conf_t, cache_valid),
+        NULL },
+
+    { ngx_string("http_flv_relay"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_live_play_relay_loc_conf_t, http_flv_relay),
+        NULL },
+
+    { ngx_string("http_flv_relay_timeout"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_live_play_relay_loc_conf_t, http_flv_relay_timeout),
+        NULL },
+
+    { ngx_string("http_relay_stall_timeout"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_live_play_relay_loc_conf_t, stall_timeout),
+        NULL },
+
+    { ngx_string("http_relay_standby"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_live_play_relay_loc_conf_t, standby),
+        NULL },
+
+    { ngx_string("http_on_play_keepalive"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_live_play_relay_loc_conf_t, keepalive),
+        NULL },
+
+    { ngx_string("http_on_play_keepalive_timeout"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_live_play_relay_loc_conf_t, keepalive_timeout),
+        NULL },
+
+    { ngx_string("http_on_play_cache_negative"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_live_play_relay_loc_conf_t, cache_negative),
+        NULL },
+
     ngx_null_command
 };
 
 static ngx_http_module_t  ngx_http_live_play_relay_module_ctx = {
     NULL,                                     /* preconfiguration */
-    NULL,                                     /* postconfiguration */
+    ngx_http_live_play_relay_postconfiguration, /* postconfiguration */
 
-    NULL,                                     /* create main configuration */
+    ngx_http_live_play_relay_create_main_conf, /* create main configuration */
     NULL,                                     /* init main configuration */
 
     NULL,                                     /* create server configuration */
@@ -162,6 +234,44 @@ static ngx_url_t *ngx_http_live_play_relay_notify_parse_url(ngx_pool_t *pool, ng
     return u;
 }
 
+static ngx_str_t ngx_http_live_relay_cache_shm_name =
+            ngx_string("http_on_play_cache");
+
+static void *ngx_http_live_play_relay_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_live_play_relay_main_conf_t   *hrmc;
+
+    hrmc = ngx_pcalloc(cf->pool, sizeof(ngx_http_live_play_relay_main_conf_t));
+    if (hrmc == NULL) {
+        return NULL;
+    }
+
+    hrmc->cache_zone_size = NGX_CONF_UNSET_SIZE;
+
+    return hrmc;
+}
+
+static ngx_int_t ngx_http_live_play_relay_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_http_live_play_relay_main_conf_t   *hrmc;
+
+    hrmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_live_play_relay_module);
+    if (hrmc->cache_zone_size == NGX_CONF_UNSET_SIZE || hrmc->cache_zone_size == 0) {
+        return NGX_OK;
+    }
+
+    hrmc->cache_zone = ngx_shared_memory_add(cf, &ngx_http_live_relay_cache_shm_name,
+                                             hrmc->cache_zone_size,
+                                             &ngx_http_live_play_relay_module);
+    if (hrmc->cache_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    hrmc->cache_zone->init = ngx_http_live_relay_cache_init_zone;
+
+    return NGX_OK;
+}
+
 static void *ngx_http_live_play_relay_create_loc_conf(ngx_conf_t *cf)
 {
     ngx_http_live_play_relay_loc_conf_t     *nacf;
@@ -181,6 +291,14 @@ static void *ngx_http_live_play_relay_create_loc_conf(ngx_conf_t *cf)
     nacf->rtmp_server_port = NGX_CONF_UNSET_UINT;
     nacf->reconnect_count_before_302 = NGX_CONF_UNSET_UINT;
     nacf->check_ip = NGX_CONF_UNSET;
+    nacf->cache_valid = NGX_CONF_UNSET_MSEC;
+    nacf->cache_negative = NGX_CONF_UNSET_MSEC;
+    nacf->http_flv_relay = NGX_CONF_UNSET;
+    nacf->http_flv_relay_timeout = NGX_CONF_UNSET_MSEC;
+    nacf->stall_timeout = NGX_CONF_UNSET_MSEC;
+    nacf->standby = NGX_CONF_UNSET;
+    nacf->keepalive = NGX_CONF_UNSET_UINT;
+    nacf->keepalive_timeout = NGX_CONF_UNSET_MSEC;
     return nacf;
 }
 
@@ -205,6 +323,14 @@ static char *ngx_http_live_play_relay_merge_loc_conf(ngx_conf_t *cf, void *paren
     ngx_conf_merge_str_value(conf->rtmp_back_source_addr_param_name,prev->rtmp_back_source_addr_param_name,"rtmp_source");
     ngx_conf_merge_str_value(conf->ip_file_path,prev->ip_file_path,"");
     ngx_conf_merge_value(conf->check_ip, prev->check_ip, 0);
+    ngx_conf_merge_msec_value(conf->cache_valid, prev->cache_valid, 10000);
+    ngx_conf_merge_msec_value(conf->cache_negative, prev->cache_negative, 2000);
+    ngx_conf_merge_value(conf->http_flv_relay, prev->http_flv_relay, 0);
+    ngx_conf_merge_msec_value(conf->http_flv_relay_timeout, prev->http_flv_relay_timeout, 10000);
+    ngx_conf_merge_msec_value(conf->stall_timeout, prev->stall_timeout, 0);
+    ngx_conf_merge_value(conf->standby, prev->standby, 0);
+    ngx_conf_merge_uint_value(conf->keepalive, prev->keepalive, 0);
+    ngx_conf_merge_msec_value(conf->keepalive_timeout, prev->keepalive_timeout, 60000);
 
     if (conf->http_on_play.len > 0) {
         prev->active = conf->active = 1;
@@ -252,6 +378,9 @@ static ngx_http_live_play_relay_ctx_t*  ngx_http_live_relay_alloc_ctx(ngx_http_l
 
             ctx->rtmp_pull_url.data = (u_char*)ngx_pcalloc(ctx->pool,ctx->url_len);
             ctx->rtmp_pull_url.len = 0;
+
+            ctx->origins.data = (u_char*)ngx_pcalloc(ctx->pool,ctx->url_len);
+            ctx->origins.len = 0;
         }
         ctx->next = NULL;
     }
@@ -335,19 +464,75 @@ ngx_http_live_netcall_close(ngx_connection_t *cc)
     }
     
     pool = cc->pool;
-    ngx_close_connection(cc);
+    // 完整收到响应的连接留给下一次查询
+    if (!cs->reuse || ngx_rtmp_netcall_keepalive_put(cs->upstream, cc) != NGX_OK) {
+        ngx_close_connection(cc);
+    }
     ngx_destroy_pool(pool);
     ngx_printf_log("ngx_http_live_play_relay_module","ngx_http_live_netcall_close","close");
 }
 
 
+// 复用的空闲连接已被源站关闭而还没收到数据, 换新连接重发一次
+static ngx_int_t ngx_http_live_netcall_retry(ngx_connection_t *cc)
+{
+    ngx_http_live_netcall_session_t    *cs;
+    ngx_peer_connection_t              *pc;
+    ngx_connection_t                   *nc;
+    ngx_chain_t                        *cl;
+    ngx_int_t                           rc;
+    ngx_uint_t                          n;
+
+    cs = cc->data;
+
+    if (!cs->reused || cs->received) {
+        return NGX_DECLINED;
+    }
+
+    cs->reused = 0;
+    cs->retried = 1;
+
+    pc = cs->pc;
+    rc = ngx_event_connect_peer(pc);
+    if (rc != NGX_OK && rc != NGX_AGAIN) {
+        pc->connection = cc;
+        return NGX_DECLINED;
+    }
+
+    nc = pc->connection;
+
+    if (cc->read->timer_set) {
+        ngx_del_timer(cc->read);
+    }
+    if (cc->write->timer_set) {
+        ngx_del_timer(cc->write);
+    }
+    ngx_close_connection(cc);
+
+    // 恢复发送前的位置重发, buf不一定从start开始
+    for (n = 0, cl = cs->request; cl; cl = cl->next, n++) {
+        cl->buf->pos = cs->request_pos[n];
+    }
+    cs->out = cs->request;
+
+    nc->data = cs;
+    nc->pool = cs->pool;
+    nc->write->handler = ngx_http_live_netcall_send;
+    nc->read->handler = ngx_http_live_netcall_recv;
+
+    ngx_http_live_netcall_send(nc->write);
+
+    return NGX_OK;
+}
+
 static void ngx_http_live_netcall_recv(ngx_event_t *rev)
 {
     ngx_http_live_netcall_session_t         *cs;
     ngx_connection_t                   *cc;
     ngx_chain_t                        *cl;
-    ngx_int_t                           n;
+    ngx_int_t                           n, rc;
     ngx_buf_t                          *b;
+    ngx_flag_t                          keepalive;
 
     cc = rev->data;
     cs = cc->data;
@@ -416,6 +601,9 @@ static void ngx_http_live_netcall_recv(ngx_event_t *rev)
         n = cc->recv(cc, b->last, b->end - b->last);
 
         if (n == NGX_ERROR || n == 0) {
+            if (ngx_http_live_netcall_retry(cc) == NGX_OK) {
+                return;
+            }
             if (n == 0 ){
                 cs->status_code = ngx_normal_close;
             } else {
@@ -444,6 +632,21 @@ static void ngx_http_live_netcall_recv(ngx_event_t *rev)
         }
 
         b->last += n;
+        cs->received = 1;
+
+        // keep-alive时源站不会断开, 收完整个响应就结束
+        if (cs->keepalive) {
+            rc = ngx_rtmp_netcall_http_complete(cs->in, &keepalive);
+            if (rc == NGX_OK) {
+                cs->reuse = keepalive ? 1 : 0;
+                cs->status_code = ngx_normal_close;
+                ngx_http_live_netcall_close(cc);
+                return;
+            }
+            if (rc == NGX_DECLINED) {
+                cs->keepalive = 0;
+            }
+        }
     }
 }
 
@@ -477,6 +680,9 @@ static void ngx_http_live_netcall_send(ngx_event_t *wev)
     cl = cc->send_chain(cc, cs->out, 0);
 
     if (cl == NGX_CHAIN_ERROR) {
+        if (ngx_http_live_netcall_retry(cc) == NGX_OK) {
+            return;
+        }
         cs->status_code = ngx_http_relay_send_chain_err;
         ngx_http_live_netcall_close(cc);
         return;
@@ -562,7 +768,7 @@ ngx_int_t ngx_http_live_netclall_param(ngx_http_live_play_request_ctx_t * rc,cha
 ngx_chain_t * ngx_http_live_netcall_http_format_request(ngx_int_t method, ngx_str_t *host,
                                      ngx_str_t *uri, ngx_chain_t *args,
                                      ngx_chain_t *body, ngx_pool_t *pool,
-                                     ngx_str_t *content_type)
+                                     ngx_str_t *content_type, ngx_flag_t keepalive)
 {
     ngx_chain_t                    *al, *bl, *ret;
     ngx_buf_t                      *b;
@@ -571,7 +777,7 @@ ngx_chain_t * ngx_http_live_netcall_http_format_request(ngx_int_t method, ngx_st
     static const char               rq_tmpl[] = " HTTP/1.0\r\n"
                                                 "Host: %V\r\n"
                                                 "Content-Type: %V\r\n"
-                                                "Connection: Close\r\n"
+                                                "Connection: %s\r\n"
                                                 "Content-Length: %uz\r\n"
                                                 "\r\n";
 
@@ -615,15 +821,18 @@ ngx_chain_t * ngx_http_live_netcall_http_format_request(ngx_int_t method, ngx_st
     }
 
     b = ngx_create_temp_buf(pool, sizeof(rq_tmpl) + host->len +
-                            content_type->len + NGX_SIZE_T_LEN);
+                            content_type->len + sizeof("keep-alive") +
+                            NGX_SIZE_T_LEN);
     if (b == NULL) {
         return NULL;
     }
 
     bl->buf = b;
 
+    // HTTP/1.0的keep-alive响应一定带Content-Length, 不用处理chunked
     b->last = ngx_snprintf(b->last, b->end - b->last, rq_tmpl,
-                           host, content_type, content_length);
+                           host, content_type,
+                           keepalive ? "keep-alive" : "Close", content_length);
 
     al->next = bl;
     bl->next = body;
@@ -655,7 +864,8 @@ static ngx_chain_t *ngx_http_live_notify_create_request(ngx_http_request_t *s, n
 
     return ngx_http_live_netcall_http_format_request(method, &url->host,
                                                 &url->uri, al, bl, pool,
-                                                &ngx_http_live_notify_urlencoded);
+                                                &ngx_http_live_notify_urlencoded,
+                                                nacf->keepalive > 0);
 }
 
 static ngx_chain_t *ngx_http_live_notify_play_create(ngx_http_request_t *s, void *arg,ngx_pool_t *pool)
@@ -764,6 +974,125 @@ ngx_chain_t * ngx_http_live_netcall_http_skip_header(ngx_chain_t *in)
     }
 }
 
+// 当前回源地址换成列表中的第i个, http地址走HTTP-FLV回源;
+// 多个源站时选中rtmp地址要清掉http_pull_url, 否则还会按HTTP-FLV回源
+static void
+ngx_http_live_relay_select_origin(ngx_http_live_play_relay_ctx_t *hrctx, ngx_uint_t i)
+{
+    u_char      *p, *last, *e;
+    ngx_str_t   *dst;
+    ngx_uint_t   n;
+
+    p = hrctx->origins.data;
+    last = p + hrctx->origins.len;
+
+    for (n = 0; p < last; n++, p = e + 1) {
+        e = ngx_strlchr(p, last, ' ');
+        if (e == NULL) {
+            e = last;
+        }
+
+        if (n != i) {
+            continue;
+        }
+
+        if (e - p > 7 && ngx_strncasecmp(p, (u_char *) "http://", 7) == 0) {
+            dst = &hrctx->http_pull_url;
+            hrctx->rtmp_pull_url.len = 0;
+        } else {
+            dst = &hrctx->rtmp_pull_url;
+            if (hrctx->norigins > 1) {
+                hrctx->http_pull_url.len = 0;
+            }
+        }
+
+        dst->len = e - p;
+        ngx_memcpy(dst->data, p, dst->len);
+        hrctx->origin = i;
+        return;
+    }
+}
+
+// 数出源站个数并选第一个, 只有rtmp_pull_url时列表就是它自己
+static void
+ngx_http_live_relay_load_origins(ngx_http_live_play_relay_ctx_t *hrctx)
+{
+    u_char      *p, *last;
+
+    if (hrctx->origins.len == 0 && hrctx->rtmp_pull_url.len > 0) {
+        ngx_memcpy(hrctx->origins.data, hrctx->rtmp_pull_url.data, hrctx->rtmp_pull_url.len);
+        hrctx->origins.len = hrctx->rtmp_pull_url.len;
+    }
+
+    p = hrctx->origins.data;
+    last = p + hrctx->origins.len;
+
+    hrctx->norigins = hrctx->origins.len ? 1 : 0;
+    for ( ;; ) {
+        p = ngx_strlchr(p, last, ' ');
+        if (p == NULL) {
+            break;
+        }
+        hrctx->norigins++;
+        p++;
+    }
+
+    hrctx->failovers = 0;
+    ngx_http_live_relay_select_origin(hrctx, 0);
+}
+
+// "pull_urls":["rtmp://a/..","http://b/.."], 按优先级排列
+static void
+ngx_http_live_notify_parse_origins(ngx_http_live_play_relay_ctx_t *hrctx, char *data)
+{
+    char        *p, *e;
+    u_char      *dst, *last;
+
+    hrctx->origins.len = 0;
+
+    p = strstr(data, "\"pull_urls\":");
+    if (p == NULL) {
+        return;
+    }
+
+    p = strchr(p + sizeof("\"pull_urls\":") - 1, '[');
+    if (p == NULL) {
+        return;
+    }
+
+    dst = hrctx->origins.data;
+    last = dst + hrctx->url_len;
+
+    for (p++; *p != '\0' && *p != ']'; p = e + 1) {
+        p = strchr(p, '\"');
+        if (p == NULL) {
+            break;
+        }
+
+        e = strchr(++p, '\"');
+        if (e == NULL) {
+            break;
+        }
+
+        if (e == p || dst + (e - p) + 1 > last) {
+            continue;
+        }
+
+        if (dst != hrctx->origins.data) {
+            *dst++ = ' ';
+        }
+
+        // 和rtmp_pull_url一样去掉json转义的反斜杠
+        for ( ; p < e; p++) {
+            if (*p != '\\') {
+                *dst++ = *p;
+            }
+        }
+    }
+
+    hrctx->origins.len = dst - hrctx->origins.data;
+}
+
 static ngx_int_t 
 ngx_http_live_notify_parse_http_message(ngx_http_live_play_relay_ctx_t *hrctx,ngx_chain_t *in)
 {
@@ -816,6 +1145,8 @@ ngx_http_live_notify_parse_http_message(ngx_http_live_play_relay_ctx_t *hrctx,ng
             }
         }
 
+        ngx_http_live_notify_parse_origins(hrctx,data);
+
         char * ptr2 = strstr(data,http_url) ;
         if(ptr2 == NULL)
             return NGX_ERROR;
@@ -847,6 +1178,141 @@ ngx_http_live_notify_parse_http_message(ngx_http_live_play_relay_ctx_t *hrctx,ng
     return NGX_OK;
 }
 
+// 自己负责查询时把结果写入缓存, 同一个流的等待者和之后的请求直接使用
+static void ngx_http_live_relay_cache_done(ngx_http_live_play_relay_ctx_t *hrctx, ngx_flag_t ok)
+{
+    ngx_http_live_play_relay_loc_conf_t* hrlc;
+
+    if(!hrctx->cache_owner)
+        return;
+
+    hrctx->cache_owner = 0;
+    hrlc = hrctx->relay_conf;
+
+    if(ok)
+    {
+        ngx_http_live_relay_cache_put(hrctx->cache_zone, &hrctx->cache_key,
+                &hrctx->origins, &hrctx->http_pull_url, hrlc->cache_valid);
+    }
+    else if(hrlc->cache_negative)
+    {
+        ngx_http_live_relay_cache_put(hrctx->cache_zone, &hrctx->cache_key,
+                NULL, NULL, hrlc->cache_negative);
+    }
+    else
+    {
+        ngx_http_live_relay_cache_abort(hrctx->cache_zone, &hrctx->cache_key);
+    }
+}
+
+// 其他worker正在查询同一个流, 轮询它写入的结果
+static void ngx_http_live_relay_cache_wait(ngx_event_t *ev)
+{
+    ngx_int_t                       rc;
+    ngx_http_live_play_relay_ctx_t* hrctx = (ngx_http_live_play_relay_ctx_t*)ev->data;
+
+    rc = ngx_http_live_relay_cache_get(hrctx->cache_zone, &hrctx->cache_key, 0,
+                &hrctx->origins, &hrctx->http_pull_url, hrctx->url_len);
+
+    if(rc == NGX_HTTP_LIVE_RELAY_CACHE_PENDING
+       && (ngx_msec_int_t)(hrctx->cache_wait_deadline - ngx_current_msec) > 0)
+    {
+        ngx_add_timer(ev, NGX_HTTP_LIVE_RELAY_CACHE_POLL);
+        return;
+    }
+
+    hrctx->backing = 0;
+
+    if(rc == NGX_HTTP_LIVE_RELAY_CACHE_HIT)
+    {
+        ngx_printf_log("ngx_http_live_play_relay_module","ngx_http_live_relay_cache_wait","hit");
+        hrctx->rtmp_pull_url.len = 0;
+        ngx_http_live_relay_load_origins(hrctx);
+        ngx_http_trigger_rtmp_relay_pull((void*)hrctx);
+        return;
+    }
+
+    // 缓存的失败结果, 等下一个播放请求重新查询
+    if(rc == NGX_HTTP_LIVE_RELAY_CACHE_NEGATIVE)
+    {
+        hrctx->errcount++;
+        ngx_printf_log("ngx_http_live_play_relay_module","ngx_http_live_relay_cache_wait","negative");
+        return;
+    }
+
+    // 查询方放弃了(观众离开或占位过期), 本worker占位自己查询, 否则已在等待的观众不会再被唤醒
+    ngx_printf_log("ngx_http_live_play_relay_module","ngx_http_live_relay_cache_wait","owner gone %ld, query",rc);
+    if(hrctx->cache_waiter == NULL
+       || ngx_http_live_relay_on_play(hrctx->cache_waiter) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "relay cache: \"%V\" query failed after owner gave up",
+                      &hrctx->cache_key);
+    }
+}
+
+// 0: 已处理(命中或在等待), NGX_DECLINED: 需要自己查询, NGX_ERROR: 缓存的失败结果
+static ngx_int_t ngx_http_live_relay_cache_lookup(ngx_http_live_play_request_ctx_t *rc)
+{
+    ngx_int_t                               state;
+    size_t                                  len;
+    ngx_http_live_play_relay_main_conf_t*   hrmc;
+    ngx_http_live_play_relay_ctx_t*         hrctx = rc->relay_ctx;
+    ngx_http_live_play_relay_loc_conf_t*    hrlc = hrctx->relay_conf;
+
+    hrmc = ngx_http_get_module_main_conf(rc->s, ngx_http_live_play_relay_module);
+    if(hrmc->cache_zone == NULL)
+        return NGX_DECLINED;
+
+    hrctx->cache_zone = hrmc->cache_zone;
+
+    // 复用ctx里的缓冲区, 放不下时才重新分配
+    len = hrctx->app.len + 1 + hrctx->stream.len;
+    if(hrctx->cache_key_size < len)
+    {
+        hrctx->cache_key.data = ngx_pnalloc(hrctx->pool, len);
+        if(hrctx->cache_key.data == NULL)
+        {
+            hrctx->cache_key_size = 0;
+            return NGX_DECLINED;
+        }
+        hrctx->cache_key_size = len;
+    }
+    hrctx->cache_key.len = ngx_sprintf(hrctx->cache_key.data, "%V/%V",
+                &hrctx->app, &hrctx->stream) - hrctx->cache_key.data;
+
+    state = ngx_http_live_relay_cache_get(hrctx->cache_zone, &hrctx->cache_key,
+                hrlc->http_on_play_timeout, &hrctx->origins,
+                &hrctx->http_pull_url, hrctx->url_len);
+
+    switch(state)
+    {
+    case NGX_HTTP_LIVE_RELAY_CACHE_HIT:
+        ngx_printf_log("ngx_http_live_play_relay_module","ngx_http_live_relay_cache_lookup","hit");
+        hrctx->rtmp_pull_url.len = 0;
+        ngx_http_live_relay_load_origins(hrctx);
+        return ngx_http_trigger_rtmp_relay_pull((void*)hrctx);
+
+    case NGX_HTTP_LIVE_RELAY_CACHE_NEGATIVE:
+        hrctx->errcount++;
+        return NGX_ERROR;
+
+    case NGX_HTTP_LIVE_RELAY_CACHE_PENDING:
+        hrctx->backing = 1;
+        hrctx->cache_waiter = rc;
+        hrctx->cache_wait_deadline = ngx_current_msec + hrlc->http_on_play_timeout;
+        hrctx->cache_wait_ev.handler = ngx_http_live_relay_cache_wait;
+        hrctx->cache_wait_ev.log = ngx_cycle->log;
+        hrctx->cache_wait_ev.data = (void*)hrctx;
+        ngx_add_timer(&hrctx->cache_wait_ev, NGX_HTTP_LIVE_RELAY_CACHE_POLL);
+        return NGX_OK;
+
+    default:
+        hrctx->cache_owner = 1;
+        return NGX_DECLINED;
+    }
+}
+
 static ngx_int_t ngx_http_live_notify_play_handle(ngx_http_live_play_relay_ctx_t *hrctx,void *arg, ngx_chain_t *in)
 {
 
@@ -884,19 +1350,24 @@ static ngx_int_t ngx_http_live_notify_play_handle(ngx_http_live_play_relay_ctx_t
     rc = ngx_http_live_notify_parse_http_retcode(in);
     if (rc != NGX_OK) {
         hrctx->errcount++;
+        ngx_http_live_relay_cache_done(hrctx, 0);
         ngx_printf_log("ngx_http_live_play_relay_module","ngx_http_live_notify_play_handle","code error %ld",rc);
         return NGX_ERROR;
     }
 
     ngx_http_live_notify_parse_http_message(hrctx,in);
+    ngx_http_live_relay_load_origins(hrctx);
     
-    if(hrctx->rtmp_pull_url.len < strlen("rtmp:\\"))
+    if(hrctx->rtmp_pull_url.len < strlen("rtmp:\\") && !ngx_http_flv_relay_enabled(hrctx))
     {
         hrctx->errcount++;
+        ngx_http_live_relay_cache_done(hrctx, 0);
         ngx_printf_log("ngx_http_live_play_relay_module","ngx_http_live_notify_play_handle","rtmp url error");
         return NGX_ERROR;
     }
 
+    ngx_http_live_relay_cache_done(hrctx, 1);
+
     return ngx_http_trigger_rtmp_relay_pull((void*)hrctx);
 }
 
@@ -915,6 +1386,7 @@ static void ngx_http_live_netcall_timeout(ngx_event_t *ev)
         }
         ctx->cs = NULL;
         ctx->backing = 0;
+        ngx_http_live_relay_cache_done(ctx, 0);
     }
 }
 
@@ -927,7 +1399,9 @@ ngx_int_t ngx_http_live_netcall_create(ngx_http_live_play_request_ctx_t *rs, ngx
     ngx_http_live_play_relay_loc_conf_t    *nhcf;
     ngx_connection_t               *c, *cc;
     ngx_pool_t                     *pool;
+    ngx_chain_t                    *cl;
     ngx_int_t                       rc;
+    ngx_uint_t                      n;
 
     nhcf = (ngx_http_live_play_relay_loc_conf_t*)ngx_http_get_module_loc_conf(rs->s,ngx_http_live_play_relay_module);
 
@@ -977,28 +1451,62 @@ ngx_int_t ngx_http_live_netcall_create(ngx_http_live_play_request_ctx_t *rs, ngx
         cs->detached = 1;
     }
 
+    cs->pool = pool;
+    cs->pc = pc;
+
     pc->log = nhcf->log;
     pc->get = ngx_http_live_netcall_get_peer;
     pc->free = ngx_http_live_netcall_free_peer;
     pc->data = cs;
 
-    /* connect */
-    rc = ngx_event_connect_peer(pc);
-    if (rc != NGX_OK && rc != NGX_AGAIN ) {
+    cs->out = ci->create(rs->s, ci->arg, pool);
+    if (cs->out == NULL) {
         goto error;
     }
+    cs->request = cs->out;
+
+    // 有空闲连接时直接复用
+    cc = NULL;
+    if (nhcf->keepalive && ci->sink == NULL && ci->filter == NULL) {
+        cs->upstream = ngx_rtmp_netcall_upstream(ci->url, nhcf->keepalive,
+                                                 nhcf->keepalive_timeout, 0);
+        cs->keepalive = 1;
+        cc = ngx_rtmp_netcall_keepalive_get(cs->upstream);
+    }
 
-    cc = pc->connection;
-    cc->data = cs;
-    cc->pool = pool;
-    cs->pc = pc;
+    if (cc) {
+        // 记下各buf的发送位置, 连接已被源站关掉时用于重发
+        for (n = 0, cl = cs->request; cl; cl = cl->next, n++);
 
-    cs->out = ci->create(rs->s, ci->arg, pool);
-    if (cs->out == NULL) {
-        ngx_close_connection(pc->connection);
-        goto error;
+        cs->request_pos = ngx_palloc(pool, n * sizeof(u_char *));
+        if (cs->request_pos == NULL) {
+            ngx_close_connection(cc);
+            goto error;
+        }
+
+        for (n = 0, cl = cs->request; cl; cl = cl->next, n++) {
+            cs->request_pos[n] = cl->buf->pos;
+        }
+
+        cc->log = pc->log;
+        cc->read->log = pc->log;
+        cc->write->log = pc->log;
+        pc->connection = cc;
+        cs->reused = 1;
+
+    } else {
+        /* connect */
+        rc = ngx_event_connect_peer(pc);
+        if (rc != NGX_OK && rc != NGX_AGAIN ) {
+            goto error;
+        }
+
+        cc = pc->connection;
     }
 
+    cc->data = cs;
+    cc->pool = pool;
+
     cc->write->handler = ngx_http_live_netcall_send;
     cc->read->handler = ngx_http_live_netcall_recv;
 
@@ -1120,6 +1628,11 @@ ngx_int_t ngx_http_live_relay_on_play(void * ptr)
     }
     else 
     {
+        // 同一个流只有一个请求去查询, 其他worker等它的结果
+        ngx_int_t rcs = ngx_http_live_relay_cache_lookup(rc);
+        if(rcs != NGX_DECLINED)
+            return rcs;
+
         // rc->relay_ctx->refcount++;
         ngx_memzero(&ci, sizeof(ci));
         char v[1024*4] = {'\0'};
@@ -1134,10 +1647,151 @@ ngx_int_t ngx_http_live_relay_on_play(void * ptr)
         ngx_int_t rss = ngx_http_live_netcall_create(rc, &ci);
         if(rss ==  NGX_OK)
             rc->relay_ctx->backing = 1;
+        else
+            ngx_http_live_relay_cache_done(rc->relay_ctx, 0);
         return rss;
     }
 }
 
+// 断开当前回源, 推流端关闭后由close_stream接着切换
+static void ngx_http_live_relay_close_pull(ngx_http_live_play_relay_ctx_t *hrctx)
+{
+    if(hrctx->flv_relay)
+    {
+        ngx_http_flv_relay_close(hrctx);
+    }
+    else if(hrctx->rctx && hrctx->rctx->session)
+    {
+        ngx_rtmp_finalize_session(hrctx->rctx->session);
+    }
+    hrctx->rctx = NULL;
+}
+
+static void ngx_http_live_relay_failover_handler(ngx_event_t *ev)
+{
+    ngx_msec_int_t                        left;
+    ngx_http_live_play_relay_ctx_t*       hrctx = (ngx_http_live_play_relay_ctx_t*)ev->data;
+    ngx_http_live_play_relay_loc_conf_t*  hrlc = hrctx->relay_conf;
+
+    if(!hrctx->switching)
+    {
+        // 卡顿检测
+        if(hrlc->stall_timeout == 0)
+            return;
+
+        left = (ngx_msec_int_t)(hrctx->last_data + hrlc->stall_timeout - ngx_current_msec);
+        if(left > 0)
+        {
+            ngx_add_timer(ev, left);
+            return;
+        }
+
+        ngx_printf_log("ngx_http_live_play_relay_module","ngx_http_live_relay_failover_handler","stall origin %ui",hrctx->origin);
+
+        if(hrctx->published)
+        {
+            ngx_http_live_relay_close_pull(hrctx);
+            return;
+        }
+
+        // 没推流就不会走close_stream, 直接切换
+        ngx_http_live_relay_close_pull(hrctx);
+    }
+
+    hrctx->switching = 0;
+
+    while(hrctx->failovers < hrctx->norigins)
+    {
+        hrctx->failovers++;
+
+        if(ngx_http_flv_relay_promote(hrctx) == NGX_OK)
+        {
+            hrctx->origin = (hrctx->origin + 1) % hrctx->norigins;
+            ngx_printf_log("ngx_http_live_play_relay_module","ngx_http_live_relay_failover_handler","standby origin %ui",hrctx->origin);
+            ngx_http_live_relay_watch(hrctx);
+            return;
+        }
+
+        ngx_http_live_relay_select_origin(hrctx, (hrctx->origin + 1) % hrctx->norigins);
+        ngx_printf_log("ngx_http_live_play_relay_module","ngx_http_live_relay_failover_handler","switch origin %ui",hrctx->origin);
+
+        hrctx->rctx = NULL;
+        if(ngx_http_trigger_rtmp_relay_pull((void*)hrctx) == NGX_OK)
+            return;
+    }
+}
+
+void ngx_http_live_relay_watch(ngx_http_live_play_relay_ctx_t *hrctx)
+{
+    u_char                               *p, *last, *e;
+    ngx_str_t                             url;
+    ngx_uint_t                            n, next;
+    ngx_event_t                          *ev = &hrctx->failover_ev;
+    ngx_http_live_play_relay_loc_conf_t*  hrlc = hrctx->relay_conf;
+
+    if(hrctx->norigins < 2 || hrlc == NULL)
+        return;
+
+    ev->handler = ngx_http_live_relay_failover_handler;
+    ev->data = (void*)hrctx;
+    ev->log = ngx_cycle->log;
+
+    hrctx->last_data = ngx_current_msec;
+    if(hrlc->stall_timeout && !ev->timer_set && !ev->posted)
+    {
+        ngx_add_timer(ev, hrlc->stall_timeout);
+    }
+
+    if(!hrlc->standby || !hrlc->http_flv_relay || hrctx->flv_standby)
+        return;
+
+    // 下一个源站是http地址时预先连上
+    next = (hrctx->origin + 1) % hrctx->norigins;
+    p = hrctx->origins.data;
+    last = p + hrctx->origins.len;
+
+    for(n = 0; p < last; n++, p = e + 1)
+    {
+        e = ngx_strlchr(p, last, ' ');
+        if(e == NULL)
+            e = last;
+
+        if(n != next)
+            continue;
+
+        url.data = p;
+        url.len = e - p;
+        if(url.len > 7 && ngx_strncasecmp(p, (u_char *)"http://", 7) == 0)
+        {
+            ngx_http_flv_relay_standby(hrctx, &url);
+        }
+        return;
+    }
+}
+
+ngx_int_t ngx_http_live_relay_failover(void *ptr)
+{
+    ngx_http_live_play_relay_ctx_t*  hrctx = (ngx_http_live_play_relay_ctx_t*)ptr;
+    ngx_event_t                     *ev = &hrctx->failover_ev;
+
+    hrctx->published = 0;
+
+    if(hrctx->norigins < 2 || hrctx->failovers >= hrctx->norigins)
+        return NGX_DECLINED;
+
+    // 当前还在close_stream里, 等rtmp live的回调都执行完再切换
+    hrctx->switching = 1;
+    ev->handler = ngx_http_live_relay_failover_handler;
+    ev->data = (void*)hrctx;
+    ev->log = ngx_cycle->log;
+
+    if(ev->timer_set)
+        ngx_del_timer(ev);
+    ngx_post_event(ev, &ngx_posted_events);
+
+    return NGX_OK;
+}
+
 ngx_int_t ngx_http_live_relay_on_play_close(void * ptr)
 {
     ngx_printf_log("ngx_http_live_play_relay_module","ngx_http_live_relay_on_play_close","begin");
@@ -1153,8 +1807,24 @@ ngx_int_t ngx_http_live_relay_on_play_close(void * ptr)
             if(ev->timer_set){
                 ngx_del_timer(ev);
              }
+            if(relay_ctx->cache_wait_ev.timer_set){
+                ngx_del_timer(&relay_ctx->cache_wait_ev);
+            }
+            if(relay_ctx->failover_ev.timer_set){
+                ngx_del_timer(&relay_ctx->failover_ev);
+            }
+            if(relay_ctx->failover_ev.posted){
+                ngx_delete_posted_event(&relay_ctx->failover_ev);
+            }
+            relay_ctx->switching = 0;
+            // 查询还没结束, 让出占位
+            if(relay_ctx->cache_owner){
+                relay_ctx->cache_owner = 0;
+                ngx_http_live_relay_cache_abort(relay_ctx->cache_zone, &relay_ctx->cache_key);
+            }
 
              ngx_http_close_rtmp_relay_pull(ptr);
+             ngx_http_flv_relay_detach(relay_ctx);
 
             if(relay_ctx->cs && relay_ctx->cs->pc )
             {
@@ -1183,7 +1853,8 @@ ngx_int_t ngx_http_get_relay_status(void* v)
         if(hrctx->reconnect_count >= count || hrctx->errcount >= count ) //重连次数太多/302跳转
             return NGX_STREAM_REWART;
 
-        if(hrctx->rtmp_pull_url.len <= 7 && hrctx->http_pull_url.len > 7)
+        if(hrctx->rtmp_pull_url.len <= 7 && hrctx->http_pull_url.len > 7
+           && !ngx_http_flv_relay_enabled(hrctx))
             return NGX_STREAM_REWART; 
 
         if(hrlc->check_ip)
@@ -6,9 +6,11 @@
 #include <ngx_http.h>
 #include "ngx_rtmp.h"
 #include "ngx_rtmp_relay_module.h"
+#include "ngx_rtmp_netcall_module.h"
 // #include "ngx_http_rtmp_live_module.h"
 
 typedef struct ngx_http_live_play_relay_ctx_s ngx_http_live_play_relay_ctx_t;
+struct ngx_http_flv_relay_ctx_s;
 
 typedef ngx_chain_t * (*ngx_http_live_netcall_create_pt)(ngx_http_request_t *r,void *arg, ngx_pool_t *pool);
 typedef ngx_int_t (*ngx_http_live_netcall_filter_pt)(ngx_chain_t *in);
@@ -29,6 +31,14 @@ typedef struct {
     ngx_str_t                                   http_on_play;
     ngx_str_t                                   method_name;
     ngx_msec_t                                  http_on_play_timeout;
+    ngx_msec_t                                  cache_valid;     // 查询成功的缓存时间
+    ngx_msec_t                                  cache_negative;  // 查询失败的缓存时间
+    ngx_flag_t                                  http_flv_relay;  // 有http_pull_url时以HTTP-FLV回源
+    ngx_msec_t                                  http_flv_relay_timeout;
+    ngx_msec_t                                  stall_timeout;   // 回源多久没有数据切换到下一个源站, 0不检测
+    ngx_flag_t                                  standby;         // 预先连接下一个HTTP-FLV源站
+    ngx_uint_t                                  keepalive;       // 保持到http_on_play的空闲连接数, 0不复用
+    ngx_msec_t                                  keepalive_timeout;
     size_t                                      bufsize;
 
     ngx_uint_t                                   reconnect_count_before_302;
@@ -44,6 +54,11 @@ typedef struct {
     ngx_http_live_play_relay_ctx_t              *free_ctx; 
 } ngx_http_live_play_relay_loc_conf_t;
 
+typedef struct {
+    size_t                                      cache_zone_size;
+    ngx_shm_zone_t                             *cache_zone;      // http_on_play结果缓存, 所有worker共用
+} ngx_http_live_play_relay_main_conf_t;
+
 typedef struct ngx_http_live_netcall_session_s {
     ngx_http_request_t                         *session;
     ngx_http_live_play_relay_ctx_t             *ctx;
@@ -63,6 +78,16 @@ typedef struct ngx_http_live_netcall_session_s {
 
     ngx_uint_t                       netcall_ts;    // 回源开始时间
     ngx_uint_t                       status_code; 
+
+    ngx_pool_t                      *pool;
+    ngx_rtmp_netcall_upstream_t     *upstream;
+    ngx_chain_t                     *request;       // 复用的连接被源站关掉时重发
+    u_char                         **request_pos;   // 各buf发送前的pos
+    unsigned                         keepalive:1;   // 请求带keep-alive, 按Content-Length判断结束
+    unsigned                         reuse:1;
+    unsigned                         reused:1;
+    unsigned                         retried:1;
+    unsigned                         received:1;
 } ngx_http_live_netcall_session_t;
 
 typedef struct {
@@ -87,11 +112,33 @@ struct ngx_http_live_play_relay_ctx_s
     ngx_str_t                           app;
     ngx_str_t                           stream;
 
+    // 按顺序排列的源站, 空格分隔, origin为当前使用的下标
+    ngx_str_t                           origins;
+    ngx_uint_t                          norigins;
+    ngx_uint_t                          origin;
+    ngx_uint_t                          failovers;      // 连续切换次数, 收到数据后清零
+    ngx_msec_t                          last_data;
+    ngx_event_t                         failover_ev;    // 卡顿检测, 推流端断开后切换也从这里执行
+    unsigned                            published:1;
+    unsigned                            switching:1;
+
     ngx_int_t                           url_len;
     ngx_int_t                           refcount;
     ngx_event_t                         netcall_timeout_ev;
+
+    // 同一个流的查询只发一次: cache_owner表示占了缓存位置由自己查询,
+    // 其他worker在查询时用cache_wait_ev轮询它的结果
+    ngx_shm_zone_t                     *cache_zone;
+    ngx_str_t                           cache_key;      // app/stream
+    size_t                              cache_key_size; // cache_key.data的容量
+    struct ngx_http_live_play_request_ctx_s *cache_waiter; // 查询方放弃时由这个观众重新查询
+    ngx_event_t                         cache_wait_ev;
+    ngx_msec_t                          cache_wait_deadline;
+    ngx_flag_t                          cache_owner;
     ngx_pool_t                         *pool;  
     ngx_rtmp_relay_ctx_t               *rctx;
+    struct ngx_http_flv_relay_ctx_s    *flv_relay;      // HTTP-FLV回源会话
+    struct ngx_http_flv_relay_ctx_s    *flv_standby;    // 下一个源站的热备, 只收不推
     ngx_log_t                          *log;
     ngx_http_live_netcall_session_t    *cs;
 
@@ -113,4 +160,10 @@ ngx_int_t ngx_http_live_relay_on_play(void* r);
 ngx_int_t ngx_http_live_relay_on_play_close(void * r);
 
 ngx_int_t ngx_http_get_relay_status(void* v);
+
+// 回源开始后调用, 多个源站时开始卡顿检测和热备
+void ngx_http_live_relay_watch(ngx_http_live_play_relay_ctx_t *hrctx);
+
+// 回源推流端断开, 有其他源站时切换过去, 返回NGX_OK时观众保持连接
+ngx_int_t ngx_http_live_relay_failover(void *ptr);
 #endif
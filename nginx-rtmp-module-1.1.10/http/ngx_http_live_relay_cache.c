@@ -0,0 +1,273 @@
+#include "ngx_http_live_relay_cache.h"
+
+
+typedef struct {
+    ngx_rbtree_t                        rbtree;
+    ngx_rbtree_node_t                   sentinel;
+    ngx_queue_t                         queue;      // 按写入先后, 内存不够时从头淘汰
+} ngx_http_live_relay_cache_shctx_t;
+
+
+// key和两个地址紧跟在节点后面
+typedef struct {
+    ngx_str_node_t                      sn;
+    ngx_queue_t                         queue;
+    ngx_uint_t                          state;
+    ngx_msec_t                          expire;
+    ngx_str_t                           rtmp_url;
+    ngx_str_t                           http_url;
+} ngx_http_live_relay_cache_node_t;
+
+
+static void
+ngx_http_live_relay_cache_delete(ngx_http_live_relay_cache_shctx_t *shctx,
+    ngx_slab_pool_t *shpool, ngx_http_live_relay_cache_node_t *node)
+{
+    ngx_rbtree_delete(&shctx->rbtree, &node->sn.node);
+    ngx_queue_remove(&node->queue);
+    ngx_slab_free_locked(shpool, node);
+}
+
+
+static ngx_http_live_relay_cache_node_t *
+ngx_http_live_relay_cache_lookup(ngx_http_live_relay_cache_shctx_t *shctx,
+    ngx_slab_pool_t *shpool, ngx_str_t *key, uint32_t hash)
+{
+    ngx_http_live_relay_cache_node_t   *node;
+
+    node = (ngx_http_live_relay_cache_node_t *)
+           ngx_str_rbtree_lookup(&shctx->rbtree, key, hash);
+
+    if (node == NULL) {
+        return NULL;
+    }
+
+    // 过期的结果和超时的占位都直接删除
+    if ((ngx_msec_int_t) (node->expire - ngx_current_msec) <= 0) {
+        ngx_http_live_relay_cache_delete(shctx, shpool, node);
+        return NULL;
+    }
+
+    return node;
+}
+
+
+static ngx_http_live_relay_cache_node_t *
+ngx_http_live_relay_cache_insert(ngx_http_live_relay_cache_shctx_t *shctx,
+    ngx_slab_pool_t *shpool, ngx_str_t *key, uint32_t hash,
+    ngx_str_t *rtmp_url, ngx_str_t *http_url)
+{
+    size_t                              size;
+    u_char                             *p;
+    ngx_queue_t                        *q;
+    ngx_http_live_relay_cache_node_t   *node;
+
+    size = sizeof(ngx_http_live_relay_cache_node_t) + key->len;
+
+    if (rtmp_url) {
+        size += rtmp_url->len + http_url->len;
+    }
+
+    for ( ;; ) {
+        node = ngx_slab_alloc_locked(shpool, size);
+        if (node) {
+            break;
+        }
+
+        if (ngx_queue_empty(&shctx->queue)) {
+            return NULL;
+        }
+
+        q = ngx_queue_head(&shctx->queue);
+
+        ngx_http_live_relay_cache_delete(shctx, shpool,
+                ngx_queue_data(q, ngx_http_live_relay_cache_node_t, queue));
+    }
+
+    ngx_memzero(node, sizeof(ngx_http_live_relay_cache_node_t));
+
+    p = (u_char *) &node[1];
+
+    node->sn.str.data = p;
+    node->sn.str.len = key->len;
+    node->sn.node.key = hash;
+    p = ngx_cpymem(p, key->data, key->len);
+
+    if (rtmp_url) {
+        node->rtmp_url.data = p;
+        node->rtmp_url.len = rtmp_url->len;
+        p = ngx_cpymem(p, rtmp_url->data, rtmp_url->len);
+
+        node->http_url.data = p;
+        node->http_url.len = http_url->len;
+        ngx_memcpy(p, http_url->data, http_url->len);
+    }
+
+    ngx_rbtree_insert(&shctx->rbtree, &node->sn.node);
+    ngx_queue_insert_tail(&shctx->queue, &node->queue);
+
+    return node;
+}
+
+
+ngx_int_t
+ngx_http_live_relay_cache_get(ngx_shm_zone_t *zone, ngx_str_t *key,
+    ngx_msec_t lock, ngx_str_t *rtmp_url, ngx_str_t *http_url, size_t size)
+{
+    ngx_slab_pool_t                    *shpool;
+    ngx_http_live_relay_cache_shctx_t  *shctx;
+    ngx_http_live_relay_cache_node_t   *node;
+    ngx_uint_t                          state;
+    uint32_t                            hash;
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+    shctx = zone->data;
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    node = ngx_http_live_relay_cache_lookup(shctx, shpool, key, hash);
+
+    if (node == NULL) {
+
+        // 第一个请求占位, 同一个流的其他请求等它的结果
+        if (lock) {
+            node = ngx_http_live_relay_cache_insert(shctx, shpool, key, hash,
+                                                    NULL, NULL);
+            if (node) {
+                node->state = NGX_HTTP_LIVE_RELAY_CACHE_PENDING;
+                node->expire = ngx_current_msec + lock;
+            }
+        }
+
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        return NGX_HTTP_LIVE_RELAY_CACHE_MISS;
+    }
+
+    state = node->state;
+
+    if (state == NGX_HTTP_LIVE_RELAY_CACHE_HIT) {
+
+        // 其他location的缓冲区更大时存下的地址放不下, 截断的地址不能用, 当作未命中重新查询
+        if (node->rtmp_url.len > size || node->http_url.len > size) {
+            ngx_shmtx_unlock(&shpool->mutex);
+
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "relay cache: \"%V\" url longer than %uz, ignored",
+                          key, size);
+
+            return NGX_HTTP_LIVE_RELAY_CACHE_MISS;
+        }
+
+        rtmp_url->len = node->rtmp_url.len;
+        ngx_memcpy(rtmp_url->data, node->rtmp_url.data, rtmp_url->len);
+
+        http_url->len = node->http_url.len;
+        ngx_memcpy(http_url->data, node->http_url.data, http_url->len);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return state;
+}
+
+
+void
+ngx_http_live_relay_cache_put(ngx_shm_zone_t *zone, ngx_str_t *key,
+    ngx_str_t *rtmp_url, ngx_str_t *http_url, ngx_msec_t valid)
+{
+    ngx_slab_pool_t                    *shpool;
+    ngx_http_live_relay_cache_shctx_t  *shctx;
+    ngx_http_live_relay_cache_node_t   *node;
+    uint32_t                            hash;
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+    shctx = zone->data;
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    // 地址长度不固定, 替换整个节点
+    node = (ngx_http_live_relay_cache_node_t *)
+           ngx_str_rbtree_lookup(&shctx->rbtree, key, hash);
+
+    if (node) {
+        ngx_http_live_relay_cache_delete(shctx, shpool, node);
+    }
+
+    node = ngx_http_live_relay_cache_insert(shctx, shpool, key, hash,
+                                            rtmp_url, http_url);
+    if (node) {
+        node->state = rtmp_url ? NGX_HTTP_LIVE_RELAY_CACHE_HIT
+                               : NGX_HTTP_LIVE_RELAY_CACHE_NEGATIVE;
+        node->expire = ngx_current_msec + valid;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+void
+ngx_http_live_relay_cache_abort(ngx_shm_zone_t *zone, ngx_str_t *key)
+{
+    ngx_slab_pool_t                    *shpool;
+    ngx_http_live_relay_cache_shctx_t  *shctx;
+    ngx_http_live_relay_cache_node_t   *node;
+    uint32_t                            hash;
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+    shctx = zone->data;
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    node = (ngx_http_live_relay_cache_node_t *)
+           ngx_str_rbtree_lookup(&shctx->rbtree, key, hash);
+
+    if (node && node->state == NGX_HTTP_LIVE_RELAY_CACHE_PENDING) {
+        ngx_http_live_relay_cache_delete(shctx, shpool, node);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+ngx_int_t
+ngx_http_live_relay_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_slab_pool_t                    *shpool;
+    ngx_http_live_relay_cache_shctx_t  *shctx;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    shctx = ngx_slab_calloc(shpool, sizeof(ngx_http_live_relay_cache_shctx_t));
+    if (shctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_rbtree_init(&shctx->rbtree, &shctx->sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_queue_init(&shctx->queue);
+
+    shpool->data = shctx;
+    shm_zone->data = shctx;
+
+    // 写满时淘汰最早的结果, 不需要slab打印no memory
+    shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
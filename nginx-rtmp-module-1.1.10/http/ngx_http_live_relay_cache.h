@@ -0,0 +1,32 @@
+#ifndef NGX_HTTP_LIVE_RELAY_CACHE_H
+#define NGX_HTTP_LIVE_RELAY_CACHE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+// http_on_play查询结果, 按app/stream缓存在共享内存中, 所有worker共用
+#define NGX_HTTP_LIVE_RELAY_CACHE_MISS      0   // 没有结果, lock不为0时已经占位, 由调用方查询
+#define NGX_HTTP_LIVE_RELAY_CACHE_HIT       1
+#define NGX_HTTP_LIVE_RELAY_CACHE_NEGATIVE  2
+#define NGX_HTTP_LIVE_RELAY_CACHE_PENDING   3   // 其他请求正在查询
+
+ngx_int_t
+ngx_http_live_relay_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+// 查找key, 命中时把地址拷贝到rtmp_url/http_url(超过size字节时按未命中处理);
+// 没有结果且lock不为0时插入一个lock毫秒后失效的占位
+ngx_int_t
+ngx_http_live_relay_cache_get(ngx_shm_zone_t *zone, ngx_str_t *key,
+        ngx_msec_t lock, ngx_str_t *rtmp_url, ngx_str_t *http_url,
+        size_t size);
+
+// 写入查询结果, rtmp_url为NULL表示失败
+void
+ngx_http_live_relay_cache_put(ngx_shm_zone_t *zone, ngx_str_t *key,
+        ngx_str_t *rtmp_url, ngx_str_t *http_url, ngx_msec_t valid);
+
+// 查询被取消, 删除自己的占位, 等待者在下次轮询时放弃等待
+void
+ngx_http_live_relay_cache_abort(ngx_shm_zone_t *zone, ngx_str_t *key);
+
+#endif
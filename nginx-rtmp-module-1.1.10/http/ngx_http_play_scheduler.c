@@ -1,19 +1,498 @@
+#include <ngx_event.h>
 #include "ngx_http_play_scheduler.h"
 
+// 转交消息头, 后面紧跟原始的请求数据, 连接的fd通过SCM_RIGHTS传递
+typedef struct {
+    ngx_uint_t      listening;  //cycle->listening中的下标, 各worker配置相同
+    size_t          len;        //请求数据长度
+} ngx_http_play_handoff_msg_t;
+
+// 接收方的c->buffer, 第一次recv时把转交过来的请求数据交给http模块
+typedef struct {
+    ngx_buf_t       buf;        //必须是第一个成员
+    u_char         *pos;
+    u_char         *last;
+} ngx_http_play_handoff_buf_t;
+
+#define NGX_HTTP_PLAY_HANDOFF_MAX_REQUEST   (32 * 1024)
+
+static ngx_connection_t    *ngx_http_play_scheduler_conn;
+static ngx_str_t            ngx_http_play_scheduler_dir;
+
 
 ngx_int_t ngx_http_live_play_process_slot(u_char * name,ssize_t len)
 {
-    ngx_core_conf_t * ccf = (ngx_core_conf_t *)ngx_get_conf(ngx_cycle->conf_ctx, ngx_core_module);                                                                             
+    ngx_core_conf_t * ccf = (ngx_core_conf_t *)ngx_get_conf(ngx_cycle->conf_ctx, ngx_core_module);
 
-    if(ccf->worker_processes == 0) {
+    if(ngx_process != NGX_PROCESS_WORKER || ccf->worker_processes <= 1) {
         return -1;
     }
 
+    // 按流名哈希到worker序号, 重新加载后的worker序号仍是0..worker_processes-1
     ngx_int_t slot = ngx_hash_key(name,len) % ccf->worker_processes;
-    printf("worker_processes %ld ; slot %ld; ngx_process_slot %ld\n",ccf->worker_processes,slot,ngx_process_slot);
 
-    if(slot == ngx_process_slot){
+    if(slot == (ngx_int_t) ngx_worker){
         return -1;
     }
     return slot;
 }
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+
+static void
+ngx_http_play_scheduler_sockaddr(struct sockaddr_un *saun, ngx_uint_t worker)
+{
+    ngx_memzero(saun, sizeof(struct sockaddr_un));
+    saun->sun_family = AF_UNIX;
+    *ngx_snprintf((u_char *) saun->sun_path, sizeof(saun->sun_path) - 1,
+                  "%V/" NGX_HTTP_PLAY_SCHEDULER_SOCKNAME ".%ui",
+                  &ngx_http_play_scheduler_dir, worker)
+        = 0;
+}
+
+static ssize_t
+ngx_http_play_scheduler_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ngx_http_play_handoff_buf_t    *hb;
+    size_t                          n;
+
+    hb = (ngx_http_play_handoff_buf_t *) c->buffer;
+
+    n = ngx_min(size, (size_t) (hb->last - hb->pos));
+    ngx_memcpy(buf, hb->pos, n);
+    hb->pos += n;
+
+    if (hb->pos == hb->last) {
+        // 转交的数据读完后恢复正常的socket读取
+        c->recv = ngx_recv;
+        c->read->ready = 0;
+    }
+    return n;
+}
+
+static void
+ngx_http_play_scheduler_close(ngx_connection_t *c)
+{
+    ngx_socket_t  fd;
+
+    ngx_free_connection(c);
+
+    fd = c->fd;
+    c->fd = (ngx_socket_t) -1;
+    ngx_close_socket(fd);
+
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
+    }
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_active, -1);
+#endif
+}
+
+// 与ngx_event_accept相同的方式初始化转交过来的连接, 然后交给http模块重新解析请求
+static void
+ngx_http_play_scheduler_accept(ngx_socket_t s, ngx_listening_t *ls, u_char *data, size_t len)
+{
+    ngx_connection_t               *c;
+    ngx_log_t                      *log, *rtmp_log;
+    ngx_http_play_handoff_buf_t    *hb;
+    u_char                          sa[NGX_SOCKADDRLEN];
+    socklen_t                       socklen;
+
+    socklen = NGX_SOCKADDRLEN;
+    if (getpeername(s, (struct sockaddr *) sa, &socklen) == -1) {
+        ngx_close_socket(s);
+        return;
+    }
+
+    c = ngx_get_connection(s, ngx_cycle->log);
+    if (c == NULL) {
+        ngx_close_socket(s);
+        return;
+    }
+
+    c->type = SOCK_STREAM;
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
+#endif
+
+    c->pool = ngx_create_pool(ls->pool_size, ngx_cycle->log);
+    if (c->pool == NULL) {
+        ngx_http_play_scheduler_close(c);
+        return;
+    }
+
+    c->sockaddr = ngx_palloc(c->pool, socklen);
+    log = ngx_palloc(c->pool, sizeof(ngx_log_t));
+    rtmp_log = ngx_palloc(c->pool, sizeof(ngx_log_t));
+    hb = ngx_pcalloc(c->pool, sizeof(ngx_http_play_handoff_buf_t) + len);
+    if (c->sockaddr == NULL || log == NULL || rtmp_log == NULL || hb == NULL) {
+        ngx_http_play_scheduler_close(c);
+        return;
+    }
+
+    ngx_memcpy(c->sockaddr, sa, socklen);
+
+    if (ngx_nonblocking(s) == -1) {
+        ngx_http_play_scheduler_close(c);
+        return;
+    }
+
+    *log = ls->log;
+    *rtmp_log = ls->log;
+
+    c->recv = ngx_http_play_scheduler_recv;
+    c->send = ngx_send;
+    c->recv_chain = ngx_recv_chain;
+    c->send_chain = ngx_send_chain;
+
+    c->log = log;
+    c->pool->log = log;
+    c->rtmp_log = rtmp_log;
+
+    c->socklen = socklen;
+    c->listening = ls;
+    c->local_sockaddr = ls->sockaddr;
+    c->local_socklen = ls->socklen;
+
+    c->unexpected_eof = 1;
+
+    c->read->log = log;
+    c->write->log = log;
+    c->write->ready = 1;
+
+    // 请求数据已经在内存中, 让ngx_http_init_connection直接读取
+    c->read->ready = 1;
+
+    hb->pos = (u_char *) hb + sizeof(ngx_http_play_handoff_buf_t);
+    hb->last = ngx_cpymem(hb->pos, data, len);
+    c->buffer = &hb->buf;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    if (ls->addr_ntop) {
+        c->addr_text.data = ngx_pnalloc(c->pool, ls->addr_text_max_len);
+        if (c->addr_text.data == NULL) {
+            ngx_http_play_scheduler_close(c);
+            return;
+        }
+
+        c->addr_text.len = ngx_sock_ntop(c->sockaddr, c->socklen,
+                                         c->addr_text.data,
+                                         ls->addr_text_max_len, 0);
+        if (c->addr_text.len == 0) {
+            ngx_http_play_scheduler_close(c);
+            return;
+        }
+    }
+
+    if (ngx_add_conn && (ngx_event_flags & NGX_USE_EPOLL_EVENT) == 0) {
+        if (ngx_add_conn(c) == NGX_ERROR) {
+            ngx_http_play_scheduler_close(c);
+            return;
+        }
+    }
+
+    log->data = NULL;
+    log->handler = NULL;
+
+    ls->handler(c);
+}
+
+#if defined(SCM_CREDENTIALS)
+
+// 发送方必须是本master下的worker: 用户相同, pid在进程表中
+static ngx_int_t
+ngx_http_play_scheduler_check_peer(struct ucred *cred)
+{
+    ngx_int_t  i;
+
+    if (cred->uid != geteuid()) {
+        return NGX_DECLINED;
+    }
+
+    for (i = 0; i < ngx_last_process; i++) {
+        if (ngx_processes[i].pid == cred->pid && !ngx_processes[i].exited) {
+            return NGX_OK;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+#endif
+
+static void
+ngx_http_play_scheduler_read_handler(ngx_event_t *rev)
+{
+    ngx_connection_t               *c = rev->data;
+    ngx_http_play_handoff_msg_t    *hdr;
+    ngx_listening_t                *ls;
+    ngx_socket_t                    fd;
+    ssize_t                         n;
+    struct iovec                    iov;
+    struct msghdr                   msg;
+    struct cmsghdr                 *cmsg;
+    static u_char                   buf[sizeof(ngx_http_play_handoff_msg_t)
+                                        + NGX_HTTP_PLAY_HANDOFF_MAX_REQUEST];
+#if defined(SCM_CREDENTIALS)
+    struct ucred                    cred;
+    ngx_flag_t                      has_cred;
+#endif
+    union {
+        struct cmsghdr              cm;
+        char                        space[CMSG_SPACE(sizeof(int))
+#if defined(SCM_CREDENTIALS)
+                                          + CMSG_SPACE(sizeof(struct ucred))
+#endif
+                                          ];
+    } cmsg_buf;
+
+    for ( ;; ) {
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf);
+
+        ngx_memzero(&msg, sizeof(struct msghdr));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &cmsg_buf;
+        msg.msg_controllen = sizeof(cmsg_buf);
+
+        n = recvmsg(c->fd, &msg, 0);
+        if (n == -1) {
+            if (ngx_socket_errno != NGX_EAGAIN) {
+                ngx_log_error(NGX_LOG_ALERT, c->log, ngx_socket_errno,
+                              "play scheduler: recvmsg() failed");
+            }
+            return;
+        }
+
+        fd = (ngx_socket_t) -1;
+#if defined(SCM_CREDENTIALS)
+        has_cred = 0;
+#endif
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                ngx_memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            }
+#if defined(SCM_CREDENTIALS)
+            if (cmsg->cmsg_level == SOL_SOCKET
+                && cmsg->cmsg_type == SCM_CREDENTIALS)
+            {
+                ngx_memcpy(&cred, CMSG_DATA(cmsg), sizeof(struct ucred));
+                has_cred = 1;
+            }
+#endif
+        }
+
+        if (fd == (ngx_socket_t) -1) {
+            continue;
+        }
+
+#if defined(SCM_CREDENTIALS)
+        // 凭证由内核填写, 拒绝不是本master下worker发来的连接
+        if (!has_cred || ngx_http_play_scheduler_check_peer(&cred) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "play scheduler: handoff from unknown peer "
+                          "pid:%P uid:%d rejected",
+                          has_cred ? cred.pid : -1,
+                          has_cred ? (int) cred.uid : -1);
+            ngx_close_socket(fd);
+            continue;
+        }
+#endif
+
+        hdr = (ngx_http_play_handoff_msg_t *) buf;
+        if ((size_t) n < sizeof(ngx_http_play_handoff_msg_t)
+                || hdr->len != n - sizeof(ngx_http_play_handoff_msg_t)
+                || hdr->listening >= ngx_cycle->listening.nelts)
+        {
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "play scheduler: bad handoff message");
+            ngx_close_socket(fd);
+            continue;
+        }
+
+        ls = ngx_cycle->listening.elts;
+        ngx_http_play_scheduler_accept(fd, &ls[hdr->listening],
+                buf + sizeof(ngx_http_play_handoff_msg_t), hdr->len);
+    }
+}
+
+#endif
+
+ngx_int_t
+ngx_http_play_scheduler_init_process(ngx_cycle_t *cycle, ngx_str_t *socket_dir)
+{
+#if (NGX_HAVE_UNIX_DOMAIN)
+    ngx_core_conf_t            *ccf;
+    ngx_connection_t           *c;
+    ngx_socket_t                s;
+    struct sockaddr_un          saun;
+    ngx_file_info_t             fi;
+#if defined(SCM_CREDENTIALS)
+    int                         on;
+#endif
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    if (ngx_process != NGX_PROCESS_WORKER || ccf->worker_processes <= 1) {
+        return NGX_OK;
+    }
+
+    ngx_http_play_scheduler_dir = *socket_dir;
+    ngx_http_play_scheduler_sockaddr(&saun, ngx_worker);
+
+    if (ngx_file_info(saun.sun_path, &fi) != ENOENT) {
+        ngx_delete_file(saun.sun_path);
+    }
+
+    s = ngx_socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (s == (ngx_socket_t) -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      ngx_socket_n " play scheduler socket failed");
+        return NGX_OK;
+    }
+
+#if defined(SCM_CREDENTIALS)
+    // 数据报socket没有连接, SO_PEERCRED取不到发送方, 改为每条消息附带发送方凭证
+    on = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_PASSCRED, &on, sizeof(int)) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "setsockopt(SO_PASSCRED) play scheduler socket failed");
+        ngx_close_socket(s);
+        return NGX_OK;
+    }
+#endif
+
+    if (ngx_nonblocking(s) == -1
+            || bind(s, (struct sockaddr *) &saun, sizeof(saun)) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "play scheduler socket \"%s\" bind failed", saun.sun_path);
+        ngx_close_socket(s);
+        return NGX_OK;
+    }
+
+    c = ngx_get_connection(s, cycle->log);
+    if (c == NULL) {
+        ngx_close_socket(s);
+        return NGX_OK;
+    }
+
+    c->log = cycle->log;
+    c->read->log = cycle->log;
+    c->write->log = cycle->log;
+    c->read->handler = ngx_http_play_scheduler_read_handler;
+
+    if (ngx_add_event(c->read, NGX_READ_EVENT, 0) != NGX_OK) {
+        ngx_free_connection(c);
+        ngx_close_socket(s);
+        return NGX_OK;
+    }
+
+    ngx_http_play_scheduler_conn = c;
+#endif
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_play_scheduler_handoff(ngx_http_request_t *r, ngx_int_t slot)
+{
+#if (NGX_HAVE_UNIX_DOMAIN)
+    ngx_connection_t               *c = r->connection;
+    ngx_buf_t                      *b = r->header_in;
+    ngx_listening_t                *ls;
+    ngx_http_play_handoff_msg_t     hdr;
+    ngx_uint_t                      i;
+    struct sockaddr_un              saun;
+    struct iovec                    iov[2];
+    struct msghdr                   msg;
+    struct cmsghdr                 *cmsg;
+    union {
+        struct cmsghdr              cm;
+        char                        space[CMSG_SPACE(sizeof(int))];
+    } cmsg_buf;
+
+    if (ngx_http_play_scheduler_conn == NULL || slot < 0) {
+        return NGX_DECLINED;
+    }
+
+#if (NGX_HTTP_SSL)
+    if (c->ssl) {
+        return NGX_DECLINED;
+    }
+#endif
+
+#if (NGX_HTTP_V2)
+    if (r->stream) {
+        return NGX_DECLINED;
+    }
+#endif
+
+    // 只转交请求头在同一个buffer中的请求
+    if (b == NULL || r->request_start < b->start || r->request_start >= b->last
+            || (size_t) (b->last - r->request_start) > NGX_HTTP_PLAY_HANDOFF_MAX_REQUEST)
+    {
+        return NGX_DECLINED;
+    }
+
+    ls = ngx_cycle->listening.elts;
+    for (i = 0; i < ngx_cycle->listening.nelts; i++) {
+        if (&ls[i] == c->listening) {
+            break;
+        }
+    }
+    if (i == ngx_cycle->listening.nelts || c->proxy_protocol_addr.len) {
+        return NGX_DECLINED;
+    }
+
+    hdr.listening = i;
+    hdr.len = b->last - r->request_start;
+
+    iov[0].iov_base = (void *) &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *) r->request_start;
+    iov[1].iov_len = hdr.len;
+
+    ngx_http_play_scheduler_sockaddr(&saun, slot);
+
+    ngx_memzero(&msg, sizeof(struct msghdr));
+    msg.msg_name = &saun;
+    msg.msg_namelen = sizeof(saun);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = &cmsg_buf;
+    msg.msg_controllen = sizeof(cmsg_buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    ngx_memcpy(CMSG_DATA(cmsg), &c->fd, sizeof(int));
+
+    if (sendmsg(ngx_http_play_scheduler_conn->fd, &msg, 0) == -1) {
+        ngx_log_error(NGX_LOG_INFO, c->log, ngx_socket_errno,
+                      "play scheduler: handoff to worker %i failed", slot);
+        return NGX_DECLINED;
+    }
+
+    // 对端worker持有同一个socket, 关闭前必须先从本worker的事件中删除
+    if (ngx_del_conn) {
+        ngx_del_conn(c, 0);
+
+    } else {
+        if (c->read->active) {
+            ngx_del_event(c->read, NGX_READ_EVENT, 0);
+        }
+        if (c->write->active) {
+            ngx_del_event(c->write, NGX_WRITE_EVENT, 0);
+        }
+    }
+    return NGX_OK;
+#else
+    return NGX_DECLINED;
+#endif
+}
@@ -6,6 +6,15 @@
 #include <ngx_http.h>
 #include "ngx_rtmp.h"
 
+#define NGX_HTTP_PLAY_SCHEDULER_SOCKNAME  "nginx-flv"
+#define NGX_HTTP_PLAY_SCHEDULER_PATH      "play_handoff"    // 默认目录, 相对于prefix
+
 ngx_int_t ngx_http_live_play_process_slot(u_char * name,ssize_t len);
 
-#endif
\ No newline at end of file
+// 每个worker创建一个unix数据报socket, 用来接收其他worker转交过来的连接
+ngx_int_t ngx_http_play_scheduler_init_process(ngx_cycle_t *cycle, ngx_str_t *socket_dir);
+
+// 把已经读完请求头的连接连同请求数据转交给slot对应的worker, 成功返回NGX_OK
+ngx_int_t ngx_http_play_scheduler_handoff(ngx_http_request_t *r, ngx_int_t slot);
+
+#endif
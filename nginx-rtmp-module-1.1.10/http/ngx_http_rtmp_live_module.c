@@ -4,6 +4,7 @@
 #include "ngx_http_live_play_module.h"
 #include "ngx_rtmp_to_flv_packet.h"
 #include "ngx_http_rtmp_relay.h"
+#include "ngx_rtmp_live_bus_module.h"
 #include "ngx_rtmp_edge_log.h"
 
 static ngx_rtmp_publish_pt              next_publish;
@@ -37,6 +38,27 @@ static ngx_command_t ngx_http_rtmp_live_commands[] =
       NGX_RTMP_APP_CONF_OFFSET,
       offsetof(ngx_http_rtmp_live_app_conf_t, http_idle_streams),
       NULL },
+
+    { ngx_string("hdl_ring_size"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_http_rtmp_live_app_conf_t, ring_size),
+      NULL },
+
+    { ngx_string("hdl_ring_max_lag_size"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_http_rtmp_live_app_conf_t, ring_max_lag_size),
+      NULL },
+
+    { ngx_string("hdl_ring_max_lag_time"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_http_rtmp_live_app_conf_t, ring_max_lag_time),
+      NULL },
     ngx_null_command 
 };
 
@@ -69,10 +91,86 @@ ngx_module_t ngx_http_rtmp_live_module = {
     NGX_MODULE_V1_PADDING    
 };
 
+static ngx_http_flv_ring_t *
+ngx_http_rtmp_live_ring_create(ngx_http_rtmp_live_app_conf_t *lacf)
+{
+    ngx_http_flv_ring_t    *ring;
+
+    ring = ngx_pcalloc(lacf->pool, sizeof(ngx_http_flv_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->slots = ngx_pcalloc(lacf->pool, sizeof(ngx_http_flv_ring_slot_t) * lacf->ring_size);
+    if (ring->slots == NULL) {
+        return NULL;
+    }
+    ring->nslots = lacf->ring_size;
+    ring->max_lag_bytes = lacf->ring_max_lag_size;
+    ring->max_lag_time = lacf->ring_max_lag_time;
+    return ring;
+}
+
+// 释放环中所有tag, 序号继续递增, 观众游标落在环外后会等待新的关键帧
+static void
+ngx_http_rtmp_live_ring_clear(ngx_http_flv_ring_t *ring)
+{
+    ngx_http_flv_ring_slot_t   *slot;
+
+    if (ring == NULL) {
+        return;
+    }
+
+    while (ring->count) {
+        slot = ngx_http_flv_ring_slot(ring, ring->seq - ring->count);
+        ngx_http_flv_free_tag_mem(slot->out);
+        slot->out = NULL;
+        ring->count--;
+    }
+    ring->has_key = 0;
+}
+
+static void
+ngx_http_rtmp_live_ring_append(ngx_http_flv_ring_t *ring, ngx_chain_t *out, 
+        u_char mtype, unsigned int mlen, unsigned int pts, unsigned int delta)
+{
+    ngx_http_flv_ring_slot_t   *slot;
+    ngx_uint_t                  idx;
+
+    slot = ngx_http_flv_ring_slot(ring, ring->seq);
+    if (ring->count == ring->nslots) {
+        // 覆盖最老的tag
+        ngx_http_flv_free_tag_mem(slot->out);
+        ring->count--;
+    }
+
+    idx = (mtype >= HTTP_FLV_VIDEO_TAG ? 0 : 1);
+
+    slot->out = ngx_http_flv_acquire_tag_mem(out);
+    slot->mtype = mtype;
+    slot->mpts = pts;
+    slot->mdelte = delta;
+    slot->mlen = mlen;
+    slot->offset = ring->bytes;
+    slot->cum[0] = ring->cum[0];
+    slot->cum[1] = ring->cum[1];
+
+    ring->cum[idx] += delta;
+    ring->bytes += mlen;
+    ring->last_pts = pts;
+    if (mtype == HTTP_FLV_VIDEO_KEY_FRAME_TAG) {
+        ring->key_seq = ring->seq;
+        ring->has_key = 1;
+    }
+    ring->seq++;
+    ring->count++;
+}
+
 static ngx_http_rtmp_live_stream_t ** 
 ngx_http_rtmp_live_get_stream(ngx_http_rtmp_live_app_conf_t *lacf, u_char *name, int create)
 {
-    ngx_http_rtmp_live_stream_t    **stream;
+    ngx_http_rtmp_live_stream_t    **stream, *st;
+    ngx_http_flv_ring_t             *ring;
     size_t                      len;
 
     if (lacf == NULL) {
@@ -94,16 +192,34 @@ ngx_http_rtmp_live_get_stream(ngx_http_rtmp_live_app_conf_t *lacf, u_char *name,
 
     ngx_printf_log("ngx_http_rtmp_live_module","ngx_http_rtmp_live_get_stream","live: create stream %s", name);
 
-    // PUSH_CACHE
+    // PUSH_CACHE, 只有复用的流才带着原来的环
+    ring = NULL;
+
     if (lacf->free_streams) {
-        *stream = lacf->free_streams;
-        lacf->free_streams = lacf->free_streams->next;
+        st = lacf->free_streams;
+        lacf->free_streams = st->next;
+
+        ring = st->ring;
+        ngx_memzero(st, sizeof(ngx_http_rtmp_live_stream_t));
+
     } else {
-        *stream = ngx_palloc(lacf->pool, sizeof(ngx_http_rtmp_live_stream_t));
+        st = ngx_pcalloc(lacf->pool, sizeof(ngx_http_rtmp_live_stream_t));
+        if (st == NULL) {
+            return NULL;
+        }
+    }
+
+    st->tag_buf_len = 1024 * 16;
+
+    if (lacf->ring_size) {
+        if (ring == NULL) {
+            ring = ngx_http_rtmp_live_ring_create(lacf);
+        }
+        ngx_http_rtmp_live_ring_clear(ring);
+        st->ring = ring;
     }
 
-    ngx_memzero(*stream, sizeof(ngx_http_rtmp_live_stream_t));
-    (*stream)->tag_buf_len = 1024 * 16;
+    *stream = st;
 
     ngx_memcpy((*stream)->name, name,ngx_min(sizeof((*stream)->name) - 1, len));
     return stream;
@@ -184,6 +300,7 @@ ngx_http_rtmp_live_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
 {
     ngx_http_rtmp_live_app_conf_t                 *lacf;
     ngx_http_rtmp_live_ctx_t                      *ctx;
+    ngx_http_live_play_relay_ctx_t                *relay;
 
     lacf = ngx_rtmp_get_module_app_conf(s, ngx_http_rtmp_live_module);
 
@@ -191,7 +308,7 @@ ngx_http_rtmp_live_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
         goto next;
     }
 
-    if (s->auto_pushed) {
+    if (s->auto_pushed && !s->live_bus) {
         goto next;
     }
     ngx_printf_log("ngx_http_rtmp_live_module","ngx_http_rtmp_live_publish","json stream:%s",v->name);
@@ -203,10 +320,57 @@ ngx_http_rtmp_live_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
         ngx_printf_log("ngx_http_rtmp_live_module","ngx_http_rtmp_live_publish","join error");
         goto next;
     }
+
+    if (ctx->stream && ctx->stream->relay_ctx) {
+        relay = ctx->stream->relay_ctx;
+        relay->published = 1;
+        relay->last_data = ngx_current_msec;
+    }
 next:
     return next_publish(s, v);
 }
 
+ngx_int_t 
+ngx_http_rtmp_live_has_stream(void *http_ctx)
+{
+    ngx_http_rtmp_live_app_conf_t           *lacf;
+    ngx_http_live_play_request_ctx_t        *ctx = (ngx_http_live_play_request_ctx_t*)http_ctx;
+    u_char                                  name[4096] = {0};
+
+    lacf = (ngx_http_rtmp_live_app_conf_t*)get_http_to_rtmp_module_app_conf(ctx->s,ngx_http_rtmp_live_module);
+    if (lacf == NULL) {
+        return 0;
+    }
+    ngx_str_format_string(ctx->stream,(char*)name);
+
+    return ngx_http_rtmp_live_get_stream(lacf, name, 0) != NULL;
+}
+
+ngx_uint_t 
+ngx_http_rtmp_live_bw_in(void *http_ctx)
+{
+    ngx_http_live_play_request_ctx_t        *ctx = (ngx_http_live_play_request_ctx_t*)http_ctx;
+    ngx_http_rtmp_live_ctx_t                *hr_ctx;
+    ngx_rtmp_bandwidth_t                    *bw;
+    time_t                                   elapsed;
+
+    hr_ctx = (ngx_http_rtmp_live_ctx_t*)ctx->hr_ctx;
+    if (hr_ctx == NULL || hr_ctx->stream == NULL) {
+        return 0;
+    }
+    bw = &hr_ctx->stream->bw_in;
+    if (bw->bandwidth) {
+        return bw->bandwidth;
+    }
+
+    // 第一个统计周期还没结束
+    elapsed = ngx_cached_time->sec - (bw->intl_end - NGX_RTMP_BANDWIDTH_INTERVAL);
+    if (elapsed <= 0) {
+        elapsed = 1;
+    }
+    return bw->intl_bytes / elapsed;
+}
+
 ngx_int_t 
 ngx_http_rtmp_live_play(void *http_ctx)
 {
@@ -233,7 +397,17 @@ ngx_http_rtmp_live_play(void *http_ctx)
     }
 
     hr_ctx = (ngx_http_rtmp_live_ctx_t*)ctx->hr_ctx;
-    
+
+    if (rc == NGX_STREAM_NOT_FIND || hr_ctx->stream == NULL) {
+        //其他worker正在推这个流时从共享内存总线读取, 不再回源
+        ngx_rtmp_conf_ctx_t     cctx;
+        if (get_http_to_rtmp_conf_ctx(ctx->s, &cctx) == NGX_OK
+            && ngx_rtmp_live_bus_attach(&cctx, &ctx->app, name) == NGX_OK)
+        {
+            rc = ngx_http_rtmp_live_join(lacf, name,0,0,ctx->s->connection->pool,HTTP_FLV_PROTOCOL,(void*)ctx);
+        }
+    }
+
     if (rc == NGX_STREAM_NOT_FIND || hr_ctx->stream == NULL) {
         //触发回源流程
         if (ngx_http_live_relay_on_play((void*)ctx) == NGX_OK || ctx->relay_ctx) {
@@ -257,7 +431,8 @@ ngx_http_rtmp_live_play(void *http_ctx)
                         return NGX_ERROR;
                 }
             }else{
-                if(hr_ctx->stream->streaming == 0 && hr_ctx->stream->publishing == 0 && ctx->relay_ctx->rctx == NULL) //表示没有上行推流
+                if(hr_ctx->stream->streaming == 0 && hr_ctx->stream->publishing == 0 && ctx->relay_ctx->rctx == NULL
+                   && ctx->relay_ctx->flv_relay == NULL && !ctx->relay_ctx->switching) //表示没有上行推流
                     ngx_http_trigger_rtmp_relay_pull(ctx->relay_ctx);
             }
         }
@@ -346,8 +521,10 @@ ngx_http_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h, ngx_chain_t *
 {
     ngx_http_rtmp_live_ctx_t       *ctx,*pctx;
     ngx_rtmp_codec_ctx_t           *codec_ctx;
+    ngx_rtmp_codec_au_t            *au;
     ngx_http_rtmp_live_app_conf_t       *lacf;
     ngx_http_live_play_request_ctx_t   *req_ctx;
+    ngx_http_live_play_relay_ctx_t     *relay;
 
     ngx_uint_t                      meta_version = 0;
     ngx_uint_t                      csidx;
@@ -382,6 +559,13 @@ ngx_http_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h, ngx_chain_t *
 
     ctx->stream->streaming = 1;
 
+    // 回源有数据, 卡顿检测和切换计数从这里重新开始
+    if (ctx->stream->relay_ctx) {
+        relay = ctx->stream->relay_ctx;
+        relay->last_data = ngx_current_msec;
+        relay->failovers = 0;
+    }
+
     csidx = !(h->type == NGX_RTMP_MSG_VIDEO);
     cs  = &ctx->cs[csidx];
     ngx_memzero(&ch, sizeof(ch));
@@ -405,14 +589,16 @@ ngx_http_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h, ngx_chain_t *
     delta = ch.timestamp - lh.timestamp;
 
     codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
-    if (codec_ctx) {
+    // 帧类型和序列头由codec模块统一解析
+    au = ngx_rtmp_codec_get_au(s, h, in);
+    if (codec_ctx && au) {
         if (h->type == NGX_RTMP_MSG_VIDEO) {
             /* Only H264 is supported */
             if (codec_ctx->video_codec_id != NGX_RTMP_VIDEO_H264) {
                 return NGX_OK;
             }
             mtype = HTTP_FLV_VIDEO_TAG;
-            if (ngx_rtmp_get_video_frame_type(in) == 1)
+            if (au->key)
                 mtype = HTTP_FLV_VIDEO_KEY_FRAME_TAG;
         } else if (h->type == NGX_RTMP_MSG_AUDIO) {
             if (codec_ctx->audio_codec_id != NGX_RTMP_AUDIO_AAC)
@@ -427,7 +613,7 @@ ngx_http_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h, ngx_chain_t *
         return NGX_OK;
     }
 
-    if (ngx_rtmp_is_codec_header(in)) {
+    if (au->header) {
         if (h->type == NGX_RTMP_MSG_VIDEO) {
             ngx_printf_log("ngx_http_rtmp_live_module","ngx_http_rtmp_live_av","update video codec packet");
             //更新sps
@@ -447,10 +633,17 @@ ngx_http_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h, ngx_chain_t *
     if (rpkt == NULL)
         return NGX_OK;
     mlen = rpkt->buf->last - rpkt->buf->pos;
+    ngx_rtmp_update_bandwidth(&ctx->stream->bw_in, mlen);
 
     // 获取当前时间 单位毫秒（打印日志使用）
     ngx_uint_t  current_ts = ngx_rtmp_current_msec();
     ngx_uint_t  peers = 0; 
+
+    // 推流端只写一次环, 观众只需要被唤醒
+    if (ctx->stream->ring) {
+        ngx_http_rtmp_live_ring_append(ctx->stream->ring, rpkt, mtype, mlen, h->timestamp, delta);
+    }
+
     for (pctx = ctx->stream->ctx; pctx; pctx = pctx->next) {
         if (pctx == ctx) {
             continue;
@@ -477,8 +670,18 @@ ngx_http_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h, ngx_chain_t *
             if(ngx_media_data_cache_send(s,(void*)pctx,HTTP_FLV_PROTOCOL,only_send_header) != NGX_OK)
                 continue;
             pctx->meta_version = meta_version;
-        }else {
-            unsigned int check_pts = ngx_http_check_tag_pts(rpkt,h->timestamp,cs->timestamp,delta);
+
+            // 秒开缓存已经包含当前帧, 游标从环尾开始
+            if (ctx->stream->ring) {
+                req_ctx->ring = ctx->stream->ring;
+                req_ctx->ring_seq = ctx->stream->ring->seq;
+                req_ctx->ring_ts[0] = pctx->cs[0].timestamp;
+                req_ctx->ring_ts[1] = pctx->cs[1].timestamp;
+            }
+        } else if (req_ctx->ring) {
+            ngx_http_live_play_ring_notify(req_ctx);
+        } else {
+            unsigned int check_pts = ngx_http_check_tag_pts(h->timestamp,cs->timestamp,delta);
             ngx_http_live_send_message(req_ctx,rpkt,mtype,mlen,check_pts,delta);
             cs->timestamp += delta;
             req_ctx->current_time = cs->timestamp;
@@ -540,6 +743,7 @@ ngx_http_rtmp_live_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *
 
     if (hr_ctx->stream->publishing && hr_ctx->publishing) {
         ngx_media_data_cahce_clear(s,HTTP_FLV_PROTOCOL);
+        ngx_http_rtmp_live_ring_clear(hr_ctx->stream->ring);
         hr_ctx->stream->publishing = 0;
         hr_ctx->stream->streaming = 0;
 
@@ -555,7 +759,13 @@ ngx_http_rtmp_live_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *
 
     if (hr_ctx->publishing) {
          ngx_printf_log("ngx_http_rtmp_live_module","ngx_http_rtmp_live_close_stream","close publish");
-        if (!lacf->http_idle_streams) {
+        // 回源断开且还有观众时切换到下一个源站, 观众不断开
+        if (hr_ctx->stream->ctx && hr_ctx->stream->relay_ctx
+            && ngx_http_live_relay_failover(hr_ctx->stream->relay_ctx) == NGX_OK)
+        {
+            ngx_printf_log("ngx_http_rtmp_live_module","ngx_http_rtmp_live_close_stream","relay failover");
+
+        } else if (!lacf->http_idle_streams) {
             for (pctx = hr_ctx->stream->ctx; pctx; pctx = pctx->next) {
                 if (pctx->publishing == 0) {
                     http_ctx = pctx->http_ctx;
@@ -596,7 +806,7 @@ ngx_int_t
 ngx_http_rtmp_live_close_play_stream(void* http_ctx)
 {
     ngx_http_rtmp_live_app_conf_t   *lacf;
-    ngx_http_rtmp_live_ctx_t * hr_ctx,**cctx;
+    ngx_http_rtmp_live_ctx_t * hr_ctx,**cctx,*hr;
     ngx_http_rtmp_live_stream_t        **stream;
     ngx_http_live_play_request_ctx_t   *ctx = (ngx_http_live_play_request_ctx_t*)http_ctx;
 
@@ -624,6 +834,17 @@ ngx_http_rtmp_live_close_play_stream(void* http_ctx)
         }
     }
 
+    //等待查询结果的观众离开, 交给同一个流的其他观众
+    if (ctx->relay_ctx && ctx->relay_ctx->cache_waiter == ctx) {
+        ctx->relay_ctx->cache_waiter = NULL;
+        for (hr = hr_ctx->stream->ctx; hr; hr = hr->next) {
+            if (hr->http_ctx) {
+                ctx->relay_ctx->cache_waiter = hr->http_ctx;
+                break;
+            }
+        }
+    }
+
     if (hr_ctx->stream->ctx) {
         hr_ctx->stream = NULL;
         ctx->relay_ctx = NULL;
@@ -687,6 +908,9 @@ ngx_http_rtmp_live_create_app_conf(ngx_conf_t *cf)
     hracf->hdl = NGX_CONF_UNSET;
     hracf->nbuckets = NGX_CONF_UNSET;
     hracf->http_idle_streams = NGX_CONF_UNSET;
+    hracf->ring_size = NGX_CONF_UNSET_UINT;
+    hracf->ring_max_lag_size = NGX_CONF_UNSET_SIZE;
+    hracf->ring_max_lag_time = NGX_CONF_UNSET_MSEC;
     return hracf;
 }
 
@@ -699,6 +923,17 @@ ngx_http_rtmp_live_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->hdl, prev->hdl, 0);
     ngx_conf_merge_value(conf->nbuckets, prev->nbuckets, 1024);
     ngx_conf_merge_value(conf->http_idle_streams, prev->http_idle_streams, 1);
+    ngx_conf_merge_uint_value(conf->ring_size, prev->ring_size, 0);
+    ngx_conf_merge_size_value(conf->ring_max_lag_size, prev->ring_max_lag_size, 4 * 1024 * 1024);
+    ngx_conf_merge_msec_value(conf->ring_max_lag_time, prev->ring_max_lag_time, 3000);
+    if (conf->ring_size) {
+        // 按2的幂取整, 序号直接按位与取slot
+        ngx_uint_t n = 1;
+        while (n < conf->ring_size) {
+            n <<= 1;
+        }
+        conf->ring_size = n;
+    }
     conf->pool = ngx_create_pool(4096, &cf->cycle->new_log);
     if (conf->pool == NULL) {
         return NGX_CONF_ERROR;
@@ -73,6 +73,8 @@ struct ngx_http_rtmp_live_stream_s {
     ngx_uint_t                          sample_rate;    /* 5512, 11025, 22050, 44100 */
     ngx_uint_t                          sample_size;    /* 1=8bit, 2=16bit */
     ngx_uint_t                          audio_channels; /* 1, 2 */
+
+    ngx_http_flv_ring_t                 *ring;    //http-flv tag环, 流回收时保留
 };
 
  struct ngx_http_rtmp_live_app_conf_s{
@@ -84,6 +86,10 @@ struct ngx_http_rtmp_live_stream_s {
     ngx_flag_t                          hdl;
     ngx_flag_t                          http_idle_streams;
     ngx_str_t                           server;
+
+    ngx_uint_t                          ring_size;          //tag环的slot个数, 0表示关闭
+    size_t                              ring_max_lag_size;
+    ngx_msec_t                          ring_max_lag_time;
 } ;
 
 extern ngx_module_t  ngx_http_rtmp_live_module;
@@ -94,4 +100,12 @@ ngx_http_rtmp_live_play(void *http_ctx);
 ngx_int_t 
 ngx_http_rtmp_live_close_play_stream(void *http_ctx);
 
+// 当前worker中是否已经存在请求的流(不创建)
+ngx_int_t 
+ngx_http_rtmp_live_has_stream(void *http_ctx);
+
+// 观众所在流的入码率(字节/秒), 统计周期未满时按当前周期估算
+ngx_uint_t 
+ngx_http_rtmp_live_bw_in(void *http_ctx);
+
 #endif
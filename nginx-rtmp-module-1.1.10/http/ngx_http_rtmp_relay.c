@@ -3,6 +3,7 @@
 #include "ngx_rtmp_relay_module.h"
 #include "ngx_http_rtmp_live_module.h"
 #include "ngx_rtmp_edge_log.h"
+#include "ngx_http_flv_relay.h"
 
 extern ngx_rtmp_conf_ctx_t * ngx_rtmp_ctx;
 
@@ -185,6 +186,7 @@ ngx_int_t ngx_http_trigger_rtmp_relay_pull(void* v)
 {
     
     ngx_http_live_play_relay_ctx_t *prctx = NULL;
+    ngx_int_t                   rc;
     ngx_rtmp_relay_target_t     target;
     ngx_str_t                   local_name;
     ngx_url_t                  *u;
@@ -265,6 +267,12 @@ ngx_int_t ngx_http_trigger_rtmp_relay_pull(void* v)
         prctx->racf = prctx->app_conf[ngx_rtmp_relay_module.ctx_index] ;
     }
 
+    // 源站给了http地址时直接拉flv, 不走rtmp
+    if (ngx_http_flv_relay_enabled(prctx)) {
+        rc = ngx_http_flv_relay_pull(prctx);
+        goto done;
+    }
+
 
     if (ngx_strncasecmp(prctx->rtmp_pull_url.data, (u_char *)"rtmp://", 7) != 0) {
         ngx_printf_log("ngx_http_rtmp_relay","ngx_http_trigger_rtmp_relay_pull","url format error");
@@ -287,7 +295,14 @@ ngx_int_t ngx_http_trigger_rtmp_relay_pull(void* v)
         return NGX_ERROR;
     }
 
-    return ngx_http_rtmp_relay_pull(prctx,&local_name,&target);
+    rc = ngx_http_rtmp_relay_pull(prctx,&local_name,&target);
+
+done:
+    // 有多个源站时开始卡顿检测和热备
+    if (rc == NGX_OK) {
+        ngx_http_live_relay_watch(prctx);
+    }
+    return rc;
 }
 
 ngx_int_t ngx_http_close_rtmp_relay_pull(void*v)
@@ -328,7 +343,7 @@ ngx_int_t ngx_http_close_rtmp_relay_pull(void*v)
 }
 
 
-void * get_http_to_rtmp_module_app_conf(void *v,ngx_module_t module)
+ngx_int_t get_http_to_rtmp_conf_ctx(void *v,ngx_rtmp_conf_ctx_t *cctx)
 {
     ngx_uint_t                 rtmp_server_port;
     ngx_rtmp_listen_t          *ls;
@@ -340,7 +355,7 @@ void * get_http_to_rtmp_module_app_conf(void *v,ngx_module_t module)
     ngx_http_live_play_relay_loc_conf_t* hrlc;
 
     if(v == NULL)
-        return NULL;
+        return NGX_ERROR;
 
     ngx_http_request_t *r = (ngx_http_request_t*)v;
     ngx_http_live_play_request_ctx_t *  rctx = (ngx_http_live_play_request_ctx_t*)ngx_http_get_module_ctx(r,ngx_http_live_play_module);
@@ -350,14 +365,14 @@ void * get_http_to_rtmp_module_app_conf(void *v,ngx_module_t module)
     if(ngx_rtmp_ctx == NULL || hrlc == NULL || rctx == NULL)
     {
         ngx_printf_log("ngx_http_rtmp_relay","get_http_to_rtmp_module_app_conf","get rtmp modules config error");
-        return NULL;
+        return NGX_ERROR;
     }
     cmcf = (ngx_rtmp_core_main_conf_t*)ngx_rtmp_ctx->main_conf[ngx_rtmp_core_module.ctx_index];
 
     if (cmcf == NULL)
     {
         ngx_printf_log("ngx_http_rtmp_relay","get_http_to_rtmp_module_app_conf","ngx_rtmp_core_main_conf_t error");
-        return NULL;
+        return NGX_ERROR;
     }
 
     cscfs = cmcf->servers.elts;
@@ -370,7 +385,7 @@ void * get_http_to_rtmp_module_app_conf(void *v,ngx_module_t module)
     if(cscfs == NULL || srv_num <= 0)
     {
         ngx_printf_log("ngx_http_rtmp_relay","get_http_to_rtmp_module_app_conf","srv_num is null");
-        return NULL;
+        return NGX_ERROR;
     }
     else
     {
@@ -390,11 +405,24 @@ void * get_http_to_rtmp_module_app_conf(void *v,ngx_module_t module)
                     ngx_strncmp((*cacfp)->name.data, rctx->app.data, rctx->app.len) == 0)
                     {
                         /* found app! */
-                        return (*cacfp)->app_conf[module.ctx_index];
+                        cctx->main_conf = cscf->ctx->main_conf;
+                        cctx->srv_conf = cscf->ctx->srv_conf;
+                        cctx->app_conf = (*cacfp)->app_conf;
+                        return NGX_OK;
                     }
                 }
             }
         }
     }
-    return NULL;
+    return NGX_ERROR;
+}
+
+void * get_http_to_rtmp_module_app_conf(void *v,ngx_module_t module)
+{
+    ngx_rtmp_conf_ctx_t        cctx;
+
+    if (get_http_to_rtmp_conf_ctx(v, &cctx) != NGX_OK) {
+        return NULL;
+    }
+    return cctx.app_conf[module.ctx_index];
 }
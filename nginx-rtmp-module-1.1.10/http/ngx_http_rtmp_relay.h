@@ -13,5 +13,8 @@ ngx_int_t ngx_http_close_rtmp_relay_pull(void*v);
 
 void * get_http_to_rtmp_module_app_conf(void *v,ngx_module_t module);
 
+// 找到http请求对应的rtmp server/application的配置上下文
+ngx_int_t get_http_to_rtmp_conf_ctx(void *v,ngx_rtmp_conf_ctx_t *cctx);
+
 
 #endif
\ No newline at end of file
@@ -36,6 +36,82 @@ static void  free_media_node(ngx_media_data_cache_t* cache,ngx_media_data_node_t
     }
 }
 
+// 新节点加入缓存后更新关键帧索引, 关键帧开始一个新的gop
+static void ngx_media_data_cache_index(ngx_media_data_cache_t* cache,ngx_media_data_node_t* node)
+{
+    ngx_media_data_gop_t  *gop;
+
+    if (node->key_frame == 1) {
+        cache->cache_gop_num++;
+        gop = ngx_media_data_gop(cache, cache->cache_gop_num - 1);
+        gop->node = node;
+        gop->bytes = 0;
+        gop->duration = 0;
+    }
+    if (cache->cache_gop_num == 0) {
+        return;
+    }
+
+    gop = ngx_media_data_gop(cache, cache->cache_gop_num - 1);
+    gop->bytes += node->size;
+    if (node->mtype == NGX_RTMP_MSG_VIDEO) {
+        gop->duration += node->delta;
+    }
+}
+
+// 超过缓存的gop个数时去掉最老的gop, 返回新的第一个gop的起始节点, 不需要淘汰时返回NULL
+static ngx_media_data_node_t* ngx_media_data_cache_trim_gop(ngx_media_data_cache_t* cache,ngx_uint_t gop_num)
+{
+    if (gop_num > NGX_MEDIA_DATA_MAX_GOP - 1) {
+        gop_num = NGX_MEDIA_DATA_MAX_GOP - 1;
+    }
+    if (cache->cache_gop_num <= gop_num || cache->cache_gop_num < 2) {
+        return NULL;
+    }
+
+    cache->gop_first = (cache->gop_first + 1) % NGX_MEDIA_DATA_MAX_GOP;
+    cache->cache_gop_num--;
+    return ngx_media_data_gop(cache, 0)->node;
+}
+
+// 新观众的起播位置: 从最新的gop往前找, 直到缓存时长不小于目标延迟, 0表示发送全部缓存
+static ngx_media_data_node_t* ngx_media_data_cache_start(ngx_media_data_cache_t* cache,ngx_msec_t latency)
+{
+    ngx_media_data_gop_t  *gop;
+    ngx_uint_t             i, duration;
+
+    if (latency == 0 || cache->cache_gop_num == 0) {
+        return cache->busy_cache_head;
+    }
+
+    duration = 0;
+    for (i = cache->cache_gop_num; i > 0; i--) {
+        gop = ngx_media_data_gop(cache, i - 1);
+        duration += gop->duration;
+        if (duration >= latency) {
+            ngx_log_debug3(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
+                    "media cache: join at gop %ui/%ui bytes=%ui",
+                    i, cache->cache_gop_num, gop->bytes);
+            return gop->node;
+        }
+    }
+    return cache->busy_cache_head;
+}
+
+static void ngx_media_data_cache_reset(ngx_media_data_cache_t* cache)
+{
+    cache->busy_cache_head = NULL;
+    cache->busy_cache_tail = NULL;
+    cache->cache_duration = 0;
+    cache->cache_frame_num = 0;
+    cache->video_cache_duration = 0;
+    cache->video_cache_frame_num = 0;
+    cache->audio_cache_duration = 0;
+    cache->audio_cache_frame_num = 0;
+    cache->cache_gop_num = 0;
+    cache->gop_first = 0;
+}
+
 //rtmp cache
 ngx_chain_t* ngx_rtmp_media_data_cache_write(ngx_rtmp_session_t* s, ngx_rtmp_header_t *h, 
         ngx_chain_t* in,ngx_rtmp_header_t *ch, ngx_rtmp_header_t *lh,ngx_int_t type)
@@ -86,6 +162,10 @@ ngx_chain_t* ngx_rtmp_media_data_cache_write(ngx_rtmp_session_t* s, ngx_rtmp_hea
         node = alloc_media_node(ctx->media_cache,s->connection->pool);
         if(node)
         { 
+            ngx_chain_t * l;
+            for(l = rpkt; l; l = l->next) {
+                node->size += (l->buf->last - l->buf->pos);
+            }
             node->mtype = h->type;
             node->mcpts = ch->timestamp;
             node->mlpts = lh->timestamp;
@@ -105,10 +185,7 @@ ngx_chain_t* ngx_rtmp_media_data_cache_write(ngx_rtmp_session_t* s, ngx_rtmp_hea
                 ctx->media_cache->busy_cache_tail = node;
             }
 
-            if(node->key_frame == 1)
-            {
-                ctx->media_cache->cache_gop_num++;
-            }
+            ngx_media_data_cache_index(ctx->media_cache, node);
 
             if(h->type == NGX_RTMP_MSG_AUDIO)
             {
@@ -125,12 +202,11 @@ ngx_chain_t* ngx_rtmp_media_data_cache_write(ngx_rtmp_session_t* s, ngx_rtmp_hea
             ? ctx->media_cache->audio_cache_duration : ctx->media_cache->video_cache_duration;
 
             //if(lacf->cache_gop_duration < ctx->media_cache->cache_duration
-           if( lacf->cache_gop_num < ctx->media_cache->cache_gop_num)
+            if(node->key_frame == 1)
             {
-                if(node->key_frame == 1)
+                ngx_media_data_node_t * first = ngx_media_data_cache_trim_gop(ctx->media_cache, lacf->cache_gop_num);
+                if(first)
                 {
-                    ctx->media_cache->cache_gop_num--;
-
                     ngx_media_data_node_t * ln = ctx->media_cache->busy_cache_head;
                     ctx->media_cache->busy_cache_head = ln->next;
 
@@ -155,14 +231,10 @@ ngx_chain_t* ngx_rtmp_media_data_cache_write(ngx_rtmp_session_t* s, ngx_rtmp_hea
                         free_media_node(ctx->media_cache,ln);
 
                         ln = ctx->media_cache->busy_cache_head;
-                        if(ln == NULL )
+                        if(ln == NULL || ln == first)
                         {
                             break;  
                         }
-                        if(ln->key_frame == 1 && ln->mtype == NGX_RTMP_MSG_VIDEO)
-                        {
-                            break; 
-                        }
 
                         ctx->media_cache->busy_cache_head = ln->next;
                     }
@@ -230,6 +302,7 @@ ngx_http_flv_media_data_cache_write(ngx_rtmp_session_t* s, ngx_rtmp_header_t *h,
 
     node = alloc_media_node(ctx->media_cache, s->connection->pool);
     if (node) { 
+        node->size = rpkt->buf->last - rpkt->buf->pos;
         node->mtype = h->type;
         node->mcpts = ch->timestamp;
         node->mlpts = lh->timestamp;
@@ -247,9 +320,7 @@ ngx_http_flv_media_data_cache_write(ngx_rtmp_session_t* s, ngx_rtmp_header_t *h,
             ctx->media_cache->busy_cache_tail = node;
         }
 
-        if (node->key_frame == 1) {
-            ctx->media_cache->cache_gop_num++;
-        }
+        ngx_media_data_cache_index(ctx->media_cache, node);
 
         if (h->type == NGX_RTMP_MSG_AUDIO) {
             ctx->media_cache->audio_cache_frame_num++;
@@ -263,10 +334,9 @@ ngx_http_flv_media_data_cache_write(ngx_rtmp_session_t* s, ngx_rtmp_header_t *h,
             ? ctx->media_cache->audio_cache_duration : ctx->media_cache->video_cache_duration;
 
         //if(lacf->cache_gop_duration < ctx->media_cache->cache_duration
-        if (lacf->cache_gop_num < ctx->media_cache->cache_gop_num) {
-            if (node->key_frame == 1) {
-                ctx->media_cache->cache_gop_num--;
-
+        if (node->key_frame == 1) {
+            ngx_media_data_node_t * first = ngx_media_data_cache_trim_gop(ctx->media_cache, lacf->cache_gop_num);
+            if (first) {
                 ngx_media_data_node_t * ln = ctx->media_cache->busy_cache_head;
                 ctx->media_cache->busy_cache_head = ln->next;
                 
@@ -287,12 +357,9 @@ ngx_http_flv_media_data_cache_write(ngx_rtmp_session_t* s, ngx_rtmp_header_t *h,
                     free_media_node(ctx->media_cache,ln);
 
                     ln = ctx->media_cache->busy_cache_head;
-                    if (ln == NULL ) {
+                    if (ln == NULL || ln == first) {
                         break;  
                     }
-                    if (ln->key_frame == 1 && ln->mtype == NGX_RTMP_MSG_VIDEO) {
-                        break; 
-                    }
 
                     ctx->media_cache->busy_cache_head = ln->next;
                 }
@@ -408,7 +475,7 @@ ngx_int_t ngx_rtmp_media_data_cache_send(ngx_rtmp_session_t* s,void* ptrctx,ngx_
     if(!vcs->active || !acs->active)
         return NGX_OK;
     
-    ngx_media_data_node_t * ln = cache->busy_cache_head;
+    ngx_media_data_node_t * ln = ngx_media_data_cache_start(cache, lacf->cache_gop_latency);
 
     while(ln)
     {
@@ -431,12 +498,6 @@ ngx_int_t ngx_rtmp_media_data_cache_send(ngx_rtmp_session_t* s,void* ptrctx,ngx_
         rpkt = ln->cache_chain;
         delta = ln->delta;
 
-        int mlen = 0;
-        ngx_chain_t * l;
-        for(l = rpkt; l; l = l->next) {
-            mlen += (l->buf->last - l->buf->pos);
-        }
-
         if (ngx_rtmp_send_message(ss, rpkt, ln->prio) != NGX_OK) {
             ++pctx->ndropped;
             cs->dropped += delta;
@@ -558,7 +619,7 @@ ngx_http_flv_media_data_cache_send(ngx_rtmp_session_t *s, void *ptrctx,ngx_int_t
     if(only_send_header == 1)
         return NGX_OK;
 
-    ngx_media_data_node_t * ln = cache->busy_cache_head;
+    ngx_media_data_node_t * ln = ngx_media_data_cache_start(cache, lacf->cache_gop_latency);
 
     while (ln) {
         u_char mtype = 0;
@@ -589,13 +650,7 @@ ngx_http_flv_media_data_cache_send(ngx_rtmp_session_t *s, void *ptrctx,ngx_int_t
             rpkt = ln->cache_chain;
             delta = ln->delta;
 
-            int mlen = 0;
-            ngx_chain_t * l;
-            for (l = rpkt; l; l = l->next) {
-                mlen += (l->buf->last - l->buf->pos);
-            }
-
-            if (ngx_http_live_send_message(ss, rpkt, mtype, mlen, ln->mcpts, ln->delta) != NGX_OK) {
+            if (ngx_http_live_send_message(ss, rpkt, mtype, ln->size, ln->mcpts, ln->delta) != NGX_OK) {
                 ++pctx->ndropped;
                 cs->dropped += delta;
             }
@@ -660,7 +715,7 @@ ngx_int_t ngx_media_data_cahce_clear(ngx_rtmp_session_t* s,ngx_int_t type)
                     cache->busy_cache_head = ln->next;
                 }        
             }
-            memset(cache,0,sizeof(ngx_media_data_node_t));
+            ngx_media_data_cache_reset(cache);
         }
     }
     else if (type == HTTP_FLV_PROTOCOL)
@@ -692,7 +747,7 @@ ngx_int_t ngx_media_data_cahce_clear(ngx_rtmp_session_t* s,ngx_int_t type)
                     cache->busy_cache_head = ln->next;
                 }        
             }
-            memset(cache,0,sizeof(ngx_media_data_node_t));
+            ngx_media_data_cache_reset(cache);
         }
     }
     return NGX_OK;
@@ -736,16 +791,15 @@ ngx_int_t ngx_rtmp_check_up_idle_stream(ngx_rtmp_session_t *s,int type)
     return NGX_OK;
 }
 
-unsigned int ngx_http_check_tag_pts(ngx_chain_t* in,unsigned int tagpts,unsigned int cspts,int delta)
+//只计算修正后的时间戳, tag由多个观众共享, 改写在各自的frame头中进行
+unsigned int ngx_http_check_tag_pts(unsigned int tagpts,unsigned int cspts,int delta)
 {
     unsigned int lpts = tagpts;
     if(cspts > tagpts)
     {
         if(delta < 0 )
             delta = 0;
-        int_4 pts = cspts + delta;
-        ngx_http_rewrite_tag_pts(pts,in);
-        lpts = pts;
+        lpts = cspts + delta;
     }
     return lpts;
-}
\ No newline at end of file
+}
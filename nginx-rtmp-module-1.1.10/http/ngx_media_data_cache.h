@@ -5,6 +5,9 @@
 #define  RTMP_PROTOCOL 0
 #define  HTTP_FLV_PROTOCOL 1
 
+// gop索引的最大个数, cache_gop_num超过时按该值减一缓存
+#define  NGX_MEDIA_DATA_MAX_GOP 16
+
 typedef struct ngx_media_data_node_s ngx_media_data_node_t;
 
 struct ngx_media_data_node_s{
@@ -14,10 +17,17 @@ struct ngx_media_data_node_s{
     ngx_uint_t      mlpts;   //上一帧时间戳
     ngx_uint_t      delta;  //时间间隔
     ngx_uint_t      prio;            //优先级
+    ngx_uint_t      size;            //数据字节数
     ngx_chain_t *   cache_chain;    //缓存的数据
     ngx_media_data_node_t * next;
 };
 
+typedef struct {
+    ngx_media_data_node_t  *node;       //gop的第一个节点(关键帧)
+    ngx_uint_t              bytes;      //gop内所有节点的字节数
+    ngx_uint_t              duration;   //gop的视频时长
+} ngx_media_data_gop_t;
+
 typedef struct{
     ngx_rtmp_session_t *s;
     ngx_uint_t      cache_duration;
@@ -34,8 +44,14 @@ typedef struct{
     ngx_media_data_node_t * busy_cache_head;
     ngx_media_data_node_t * busy_cache_tail;
     ngx_media_data_node_t * free_node_list;
+
+    ngx_media_data_gop_t    gops[NGX_MEDIA_DATA_MAX_GOP]; //关键帧索引, 按gop_first开始的环形数组
+    ngx_uint_t              gop_first;
 }ngx_media_data_cache_t; 
 
+#define ngx_media_data_gop(cache, n) \
+    (&(cache)->gops[((cache)->gop_first + (n)) % NGX_MEDIA_DATA_MAX_GOP])
+
 
 ngx_chain_t* ngx_media_data_cache_write(ngx_rtmp_session_t* s, ngx_rtmp_header_t *h,
                                         ngx_chain_t* in,ngx_rtmp_header_t *ch,
@@ -51,5 +67,5 @@ ngx_int_t ngx_http_flv_send_header(ngx_rtmp_session_t* s,void* pctx);
 //判断冷热流
 ngx_int_t ngx_rtmp_check_up_idle_stream(ngx_rtmp_session_t *s,int type);
 
-unsigned int ngx_http_check_tag_pts(ngx_chain_t* in,unsigned int tagpts,unsigned int cspts,int delta);
+unsigned int ngx_http_check_tag_pts(unsigned int tagpts,unsigned int cspts,int delta);
 #endif
@@ -2,27 +2,71 @@
 #include "ngx_rtmp_codec_module.h"
 #include "ngx_http_rtmp_live_module.h"
 
+typedef struct ngx_http_flv_block_s ngx_http_flv_block_t;
+
+struct ngx_http_flv_block_s {
+    ngx_http_flv_block_t   *next;   //空闲链表
+    size_t                  size;   //整块大小
+    ngx_uint_t              cls;    //大小级别, NGX_HTTP_FLV_POOL_CLASSES表示直接malloc
+};
+
+// 块头之后是引用计数, 紧接着是对齐的ngx_chain_t
+#define NGX_HTTP_FLV_BLOCK_HEADER                                          \
+    ngx_align(sizeof(ngx_http_flv_block_t) + NGX_RTMP_REFCOUNT_BYTES, sizeof(void *))
+
+ngx_http_flv_pool_stat_t            ngx_http_flv_pool_stat;
+
+static ngx_http_flv_block_t        *ngx_http_flv_pool_free[NGX_HTTP_FLV_POOL_CLASSES];
+
 ngx_chain_t*  ngx_http_flv_base_alloc_tag_mem(size_t mem_size)
 {
     u_char * p = NULL;
     ngx_chain_t                *out;
     ngx_buf_t                  *b;
+    ngx_http_flv_block_t       *block;
+    ngx_uint_t                  cls;
 
     unsigned int tag_size = 128;
-    unsigned int struct_size = sizeof(ngx_chain_t)+sizeof(ngx_buf_t);
-    unsigned int size = mem_size + struct_size + tag_size;
-    p = (u_char*)malloc(size);
+    unsigned int struct_size = NGX_HTTP_FLV_BLOCK_HEADER + sizeof(ngx_chain_t)+sizeof(ngx_buf_t);
+    size_t size = mem_size + struct_size + tag_size;
 
-    if (p == NULL) {
-        return NULL;
+    for (cls = 0; cls < NGX_HTTP_FLV_POOL_CLASSES; cls++) {
+        if (size <= ((size_t) 1 << (cls + NGX_HTTP_FLV_POOL_MIN_SHIFT))) {
+            size = (size_t) 1 << (cls + NGX_HTTP_FLV_POOL_MIN_SHIFT);
+            break;
+        }
+    }
+
+    ngx_http_flv_pool_stat.tag_alloc++;
+
+    if (cls < NGX_HTTP_FLV_POOL_CLASSES && ngx_http_flv_pool_free[cls]) {
+        block = ngx_http_flv_pool_free[cls];
+        ngx_http_flv_pool_free[cls] = block->next;
+        ngx_http_flv_pool_stat.bytes_cached -= size;
+        ngx_http_flv_pool_stat.tag_hit++;
+    } else {
+        block = (ngx_http_flv_block_t *) malloc(size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->size = size;
+        block->cls = cls;
     }
+    block->next = NULL;
 
+    ngx_http_flv_pool_stat.bytes_in_use += size;
+    if (ngx_http_flv_pool_stat.bytes_in_use > ngx_http_flv_pool_stat.bytes_in_use_max) {
+        ngx_http_flv_pool_stat.bytes_in_use_max = ngx_http_flv_pool_stat.bytes_in_use;
+    }
+
+    p = (u_char *) block + NGX_HTTP_FLV_BLOCK_HEADER;
     out = (ngx_chain_t *)p;
     p += sizeof(ngx_chain_t);
 
     out->buf = (ngx_buf_t *)p;
     p += sizeof(ngx_buf_t);
 
+    ngx_memzero(out->buf, sizeof(ngx_buf_t));
     out->buf->start = p;
     out->buf->end = p + (size - struct_size);
 
@@ -30,6 +74,9 @@ ngx_chain_t*  ngx_http_flv_base_alloc_tag_mem(size_t mem_size)
     b = out->buf;
     b->pos = b->last = p;
     b->memory = 1;
+
+    /* tag has refcount =1 when created, owned by the caller */
+    ngx_rtmp_ref_set(out, 1);
     return out;
 }
 
@@ -43,24 +90,37 @@ ngx_chain_t*  ngx_http_flv_alloc_tag_mem(ngx_chain_t* in)
     return ngx_http_flv_base_alloc_tag_mem(mlen);
 }
 
-ngx_chain_t * ngx_http_flv_copy_tag_mem(ngx_chain_t* in)
+ngx_chain_t * ngx_http_flv_acquire_tag_mem(ngx_chain_t* in)
 {
-    ngx_chain_t * l = ngx_http_flv_alloc_tag_mem(in);
-    if(l)
+    if(in)
     {
-        int mlen = in->buf->last - in->buf->pos;
-        memcpy(l->buf->pos,in->buf->pos,mlen);
-        l->buf->last = l->buf->pos + mlen;
+        ngx_rtmp_ref_get(in);
     }
-    return l;
+    return in;
 }
 
 void ngx_http_flv_free_tag_mem(ngx_chain_t* in)
 {
     if(in)
     {
-        u_char* p = (u_char*)in;
-        free(p);
+        // 还有其他观众引用，不释放
+        if (ngx_rtmp_ref_put(in)) {
+            return;
+        }
+        ngx_http_flv_block_t *block = (ngx_http_flv_block_t *) ((u_char*)in - NGX_HTTP_FLV_BLOCK_HEADER);
+        ngx_http_flv_pool_stat.bytes_in_use -= block->size;
+
+        // 超大的块或空闲链表已经足够大时还给系统
+        if (block->cls == NGX_HTTP_FLV_POOL_CLASSES
+                || ngx_http_flv_pool_stat.bytes_cached + block->size > NGX_HTTP_FLV_POOL_MAX_CACHED)
+        {
+            free(block);
+            return;
+        }
+
+        block->next = ngx_http_flv_pool_free[block->cls];
+        ngx_http_flv_pool_free[block->cls] = block;
+        ngx_http_flv_pool_stat.bytes_cached += block->size;
         in = NULL;
     }
 }
@@ -543,13 +603,18 @@ ngx_http_flv_perpare_header(ngx_rtmp_session_t *session, void *ctx, ngx_rtmp_hea
     if (stream == NULL)
         return NGX_ERROR;
     
-    // 缓存 meta data 
+    // 缓存 meta data, 观众队列还在引用旧tag时重新申请
+    if (stream->meta_conf_tag && ngx_rtmp_ref(stream->meta_conf_tag) > 1) {
+        ngx_http_flv_free_tag_mem(stream->meta_conf_tag);
+        stream->meta_conf_tag = NULL;
+    }
     if ( stream->meta_conf_tag == NULL){
         stream->meta_conf_tag = ngx_http_flv_base_alloc_tag_mem(stream->tag_buf_len);
     }
 
     if (stream->meta_conf_tag){
-        stream->meta_conf_tag->buf->pos = stream->meta_conf_tag->buf->last;
+        stream->meta_conf_tag->buf->pos = stream->meta_conf_tag->buf->start;
+        stream->meta_conf_tag->buf->last = stream->meta_conf_tag->buf->start;
         stream->meta_tag_size = 0;
     } else {
         return NGX_ERROR;
@@ -597,11 +662,16 @@ ngx_http_flv_perpare_header(ngx_rtmp_session_t *session, void *ctx, ngx_rtmp_hea
     // 缓存 AAC 
     // audio header tag
     if (has_audio && codec_ctx->aac_header) {
+        if (stream->aac_conf_tag && ngx_rtmp_ref(stream->aac_conf_tag) > 1) {
+            ngx_http_flv_free_tag_mem(stream->aac_conf_tag);
+            stream->aac_conf_tag = NULL;
+        }
         if (stream->aac_conf_tag == NULL) 
             stream->aac_conf_tag = ngx_http_flv_base_alloc_tag_mem(stream->tag_buf_len);
         
         if (stream->aac_conf_tag) {
-            stream->aac_conf_tag->buf->pos = stream->aac_conf_tag->buf->last;
+            stream->aac_conf_tag->buf->pos = stream->aac_conf_tag->buf->start;
+            stream->aac_conf_tag->buf->last = stream->aac_conf_tag->buf->start;
             stream->aac_tag_size = 0;
         } else {
             return NGX_ERROR;
@@ -616,11 +686,16 @@ ngx_http_flv_perpare_header(ngx_rtmp_session_t *session, void *ctx, ngx_rtmp_hea
     // 缓存 AVC
     // video header tag
     if (has_video && codec_ctx->avc_header) {
+        if (stream->avc_conf_tag && ngx_rtmp_ref(stream->avc_conf_tag) > 1) {
+            ngx_http_flv_free_tag_mem(stream->avc_conf_tag);
+            stream->avc_conf_tag = NULL;
+        }
         if ( stream->avc_conf_tag == NULL)
             stream->avc_conf_tag = ngx_http_flv_base_alloc_tag_mem(stream->tag_buf_len);
         
-        if (stream->aac_conf_tag) {
-            stream->avc_conf_tag->buf->pos = stream->avc_conf_tag->buf->last;
+        if (stream->avc_conf_tag) {
+            stream->avc_conf_tag->buf->pos = stream->avc_conf_tag->buf->start;
+            stream->avc_conf_tag->buf->last = stream->avc_conf_tag->buf->start;
             stream->avc_tag_size = 0;
         } else {
             return NGX_ERROR;
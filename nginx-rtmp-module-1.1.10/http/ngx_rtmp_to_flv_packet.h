@@ -16,13 +16,34 @@ ngx_chain_t* ngx_http_flv_perpare_video_header(ngx_rtmp_session_t *s, ngx_rtmp_h
 ngx_chain_t* ngx_http_flv_perpare_audio_header(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h
                                         ,ngx_chain_t *out);
 
+// tag内存按2的幂分级缓存, 每个worker一份空闲链表, 在所有流之间复用
+#define NGX_HTTP_FLV_POOL_MIN_SHIFT     8       /* 256B */
+#define NGX_HTTP_FLV_POOL_MAX_SHIFT     20      /* 1M, 更大的tag直接malloc */
+#define NGX_HTTP_FLV_POOL_CLASSES       (NGX_HTTP_FLV_POOL_MAX_SHIFT - NGX_HTTP_FLV_POOL_MIN_SHIFT + 1)
+#define NGX_HTTP_FLV_POOL_MAX_CACHED    (64 * 1024 * 1024)  /* 空闲链表最多保留的字节数 */
+
+typedef struct {
+    ngx_uint_t      tag_alloc;          //tag申请次数
+    ngx_uint_t      tag_hit;            //从空闲链表命中的次数
+    size_t          bytes_in_use;       //正在使用的tag内存
+    size_t          bytes_in_use_max;   //bytes_in_use的最高值
+    size_t          bytes_cached;       //空闲链表中的tag内存
+    ngx_uint_t      frame_alloc;        //帧节点申请次数
+    ngx_uint_t      frame_hit;          //帧节点从空闲链表命中的次数
+    ngx_uint_t      frames_in_use;
+    ngx_uint_t      frames_in_use_max;
+} ngx_http_flv_pool_stat_t;
+
+extern ngx_http_flv_pool_stat_t ngx_http_flv_pool_stat;
+
 ngx_chain_t*  ngx_http_flv_base_alloc_tag_mem(size_t mem_size);
 
 ngx_chain_t*  ngx_http_flv_alloc_tag_mem(ngx_chain_t* in);
 
-ngx_chain_t * ngx_http_flv_copy_tag_mem(ngx_chain_t* in);
+ngx_chain_t * ngx_http_flv_acquire_tag_mem(ngx_chain_t* in); //增加引用计数, 多个观众共享同一个tag
+
 
-void ngx_http_flv_free_tag_mem(ngx_chain_t* in);
+void ngx_http_flv_free_tag_mem(ngx_chain_t* in); //减少引用计数, 最后一个引用释放内存
 
 ngx_int_t ngx_http_flv_perpare_header(ngx_rtmp_session_t *s,void * ctx,ngx_rtmp_header_t *h); //header =  flv header tag + mediadata tag + aac_tag +avc_tag
 
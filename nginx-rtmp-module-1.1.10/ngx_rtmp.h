@@ -16,6 +16,11 @@
 
 #include "ngx_rtmp_amf.h"
 #include "ngx_rtmp_bandwidth.h"
+
+
+typedef struct ngx_rtmp_codec_au_s  ngx_rtmp_codec_au_t;
+
+
 #include "ngx_rtmp_codec_module.h"
 
 
@@ -242,6 +247,7 @@ typedef struct {
     unsigned                auto_pushed:1;
     unsigned                relay:1;
     unsigned                static_relay:1;
+    unsigned                live_bus:1;     //共享内存总线的本地读者会话
 
     /* input stream 0 (reserved by RTMP spec)
      * is used as free chain link */
@@ -364,6 +370,7 @@ typedef struct ngx_rtmp_core_srv_conf_s {
     ngx_flag_t              busy;
     size_t                  out_queue;
     size_t                  out_cork;
+    size_t                  out_batch;  /* max bytes per writev, 0 - off */
     ngx_msec_t              buflen;
     ngx_msec_t              idle_up_stream_destory; // 空闲流的销毁时间
 
@@ -647,6 +654,11 @@ ngx_rtmp_is_codec_header(ngx_chain_t *in)
 }
 
 
+/* 返回in在codec模块中的解析结果, 不是当前消息时重新解析 */
+ngx_rtmp_codec_au_t *ngx_rtmp_codec_get_au(ngx_rtmp_session_t *s,
+    ngx_rtmp_header_t *h, ngx_chain_t *in);
+
+
 extern ngx_rtmp_bandwidth_t                 ngx_rtmp_bw_out;
 extern ngx_rtmp_bandwidth_t                 ngx_rtmp_bw_in;
 
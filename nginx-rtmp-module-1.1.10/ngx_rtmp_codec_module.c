@@ -30,6 +30,8 @@ static void ngx_rtmp_codec_parse_aac_header(ngx_rtmp_session_t *s,
        ngx_chain_t *in);
 static void ngx_rtmp_codec_parse_avc_header(ngx_rtmp_session_t *s,
        ngx_chain_t *in);
+static void ngx_rtmp_codec_parse_au(ngx_rtmp_session_t *s,
+       ngx_rtmp_codec_ctx_t *ctx, ngx_rtmp_header_t *h, ngx_chain_t *in);
 #if (NGX_DEBUG)
 static void ngx_rtmp_codec_dump_header(ngx_rtmp_session_t *s, const char *type,
        ngx_chain_t *in);
@@ -216,6 +218,8 @@ ngx_rtmp_codec_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         return NGX_OK;
     }
 
+    ngx_rtmp_codec_parse_au(s, ctx, h, in);
+
     fmt =  in->buf->pos[0];
     if (h->type == NGX_RTMP_MSG_AUDIO) {
         ctx->audio_codec_id = (fmt & 0xf0) >> 4;
@@ -268,6 +272,176 @@ ngx_rtmp_codec_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 }
 
 
+/* 从链中按偏移顺序读取, dst为NULL时只跳过 */
+static ngx_int_t
+ngx_rtmp_codec_read(ngx_chain_t **in, u_char **p, u_char *dst, size_t n)
+{
+    size_t  size;
+
+    while (n) {
+        while (*p == (*in)->buf->last) {
+            *in = (*in)->next;
+            if (*in == NULL) {
+                return NGX_ERROR;
+            }
+
+            *p = (*in)->buf->pos;
+        }
+
+        size = ngx_min((size_t) ((*in)->buf->last - *p), n);
+
+        if (dst) {
+            dst = ngx_cpymem(dst, *p, size);
+        }
+
+        *p += size;
+        n -= size;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_codec_parse_au(ngx_rtmp_session_t *s, ngx_rtmp_codec_ctx_t *ctx,
+    ngx_rtmp_header_t *h, ngx_chain_t *in)
+{
+    u_char                 *p, hdr[5];
+    uint32_t                offset, len;
+    ngx_uint_t              i;
+    ngx_chain_t            *cl;
+    ngx_rtmp_codec_au_t    *au;
+    ngx_rtmp_codec_nal_t   *nal;
+
+    au = &ctx->au;
+
+    if (au->nals.elts == NULL
+        && ngx_array_init(&au->nals, s->connection->pool, 16,
+                          sizeof(ngx_rtmp_codec_nal_t))
+           != NGX_OK)
+    {
+        return;
+    }
+
+    au->in = in;
+    au->type = h->type;
+    au->timestamp = h->timestamp;
+    au->cts = 0;
+    au->data = 1;
+    au->key = 0;
+    au->header = 0;
+    au->nals.nelts = 0;
+
+    au->size = 0;
+    for (cl = in; cl; cl = cl->next) {
+        au->size += (uint32_t) (cl->buf->last - cl->buf->pos);
+    }
+
+    cl = in;
+    p = in->buf->pos;
+
+    if (h->type == NGX_RTMP_MSG_AUDIO) {
+        if ((in->buf->pos[0] & 0xf0) >> 4 == NGX_RTMP_AUDIO_AAC
+            && au->size >= 2)
+        {
+            (void) ngx_rtmp_codec_read(&cl, &p, hdr, 2);
+
+            au->header = (hdr[1] == 0);
+            au->data = 2;
+        }
+
+        return;
+    }
+
+    au->key = ((in->buf->pos[0] & 0xf0) >> 4 == NGX_RTMP_VIDEO_KEY_FRAME);
+
+    if ((in->buf->pos[0] & 0x0f) != NGX_RTMP_VIDEO_H264 || au->size < 5) {
+        return;
+    }
+
+    /* AVCPacketType, CompositionTime */
+
+    (void) ngx_rtmp_codec_read(&cl, &p, hdr, 5);
+
+    au->header = (hdr[1] == 0);
+    au->cts = ((uint32_t) hdr[2] << 16) | ((uint32_t) hdr[3] << 8) | hdr[4];
+    au->data = 5;
+
+    if (hdr[1] != 1 || ctx->avc_nal_bytes == 0 || ctx->avc_nal_bytes > 4) {
+        return;
+    }
+
+    /* NAL长度前缀, 与hls原来的解析一致, 长度不完整的NAL丢弃 */
+
+    offset = 5;
+
+    while (offset + ctx->avc_nal_bytes < au->size) {
+
+        if (ngx_rtmp_codec_read(&cl, &p, hdr, ctx->avc_nal_bytes) != NGX_OK) {
+            break;
+        }
+
+        offset += ctx->avc_nal_bytes;
+
+        len = 0;
+        for (i = 0; i < ctx->avc_nal_bytes; i++) {
+            len = (len << 8) | hdr[i];
+        }
+
+        if (len == 0) {
+            continue;
+        }
+
+        if (len > au->size - offset) {
+            break;
+        }
+
+        nal = ngx_array_push(&au->nals);
+        if (nal == NULL) {
+            break;
+        }
+
+        nal->offset = offset;
+        nal->size = len;
+
+        (void) ngx_rtmp_codec_read(&cl, &p, &nal->type, 1);
+        (void) ngx_rtmp_codec_read(&cl, &p, NULL, len - 1);
+
+        offset += len;
+    }
+
+    ngx_log_debug5(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "codec: au ts=%uD cts=%uD key=%ui size=%uD nals=%ui",
+                   au->timestamp, au->cts, (ngx_uint_t) au->key, au->size,
+                   au->nals.nelts);
+}
+
+
+ngx_rtmp_codec_au_t *
+ngx_rtmp_codec_get_au(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+    ngx_chain_t *in)
+{
+    ngx_rtmp_codec_ctx_t   *ctx;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+    if (ctx == NULL || in == NULL || in->buf->pos == in->buf->last) {
+        return NULL;
+    }
+
+    if (ctx->au.in != in || ctx->au.type != h->type
+        || ctx->au.timestamp != h->timestamp)
+    {
+        ngx_rtmp_codec_parse_au(s, ctx, h, in);
+
+        if (ctx->au.in != in) {
+            return NULL;
+        }
+    }
+
+    return &ctx->au;
+}
+
+
 static void
 ngx_rtmp_codec_parse_aac_header(ngx_rtmp_session_t *s, ngx_chain_t *in)
 {
@@ -49,6 +49,31 @@ u_char * ngx_rtmp_get_audio_codec_name(ngx_uint_t id);
 u_char * ngx_rtmp_get_video_codec_name(ngx_uint_t id);
 
 
+/* H264 NAL在消息中的位置, offset从消息开始算起, 不含长度前缀 */
+typedef struct {
+    uint32_t                    offset;
+    uint32_t                    size;
+    u_char                      type;       /* NAL头字节 */
+} ngx_rtmp_codec_nal_t;
+
+
+/*
+ * 一个音视频消息的解析结果, 在ngx_rtmp_codec_av中生成一次,
+ * hls/dash/record/http-flv直接使用, 不再各自解析消息头和NAL
+ */
+struct ngx_rtmp_codec_au_s {
+    ngx_chain_t                *in;
+    ngx_uint_t                  type;       /* NGX_RTMP_MSG_AUDIO/VIDEO */
+    uint32_t                    timestamp;
+    uint32_t                    cts;
+    uint32_t                    size;       /* 消息长度 */
+    uint32_t                    data;       /* 帧数据的偏移, 跳过FLV音视频头 */
+    unsigned                    key:1;
+    unsigned                    header:1;   /* AVC/AAC序列头 */
+    ngx_array_t                 nals;       /* ngx_rtmp_codec_nal_t */
+};
+
+
 typedef struct {
     ngx_uint_t                  width;
     ngx_uint_t                  height;
@@ -78,6 +103,8 @@ typedef struct {
 
     ngx_chain_t                *meta;
     ngx_uint_t                  meta_version;
+
+    ngx_rtmp_codec_au_t         au;
 } ngx_rtmp_codec_ctx_t;
 
 
@@ -0,0 +1,660 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp_counter_module.h"
+#include "ngx_rtmp_cmd_module.h"
+
+
+static ngx_rtmp_publish_pt              next_publish;
+static ngx_rtmp_play_pt                 next_play;
+static ngx_rtmp_close_stream_pt         next_close_stream;
+
+
+static ngx_int_t ngx_rtmp_counter_postconfiguration(ngx_conf_t *cf);
+static void * ngx_rtmp_counter_create_main_conf(ngx_conf_t *cf);
+static char * ngx_rtmp_counter_init_main_conf(ngx_conf_t *cf, void *conf);
+static ngx_int_t ngx_rtmp_counter_init_process(ngx_cycle_t *cycle);
+
+
+typedef struct {
+    ngx_rtmp_counter_t                  c;
+    u_char                              name[NGX_RTMP_MAX_NAME];
+} ngx_rtmp_counter_app_t;
+
+
+/* 每个worker一个计数块, 只有该worker(以及reload时还没退出的旧worker)写 */
+typedef struct {
+    ngx_rtmp_counter_app_t              apps[NGX_RTMP_COUNTER_APPS];
+    ngx_uint_t                          nslots;
+    ngx_rtmp_counter_slot_t            *slots;
+} ngx_rtmp_counter_block_t;
+
+
+typedef struct {
+    ngx_rtmp_counter_block_t           *blocks[NGX_RTMP_COUNTER_MAX_WORKERS];
+} ngx_rtmp_counter_shctx_t;
+
+
+typedef struct {
+    size_t                              zone_size;
+    ngx_uint_t                          streams;
+    ngx_shm_zone_t                     *shm_zone;
+} ngx_rtmp_counter_main_conf_t;
+
+
+/* 汇总时的一项, 计数从共享内存中拷贝出来 */
+typedef struct {
+    u_char                             *app;
+    u_char                             *name;
+    ngx_atomic_uint_t                   v[NGX_RTMP_COUNTER_N];
+} ngx_rtmp_counter_entry_t;
+
+
+static ngx_str_t    ngx_rtmp_counter_shm_name = ngx_string("rtmp_counter");
+
+/* 本次配置的计数配置, 在master中设置, worker继承 */
+static ngx_rtmp_counter_main_conf_t    *ngx_rtmp_counter_conf;
+static ngx_slab_pool_t                 *ngx_rtmp_counter_shpool;
+static ngx_rtmp_counter_block_t        *ngx_rtmp_counter_block;
+
+
+static ngx_command_t  ngx_rtmp_counter_commands[] = {
+
+    { ngx_string("counter_zone"),
+      NGX_RTMP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_MAIN_CONF_OFFSET,
+      offsetof(ngx_rtmp_counter_main_conf_t, zone_size),
+      NULL },
+
+    { ngx_string("counter_streams"),
+      NGX_RTMP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_RTMP_MAIN_CONF_OFFSET,
+      offsetof(ngx_rtmp_counter_main_conf_t, streams),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_rtmp_module_t  ngx_rtmp_counter_module_ctx = {
+    NULL,                                   /* preconfiguration */
+    ngx_rtmp_counter_postconfiguration,     /* postconfiguration */
+    ngx_rtmp_counter_create_main_conf,      /* create main configuration */
+    ngx_rtmp_counter_init_main_conf,        /* init main configuration */
+    NULL,                                   /* create server configuration */
+    NULL,                                   /* merge server configuration */
+    NULL,                                   /* create app configuration */
+    NULL                                    /* merge app configuration */
+};
+
+
+ngx_module_t  ngx_rtmp_counter_module = {
+    NGX_MODULE_V1,
+    &ngx_rtmp_counter_module_ctx,           /* module context */
+    ngx_rtmp_counter_commands,              /* module directives */
+    NGX_RTMP_MODULE,                        /* module type */
+    NULL,                                   /* init master */
+    NULL,                                   /* init module */
+    ngx_rtmp_counter_init_process,          /* init process */
+    NULL,                                   /* init thread */
+    NULL,                                   /* exit thread */
+    NULL,                                   /* exit process */
+    NULL,                                   /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void *
+ngx_rtmp_counter_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_rtmp_counter_main_conf_t   *cmcf;
+
+    cmcf = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_counter_main_conf_t));
+    if (cmcf == NULL) {
+        return NULL;
+    }
+
+    cmcf->zone_size = NGX_CONF_UNSET_SIZE;
+    cmcf->streams = NGX_CONF_UNSET_UINT;
+
+    return cmcf;
+}
+
+
+static char *
+ngx_rtmp_counter_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_rtmp_counter_main_conf_t   *cmcf = conf;
+
+    ngx_conf_init_size_value(cmcf->zone_size, 0);
+    ngx_conf_init_uint_value(cmcf->streams, 1024);
+
+    if (cmcf->streams == 0) {
+        cmcf->streams = 1;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_rtmp_counter_t *
+ngx_rtmp_counter_app(ngx_rtmp_counter_block_t *block, ngx_str_t *app)
+{
+    ngx_rtmp_counter_app_t         *a;
+    ngx_uint_t                      n, len;
+
+    len = ngx_min(app->len, NGX_RTMP_MAX_NAME - 1);
+
+    for (n = 0; n < NGX_RTMP_COUNTER_APPS; n++) {
+        a = &block->apps[n];
+
+        if (a->name[0] == '\0') {
+            ngx_memcpy(a->name, app->data, len);
+            a->name[len] = '\0';
+            return &a->c;
+        }
+
+        if (ngx_strncmp(a->name, app->data, len) == 0
+            && a->name[len] == '\0')
+        {
+            return &a->c;
+        }
+    }
+
+    return NULL;
+}
+
+
+ngx_rtmp_counter_slot_t *
+ngx_rtmp_counter_acquire(ngx_str_t *app, ngx_str_t *name, ngx_uint_t role)
+{
+    ngx_rtmp_counter_block_t       *block;
+    ngx_rtmp_counter_slot_t        *slot, *free;
+    ngx_rtmp_counter_t             *ac;
+    ngx_uint_t                      n, i, len;
+
+    block = ngx_rtmp_counter_block;
+    if (block == NULL) {
+        return NULL;
+    }
+
+    len = ngx_min(name->len, NGX_RTMP_MAX_NAME - 1);
+    free = NULL;
+    slot = NULL;
+
+    ngx_shmtx_lock(&ngx_rtmp_counter_shpool->mutex);
+
+    ac = ngx_rtmp_counter_app(block, app);
+    if (ac == NULL) {
+        goto done;
+    }
+
+    /*
+     * 开放寻址, 释放的slot保留名字作为墓碑,
+     * 遇到从未使用过的slot说明表中没有这个流
+     */
+    i = ngx_crc32_short(name->data, len) % block->nslots;
+
+    for (n = 0; n < block->nslots; n++, i = (i + 1) % block->nslots) {
+        slot = &block->slots[i];
+
+        if (slot->name[0] == '\0') {
+            if (free == NULL) {
+                free = slot;
+            }
+            break;
+        }
+
+        if (slot->refs == 0) {
+            if (free == NULL) {
+                free = slot;
+            }
+            continue;
+        }
+
+        if (slot->app == ac
+            && slot->pid == (ngx_uint_t) ngx_pid
+            && ngx_strncmp(slot->name, name->data, len) == 0
+            && slot->name[len] == '\0')
+        {
+            goto found;
+        }
+    }
+
+    slot = free;
+    if (slot == NULL) {
+        goto done;
+    }
+
+    ngx_memzero(&slot->c, sizeof(ngx_rtmp_counter_t));
+    slot->app = ac;
+    slot->pid = (ngx_uint_t) ngx_pid;
+    ngx_memcpy(slot->app_name, app->data, ngx_min(app->len, NGX_RTMP_MAX_NAME - 1));
+    slot->app_name[ngx_min(app->len, NGX_RTMP_MAX_NAME - 1)] = '\0';
+    ngx_memcpy(slot->name, name->data, len);
+    slot->name[len] = '\0';
+
+found:
+
+    slot->refs++;
+
+    ngx_shmtx_unlock(&ngx_rtmp_counter_shpool->mutex);
+
+    ngx_rtmp_counter_add(slot, role == NGX_RTMP_COUNTER_ROLE_PUBLISHER
+                               ? NGX_RTMP_COUNTER_PUBLISHERS
+                               : NGX_RTMP_COUNTER_PLAYERS, 1);
+
+    return slot;
+
+done:
+
+    ngx_shmtx_unlock(&ngx_rtmp_counter_shpool->mutex);
+
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                  "counter: no free slot for '%V/%V'", app, name);
+
+    return NULL;
+}
+
+
+void
+ngx_rtmp_counter_release(ngx_rtmp_counter_slot_t *slot, ngx_uint_t role)
+{
+    if (slot == NULL) {
+        return;
+    }
+
+    ngx_rtmp_counter_add(slot, role == NGX_RTMP_COUNTER_ROLE_PUBLISHER
+                               ? NGX_RTMP_COUNTER_PUBLISHERS
+                               : NGX_RTMP_COUNTER_PLAYERS, -1);
+
+    ngx_shmtx_lock(&ngx_rtmp_counter_shpool->mutex);
+    slot->refs--;
+    ngx_shmtx_unlock(&ngx_rtmp_counter_shpool->mutex);
+}
+
+
+static void
+ngx_rtmp_counter_copy(ngx_rtmp_counter_entry_t *e, ngx_rtmp_counter_t *c)
+{
+    ngx_uint_t                      n;
+
+    for (n = 0; n < NGX_RTMP_COUNTER_N; n++) {
+        e->v[n] += c->v[n];
+    }
+}
+
+
+static u_char *
+ngx_rtmp_counter_strdup(ngx_pool_t *pool, u_char *src)
+{
+    ngx_str_t                       str;
+
+    str.data = src;
+    str.len = ngx_strlen(src) + 1;
+
+    return ngx_pstrdup(pool, &str);
+}
+
+
+static int ngx_libc_cdecl
+ngx_rtmp_counter_cmp(const void *one, const void *two)
+{
+    const ngx_rtmp_counter_entry_t *a = one;
+    const ngx_rtmp_counter_entry_t *b = two;
+    ngx_int_t                       rc;
+
+    rc = ngx_strcmp(a->app, b->app);
+    if (rc) {
+        return rc;
+    }
+
+    /* app自身(name为NULL)排在它的流前面 */
+    if (a->name == NULL || b->name == NULL) {
+        return (a->name != NULL) - (b->name != NULL);
+    }
+
+    return ngx_strcmp(a->name, b->name);
+}
+
+
+ngx_int_t
+ngx_rtmp_counter_walk(ngx_pool_t *pool, ngx_rtmp_counter_visit_pt visit,
+    void *data)
+{
+    ngx_rtmp_counter_shctx_t       *shctx;
+    ngx_rtmp_counter_block_t       *block;
+    ngx_rtmp_counter_slot_t        *slot;
+    ngx_rtmp_counter_entry_t       *e, *last;
+    ngx_slab_pool_t                *shpool;
+    ngx_array_t                     entries;
+    ngx_uint_t                      w, n;
+
+    if (ngx_rtmp_counter_conf == NULL
+        || ngx_rtmp_counter_conf->shm_zone == NULL)
+    {
+        return NGX_DECLINED;
+    }
+
+    shpool = (ngx_slab_pool_t *) ngx_rtmp_counter_conf->shm_zone->shm.addr;
+    shctx = ngx_rtmp_counter_conf->shm_zone->data;
+
+    if (ngx_array_init(&entries, pool, 64, sizeof(ngx_rtmp_counter_entry_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /* 只在拷贝名字和计数时持锁, 排序和输出在锁外进行 */
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (w = 0; w < NGX_RTMP_COUNTER_MAX_WORKERS; w++) {
+        block = shctx->blocks[w];
+        if (block == NULL) {
+            continue;
+        }
+
+        for (n = 0; n < NGX_RTMP_COUNTER_APPS; n++) {
+            if (block->apps[n].name[0] == '\0') {
+                break;
+            }
+
+            e = ngx_array_push(&entries);
+            if (e == NULL) {
+                goto failed;
+            }
+            ngx_memzero(e, sizeof(*e));
+            e->app = ngx_rtmp_counter_strdup(pool, block->apps[n].name);
+            if (e->app == NULL) {
+                goto failed;
+            }
+            ngx_rtmp_counter_copy(e, &block->apps[n].c);
+        }
+
+        for (n = 0; n < block->nslots; n++) {
+            slot = &block->slots[n];
+            if (slot->refs == 0) {
+                continue;
+            }
+
+            e = ngx_array_push(&entries);
+            if (e == NULL) {
+                goto failed;
+            }
+            ngx_memzero(e, sizeof(*e));
+            e->app = ngx_rtmp_counter_strdup(pool, slot->app_name);
+            e->name = ngx_rtmp_counter_strdup(pool, slot->name);
+            if (e->app == NULL || e->name == NULL) {
+                goto failed;
+            }
+            ngx_rtmp_counter_copy(e, &slot->c);
+        }
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    /* 各worker的同名app和同名流相加 */
+    ngx_qsort(entries.elts, entries.nelts, sizeof(ngx_rtmp_counter_entry_t),
+              ngx_rtmp_counter_cmp);
+
+    e = entries.elts;
+    last = NULL;
+
+    for (n = 0; n < entries.nelts; n++) {
+        if (last && ngx_rtmp_counter_cmp(last, &e[n]) == 0) {
+            for (w = 0; w < NGX_RTMP_COUNTER_N; w++) {
+                last->v[w] += e[n].v[w];
+            }
+            continue;
+        }
+
+        if (last) {
+            visit(data, last->app, last->name, last->v);
+        }
+        last = &e[n];
+    }
+
+    if (last) {
+        visit(data, last->app, last->name, last->v);
+    }
+
+    return NGX_OK;
+
+failed:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_rtmp_counter_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
+{
+    ngx_rtmp_counter_ctx_t         *ctx;
+    ngx_str_t                       name;
+
+    /* 回环推流和总线读者不是真正的上行, 不计入 */
+    if (ngx_rtmp_counter_block == NULL || s->auto_pushed) {
+        goto next;
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_counter_module);
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(s->connection->pool, sizeof(ngx_rtmp_counter_ctx_t));
+        if (ctx == NULL) {
+            goto next;
+        }
+        ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_counter_module);
+    }
+
+    if (ctx->slot == NULL) {
+        name.data = v->name;
+        name.len = ngx_strlen(v->name);
+        ctx->role = NGX_RTMP_COUNTER_ROLE_PUBLISHER;
+        ctx->slot = ngx_rtmp_counter_acquire(&s->app, &name, ctx->role);
+    }
+
+next:
+    return next_publish(s, v);
+}
+
+
+static ngx_int_t
+ngx_rtmp_counter_play(ngx_rtmp_session_t *s, ngx_rtmp_play_t *v)
+{
+    ngx_rtmp_counter_ctx_t         *ctx;
+    ngx_str_t                       name;
+
+    if (ngx_rtmp_counter_block == NULL) {
+        goto next;
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_counter_module);
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(s->connection->pool, sizeof(ngx_rtmp_counter_ctx_t));
+        if (ctx == NULL) {
+            goto next;
+        }
+        ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_counter_module);
+    }
+
+    if (ctx->slot == NULL) {
+        name.data = v->name;
+        name.len = ngx_strlen(v->name);
+        ctx->role = NGX_RTMP_COUNTER_ROLE_PLAYER;
+        ctx->slot = ngx_rtmp_counter_acquire(&s->app, &name, ctx->role);
+    }
+
+next:
+    return next_play(s, v);
+}
+
+
+static ngx_int_t
+ngx_rtmp_counter_close_stream(ngx_rtmp_session_t *s,
+    ngx_rtmp_close_stream_t *v)
+{
+    ngx_rtmp_counter_ctx_t         *ctx;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_counter_module);
+    if (ctx && ctx->slot) {
+        ngx_rtmp_counter_release(ctx->slot, ctx->role);
+        ctx->slot = NULL;
+    }
+
+    return next_close_stream(s, v);
+}
+
+
+static ngx_int_t
+ngx_rtmp_counter_shm_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_slab_pool_t                *shpool;
+    ngx_rtmp_counter_shctx_t       *shctx;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    shctx = ngx_slab_calloc(shpool, sizeof(ngx_rtmp_counter_shctx_t));
+    if (shctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = shctx;
+    shm_zone->data = shctx;
+
+    return NGX_OK;
+}
+
+
+/* 异常退出的进程来不及释放slot, 新worker启动时回收, 需要已经持有锁 */
+static void
+ngx_rtmp_counter_reap(ngx_rtmp_counter_block_t *block)
+{
+    ngx_rtmp_counter_slot_t        *slot;
+    ngx_uint_t                      n;
+
+    for (n = 0; n < block->nslots; n++) {
+        slot = &block->slots[n];
+
+        if (slot->refs == 0 || slot->pid == (ngx_uint_t) ngx_pid
+            || kill((ngx_pid_t) slot->pid, 0) == 0 || ngx_errno != NGX_ESRCH)
+        {
+            continue;
+        }
+
+        ngx_rtmp_counter_atomic_add(&slot->app->v[NGX_RTMP_COUNTER_PUBLISHERS],
+                    - (ngx_atomic_int_t) slot->c.v[NGX_RTMP_COUNTER_PUBLISHERS]);
+        ngx_rtmp_counter_atomic_add(&slot->app->v[NGX_RTMP_COUNTER_PLAYERS],
+                    - (ngx_atomic_int_t) slot->c.v[NGX_RTMP_COUNTER_PLAYERS]);
+        slot->refs = 0;
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_counter_init_process(ngx_cycle_t *cycle)
+{
+    ngx_rtmp_counter_main_conf_t   *cmcf;
+    ngx_rtmp_counter_shctx_t       *shctx;
+    ngx_rtmp_counter_block_t       *block;
+    ngx_slab_pool_t                *shpool;
+    ngx_uint_t                      worker;
+
+    cmcf = ngx_rtmp_counter_conf;
+    if (cmcf == NULL || cmcf->shm_zone == NULL) {
+        return NGX_OK;
+    }
+
+    worker = (ngx_process == NGX_PROCESS_WORKER ? ngx_worker : 0);
+    if (worker >= NGX_RTMP_COUNTER_MAX_WORKERS) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "counter: worker %ui is not counted", worker);
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) cmcf->shm_zone->shm.addr;
+    shctx = cmcf->shm_zone->data;
+
+    /* reload或worker重启后沿用同一个计数块, 累计值不会丢失 */
+    ngx_shmtx_lock(&shpool->mutex);
+
+    block = shctx->blocks[worker];
+    if (block == NULL) {
+        block = ngx_slab_calloc_locked(shpool, sizeof(ngx_rtmp_counter_block_t));
+        if (block) {
+            block->slots = ngx_slab_calloc_locked(shpool,
+                               cmcf->streams * sizeof(ngx_rtmp_counter_slot_t));
+            if (block->slots == NULL) {
+                ngx_slab_free_locked(shpool, block);
+                block = NULL;
+
+            } else {
+                block->nslots = cmcf->streams;
+                shctx->blocks[worker] = block;
+            }
+        }
+    }
+
+    if (block) {
+        ngx_rtmp_counter_reap(block);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (block == NULL) {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
+                      "counter: no memory in zone for worker %ui", worker);
+        return NGX_OK;
+    }
+
+    ngx_rtmp_counter_shpool = shpool;
+    ngx_rtmp_counter_block = block;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_counter_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_rtmp_counter_main_conf_t   *cmcf;
+
+    next_publish = ngx_rtmp_publish;
+    ngx_rtmp_publish = ngx_rtmp_counter_publish;
+
+    next_play = ngx_rtmp_play;
+    ngx_rtmp_play = ngx_rtmp_counter_play;
+
+    next_close_stream = ngx_rtmp_close_stream;
+    ngx_rtmp_close_stream = ngx_rtmp_counter_close_stream;
+
+    cmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_counter_module);
+    ngx_rtmp_counter_conf = cmcf;
+
+    if (cmcf->zone_size == 0) {
+        return NGX_OK;
+    }
+
+    cmcf->shm_zone = ngx_shared_memory_add(cf, &ngx_rtmp_counter_shm_name,
+                                           cmcf->zone_size,
+                                           &ngx_rtmp_counter_module);
+    if (cmcf->shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    cmcf->shm_zone->init = ngx_rtmp_counter_shm_init;
+
+    return NGX_OK;
+}
@@ -0,0 +1,117 @@
+
+#ifndef _NGX_RTMP_COUNTER_H_INCLUDED_
+#define _NGX_RTMP_COUNTER_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp.h"
+#include "ngx_rtmp_cmd_module.h"
+
+
+#define NGX_RTMP_COUNTER_MAX_WORKERS    64
+#define NGX_RTMP_COUNTER_APPS           32
+
+/* 计数项, 字节数和帧数只增不减, publishers/players为当前值 */
+#define NGX_RTMP_COUNTER_IN_VIDEO_BYTES     0
+#define NGX_RTMP_COUNTER_IN_AUDIO_BYTES     1
+#define NGX_RTMP_COUNTER_IN_VIDEO_FRAMES    2
+#define NGX_RTMP_COUNTER_OUT_VIDEO_BYTES    3
+#define NGX_RTMP_COUNTER_OUT_AUDIO_BYTES    4
+#define NGX_RTMP_COUNTER_OUT_VIDEO_FRAMES   5
+#define NGX_RTMP_COUNTER_DROP_VIDEO_FRAMES  6
+#define NGX_RTMP_COUNTER_PUBLISHERS         7
+#define NGX_RTMP_COUNTER_PLAYERS            8
+#define NGX_RTMP_COUNTER_N                  9
+
+#define NGX_RTMP_COUNTER_ROLE_PUBLISHER     0
+#define NGX_RTMP_COUNTER_ROLE_PLAYER        1
+
+/* 按cache line对齐, 不同worker写的计数不会落在同一行 */
+#define NGX_RTMP_COUNTER_LINE               64
+
+
+#if (NGX_HAVE_GCC_ATOMIC && defined __ATOMIC_RELAXED)
+#define ngx_rtmp_counter_atomic_add(p, v)                                     \
+    (void) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#else
+#define ngx_rtmp_counter_atomic_add(p, v)                                     \
+    (void) ngx_atomic_fetch_add(p, v)
+#endif
+
+
+typedef struct {
+    ngx_atomic_t                        v[NGX_RTMP_COUNTER_N];
+    u_char                              pad[NGX_RTMP_COUNTER_LINE * 2
+                                            - NGX_RTMP_COUNTER_N
+                                              * sizeof(ngx_atomic_t)];
+} ngx_rtmp_counter_t;
+
+
+/* 共享内存中的流计数, 同名流的所有会话共用一个slot */
+typedef struct {
+    ngx_rtmp_counter_t                  c;
+    ngx_rtmp_counter_t                 *app;
+    ngx_uint_t                          refs;
+    ngx_uint_t                          pid;    /* 占用slot的进程 */
+    u_char                              app_name[NGX_RTMP_MAX_NAME];
+    u_char                              name[NGX_RTMP_MAX_NAME];
+    u_char                              pad[NGX_RTMP_COUNTER_LINE
+                                            - 3 * sizeof(ngx_uint_t)];
+} ngx_rtmp_counter_slot_t;
+
+
+extern ngx_module_t  ngx_rtmp_counter_module;
+
+
+/* 会话的流计数slot, 没有开启counter_zone时为NULL */
+typedef struct {
+    ngx_rtmp_counter_slot_t            *slot;
+    ngx_uint_t                          role;
+} ngx_rtmp_counter_ctx_t;
+
+
+static ngx_inline void
+ngx_rtmp_counter_add(ngx_rtmp_counter_slot_t *slot, ngx_uint_t n,
+    ngx_atomic_int_t v)
+{
+    if (slot == NULL) {
+        return;
+    }
+
+    ngx_rtmp_counter_atomic_add(&slot->c.v[n], v);
+    ngx_rtmp_counter_atomic_add(&slot->app->v[n], v);
+}
+
+
+static ngx_inline ngx_rtmp_counter_slot_t *
+ngx_rtmp_counter_session(ngx_rtmp_session_t *s)
+{
+    ngx_rtmp_counter_ctx_t             *ctx;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_counter_module);
+
+    return ctx ? ctx->slot : NULL;
+}
+
+
+/* 在本worker的计数块中找到或占用流的slot, 并增加对应角色的当前值 */
+ngx_rtmp_counter_slot_t *
+ngx_rtmp_counter_acquire(ngx_str_t *app, ngx_str_t *name, ngx_uint_t role);
+
+void
+ngx_rtmp_counter_release(ngx_rtmp_counter_slot_t *slot, ngx_uint_t role);
+
+/*
+ * 汇总所有worker的计数, 每个app回调一次(name为NULL), 之后是该app下的流,
+ * 同名流在各worker的计数相加, 返回NGX_DECLINED表示没有开启counter_zone
+ */
+typedef void (*ngx_rtmp_counter_visit_pt)(void *data, u_char *app,
+        u_char *name, ngx_atomic_uint_t *v);
+
+ngx_int_t
+ngx_rtmp_counter_walk(ngx_pool_t *pool, ngx_rtmp_counter_visit_pt visit,
+        void *data);
+
+
+#endif /* _NGX_RTMP_COUNTER_H_INCLUDED_ */
@@ -24,6 +24,16 @@ void ngx_printf_log(char* module,char* function,char* action, ...)
 #endif
 }
 
+// 每发送1MB数据消耗的系统调用次数
+static ngx_uint_t
+ngx_rtmp_edge_syscalls_per_mb(ngx_uint_t calls, ngx_uint_t bytes)
+{
+    if (bytes == 0) {
+        return 0;
+    }
+    return calls * 1024 * 1024 / bytes;
+}
+
 void 
 ngx_rtmp_edge_log(ngx_uint_t proType, ngx_uint_t logType, void *ss, ngx_uint_t current_ts)
 {
@@ -65,7 +75,7 @@ ngx_rtmp_edge_log(ngx_uint_t proType, ngx_uint_t logType, void *ss, ngx_uint_t c
             } 
             break;
         case NGX_EDGE_PULL_WATCH:
-            szformat = "EDGE{\"_type\":\"v2.edgePullWatch\",\"timestamp\":%l,\"session\":\"%s\",\"clientIP\":\"%V\",\"serverIP\":\"%V\",\"host\":\"%V\",\"name\":\"%V\",\"protocolType\":\"%s\",\"body\":{\"pullUrl\":\"%V\",\"pts\":%l,\"videoSize\":%l,\"audioSize\":%l,\"delay\":%l,\"sendFrame\":%l,\"dropVideoFrame\":%l,\"cacheVideoFrame\":%l,\"cacheMaxDuration\":%l,\"delay_AV\":%l,\"sysDuration\":%l,\"dataDuration\":%l}}EDGE";
+            szformat = "EDGE{\"_type\":\"v2.edgePullWatch\",\"timestamp\":%l,\"session\":\"%s\",\"clientIP\":\"%V\",\"serverIP\":\"%V\",\"host\":\"%V\",\"name\":\"%V\",\"protocolType\":\"%s\",\"body\":{\"pullUrl\":\"%V\",\"pts\":%l,\"videoSize\":%l,\"audioSize\":%l,\"delay\":%l,\"sendFrame\":%l,\"dropVideoFrame\":%l,\"cacheVideoFrame\":%l,\"cacheMaxDuration\":%l,\"delay_AV\":%l,\"sysDuration\":%l,\"dataDuration\":%l,\"syscallsPerMB\":%l}}EDGE";
             if (proType == NGX_EDGE_RTMP) {
                 s = (ngx_rtmp_session_t *)ss;
                 if ( global_log == NULL && s->connection && s->connection->log ) {
@@ -77,7 +87,7 @@ ngx_rtmp_edge_log(ngx_uint_t proType, ngx_uint_t logType, void *ss, ngx_uint_t c
                             ngx_edge_type[proType], &s->pull_url, s->stream_ts,   
                             s->recv_video_size - s->lrecv_video_size, 
                             s->recv_audio_size - s->lrecv_audio_size, s->delta, 
-                            s->recv_video_frame - s->lrecv_video_frame, 0,0,0,0,0,0);
+                            s->recv_video_frame - s->lrecv_video_frame, 0,0,0,0,0,0,0);
                 }
             } else if (proType == NGX_EDGE_HTTP ) {
                 pr = (ngx_http_live_play_request_ctx_t *)ss;
@@ -92,14 +102,16 @@ ngx_rtmp_edge_log(ngx_uint_t proType, ngx_uint_t logType, void *ss, ngx_uint_t c
                             pr->recv_audio_size - pr->lrecv_audio_size, pr->cache_time_duration, 
                             pr->recv_video_frame - pr->lrecv_video_frame, 
                             pr->dropVideoFrame, pr->cacheVideoFrame,pr->cache_max_duration,pr->audio_pts - pr->video_pts
-                            ,pr->current_ts - pr->system_first_pts,pr->stream_ts-pr->data_first_pts);
+                            ,pr->current_ts - pr->system_first_pts,pr->stream_ts-pr->data_first_pts,
+                            ngx_rtmp_edge_syscalls_per_mb(pr->send_syscalls - pr->lsend_syscalls,
+                                pr->send_bytes - pr->lsend_bytes));
                 }
             } else {
                 return;
             } 
             break;
         case NGX_EDGE_PULL_STOP:
-            szformat = "EDGE{\"_type\":\"v2.edgePullStop\",\"timestamp\":%l,\"session\":\"%s\",\"clientIP\":\"%V\",\"serverIP\":\"%V\",\"host\":\"%V\",\"name\":\"%V\",\"protocolType\":\"%s\",\"body\":{\"pullUrl\":\"%V\",\"duration\":%l,\"statusCode\":%l,\"videoSize\":%l,\"audioSize\":%l,\"allDropFrame\":%l,\"cacheMaxDuration\":%l}}EDGE";
+            szformat = "EDGE{\"_type\":\"v2.edgePullStop\",\"timestamp\":%l,\"session\":\"%s\",\"clientIP\":\"%V\",\"serverIP\":\"%V\",\"host\":\"%V\",\"name\":\"%V\",\"protocolType\":\"%s\",\"body\":{\"pullUrl\":\"%V\",\"duration\":%l,\"statusCode\":%l,\"videoSize\":%l,\"audioSize\":%l,\"allDropFrame\":%l,\"cacheMaxDuration\":%l,\"syscallsPerMB\":%l}}EDGE";
             if (proType == NGX_EDGE_RTMP) {
                 s = (ngx_rtmp_session_t *)ss;
                 if ( global_log == NULL && s->connection && s->connection->log ) {
@@ -109,7 +121,7 @@ ngx_rtmp_edge_log(ngx_uint_t proType, ngx_uint_t logType, void *ss, ngx_uint_t c
                     ngx_log_error(NGX_LOG_INFO, global_log, 0, szformat, current_ts, s->uuid,
                             &s->client_ip, &s->server_ip, &s->host, &s->name, 
                             ngx_edge_type[proType], &s->pull_url, 0, 
-                            s->status_code, s->recv_video_size, s->recv_audio_size, s->dropVideoFrame);
+                            s->status_code, s->recv_video_size, s->recv_audio_size, s->dropVideoFrame, 0, 0);
                 }
             } else if (proType == NGX_EDGE_HTTP) {
                 pr = (ngx_http_live_play_request_ctx_t *)ss;
@@ -121,7 +133,8 @@ ngx_rtmp_edge_log(ngx_uint_t proType, ngx_uint_t logType, void *ss, ngx_uint_t c
                             &pr->client_ip, &pr->server_ip, &pr->host, &pr->stream, 
                             ngx_edge_type[proType], &pr->pull_url, pr->current_ts-pr->request_ts, 
                             pr->status_code, pr->recv_video_size, 
-                            pr->recv_audio_size, pr->dropVideoFrame,pr->cache_max_duration);
+                            pr->recv_audio_size, pr->dropVideoFrame,pr->cache_max_duration,
+                            ngx_rtmp_edge_syscalls_per_mb(pr->send_syscalls, pr->send_bytes));
                 }
             } else {
                 return;
@@ -9,6 +9,7 @@
 #include "ngx_rtmp_play_module.h"
 #include "ngx_rtmp_codec_module.h"
 #include "ngx_rtmp_streams.h"
+#include "ngx_rtmp_record_module.h"
 
 
 static ngx_int_t ngx_rtmp_flv_postconfiguration(ngx_conf_t *cf);
@@ -216,6 +217,7 @@ ngx_rtmp_flv_timestamp_to_offset(ngx_rtmp_session_t *s, ngx_file_t *f,
     ngx_rtmp_flv_ctx_t             *ctx;
     ssize_t                         n, size;
     ngx_uint_t                      offset, index, ret, nelts;
+    off_t                           index_offset;
     double                          v;
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_flv_module);
@@ -233,12 +235,28 @@ ngx_rtmp_flv_timestamp_to_offset(ngx_rtmp_session_t *s, ngx_file_t *f,
         ctx->meta_read = 1;
     }
 
-    if (timestamp <= 0 || ctx->filepositions.nelts == 0
-                       || ctx->times.nelts == 0)
-    {
+    if (timestamp <= 0) {
         goto rewind;
     }
 
+    if (ctx->filepositions.nelts == 0 || ctx->times.nelts == 0) {
+
+        /* no keyframes metadata, try the recorder's index */
+
+        if (ngx_rtmp_record_index_lookup(&f->name, (uint32_t) timestamp,
+                                         &index_offset, s->connection->log)
+            != NGX_OK || index_offset < NGX_RTMP_FLV_DATA_OFFSET)
+        {
+            goto rewind;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                      "flv: lookup index file timestamp=%i offset=%O",
+                       timestamp, index_offset);
+
+        return (ngx_int_t) index_offset;
+    }
+
     /* read index table from file given offset */
     offset = NGX_RTMP_FLV_DATA_OFFSET + NGX_RTMP_FLV_TAG_HEADER +
              ctx->times.offset;
@@ -500,12 +500,67 @@ ngx_rtmp_recv(ngx_event_t *rev)
 }
 
 
+/* Gather queued messages starting at out_chain/out_bpos into a single
+ * writev(); at most NGX_IOVS_PREALLOCATE links and limit bytes */
+static ssize_t
+ngx_rtmp_send_batch(ngx_rtmp_session_t *s, size_t limit, size_t *size)
+{
+    struct iovec                iovs[NGX_IOVS_PREALLOCATE];
+    ngx_iovec_t                 vec;
+    ngx_chain_t                *cl;
+    u_char                     *pos;
+    size_t                      idx, len;
+
+    vec.iovs = iovs;
+    vec.count = 0;
+    vec.size = 0;
+    vec.nalloc = NGX_IOVS_PREALLOCATE;
+
+    cl = s->out_chain;
+    pos = s->out_bpos;
+    idx = s->out_pos;
+
+    for ( ;; ) {
+        len = cl->buf->last - pos;
+        if (len > limit - vec.size) {
+            len = limit - vec.size;
+        }
+
+        if (len) {
+            iovs[vec.count].iov_base = (void *) pos;
+            iovs[vec.count].iov_len = len;
+            vec.count++;
+            vec.size += len;
+        }
+
+        if (vec.count == vec.nalloc || vec.size >= limit) {
+            break;
+        }
+
+        cl = cl->next;
+        if (cl == NULL) {
+            idx = (idx + 1) % s->out_queue;
+            if (idx == s->out_last) {
+                break;
+            }
+            cl = s->out[idx];
+        }
+        pos = cl->buf->pos;
+    }
+
+    *size = vec.size;
+
+    return ngx_writev(s->connection, &vec);
+}
+
+
 static void
 ngx_rtmp_send(ngx_event_t *wev)
 {
     ngx_connection_t           *c;
     ngx_rtmp_session_t         *s;
-    ngx_int_t                   n;
+    ssize_t                     n;
+    size_t                      size, sent, rest;
     ngx_rtmp_core_srv_conf_t   *cscf;
 
     c = wev->data;
@@ -533,8 +588,16 @@ ngx_rtmp_send(ngx_event_t *wev)
         s->out_bpos = s->out_chain->buf->pos;
     }
 
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
     while (s->out_chain) {
-        n = c->send(c, s->out_bpos, s->out_chain->buf->last - s->out_bpos);
+        if (cscf->out_batch) {
+            n = ngx_rtmp_send_batch(s, cscf->out_batch, &size);
+
+        } else {
+            size = s->out_chain->buf->last - s->out_bpos;
+            n = c->send(c, s->out_bpos, size);
+        }
 
         if (n == NGX_AGAIN || n == 0) {
             ngx_add_timer(c->write, s->timeout);
@@ -554,11 +617,19 @@ ngx_rtmp_send(ngx_event_t *wev)
         s->out_bytes += n;
         s->ping_reset = 1;
         ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_out, n);
-        s->out_bpos += n;
-        if (s->out_bpos == s->out_chain->buf->last) {
+
+        /* advance over sent links, possibly spanning several messages */
+        sent = n;
+        while (sent) {
+            rest = s->out_chain->buf->last - s->out_bpos;
+            if (sent < rest) {
+                s->out_bpos += sent;
+                break;
+            }
+
+            sent -= rest;
             s->out_chain = s->out_chain->next;
             if (s->out_chain == NULL) {
-                cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
                 ngx_rtmp_free_shared_chain(cscf, s->out[s->out_pos]);
                 ++s->out_pos;
                 s->out_pos %= s->out_queue;
@@ -569,6 +640,17 @@ ngx_rtmp_send(ngx_event_t *wev)
             }
             s->out_bpos = s->out_chain->buf->pos;
         }
+
+        if ((size_t) n < size) {
+            /* socket buffer is full */
+            c->write->ready = 0;
+            ngx_add_timer(c->write, s->timeout);
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                s->status_code = ngx_rtmp_handler_send_write_err;
+                ngx_rtmp_finalize_session(s);
+            }
+            return;
+        }
     }
 
     if (wev->active) {
@@ -0,0 +1,1236 @@
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include "ngx_rtmp_live_bus_module.h"
+#include "ngx_rtmp_live_module.h"
+#include "ngx_rtmp_cmd_module.h"
+#include "ngx_rtmp_codec_module.h"
+#include "ngx_rtmp_edge_log.h"
+
+
+static ngx_rtmp_publish_pt              next_publish;
+static ngx_rtmp_play_pt                 next_play;
+static ngx_rtmp_close_stream_pt         next_close_stream;
+
+
+static ngx_int_t ngx_rtmp_live_bus_postconfiguration(ngx_conf_t *cf);
+static void * ngx_rtmp_live_bus_create_main_conf(ngx_conf_t *cf);
+static void * ngx_rtmp_live_bus_create_app_conf(ngx_conf_t *cf);
+static char * ngx_rtmp_live_bus_merge_app_conf(ngx_conf_t *cf,
+       void *parent, void *child);
+static void ngx_rtmp_live_bus_poll(ngx_event_t *ev);
+
+
+#define NGX_RTMP_LIVE_BUS_HDR_META      0
+#define NGX_RTMP_LIVE_BUS_HDR_VIDEO     1
+#define NGX_RTMP_LIVE_BUS_HDR_AUDIO     2
+#define NGX_RTMP_LIVE_BUS_NHDR          3
+
+#define NGX_RTMP_LIVE_BUS_REC_SIZE(mlen)                                      \
+    ngx_align(sizeof(ngx_rtmp_live_bus_rec_t) + (mlen), 8)
+
+
+/* 环中每条消息的头, 后面紧跟消息体 */
+typedef struct {
+    uint32_t                            mlen;
+    uint32_t                            timestamp;
+    uint8_t                             type;
+    uint8_t                             key;
+    uint8_t                             reserved[6];
+} ngx_rtmp_live_bus_rec_t;
+
+
+typedef struct ngx_rtmp_live_bus_stream_s ngx_rtmp_live_bus_stream_t;
+
+/* 共享内存中的流, 推流worker单写, 其他worker各自维护读位置 */
+struct ngx_rtmp_live_bus_stream_s {
+    ngx_rtmp_live_bus_stream_t         *next;
+    u_char                              app[NGX_RTMP_MAX_NAME];
+    u_char                              name[NGX_RTMP_MAX_NAME];
+    ngx_pid_t                           pid;
+    ngx_uint_t                          generation;
+    ngx_uint_t                          refs;
+    ngx_uint_t                          active;
+
+    /* 写入的总字节数和最近关键帧的位置, 只增不减;
+     * reserve是正在写入的消息的结束位置, 写之前先于head推进 */
+    ngx_atomic_t                        head;
+    ngx_atomic_t                        reserve;
+    ngx_atomic_t                        key_pos;
+    ngx_atomic_t                        has_key;
+
+    size_t                              size;
+    u_char                             *data;
+
+    /* 编码头和metadata, 新加入的读者先收到这些, 受slab锁保护 */
+    ngx_rtmp_live_bus_rec_t             hdr[NGX_RTMP_LIVE_BUS_NHDR];
+    u_char                             *hdr_data[NGX_RTMP_LIVE_BUS_NHDR];
+};
+
+
+typedef struct {
+    ngx_rtmp_live_bus_stream_t         *streams;
+} ngx_rtmp_live_bus_shctx_t;
+
+
+typedef struct {
+    size_t                              zone_size;
+    ngx_shm_zone_t                     *shm_zone;
+} ngx_rtmp_live_bus_main_conf_t;
+
+
+typedef struct {
+    ngx_flag_t                          bus;
+    size_t                              buffer;
+    ngx_msec_t                          poll;
+    ngx_msec_t                          idle;
+} ngx_rtmp_live_bus_app_conf_t;
+
+
+typedef struct {
+    ngx_rtmp_session_t                 *session;
+    ngx_rtmp_live_bus_stream_t         *stream;
+    ngx_uint_t                          generation;
+    unsigned                            reader:1;
+    unsigned                            synced:1;
+
+    /* 读者 */
+    ngx_atomic_uint_t                   pos;
+    ngx_atomic_uint_t                   last_head;
+    ngx_atomic_uint_t                   skipped;
+    ngx_event_t                         poll_evt;
+    ngx_msec_t                          last_data;
+    ngx_msec_t                          last_busy;
+    uint32_t                            busy_time;
+    u_char                             *buf;
+    size_t                              buf_size;
+} ngx_rtmp_live_bus_ctx_t;
+
+
+static ngx_str_t    ngx_rtmp_live_bus_shm_name = ngx_string("rtmp_live_bus");
+
+
+static ngx_command_t  ngx_rtmp_live_bus_commands[] = {
+
+    { ngx_string("live_bus_zone"),
+      NGX_RTMP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_MAIN_CONF_OFFSET,
+      offsetof(ngx_rtmp_live_bus_main_conf_t, zone_size),
+      NULL },
+
+    { ngx_string("live_bus"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_live_bus_app_conf_t, bus),
+      NULL },
+
+    { ngx_string("live_bus_buffer"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_live_bus_app_conf_t, buffer),
+      NULL },
+
+    { ngx_string("live_bus_poll"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_live_bus_app_conf_t, poll),
+      NULL },
+
+    { ngx_string("live_bus_idle"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_live_bus_app_conf_t, idle),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_rtmp_module_t  ngx_rtmp_live_bus_module_ctx = {
+    NULL,                                   /* preconfiguration */
+    ngx_rtmp_live_bus_postconfiguration,    /* postconfiguration */
+    ngx_rtmp_live_bus_create_main_conf,     /* create main configuration */
+    NULL,                                   /* init main configuration */
+    NULL,                                   /* create server configuration */
+    NULL,                                   /* merge server configuration */
+    ngx_rtmp_live_bus_create_app_conf,      /* create app configuration */
+    ngx_rtmp_live_bus_merge_app_conf        /* merge app configuration */
+};
+
+
+ngx_module_t  ngx_rtmp_live_bus_module = {
+    NGX_MODULE_V1,
+    &ngx_rtmp_live_bus_module_ctx,          /* module context */
+    ngx_rtmp_live_bus_commands,             /* module directives */
+    NGX_RTMP_MODULE,                        /* module type */
+    NULL,                                   /* init master */
+    NULL,                                   /* init module */
+    NULL,                                   /* init process */
+    NULL,                                   /* init thread */
+    NULL,                                   /* exit thread */
+    NULL,                                   /* exit process */
+    NULL,                                   /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void *
+ngx_rtmp_live_bus_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_rtmp_live_bus_main_conf_t  *bmcf;
+
+    bmcf = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_live_bus_main_conf_t));
+    if (bmcf == NULL) {
+        return NULL;
+    }
+
+    bmcf->zone_size = NGX_CONF_UNSET_SIZE;
+
+    return bmcf;
+}
+
+
+static void *
+ngx_rtmp_live_bus_create_app_conf(ngx_conf_t *cf)
+{
+    ngx_rtmp_live_bus_app_conf_t   *bacf;
+
+    bacf = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_live_bus_app_conf_t));
+    if (bacf == NULL) {
+        return NULL;
+    }
+
+    bacf->bus = NGX_CONF_UNSET;
+    bacf->buffer = NGX_CONF_UNSET_SIZE;
+    bacf->poll = NGX_CONF_UNSET_MSEC;
+    bacf->idle = NGX_CONF_UNSET_MSEC;
+
+    return bacf;
+}
+
+
+static char *
+ngx_rtmp_live_bus_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_rtmp_live_bus_app_conf_t *prev = parent;
+    ngx_rtmp_live_bus_app_conf_t *conf = child;
+
+    ngx_conf_merge_value(conf->bus, prev->bus, 0);
+    ngx_conf_merge_size_value(conf->buffer, prev->buffer, 4 * 1024 * 1024);
+    ngx_conf_merge_msec_value(conf->poll, prev->poll, 20);
+    ngx_conf_merge_msec_value(conf->idle, prev->idle, 10000);
+
+    if (conf->buffer < 64 * 1024) {
+        conf->buffer = 64 * 1024;
+    }
+
+    if (conf->poll == 0) {
+        conf->poll = 1;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_slab_pool_t *
+ngx_rtmp_live_bus_shpool(void **main_conf)
+{
+    ngx_rtmp_live_bus_main_conf_t  *bmcf;
+
+    bmcf = main_conf[ngx_rtmp_live_bus_module.ctx_index];
+    if (bmcf == NULL || bmcf->shm_zone == NULL) {
+        return NULL;
+    }
+
+    return (ngx_slab_pool_t *) bmcf->shm_zone->shm.addr;
+}
+
+
+/* 以下几个函数都要求已经持有slab锁 */
+
+static ngx_rtmp_live_bus_stream_t *
+ngx_rtmp_live_bus_find(ngx_slab_pool_t *shpool, ngx_str_t *app, u_char *name)
+{
+    ngx_rtmp_live_bus_shctx_t      *shctx;
+    ngx_rtmp_live_bus_stream_t     *st;
+
+    shctx = shpool->data;
+
+    for (st = shctx->streams; st; st = st->next) {
+        if (ngx_strlen(st->app) == app->len
+            && ngx_strncmp(st->app, app->data, app->len) == 0
+            && ngx_strcmp(st->name, name) == 0)
+        {
+            return st;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_rtmp_live_bus_clear_headers(ngx_slab_pool_t *shpool,
+       ngx_rtmp_live_bus_stream_t *st)
+{
+    ngx_uint_t  n;
+
+    for (n = 0; n < NGX_RTMP_LIVE_BUS_NHDR; n++) {
+        if (st->hdr_data[n]) {
+            ngx_slab_free_locked(shpool, st->hdr_data[n]);
+            st->hdr_data[n] = NULL;
+        }
+        st->hdr[n].mlen = 0;
+    }
+}
+
+
+static void
+ngx_rtmp_live_bus_release(ngx_slab_pool_t *shpool,
+       ngx_rtmp_live_bus_stream_t *st)
+{
+    ngx_rtmp_live_bus_shctx_t      *shctx;
+    ngx_rtmp_live_bus_stream_t    **pst;
+
+    if (st->active || st->refs) {
+        return;
+    }
+
+    shctx = shpool->data;
+
+    for (pst = &shctx->streams; *pst; pst = &(*pst)->next) {
+        if (*pst == st) {
+            *pst = st->next;
+            break;
+        }
+    }
+
+    ngx_rtmp_live_bus_clear_headers(shpool, st);
+
+    if (st->data) {
+        ngx_slab_free_locked(shpool, st->data);
+    }
+
+    ngx_slab_free_locked(shpool, st);
+}
+
+
+/* 环的读写, pos是不回绕的总字节位置 */
+
+static void
+ngx_rtmp_live_bus_ring_write(ngx_rtmp_live_bus_stream_t *st,
+       ngx_atomic_uint_t pos, u_char *p, size_t len)
+{
+    size_t  off, n;
+
+    off = pos % st->size;
+    n = ngx_min(len, st->size - off);
+
+    ngx_memcpy(st->data + off, p, n);
+    if (n < len) {
+        ngx_memcpy(st->data, p + n, len - n);
+    }
+}
+
+
+static void
+ngx_rtmp_live_bus_ring_read(ngx_rtmp_live_bus_stream_t *st,
+       ngx_atomic_uint_t pos, u_char *p, size_t len)
+{
+    size_t  off, n;
+
+    off = pos % st->size;
+    n = ngx_min(len, st->size - off);
+
+    ngx_memcpy(p, st->data + off, n);
+    if (n < len) {
+        ngx_memcpy(p + n, st->data, len - n);
+    }
+}
+
+
+static ngx_rtmp_live_bus_ctx_t *
+ngx_rtmp_live_bus_writer(ngx_rtmp_session_t *s)
+{
+    ngx_rtmp_live_bus_ctx_t    *ctx;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_bus_module);
+    if (ctx == NULL || ctx->reader || ctx->stream == NULL) {
+        return NULL;
+    }
+
+    return ctx;
+}
+
+
+static void
+ngx_rtmp_live_bus_write(ngx_rtmp_session_t *s, ngx_rtmp_live_bus_ctx_t *ctx,
+       ngx_rtmp_header_t *h, ngx_chain_t *in, u_char *prefix, size_t plen,
+       ngx_int_t hdr, unsigned key)
+{
+    ngx_rtmp_live_bus_stream_t     *st;
+    ngx_rtmp_live_bus_rec_t         rec;
+    ngx_slab_pool_t                *shpool;
+    ngx_atomic_uint_t               head, pos;
+    ngx_chain_t                    *cl;
+    size_t                          mlen, n;
+    u_char                         *p;
+
+    st = ctx->stream;
+
+    mlen = plen;
+    for (cl = in; cl; cl = cl->next) {
+        mlen += cl->buf->last - cl->buf->pos;
+    }
+
+    if (NGX_RTMP_LIVE_BUS_REC_SIZE(mlen) > st->size / 2) {
+        ngx_log_error(NGX_LOG_WARN, s->connection->log, 0,
+                      "live bus: message too big for bus buffer: %uz", mlen);
+        return;
+    }
+
+    ngx_memzero(&rec, sizeof(rec));
+    rec.mlen = (uint32_t) mlen;
+    rec.timestamp = h->timestamp;
+    rec.type = h->type;
+    rec.key = key;
+
+    if (hdr != NGX_ERROR) {
+        // 编码头另存一份, 新读者加入时先下发
+        shpool = ngx_rtmp_live_bus_shpool(s->main_conf);
+
+        ngx_shmtx_lock(&shpool->mutex);
+
+        if (st->hdr_data[hdr]) {
+            ngx_slab_free_locked(shpool, st->hdr_data[hdr]);
+            st->hdr[hdr].mlen = 0;
+        }
+
+        st->hdr_data[hdr] = ngx_slab_alloc_locked(shpool, mlen ? mlen : 1);
+        if (st->hdr_data[hdr]) {
+            p = ngx_cpymem(st->hdr_data[hdr], prefix, plen);
+            for (cl = in; cl; cl = cl->next) {
+                p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+            }
+            st->hdr[hdr] = rec;
+        }
+
+        ngx_shmtx_unlock(&shpool->mutex);
+    }
+
+    head = st->head;
+
+    // 先声明要覆盖的区域, 读者拷贝前后检查reserve判断数据是否被覆盖
+    st->reserve = head + NGX_RTMP_LIVE_BUS_REC_SIZE(mlen);
+    ngx_memory_barrier();
+
+    pos = head;
+    ngx_rtmp_live_bus_ring_write(st, pos, (u_char *) &rec, sizeof(rec));
+    pos += sizeof(rec);
+
+    if (plen) {
+        ngx_rtmp_live_bus_ring_write(st, pos, prefix, plen);
+        pos += plen;
+    }
+
+    for (cl = in; cl; cl = cl->next) {
+        n = cl->buf->last - cl->buf->pos;
+        ngx_rtmp_live_bus_ring_write(st, pos, cl->buf->pos, n);
+        pos += n;
+    }
+
+    // 数据写完后再发布新的head, 读者看到head时数据一定已经完整
+    ngx_memory_barrier();
+
+    st->head = head + NGX_RTMP_LIVE_BUS_REC_SIZE(mlen);
+
+    if (key) {
+        st->key_pos = head;
+        st->has_key = 1;
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+        ngx_chain_t *in)
+{
+    ngx_rtmp_live_bus_ctx_t        *ctx;
+    ngx_rtmp_codec_ctx_t           *codec_ctx;
+    ngx_int_t                       hdr;
+    unsigned                        key;
+
+    ctx = ngx_rtmp_live_bus_writer(s);
+    if (ctx == NULL || in == NULL || in->buf == NULL) {
+        return NGX_OK;
+    }
+
+    hdr = NGX_ERROR;
+    key = 0;
+
+    codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+
+    if (h->type == NGX_RTMP_MSG_VIDEO) {
+        key = (ngx_rtmp_get_video_frame_type(in) == NGX_RTMP_VIDEO_KEY_FRAME);
+
+        if (codec_ctx && codec_ctx->video_codec_id == NGX_RTMP_VIDEO_H264
+            && ngx_rtmp_is_codec_header(in))
+        {
+            hdr = NGX_RTMP_LIVE_BUS_HDR_VIDEO;
+            key = 0;
+        }
+
+    } else {
+        if (codec_ctx && codec_ctx->audio_codec_id == NGX_RTMP_AUDIO_AAC
+            && ngx_rtmp_is_codec_header(in))
+        {
+            hdr = NGX_RTMP_LIVE_BUS_HDR_AUDIO;
+        }
+    }
+
+    ngx_rtmp_live_bus_write(s, ctx, h, in, NULL, 0, hdr, key);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_meta(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+        ngx_chain_t *in)
+{
+    ngx_rtmp_live_bus_ctx_t        *ctx;
+    ngx_rtmp_header_t               mh;
+    u_char                          prefix[3 + sizeof("@setDataFrame") - 1];
+
+    ctx = ngx_rtmp_live_bus_writer(s);
+    if (ctx == NULL || in == NULL || in->buf == NULL) {
+        return NGX_OK;
+    }
+
+    // amf分发时已经跳过了函数名, 补回一个@setDataFrame让读者端按同样路径解析
+    prefix[0] = NGX_RTMP_AMF_STRING;
+    prefix[1] = 0;
+    prefix[2] = sizeof("@setDataFrame") - 1;
+    ngx_memcpy(prefix + 3, "@setDataFrame", sizeof("@setDataFrame") - 1);
+
+    mh = *h;
+    mh.type = NGX_RTMP_MSG_AMF_META;
+
+    ngx_rtmp_live_bus_write(s, ctx, &mh, in, prefix, sizeof(prefix),
+                            NGX_RTMP_LIVE_BUS_HDR_META, 0);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_live_bus_open(ngx_rtmp_session_t *s, u_char *name)
+{
+    ngx_rtmp_live_bus_app_conf_t   *bacf;
+    ngx_rtmp_live_bus_ctx_t        *ctx;
+    ngx_rtmp_live_bus_stream_t     *st;
+    ngx_slab_pool_t                *shpool;
+    ngx_core_conf_t                *ccf;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                           ngx_core_module);
+    if (ccf->worker_processes <= 1) {
+        return;
+    }
+
+    bacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_bus_module);
+    shpool = ngx_rtmp_live_bus_shpool(s->main_conf);
+
+    if (bacf == NULL || !bacf->bus || shpool == NULL || s->app.len == 0
+        || s->app.len >= NGX_RTMP_MAX_NAME)
+    {
+        return;
+    }
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    st = ngx_rtmp_live_bus_find(shpool, &s->app, name);
+
+    if (st == NULL) {
+        st = ngx_slab_calloc_locked(shpool,
+                                    sizeof(ngx_rtmp_live_bus_stream_t));
+        if (st == NULL) {
+            goto failed;
+        }
+
+        st->data = ngx_slab_alloc_locked(shpool, bacf->buffer);
+        if (st->data == NULL) {
+            ngx_slab_free_locked(shpool, st);
+            goto failed;
+        }
+
+        st->size = bacf->buffer;
+        ngx_memcpy(st->app, s->app.data, s->app.len);
+        ngx_cpystrn(st->name, name, NGX_RTMP_MAX_NAME);
+
+        st->next = ((ngx_rtmp_live_bus_shctx_t *) shpool->data)->streams;
+        ((ngx_rtmp_live_bus_shctx_t *) shpool->data)->streams = st;
+
+    } else if (st->active && st->pid != ngx_pid
+               && (kill(st->pid, 0) == 0
+                   || ngx_errno != NGX_ESRCH))
+    {
+        // 其他worker还在往这个环里写, 接管会把两路推流的帧混在一起
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        ngx_log_error(NGX_LOG_WARN, s->connection->log, 0,
+                      "live bus: '%V/%s' is already published by "
+                      "worker %P, not sharing this publish",
+                      &s->app, name, st->pid);
+        return;
+    }
+
+    // 同名流重新推送时复用原来的环, 读者通过generation发现切换
+    st->pid = ngx_pid;
+    st->generation++;
+    st->active = 1;
+    st->has_key = 0;
+    ngx_rtmp_live_bus_clear_headers(shpool, st);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_bus_module);
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(s->connection->pool, sizeof(ngx_rtmp_live_bus_ctx_t));
+        if (ctx == NULL) {
+            return;
+        }
+        ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_live_bus_module);
+    }
+
+    ctx->session = s;
+    ctx->stream = st;
+    ctx->generation = st->generation;
+
+    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                  "live bus: publish '%V/%s' generation=%ui",
+                  &s->app, name, ctx->generation);
+    return;
+
+failed:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                  "live bus: no memory in zone for '%V/%s'", &s->app, name);
+}
+
+
+static ssize_t
+ngx_rtmp_live_bus_send(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    return size;
+}
+
+
+ngx_int_t
+ngx_rtmp_live_bus_attach(ngx_rtmp_conf_ctx_t *cctx, ngx_str_t *app,
+        u_char *name)
+{
+    ngx_rtmp_live_bus_app_conf_t   *bacf;
+    ngx_rtmp_live_bus_ctx_t        *ctx;
+    ngx_rtmp_live_bus_stream_t     *st;
+    ngx_rtmp_live_ctx_t            *lctx;
+    ngx_rtmp_addr_conf_t           *addr_conf;
+    ngx_rtmp_conf_ctx_t            *addr_ctx;
+    ngx_rtmp_session_t             *rs;
+    ngx_rtmp_publish_t              v;
+    ngx_slab_pool_t                *shpool;
+    ngx_connection_t               *c;
+    ngx_pool_t                     *pool;
+    ngx_log_t                      *log, *rtmp_log;
+    ngx_fd_t                        fd;
+    ngx_uint_t                      generation;
+
+    bacf = ngx_rtmp_get_module_app_conf(cctx, ngx_rtmp_live_bus_module);
+    shpool = ngx_rtmp_live_bus_shpool(cctx->main_conf);
+
+    if (bacf == NULL || !bacf->bus || shpool == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    st = ngx_rtmp_live_bus_find(shpool, app, name);
+    if (st == NULL || !st->active || st->pid == ngx_pid) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    st->refs++;
+    generation = st->generation;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    /*
+     * 读者会话没有真实的网络连接, 用/dev/null占位, 这样会话的关闭流程
+     * 与普通连接完全一致; 它作为本worker的推流端驱动本地的分发
+     */
+    fd = ngx_open_file("/dev/null", NGX_FILE_WRONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        goto failed;
+    }
+
+    pool = ngx_create_pool(4096, ngx_cycle->log);
+    if (pool == NULL) {
+        ngx_close_file(fd);
+        goto failed;
+    }
+
+    log = ngx_palloc(pool, sizeof(ngx_log_t));
+    rtmp_log = ngx_palloc(pool, sizeof(ngx_log_t));
+    addr_conf = ngx_pcalloc(pool, sizeof(ngx_rtmp_addr_conf_t));
+    addr_ctx = ngx_pcalloc(pool, sizeof(ngx_rtmp_conf_ctx_t));
+    if (log == NULL || rtmp_log == NULL || addr_conf == NULL
+        || addr_ctx == NULL)
+    {
+        ngx_destroy_pool(pool);
+        ngx_close_file(fd);
+        goto failed;
+    }
+
+    *log = *ngx_cycle->log;
+    *rtmp_log = *ngx_cycle->log;
+
+    c = ngx_get_connection(fd, log);
+    if (c == NULL) {
+        ngx_destroy_pool(pool);
+        ngx_close_file(fd);
+        goto failed;
+    }
+
+    c->pool = pool;
+    c->log = log;
+    c->rtmp_log = rtmp_log;
+    c->read->log = log;
+    c->write->log = log;
+    c->write->ready = 1;
+    c->send = ngx_rtmp_live_bus_send;
+    c->send_chain = ngx_send_chain;
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+    ngx_str_set(&c->addr_text, "ngx-live-bus");
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
+#endif
+
+    addr_conf->ctx = addr_ctx;
+    addr_ctx->main_conf = cctx->main_conf;
+    addr_ctx->srv_conf  = cctx->srv_conf;
+    ngx_str_set(&addr_conf->addr_text, "ngx-live-bus");
+
+    rs = ngx_rtmp_init_session(c, addr_conf);
+    if (rs == NULL) {
+        /* init_session关闭了连接 */
+        goto failed;
+    }
+
+    rs->app_conf = cctx->app_conf;
+    rs->auto_pushed = 1;
+    rs->live_bus = 1;
+    ngx_str_set(&rs->flashver, "ngx-live-bus");
+
+    rs->app.data = ngx_pstrdup(pool, app);
+    if (rs->app.data == NULL) {
+        ngx_rtmp_finalize_session(rs);
+        goto failed;
+    }
+    rs->app.len = app->len;
+
+    ctx = ngx_pcalloc(pool, sizeof(ngx_rtmp_live_bus_ctx_t));
+    if (ctx == NULL) {
+        ngx_rtmp_finalize_session(rs);
+        goto failed;
+    }
+
+    // 从这里开始引用计数由读者会话的close_stream释放
+    ctx->session = rs;
+    ctx->stream = st;
+    ctx->reader = 1;
+    ctx->generation = generation;
+    ctx->last_data = ngx_current_msec;
+    ctx->last_busy = ngx_current_msec;
+    ngx_rtmp_set_ctx(rs, ctx, ngx_rtmp_live_bus_module);
+
+    ngx_memzero(&v, sizeof(v));
+    ngx_cpystrn(v.name, name, NGX_RTMP_MAX_NAME);
+    ngx_cpystrn(v.type, (u_char *) "live", sizeof(v.type));
+    v.silent = 1;
+
+    if (ngx_rtmp_publish(rs, &v) != NGX_OK) {
+        ngx_rtmp_finalize_session(rs);
+        return NGX_ERROR;
+    }
+
+    lctx = ngx_rtmp_get_module_ctx(rs, ngx_rtmp_live_module);
+    if (lctx == NULL || !lctx->publishing) {
+        ngx_rtmp_finalize_session(rs);
+        return NGX_ERROR;
+    }
+
+    ctx->poll_evt.data = rs;
+    ctx->poll_evt.log = log;
+    ctx->poll_evt.handler = ngx_rtmp_live_bus_poll;
+    ngx_add_timer(&ctx->poll_evt, 1);
+
+    ngx_log_error(NGX_LOG_INFO, log, 0,
+                  "live bus: attach '%V/%s' from pid %P", app, name, st->pid);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_shmtx_lock(&shpool->mutex);
+    st->refs--;
+    ngx_rtmp_live_bus_release(shpool, st);
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_deliver(ngx_rtmp_session_t *s, ngx_rtmp_live_bus_rec_t *rec,
+       u_char *data)
+{
+    ngx_rtmp_header_t           h;
+    ngx_chain_t                 cl;
+    ngx_buf_t                   b;
+
+    ngx_memzero(&b, sizeof(b));
+    b.start = b.pos = data;
+    b.end = b.last = data + rec->mlen;
+    b.memory = 1;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    ngx_memzero(&h, sizeof(h));
+    h.timestamp = rec->timestamp;
+    h.mlen = rec->mlen;
+    h.type = rec->type;
+    h.msid = NGX_RTMP_MSID;
+    h.csid = (rec->type == NGX_RTMP_MSG_VIDEO ? NGX_RTMP_CSID_VIDEO :
+              rec->type == NGX_RTMP_MSG_AUDIO ? NGX_RTMP_CSID_AUDIO :
+                                                NGX_RTMP_CSID_AMF);
+
+    return ngx_rtmp_receive_message(s, &h, &cl);
+}
+
+
+static u_char *
+ngx_rtmp_live_bus_buffer(ngx_rtmp_live_bus_ctx_t *ctx, size_t size)
+{
+    if (size > ctx->buf_size) {
+        if (ctx->buf) {
+            ngx_free(ctx->buf);
+        }
+
+        ctx->buf_size = ngx_max(size, 64 * 1024);
+        ctx->buf = ngx_alloc(ctx->buf_size, ctx->session->connection->log);
+        if (ctx->buf == NULL) {
+            ctx->buf_size = 0;
+        }
+    }
+
+    return ctx->buf;
+}
+
+
+/* 从pos开始的数据还没有被写端覆盖(包括正在写入的部分) */
+static ngx_inline ngx_uint_t
+ngx_rtmp_live_bus_valid(ngx_rtmp_live_bus_stream_t *st, ngx_atomic_uint_t pos)
+{
+    ngx_memory_barrier();
+
+    return st->reserve - pos <= st->size;
+}
+
+
+/* 读者被写端套圈, 跳到最近的关键帧, 关键帧也被覆盖则跳到head */
+static void
+ngx_rtmp_live_bus_skip(ngx_rtmp_session_t *s, ngx_rtmp_live_bus_ctx_t *ctx)
+{
+    ngx_rtmp_live_bus_stream_t     *st;
+    ngx_atomic_uint_t               pos, key_pos;
+
+    st = ctx->stream;
+    pos = ctx->pos;
+
+    key_pos = st->key_pos;
+
+    if (st->has_key && key_pos > pos && ngx_rtmp_live_bus_valid(st, key_pos)) {
+        ctx->pos = key_pos;
+
+    } else {
+        ctx->pos = st->head;
+    }
+
+    ctx->skipped += ctx->pos - pos;
+
+    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                  "live bus: reader of '%s' overrun, skipped %uA bytes, "
+                  "%uA in total", st->name, ctx->pos - pos, ctx->skipped);
+}
+
+
+/* 重新同步: 先下发编码头和metadata, 再从最近的关键帧开始读 */
+static ngx_int_t
+ngx_rtmp_live_bus_sync(ngx_rtmp_session_t *s, ngx_rtmp_live_bus_ctx_t *ctx)
+{
+    ngx_rtmp_live_bus_stream_t     *st;
+    ngx_rtmp_live_bus_rec_t         rec[NGX_RTMP_LIVE_BUS_NHDR];
+    ngx_slab_pool_t                *shpool;
+    ngx_atomic_uint_t               head, key_pos;
+    ngx_uint_t                      n, has_key;
+    size_t                          size;
+    u_char                         *p, *data[NGX_RTMP_LIVE_BUS_NHDR];
+
+    st = ctx->stream;
+    shpool = ngx_rtmp_live_bus_shpool(s->main_conf);
+
+    size = 0;
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (n = 0; n < NGX_RTMP_LIVE_BUS_NHDR; n++) {
+        rec[n] = st->hdr[n];
+        size += st->hdr_data[n] ? st->hdr[n].mlen : 0;
+    }
+
+    p = ngx_rtmp_live_bus_buffer(ctx, size);
+
+    for (n = 0; n < NGX_RTMP_LIVE_BUS_NHDR; n++) {
+        data[n] = NULL;
+        if (p && st->hdr_data[n]) {
+            data[n] = p;
+            p = ngx_cpymem(p, st->hdr_data[n], rec[n].mlen);
+        }
+    }
+
+    ctx->generation = st->generation;
+    head = st->head;
+    key_pos = st->key_pos;
+    has_key = st->has_key;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    for (n = 0; n < NGX_RTMP_LIVE_BUS_NHDR; n++) {
+        if (data[n] == NULL) {
+            continue;
+        }
+
+        if (ngx_rtmp_live_bus_deliver(s, &rec[n], data[n]) != NGX_OK
+            || s->connection->destroyed)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    ctx->pos = (has_key && ngx_rtmp_live_bus_valid(st, key_pos))
+               ? key_pos : head;
+    ctx->synced = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_live_bus_poll(ngx_event_t *ev)
+{
+    ngx_rtmp_session_t             *s;
+    ngx_rtmp_live_bus_app_conf_t   *bacf;
+    ngx_rtmp_live_bus_ctx_t        *ctx;
+    ngx_rtmp_live_bus_stream_t     *st;
+    ngx_rtmp_live_bus_rec_t         rec;
+    ngx_atomic_uint_t               head;
+    u_char                         *p;
+
+    s = ev->data;
+    if (s->connection->destroyed) {
+        return;
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_bus_module);
+    bacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_bus_module);
+    st = ctx->stream;
+
+    if (!st->active) {
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                      "live bus: publisher of '%s' gone", st->name);
+        goto finalize;
+    }
+
+    if (!ctx->synced || ctx->generation != st->generation) {
+        if (ngx_rtmp_live_bus_sync(s, ctx) != NGX_OK) {
+            goto finalize;
+        }
+    }
+
+    head = st->head;
+    ngx_memory_barrier();
+
+    while (ctx->pos < head) {
+
+        // 读者落后超过环的长度, 或者拷贝期间被写端覆盖, 丢弃拷贝并跳过
+        if (!ngx_rtmp_live_bus_valid(st, ctx->pos)) {
+            ngx_rtmp_live_bus_skip(s, ctx);
+            continue;
+        }
+
+        ngx_rtmp_live_bus_ring_read(st, ctx->pos, (u_char *) &rec,
+                                    sizeof(rec));
+
+        if (!ngx_rtmp_live_bus_valid(st, ctx->pos)) {
+            ngx_rtmp_live_bus_skip(s, ctx);
+            continue;
+        }
+
+        if (NGX_RTMP_LIVE_BUS_REC_SIZE(rec.mlen) > head - ctx->pos) {
+            ctx->pos = head;
+            break;
+        }
+
+        p = ngx_rtmp_live_bus_buffer(ctx, rec.mlen ? rec.mlen : 1);
+        if (p == NULL) {
+            goto finalize;
+        }
+
+        ngx_rtmp_live_bus_ring_read(st, ctx->pos + sizeof(rec), p, rec.mlen);
+
+        if (!ngx_rtmp_live_bus_valid(st, ctx->pos)) {
+            ngx_rtmp_live_bus_skip(s, ctx);
+            continue;
+        }
+
+        ctx->pos += NGX_RTMP_LIVE_BUS_REC_SIZE(rec.mlen);
+
+        if (ngx_rtmp_live_bus_deliver(s, &rec, p) != NGX_OK
+            || s->connection->destroyed)
+        {
+            goto finalize;
+        }
+    }
+
+    if (head != ctx->last_head) {
+        ctx->last_head = head;
+        ctx->last_data = ngx_current_msec;
+    }
+
+    if (s->busy_time != ctx->busy_time) {
+        ctx->busy_time = s->busy_time;
+        ctx->last_busy = ngx_current_msec;
+    }
+
+    if (ngx_current_msec - ctx->last_data > bacf->idle) {
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                      "live bus: no data for '%s'", st->name);
+        goto finalize;
+    }
+
+    if (ngx_current_msec - ctx->last_busy > bacf->idle) {
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                      "live bus: no local subscribers for '%s'", st->name);
+        goto finalize;
+    }
+
+    ngx_add_timer(ev, bacf->poll);
+    return;
+
+finalize:
+
+    if (!s->connection->destroyed) {
+        s->status_code = ngx_rtmp_live_no_publisher_err;
+        ngx_rtmp_finalize_session(s);
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
+{
+    ngx_int_t                       rc;
+    ngx_rtmp_live_ctx_t            *lctx;
+
+    rc = next_publish(s, v);
+
+    if (rc != NGX_OK || s->auto_pushed || s->live_bus) {
+        return rc;
+    }
+
+    lctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_module);
+    if (lctx && lctx->stream && lctx->publishing) {
+        ngx_rtmp_live_bus_open(s, v->name);
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_play(ngx_rtmp_session_t *s, ngx_rtmp_play_t *v)
+{
+    ngx_int_t                       rc;
+    ngx_rtmp_live_ctx_t            *lctx;
+    ngx_rtmp_conf_ctx_t             cctx;
+
+    rc = next_play(s, v);
+
+    if (rc != NGX_OK || s->connection->destroyed) {
+        return rc;
+    }
+
+    lctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_module);
+    if (lctx && lctx->stream && !lctx->stream->publishing) {
+        cctx.main_conf = s->main_conf;
+        cctx.srv_conf = s->srv_conf;
+        cctx.app_conf = s->app_conf;
+
+        (void) ngx_rtmp_live_bus_attach(&cctx, &s->app, v->name);
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_close_stream(ngx_rtmp_session_t *s,
+       ngx_rtmp_close_stream_t *v)
+{
+    ngx_rtmp_live_bus_ctx_t        *ctx;
+    ngx_rtmp_live_bus_stream_t     *st;
+    ngx_slab_pool_t                *shpool;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_bus_module);
+    if (ctx == NULL || ctx->stream == NULL) {
+        goto next;
+    }
+
+    st = ctx->stream;
+    shpool = ngx_rtmp_live_bus_shpool(s->main_conf);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (ctx->reader) {
+        st->refs--;
+
+    } else if (st->pid == ngx_pid && st->generation == ctx->generation) {
+        st->active = 0;
+    }
+
+    ngx_rtmp_live_bus_release(shpool, st);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ctx->stream = NULL;
+
+    if (ctx->poll_evt.timer_set) {
+        ngx_del_timer(&ctx->poll_evt);
+    }
+
+    if (ctx->buf) {
+        ngx_free(ctx->buf);
+        ctx->buf = NULL;
+        ctx->buf_size = 0;
+    }
+
+next:
+    return next_close_stream(s, v);
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_shm_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_slab_pool_t                *shpool;
+    ngx_rtmp_live_bus_shctx_t      *shctx;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    shctx = ngx_slab_calloc(shpool, sizeof(ngx_rtmp_live_bus_shctx_t));
+    if (shctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = shctx;
+    shm_zone->data = shctx;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_rtmp_core_main_conf_t      *cmcf;
+    ngx_rtmp_live_bus_main_conf_t  *bmcf;
+    ngx_rtmp_handler_pt            *h;
+    ngx_rtmp_amf_handler_t         *ch;
+
+    cmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_core_module);
+
+    h = ngx_array_push(&cmcf->events[NGX_RTMP_MSG_AUDIO]);
+    *h = ngx_rtmp_live_bus_av;
+
+    h = ngx_array_push(&cmcf->events[NGX_RTMP_MSG_VIDEO]);
+    *h = ngx_rtmp_live_bus_av;
+
+    ch = ngx_array_push(&cmcf->amf);
+    if (ch == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_str_set(&ch->name, "@setDataFrame");
+    ch->handler = ngx_rtmp_live_bus_meta;
+
+    ch = ngx_array_push(&cmcf->amf);
+    if (ch == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_str_set(&ch->name, "onMetaData");
+    ch->handler = ngx_rtmp_live_bus_meta;
+
+    next_publish = ngx_rtmp_publish;
+    ngx_rtmp_publish = ngx_rtmp_live_bus_publish;
+
+    next_play = ngx_rtmp_play;
+    ngx_rtmp_play = ngx_rtmp_live_bus_play;
+
+    next_close_stream = ngx_rtmp_close_stream;
+    ngx_rtmp_close_stream = ngx_rtmp_live_bus_close_stream;
+
+    bmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_live_bus_module);
+    if (bmcf->zone_size == NGX_CONF_UNSET_SIZE || bmcf->zone_size == 0) {
+        return NGX_OK;
+    }
+
+    bmcf->shm_zone = ngx_shared_memory_add(cf, &ngx_rtmp_live_bus_shm_name,
+                                           bmcf->zone_size,
+                                           &ngx_rtmp_live_bus_module);
+    if (bmcf->shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    bmcf->shm_zone->init = ngx_rtmp_live_bus_shm_init;
+
+    return NGX_OK;
+}
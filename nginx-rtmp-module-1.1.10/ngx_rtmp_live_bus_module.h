@@ -0,0 +1,22 @@
+
+#ifndef _NGX_RTMP_LIVE_BUS_H_INCLUDED_
+#define _NGX_RTMP_LIVE_BUS_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp.h"
+
+
+extern ngx_module_t  ngx_rtmp_live_bus_module;
+
+/*
+ * 本worker没有该流的推流端时, 如果其他worker正在往共享内存总线写这个流,
+ * 在本worker创建一个本地读者会话作为推流端, 成功返回NGX_OK
+ */
+ngx_int_t
+ngx_rtmp_live_bus_attach(ngx_rtmp_conf_ctx_t *cctx, ngx_str_t *app,
+        u_char *name);
+
+
+#endif /* _NGX_RTMP_LIVE_BUS_H_INCLUDED_ */
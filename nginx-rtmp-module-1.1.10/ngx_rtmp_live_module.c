@@ -10,6 +10,7 @@
 #include "ngx_rtmp_cmd_module.h"
 #include "ngx_rtmp_codec_module.h"
 #include "ngx_rtmp_edge_log.h"
+#include "ngx_rtmp_counter_module.h"
 
 
 static ngx_rtmp_publish_pt              next_publish;
@@ -131,6 +132,13 @@ static ngx_command_t  ngx_rtmp_live_commands[] = {
       offsetof(ngx_rtmp_live_app_conf_t, cache_gop_num),
       NULL },
 
+     { ngx_string("cache_gop_latency"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_live_app_conf_t, cache_gop_latency),
+      NULL },
+
       ngx_null_command
 };
 
@@ -187,6 +195,7 @@ ngx_rtmp_live_create_app_conf(ngx_conf_t *cf)
 
     lacf->cache_gop_duration = NGX_CONF_UNSET_MSEC;
     lacf->cache_gop_num = NGX_CONF_UNSET_UINT;
+    lacf->cache_gop_latency = NGX_CONF_UNSET_MSEC;
     lacf->cache_gop = NGX_CONF_UNSET;
     return lacf;
 }
@@ -213,6 +222,13 @@ ngx_rtmp_live_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->cache_gop, prev->cache_gop, 0);
     ngx_conf_merge_msec_value(conf->cache_gop_duration, prev->cache_gop_duration, 0);
     ngx_conf_merge_uint_value(conf->cache_gop_num, prev->cache_gop_num,0);
+    ngx_conf_merge_msec_value(conf->cache_gop_latency, prev->cache_gop_latency, 0);
+    if (conf->cache_gop_num > NGX_MEDIA_DATA_MAX_GOP - 1) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                "cache_gop_num %ui is too large, using %d",
+                conf->cache_gop_num, NGX_MEDIA_DATA_MAX_GOP - 1);
+        conf->cache_gop_num = NGX_MEDIA_DATA_MAX_GOP - 1;
+    }
 
     conf->pool = ngx_create_pool(4096, &cf->cycle->new_log);
     if (conf->pool == NULL) {
@@ -778,6 +794,7 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_uint_t                      csidx;
     uint32_t                        delta;
     ngx_rtmp_live_chunk_stream_t   *cs;
+    ngx_rtmp_counter_slot_t        *counter;
     //是否立即销毁内存的标记
     ngx_int_t                       rpkt_destory = 0;
 //#ifdef NGX_DEBUG
@@ -1093,6 +1110,8 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
             cs->dropped += delta;
 
             ss->dropVideoFrame++;
+            ngx_rtmp_counter_add(ngx_rtmp_counter_session(ss),
+                                 NGX_RTMP_COUNTER_DROP_VIDEO_FRAMES, 1);
 
             if (mandatory) {
                 ngx_log_debug0(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0,
@@ -1111,8 +1130,13 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         // play rtmp log 
         if (h->type == NGX_RTMP_MSG_AUDIO) {
             ss->recv_audio_size += h->mlen;
+            ngx_rtmp_counter_add(ngx_rtmp_counter_session(ss),
+                                 NGX_RTMP_COUNTER_OUT_AUDIO_BYTES, h->mlen);
         } else if (h->type == NGX_RTMP_MSG_VIDEO){
             ss->recv_video_size += h->mlen;       
+            counter = ngx_rtmp_counter_session(ss);
+            ngx_rtmp_counter_add(counter, NGX_RTMP_COUNTER_OUT_VIDEO_BYTES, h->mlen);
+            ngx_rtmp_counter_add(counter, NGX_RTMP_COUNTER_OUT_VIDEO_FRAMES, 1);
         }
         ss->recv_video_frame += 1;
         ss->stream_ts = h->timestamp;
@@ -1159,10 +1183,14 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                               h->mlen);
     
     // publish rtmp log 
+    counter = ngx_rtmp_counter_session(s);
     if (h->type == NGX_RTMP_MSG_AUDIO) {
         s->recv_audio_size += h->mlen;
         s->send_audio_size += h->mlen * peers;
+        ngx_rtmp_counter_add(counter, NGX_RTMP_COUNTER_IN_AUDIO_BYTES, h->mlen);
     } else if (h->type == NGX_RTMP_MSG_VIDEO){
+        ngx_rtmp_counter_add(counter, NGX_RTMP_COUNTER_IN_VIDEO_BYTES, h->mlen);
+        ngx_rtmp_counter_add(counter, NGX_RTMP_COUNTER_IN_VIDEO_FRAMES, 1);
         s->recv_video_size += h->mlen;       
         s->send_video_size += h->mlen * peers;       
         
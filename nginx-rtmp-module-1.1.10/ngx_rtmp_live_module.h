@@ -97,6 +97,7 @@ typedef struct {
     //liw
     ngx_msec_t                          cache_gop_duration;
     ngx_uint_t                          cache_gop_num;
+    ngx_msec_t                          cache_gop_latency;  //新观众起播的目标延迟, 0表示发送全部缓存
     ngx_flag_t                          cache_gop;
 } ngx_rtmp_live_app_conf_t;
 
@@ -12,6 +12,8 @@
 
 
 static ngx_int_t ngx_rtmp_mp4_postconfiguration(ngx_conf_t *cf);
+static void *ngx_rtmp_mp4_create_main_conf(ngx_conf_t *cf);
+static char *ngx_rtmp_mp4_init_main_conf(ngx_conf_t *cf, void *conf);
 static ngx_int_t ngx_rtmp_mp4_init(ngx_rtmp_session_t *s,  ngx_file_t *f,
        ngx_int_t aindex, ngx_int_t vindex);
 static ngx_int_t ngx_rtmp_mp4_done(ngx_rtmp_session_t *s,  ngx_file_t *f);
@@ -174,15 +176,59 @@ typedef struct {
     ngx_rtmp_mp4_sizes2_t              *sizes2;
     ngx_rtmp_mp4_offsets_t             *offsets;
     ngx_rtmp_mp4_offsets64_t           *offsets64;
+
+    /*
+     * running totals at the start of each stts/stsc/ctts entry,
+     * built once per file to binary search on seek
+     */
+    uint64_t                           *time_start;
+    ngx_uint_t                         *time_sample;
+    ngx_uint_t                         *chunk_sample;
+    ngx_uint_t                         *delay_sample;
+
     ngx_rtmp_mp4_cursor_t               cursor;
 } ngx_rtmp_mp4_track_t;
 
 
+/*
+ * Mapped moov of an mp4 file with parsed tables, shared by all sessions
+ * of the worker playing the same file with the same track selection
+ */
 typedef struct {
+    ngx_queue_t                         queue;
+    ngx_pool_t                         *pool;
+    ngx_uint_t                          refs;
+    time_t                              accessed;
+
+    ngx_file_uniq_t                     uniq;
+    time_t                              mtime;
+    off_t                               size;
+    ngx_int_t                           aindex, vindex;
+
     void                               *mmaped;
     size_t                              mmaped_size;
     ngx_fd_t                            extra;
 
+    ngx_rtmp_mp4_track_t                tracks[2];
+    ngx_uint_t                          ntracks;
+
+    ngx_uint_t                          width;
+    ngx_uint_t                          height;
+    ngx_uint_t                          nchannels;
+    ngx_uint_t                          sample_size;
+    ngx_uint_t                          sample_rate;
+} ngx_rtmp_mp4_file_t;
+
+
+typedef struct {
+    ngx_uint_t                          cache;
+    time_t                              cache_inactive;
+} ngx_rtmp_mp4_main_conf_t;
+
+
+typedef struct {
+    ngx_rtmp_mp4_file_t                *file;
+
     unsigned                            meta_sent:1;
 
     ngx_rtmp_mp4_track_t                tracks[2];
@@ -226,6 +272,17 @@ ngx_rtmp_mp4_from_rtmp_timestamp(ngx_rtmp_mp4_track_t *t, uint32_t ts)
 static u_char                           ngx_rtmp_mp4_buffer[1024*1024];
 
 
+/* most recently used first */
+static ngx_queue_t                      ngx_rtmp_mp4_cache;
+static ngx_uint_t                       ngx_rtmp_mp4_cache_n;
+
+/* frees idle files when no new session comes to do it */
+static ngx_event_t                      ngx_rtmp_mp4_cache_event;
+
+
+static void ngx_rtmp_mp4_cache_arm(ngx_rtmp_mp4_main_conf_t *mmcf);
+
+
 #if (NGX_WIN32)
 static void *
 ngx_rtmp_mp4_mmap(ngx_fd_t fd, size_t size, off_t offset, ngx_fd_t *extra)
@@ -407,11 +464,31 @@ static ngx_rtmp_mp4_descriptor_t        ngx_rtmp_mp4_descriptors[] = {
 };
 
 
+static ngx_command_t  ngx_rtmp_mp4_commands[] = {
+
+    { ngx_string("mp4_cache"),
+      NGX_RTMP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_RTMP_MAIN_CONF_OFFSET,
+      offsetof(ngx_rtmp_mp4_main_conf_t, cache),
+      NULL },
+
+    { ngx_string("mp4_cache_inactive"),
+      NGX_RTMP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_RTMP_MAIN_CONF_OFFSET,
+      offsetof(ngx_rtmp_mp4_main_conf_t, cache_inactive),
+      NULL },
+
+      ngx_null_command
+};
+
+
 static ngx_rtmp_module_t  ngx_rtmp_mp4_module_ctx = {
     NULL,                                   /* preconfiguration */
     ngx_rtmp_mp4_postconfiguration,         /* postconfiguration */
-    NULL,                                   /* create main configuration */
-    NULL,                                   /* init main configuration */
+    ngx_rtmp_mp4_create_main_conf,          /* create main configuration */
+    ngx_rtmp_mp4_init_main_conf,            /* init main configuration */
     NULL,                                   /* create server configuration */
     NULL,                                   /* merge server configuration */
     NULL,                                   /* create app configuration */
@@ -422,7 +499,7 @@ static ngx_rtmp_module_t  ngx_rtmp_mp4_module_ctx = {
 ngx_module_t  ngx_rtmp_mp4_module = {
     NGX_MODULE_V1,
     &ngx_rtmp_mp4_module_ctx,               /* module context */
-    NULL,                                   /* module directives */
+    ngx_rtmp_mp4_commands,                  /* module directives */
     NGX_RTMP_MODULE,                        /* module type */
     NULL,                                   /* init master */
     NULL,                                   /* init module */
@@ -435,6 +512,35 @@ ngx_module_t  ngx_rtmp_mp4_module = {
 };
 
 
+static void *
+ngx_rtmp_mp4_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_rtmp_mp4_main_conf_t      *mmcf;
+
+    mmcf = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_mp4_main_conf_t));
+    if (mmcf == NULL) {
+        return NULL;
+    }
+
+    mmcf->cache = NGX_CONF_UNSET_UINT;
+    mmcf->cache_inactive = NGX_CONF_UNSET;
+
+    return mmcf;
+}
+
+
+static char *
+ngx_rtmp_mp4_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_rtmp_mp4_main_conf_t      *mmcf = conf;
+
+    ngx_conf_init_uint_value(mmcf->cache, 64);
+    ngx_conf_init_value(mmcf->cache_inactive, 60);
+
+    return NGX_CONF_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_mp4_parse_trak(ngx_rtmp_session_t *s, u_char *pos, u_char *last)
 {
@@ -1306,6 +1412,90 @@ ngx_rtmp_mp4_parse(ngx_rtmp_session_t *s, u_char *pos, u_char *last)
 }
 
 
+static ngx_int_t
+ngx_rtmp_mp4_index_track(ngx_pool_t *pool, ngx_rtmp_mp4_track_t *t)
+{
+    ngx_uint_t                      n, i;
+    ngx_rtmp_mp4_time_entry_t      *te;
+    ngx_rtmp_mp4_chunk_entry_t     *ce;
+    ngx_rtmp_mp4_delay_entry_t     *de;
+
+    if (t->times) {
+        n = ngx_rtmp_r32(t->times->entry_count);
+
+        t->time_start = ngx_palloc(pool, (n + 1) * sizeof(uint64_t));
+        t->time_sample = ngx_palloc(pool, (n + 1) * sizeof(ngx_uint_t));
+
+        if (t->time_start == NULL || t->time_sample == NULL) {
+            return NGX_ERROR;
+        }
+
+        t->time_start[0] = 0;
+        t->time_sample[0] = 0;
+
+        te = t->times->entries;
+
+        for (i = 0; i < n; i++, te++) {
+            t->time_start[i + 1] = t->time_start[i] +
+                                   (uint64_t) ngx_rtmp_r32(te->sample_delta) *
+                                   ngx_rtmp_r32(te->sample_count);
+            t->time_sample[i + 1] = t->time_sample[i] +
+                                    ngx_rtmp_r32(te->sample_count);
+        }
+    }
+
+    if (t->chunks && t->chunks->entry_count) {
+        n = ngx_rtmp_r32(t->chunks->entry_count);
+
+        t->chunk_sample = ngx_palloc(pool, n * sizeof(ngx_uint_t));
+        if (t->chunk_sample == NULL) {
+            return NGX_ERROR;
+        }
+
+        t->chunk_sample[0] = 0;
+
+        ce = t->chunks->entries;
+
+        for (i = 0; i + 1 < n; i++, ce++) {
+
+            /* broken stsc, seek falls back to the linear scan */
+
+            if (ngx_rtmp_r32(ce[1].first_chunk) <
+                ngx_rtmp_r32(ce[0].first_chunk))
+            {
+                t->chunk_sample = NULL;
+                break;
+            }
+
+            t->chunk_sample[i + 1] = t->chunk_sample[i] +
+                                     (ngx_rtmp_r32(ce[1].first_chunk) -
+                                      ngx_rtmp_r32(ce[0].first_chunk)) *
+                                     ngx_rtmp_r32(ce[0].samples_per_chunk);
+        }
+    }
+
+    if (t->delays) {
+        n = ngx_rtmp_r32(t->delays->entry_count);
+
+        t->delay_sample = ngx_palloc(pool, (n + 1) * sizeof(ngx_uint_t));
+        if (t->delay_sample == NULL) {
+            return NGX_ERROR;
+        }
+
+        t->delay_sample[0] = 0;
+
+        de = t->delays->entries;
+
+        for (i = 0; i < n; i++, de++) {
+            t->delay_sample[i + 1] = t->delay_sample[i] +
+                                     ngx_rtmp_r32(de->sample_count);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_mp4_next_time(ngx_rtmp_session_t *s, ngx_rtmp_mp4_track_t *t)
 {
@@ -1361,6 +1551,7 @@ ngx_rtmp_mp4_seek_time(ngx_rtmp_session_t *s, ngx_rtmp_mp4_track_t *t,
     ngx_rtmp_mp4_cursor_t      *cr;
     ngx_rtmp_mp4_time_entry_t  *te;
     uint32_t                    dt;
+    ngx_uint_t                  lo, hi, mid;
 
     if (t->times == NULL) {
         return NGX_ERROR;
@@ -1370,6 +1561,30 @@ ngx_rtmp_mp4_seek_time(ngx_rtmp_session_t *s, ngx_rtmp_mp4_track_t *t,
 
     te = t->times->entries;
 
+    if (t->time_start) {
+
+        /* first entry ending at or after timestamp */
+
+        lo = 0;
+        hi = ngx_rtmp_r32(t->times->entry_count);
+
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+
+            if (t->time_start[mid + 1] >= timestamp) {
+                hi = mid;
+
+            } else {
+                lo = mid + 1;
+            }
+        }
+
+        cr->time_pos = lo;
+        cr->timestamp = (uint32_t) t->time_start[lo];
+        cr->pos = t->time_sample[lo];
+        te += lo;
+    }
+
     while (cr->time_pos < ngx_rtmp_r32(t->times->entry_count)) {
         dt = ngx_rtmp_r32(te->sample_delta) * ngx_rtmp_r32(te->sample_count);
 
@@ -1546,7 +1761,7 @@ ngx_rtmp_mp4_seek_chunk(ngx_rtmp_session_t *s, ngx_rtmp_mp4_track_t *t)
 {
     ngx_rtmp_mp4_cursor_t          *cr;
     ngx_rtmp_mp4_chunk_entry_t     *ce, *nce;
-    ngx_uint_t                      pos, dpos, dchunk;
+    ngx_uint_t                      pos, dpos, dchunk, lo, hi, mid;
 
     cr = &t->cursor;
 
@@ -1558,6 +1773,29 @@ ngx_rtmp_mp4_seek_chunk(ngx_rtmp_session_t *s, ngx_rtmp_mp4_track_t *t)
     ce = t->chunks->entries;
     pos = 0;
 
+    if (t->chunk_sample) {
+
+        /* last entry starting at or before the sample */
+
+        lo = 0;
+        hi = ngx_rtmp_r32(t->chunks->entry_count);
+
+        while (hi - lo > 1) {
+            mid = lo + (hi - lo) / 2;
+
+            if (t->chunk_sample[mid] <= cr->pos) {
+                lo = mid;
+
+            } else {
+                hi = mid;
+            }
+        }
+
+        cr->chunk_pos = lo;
+        pos = t->chunk_sample[lo];
+        ce += lo;
+    }
+
     while (cr->chunk_pos + 1 < ngx_rtmp_r32(t->chunks->entry_count)) {
         nce = ce + 1;
 
@@ -1769,12 +2007,55 @@ ngx_rtmp_mp4_next_key(ngx_rtmp_session_t *s, ngx_rtmp_mp4_track_t *t)
 }
 
 
+static ngx_int_t
+ngx_rtmp_mp4_seek_sample(ngx_rtmp_mp4_track_t *t, ngx_uint_t sample)
+{
+    ngx_rtmp_mp4_cursor_t      *cr;
+    ngx_rtmp_mp4_time_entry_t  *te;
+    ngx_uint_t                  lo, hi, mid;
+
+    cr = &t->cursor;
+
+    hi = ngx_rtmp_r32(t->times->entry_count);
+
+    if (sample < cr->pos || sample >= t->time_sample[hi]) {
+        return NGX_ERROR;
+    }
+
+    /* stts entry holding the sample */
+
+    lo = 0;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if (t->time_sample[mid + 1] > sample) {
+            hi = mid;
+
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    te = &t->times->entries[lo];
+
+    cr->time_pos = lo;
+    cr->time_count = sample - t->time_sample[lo];
+    cr->timestamp = (uint32_t) (t->time_start[lo] + (uint64_t) cr->time_count
+                                * ngx_rtmp_r32(te->sample_delta));
+    cr->pos = sample;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_mp4_seek_key(ngx_rtmp_session_t *s, ngx_rtmp_mp4_track_t *t)
 {
     ngx_rtmp_mp4_cursor_t      *cr;
     uint32_t                   *ke;
     ngx_int_t                   dpos;
+    ngx_uint_t                  lo, hi, mid;
 
     cr = &t->cursor;
 
@@ -1782,6 +2063,24 @@ ngx_rtmp_mp4_seek_key(ngx_rtmp_session_t *s, ngx_rtmp_mp4_track_t *t)
         return NGX_OK;
     }
 
+    /* stss is sorted, first key after the sample */
+
+    lo = 0;
+    hi = ngx_rtmp_r32(t->keys->entry_count);
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if (ngx_rtmp_r32(t->keys->entries[mid]) > cr->pos) {
+            hi = mid;
+
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    cr->key_pos = lo;
+
     while (cr->key_pos < ngx_rtmp_r32(t->keys->entry_count)) {
         if (ngx_rtmp_r32(t->keys->entries[cr->key_pos]) > cr->pos) {
             break;
@@ -1805,7 +2104,13 @@ ngx_rtmp_mp4_seek_key(ngx_rtmp_session_t *s, ngx_rtmp_mp4_track_t *t)
     dpos = ngx_rtmp_r32(*ke) - cr->pos - 1;
     cr->key = 1;
 
-    /* TODO: range version needed */
+    /* jump to the sample before the key, last step sets last_timestamp */
+    if (dpos > 1 && t->time_start &&
+        ngx_rtmp_mp4_seek_sample(t, ngx_rtmp_r32(*ke) - 2) == NGX_OK)
+    {
+        dpos = 1;
+    }
+
     for (; dpos > 0; --dpos) {
         ngx_rtmp_mp4_next_time(s, t);
     }
@@ -1881,6 +2186,7 @@ ngx_rtmp_mp4_seek_delay(ngx_rtmp_session_t *s, ngx_rtmp_mp4_track_t *t)
     ngx_rtmp_mp4_cursor_t      *cr;
     ngx_rtmp_mp4_delay_entry_t *de;
     uint32_t                    pos, dpos;
+    ngx_uint_t                  lo, hi, mid;
 
     cr = &t->cursor;
 
@@ -1891,6 +2197,29 @@ ngx_rtmp_mp4_seek_delay(ngx_rtmp_session_t *s, ngx_rtmp_mp4_track_t *t)
     pos = 0;
     de = t->delays->entries;
 
+    if (t->delay_sample) {
+
+        /* first entry ending after the sample */
+
+        lo = 0;
+        hi = ngx_rtmp_r32(t->delays->entry_count);
+
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+
+            if (t->delay_sample[mid + 1] > cr->pos) {
+                hi = mid;
+
+            } else {
+                lo = mid + 1;
+            }
+        }
+
+        cr->delay_pos = lo;
+        pos = (uint32_t) t->delay_sample[lo];
+        de += lo;
+    }
+
     while (cr->delay_pos < ngx_rtmp_r32(t->delays->entry_count)) {
         dpos = ngx_rtmp_r32(de->sample_count);
 
@@ -2109,7 +2438,7 @@ ngx_rtmp_mp4_send(ngx_rtmp_session_t *s, ngx_file_t *f, ngx_uint_t *ts)
 
     ctx  = ngx_rtmp_get_module_ctx(s, ngx_rtmp_mp4_module);
 
-    if (ctx == NULL) {
+    if (ctx == NULL || ctx->file == NULL) {
         return NGX_ERROR;
     }
 
@@ -2307,33 +2636,202 @@ next:
 }
 
 
-static ngx_int_t
-ngx_rtmp_mp4_init(ngx_rtmp_session_t *s, ngx_file_t *f, ngx_int_t aindex,
-                  ngx_int_t vindex)
+static void
+ngx_rtmp_mp4_cache_free(ngx_rtmp_mp4_file_t *mf)
+{
+    if (mf->queue.next) {
+        ngx_queue_remove(&mf->queue);
+        ngx_rtmp_mp4_cache_n--;
+    }
+
+    if (mf->mmaped &&
+        ngx_rtmp_mp4_munmap(mf->mmaped, mf->mmaped_size, &mf->extra)
+        != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                      "mp4: munmap failed");
+    }
+
+    ngx_destroy_pool(mf->pool);
+}
+
+
+static void
+ngx_rtmp_mp4_cache_expire(ngx_rtmp_mp4_main_conf_t *mmcf)
+{
+    ngx_queue_t                *q, *prev;
+    ngx_rtmp_mp4_file_t        *mf;
+
+    /* least recently used are at the tail, files in use are kept */
+
+    for (q = ngx_queue_last(&ngx_rtmp_mp4_cache);
+         q != ngx_queue_sentinel(&ngx_rtmp_mp4_cache);
+         q = prev)
+    {
+        prev = ngx_queue_prev(q);
+
+        mf = ngx_queue_data(q, ngx_rtmp_mp4_file_t, queue);
+
+        if (mf->refs) {
+            continue;
+        }
+
+        if (ngx_rtmp_mp4_cache_n > mmcf->cache ||
+            mf->accessed + mmcf->cache_inactive <= ngx_time())
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
+                           "mp4: cache free %p", mf);
+
+            ngx_rtmp_mp4_cache_free(mf);
+        }
+    }
+}
+
+
+static ngx_rtmp_mp4_file_t *
+ngx_rtmp_mp4_cache_get(ngx_file_info_t *fi, ngx_int_t aindex,
+    ngx_int_t vindex)
+{
+    ngx_queue_t                *q;
+    ngx_rtmp_mp4_file_t        *mf;
+
+    for (q = ngx_queue_head(&ngx_rtmp_mp4_cache);
+         q != ngx_queue_sentinel(&ngx_rtmp_mp4_cache);
+         q = ngx_queue_next(q))
+    {
+        mf = ngx_queue_data(q, ngx_rtmp_mp4_file_t, queue);
+
+        if (mf->uniq != ngx_file_uniq(fi)) {
+            continue;
+        }
+
+        if (mf->mtime != ngx_file_mtime(fi) ||
+            mf->size != ngx_file_size(fi))
+        {
+            /* file was replaced, drop the old one once released */
+
+            if (mf->refs == 0) {
+                q = ngx_queue_prev(q);
+                ngx_rtmp_mp4_cache_free(mf);
+            }
+
+            continue;
+        }
+
+        if (mf->aindex != aindex || mf->vindex != vindex) {
+            continue;
+        }
+
+        ngx_queue_remove(q);
+        ngx_queue_insert_head(&ngx_rtmp_mp4_cache, q);
+
+        mf->refs++;
+
+        return mf;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_rtmp_mp4_cache_handler(ngx_event_t *ev)
+{
+    ngx_rtmp_mp4_main_conf_t   *mmcf = ev->data;
+
+    ngx_rtmp_mp4_cache_expire(mmcf);
+
+    if (!ngx_exiting) {
+        ngx_rtmp_mp4_cache_arm(mmcf);
+    }
+}
+
+
+static void
+ngx_rtmp_mp4_cache_arm(ngx_rtmp_mp4_main_conf_t *mmcf)
+{
+    ngx_event_t                *ev;
+    ngx_queue_t                *q;
+    ngx_rtmp_mp4_file_t        *mf;
+
+    ev = &ngx_rtmp_mp4_cache_event;
+
+    if (ev->timer_set) {
+        return;
+    }
+
+    for (q = ngx_queue_head(&ngx_rtmp_mp4_cache);
+         q != ngx_queue_sentinel(&ngx_rtmp_mp4_cache);
+         q = ngx_queue_next(q))
+    {
+        mf = ngx_queue_data(q, ngx_rtmp_mp4_file_t, queue);
+
+        if (mf->refs == 0) {
+            ev->handler = ngx_rtmp_mp4_cache_handler;
+            ev->data = mmcf;
+            ev->log = ngx_cycle->log;
+            ev->cancelable = 1;
+
+            ngx_add_timer(ev, (ngx_msec_t) mmcf->cache_inactive * 1000);
+
+            return;
+        }
+    }
+}
+
+
+static void
+ngx_rtmp_mp4_cache_release(ngx_rtmp_mp4_main_conf_t *mmcf,
+    ngx_rtmp_mp4_file_t *mf)
+{
+    if (--mf->refs) {
+        return;
+    }
+
+    mf->accessed = ngx_time();
+
+    ngx_rtmp_mp4_cache_expire(mmcf);
+    ngx_rtmp_mp4_cache_arm(mmcf);
+}
+
+
+static ngx_rtmp_mp4_file_t *
+ngx_rtmp_mp4_load(ngx_rtmp_session_t *s, ngx_file_t *f, ngx_file_info_t *fi)
 {
     ngx_rtmp_mp4_ctx_t         *ctx;
-    uint32_t                    hdr[2];
+    ngx_rtmp_mp4_file_t        *mf;
+    ngx_pool_t                 *pool;
+    ngx_uint_t                  i;
     ssize_t                     n;
+    uint32_t                    hdr[2];
     size_t                      offset, page_offset, size, shift;
     uint64_t                    extended_size;
-    ngx_file_info_t             fi;
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_mp4_module);
 
-    if (ctx == NULL) {
-        ctx = ngx_palloc(s->connection->pool, sizeof(ngx_rtmp_mp4_ctx_t));
-
-        if (ctx == NULL) {
-            return NGX_ERROR;
-        }
+    if (ngx_file_size(fi) == 0) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "mp4: bad file size %O", ngx_file_size(fi));
+        return NULL;
+    }
 
-        ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_mp4_module);
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        return NULL;
     }
 
-    ngx_memzero(ctx, sizeof(*ctx));
+    mf = ngx_pcalloc(pool, sizeof(ngx_rtmp_mp4_file_t));
+    if (mf == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
 
-    ctx->aindex = aindex;
-    ctx->vindex = vindex;
+    mf->pool = pool;
+    mf->uniq = ngx_file_uniq(fi);
+    mf->mtime = ngx_file_mtime(fi);
+    mf->size = ngx_file_size(fi);
+    mf->aindex = ctx->aindex;
+    mf->vindex = ctx->vindex;
 
     offset = 0;
     size   = 0;
@@ -2345,7 +2843,7 @@ ngx_rtmp_mp4_init(ngx_rtmp_session_t *s, ngx_file_t *f, ngx_int_t aindex,
             ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
                           "mp4: error reading file at offset=%uz "
                           "while searching for moov box", offset);
-            return NGX_ERROR;
+            goto failed;
         }
 
         size = (size_t) ngx_rtmp_r32(hdr[0]);
@@ -2359,19 +2857,18 @@ ngx_rtmp_mp4_init(ngx_rtmp_session_t *s, ngx_file_t *f, ngx_int_t aindex,
                 ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
                               "mp4: error reading file at offset=%uz "
                               "while searching for moov box", offset + 8);
-                return NGX_ERROR;
+                goto failed;
             }
 
             size = (size_t) ngx_rtmp_r64(extended_size);
             shift += sizeof(extended_size);
 
         } else if (size == 0) {
-            if (ngx_fd_info(f->fd, &fi) == NGX_FILE_ERROR) {
-                ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                              "mp4: " ngx_fd_info_n " failed");
-                return NGX_ERROR;
-            }
-            size = ngx_file_size(&fi) - offset;
+            size = (size_t) mf->size - offset;
+        }
+
+        if (size < shift) {
+            goto failed;
         }
 
         if (hdr[1] == ngx_rtmp_mp4_make_tag('m','o','o','v')) {
@@ -2386,27 +2883,129 @@ ngx_rtmp_mp4_init(ngx_rtmp_session_t *s, ngx_file_t *f, ngx_int_t aindex,
         offset += size;
     }
 
-    if (size < shift) {
-        return NGX_ERROR;
+    if ((off_t) (offset + size) > mf->size) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "mp4: truncated moov box at offset=%uz, size=%uz",
+                      offset, size);
+        goto failed;
     }
 
     size   -= shift;
     offset += shift;
 
+    /* only moov is mapped, samples are read from the file */
+
     page_offset = offset & (ngx_pagesize - 1);
-    ctx->mmaped_size = page_offset + size;
+    mf->mmaped_size = page_offset + size;
 
-    ctx->mmaped = ngx_rtmp_mp4_mmap(f->fd, ctx->mmaped_size,
-                                    offset - page_offset, &ctx->extra);
-    if (ctx->mmaped == NULL) {
+    mf->mmaped = ngx_rtmp_mp4_mmap(f->fd, mf->mmaped_size,
+                                   offset - page_offset, &mf->extra);
+    if (mf->mmaped == NULL) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
                       "mp4: mmap failed at offset=%ui, size=%uz",
                       offset, size);
+        goto failed;
+    }
+
+    if (ngx_rtmp_mp4_parse(s, (u_char *) mf->mmaped + page_offset,
+                           (u_char *) mf->mmaped + page_offset + size)
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    for (i = 0; i < ctx->ntracks; i++) {
+        if (ngx_rtmp_mp4_index_track(pool, &ctx->tracks[i]) != NGX_OK) {
+            goto failed;
+        }
+    }
+
+    ngx_memcpy(mf->tracks, ctx->tracks, sizeof(ctx->tracks));
+    mf->ntracks = ctx->ntracks;
+    mf->width = ctx->width;
+    mf->height = ctx->height;
+    mf->nchannels = ctx->nchannels;
+    mf->sample_size = ctx->sample_size;
+    mf->sample_rate = ctx->sample_rate;
+
+    mf->refs = 1;
+
+    ngx_queue_insert_head(&ngx_rtmp_mp4_cache, &mf->queue);
+    ngx_rtmp_mp4_cache_n++;
+
+    return mf;
+
+failed:
+
+    ngx_rtmp_mp4_cache_free(mf);
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_rtmp_mp4_init(ngx_rtmp_session_t *s, ngx_file_t *f, ngx_int_t aindex,
+                  ngx_int_t vindex)
+{
+    ngx_rtmp_mp4_ctx_t         *ctx;
+    ngx_rtmp_mp4_main_conf_t   *mmcf;
+    ngx_rtmp_mp4_file_t        *mf;
+    ngx_file_info_t             fi;
+
+    mmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_mp4_module);
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_mp4_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_palloc(s->connection->pool, sizeof(ngx_rtmp_mp4_ctx_t));
+
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_mp4_module);
+
+    } else if (ctx->file) {
+        ngx_rtmp_mp4_cache_release(mmcf, ctx->file);
+    }
+
+    ngx_memzero(ctx, sizeof(*ctx));
+
+    ctx->aindex = aindex;
+    ctx->vindex = vindex;
+
+    if (ngx_fd_info(f->fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "mp4: " ngx_fd_info_n " failed");
         return NGX_ERROR;
     }
 
-    return ngx_rtmp_mp4_parse(s, (u_char *) ctx->mmaped + page_offset,
-                                 (u_char *) ctx->mmaped + page_offset + size);
+    ngx_rtmp_mp4_cache_expire(mmcf);
+
+    mf = ngx_rtmp_mp4_cache_get(&fi, aindex, vindex);
+
+    if (mf) {
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "mp4: cache hit %p", mf);
+
+        ngx_memcpy(ctx->tracks, mf->tracks, sizeof(ctx->tracks));
+        ctx->ntracks = mf->ntracks;
+        ctx->width = mf->width;
+        ctx->height = mf->height;
+        ctx->nchannels = mf->nchannels;
+        ctx->sample_size = mf->sample_size;
+        ctx->sample_rate = mf->sample_rate;
+
+    } else {
+        mf = ngx_rtmp_mp4_load(s, f, &fi);
+        if (mf == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    ctx->file = mf;
+
+    return NGX_OK;
 }
 
 
@@ -2414,23 +3013,19 @@ static ngx_int_t
 ngx_rtmp_mp4_done(ngx_rtmp_session_t *s, ngx_file_t *f)
 {
     ngx_rtmp_mp4_ctx_t            *ctx;
+    ngx_rtmp_mp4_main_conf_t      *mmcf;
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_mp4_module);
 
-    if (ctx == NULL || ctx->mmaped == NULL) {
+    if (ctx == NULL || ctx->file == NULL) {
         return NGX_OK;
     }
 
-    if (ngx_rtmp_mp4_munmap(ctx->mmaped, ctx->mmaped_size, &ctx->extra)
-        != NGX_OK)
-    {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "mp4: munmap failed");
-        return NGX_ERROR;
-    }
+    mmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_mp4_module);
 
-    ctx->mmaped = NULL;
-    ctx->mmaped_size = 0;
+    ngx_rtmp_mp4_cache_release(mmcf, ctx->file);
+
+    ctx->file = NULL;
 
     return NGX_OK;
 }
@@ -2575,6 +3170,8 @@ ngx_rtmp_mp4_postconfiguration(ngx_conf_t *cf)
 
     *pfmt = fmt;
 
+    ngx_queue_init(&ngx_rtmp_mp4_cache);
+
     ngx_str_set(&fmt->name, "mp4-format");
 
     ngx_str_set(&fmt->pfx, "mp4:");
@@ -16,7 +16,6 @@ static char * ngx_rtmp_netcall_merge_srv_conf(ngx_conf_t *cf,
        void *parent, void *child);
 
 static void ngx_rtmp_netcall_close(ngx_connection_t *cc);
-static void ngx_rtmp_netcall_detach(ngx_connection_t *cc);
 
 static void ngx_rtmp_netcall_recv(ngx_event_t *rev);
 static void ngx_rtmp_netcall_send(ngx_event_t *wev);
@@ -25,10 +24,33 @@ static void ngx_rtmp_netcall_send(ngx_event_t *wev);
 typedef struct {
     ngx_msec_t                                  timeout;
     size_t                                      bufsize;
+    ngx_uint_t                                  keepalive;
+    ngx_msec_t                                  keepalive_timeout;
+    ngx_uint_t                                  max_conns;
     ngx_log_t                                  *log;
 } ngx_rtmp_netcall_srv_conf_t;
 
 
+struct ngx_rtmp_netcall_upstream_s {
+    ngx_url_t                                  *url;
+    ngx_uint_t                                  keepalive;
+    ngx_msec_t                                  timeout;
+    ngx_uint_t                                  max_conns;
+    ngx_uint_t                                  active;
+    ngx_queue_t                                 cache;
+    ngx_queue_t                                 free;
+    ngx_queue_t                                 waiting;
+    ngx_rtmp_netcall_upstream_t                *next;
+};
+
+
+typedef struct {
+    ngx_queue_t                                 queue;
+    ngx_connection_t                           *connection;
+    ngx_rtmp_netcall_upstream_t                *upstream;
+} ngx_rtmp_netcall_keepalive_t;
+
+
 typedef struct ngx_rtmp_netcall_session_s {
     ngx_rtmp_session_t                         *session;
     ngx_peer_connection_t                      *pc;
@@ -44,6 +66,18 @@ typedef struct ngx_rtmp_netcall_session_s {
     ngx_msec_t                                  timeout;
     unsigned                                    detached:1;
     size_t                                      bufsize;
+    ngx_pool_t                                 *pool;
+
+    /* keepalive & queueing */
+    ngx_rtmp_netcall_upstream_t                *upstream;
+    ngx_queue_t                                 queue;
+    ngx_event_t                                 wait;
+    ngx_chain_t                                *request;
+    u_char                                    **request_pos;
+    unsigned                                    keepalive:1;
+    unsigned                                    reuse:1;
+    unsigned                                    reused:1;
+    unsigned                                    received:1;
 } ngx_rtmp_netcall_session_t;
 
 
@@ -68,6 +102,27 @@ static ngx_command_t  ngx_rtmp_netcall_commands[] = {
       offsetof(ngx_rtmp_netcall_srv_conf_t, bufsize),
       NULL },
 
+    { ngx_string("netcall_keepalive"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_netcall_srv_conf_t, keepalive),
+      NULL },
+
+    { ngx_string("netcall_keepalive_timeout"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_netcall_srv_conf_t, keepalive_timeout),
+      NULL },
+
+    { ngx_string("netcall_max_conns"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_netcall_srv_conf_t, max_conns),
+      NULL },
+
       ngx_null_command
 };
 
@@ -112,6 +167,9 @@ ngx_rtmp_netcall_create_srv_conf(ngx_conf_t *cf)
 
     nscf->timeout = NGX_CONF_UNSET_MSEC;
     nscf->bufsize = NGX_CONF_UNSET_SIZE;
+    nscf->keepalive = NGX_CONF_UNSET_UINT;
+    nscf->keepalive_timeout = NGX_CONF_UNSET_MSEC;
+    nscf->max_conns = NGX_CONF_UNSET_UINT;
 
     nscf->log = &cf->cycle->new_log;
 
@@ -127,6 +185,10 @@ ngx_rtmp_netcall_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_msec_value(conf->timeout, prev->timeout, 10000);
     ngx_conf_merge_size_value(conf->bufsize, prev->bufsize, 1024);
+    ngx_conf_merge_uint_value(conf->keepalive, prev->keepalive, 0);
+    ngx_conf_merge_msec_value(conf->keepalive_timeout,
+                              prev->keepalive_timeout, 60000);
+    ngx_conf_merge_uint_value(conf->max_conns, prev->max_conns, 0);
 
     return NGX_CONF_OK;
 }
@@ -143,7 +205,7 @@ ngx_rtmp_netcall_disconnect(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
     if (ctx) {
         for (cs = ctx->cs; cs; cs = cs->next) {
-            ngx_rtmp_netcall_detach(cs->pc->connection);
+            cs->detached = 1;
         }
     }
 
@@ -171,34 +233,382 @@ ngx_rtmp_netcall_free_peer(ngx_peer_connection_t *pc, void *data,
 }
 
 
+static ngx_rtmp_netcall_upstream_t *ngx_rtmp_netcall_upstreams;
+
+
+ngx_rtmp_netcall_upstream_t *
+ngx_rtmp_netcall_upstream(ngx_url_t *url, ngx_uint_t keepalive,
+        ngx_msec_t timeout, ngx_uint_t max_conns)
+{
+    ngx_rtmp_netcall_upstream_t    *up;
+    ngx_rtmp_netcall_keepalive_t   *items;
+    ngx_uint_t                      n;
+
+    for (up = ngx_rtmp_netcall_upstreams; up; up = up->next) {
+        if (up->url == url) {
+            return up;
+        }
+    }
+
+    up = ngx_pcalloc(ngx_cycle->pool, sizeof(ngx_rtmp_netcall_upstream_t));
+    if (up == NULL) {
+        return NULL;
+    }
+
+    if (keepalive) {
+        items = ngx_pcalloc(ngx_cycle->pool,
+                            sizeof(ngx_rtmp_netcall_keepalive_t) * keepalive);
+        if (items == NULL) {
+            return NULL;
+        }
+
+    } else {
+        items = NULL;
+    }
+
+    up->url = url;
+    up->keepalive = keepalive;
+    up->timeout = timeout;
+    up->max_conns = max_conns;
+
+    ngx_queue_init(&up->cache);
+    ngx_queue_init(&up->free);
+    ngx_queue_init(&up->waiting);
+
+    for (n = 0; n < keepalive; n++) {
+        items[n].upstream = up;
+        ngx_queue_insert_tail(&up->free, &items[n].queue);
+    }
+
+    up->next = ngx_rtmp_netcall_upstreams;
+    ngx_rtmp_netcall_upstreams = up;
+
+    return up;
+}
+
+
+static void
+ngx_rtmp_netcall_keepalive_dummy(ngx_event_t *ev)
+{
+}
+
+
+static void
+ngx_rtmp_netcall_keepalive_close_handler(ngx_event_t *ev)
+{
+    ngx_rtmp_netcall_keepalive_t   *item;
+    ngx_connection_t               *c;
+    ngx_int_t                       n;
+    u_char                          buf[1];
+
+    c = ev->data;
+    item = c->data;
+
+    if (c->close || ev->timedout) {
+        goto close;
+    }
+
+    /* anything but EAGAIN means close or unexpected data */
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        ev->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+close:
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&item->upstream->free, &item->queue);
+
+    ngx_close_connection(c);
+}
+
+
+ngx_connection_t *
+ngx_rtmp_netcall_keepalive_get(ngx_rtmp_netcall_upstream_t *up)
+{
+    ngx_rtmp_netcall_keepalive_t   *item;
+    ngx_connection_t               *c;
+    ngx_queue_t                    *q;
+
+    if (up == NULL || ngx_queue_empty(&up->cache)) {
+        return NULL;
+    }
+
+    q = ngx_queue_head(&up->cache);
+    ngx_queue_remove(q);
+
+    item = ngx_queue_data(q, ngx_rtmp_netcall_keepalive_t, queue);
+    ngx_queue_insert_head(&up->free, q);
+
+    c = item->connection;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    c->idle = 0;
+    c->data = NULL;
+
+    return c;
+}
+
+
 ngx_int_t
-ngx_rtmp_netcall_create(ngx_rtmp_session_t *s, ngx_rtmp_netcall_init_t *ci)
+ngx_rtmp_netcall_keepalive_put(ngx_rtmp_netcall_upstream_t *up,
+        ngx_connection_t *cc)
+{
+    ngx_rtmp_netcall_keepalive_t   *item;
+    ngx_queue_t                    *q;
+
+    if (up == NULL || up->keepalive == 0 || ngx_terminate || ngx_exiting) {
+        return NGX_DECLINED;
+    }
+
+    if (cc->read->timer_set) {
+        ngx_del_timer(cc->read);
+    }
+
+    if (cc->write->timer_set) {
+        ngx_del_timer(cc->write);
+    }
+
+    if (ngx_handle_read_event(cc->read, 0) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_queue_empty(&up->free)) {
+
+        /* drop the least recently used connection */
+        q = ngx_queue_last(&up->cache);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_rtmp_netcall_keepalive_t, queue);
+        ngx_close_connection(item->connection);
+
+    } else {
+        q = ngx_queue_head(&up->free);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_rtmp_netcall_keepalive_t, queue);
+    }
+
+    ngx_queue_insert_head(&up->cache, q);
+
+    item->connection = cc;
+
+    cc->data = item;
+    cc->pool = NULL;
+    cc->idle = 1;
+    cc->destroyed = 0;
+    cc->log = ngx_cycle->log;
+    cc->read->log = ngx_cycle->log;
+    cc->write->log = ngx_cycle->log;
+
+    cc->read->handler = ngx_rtmp_netcall_keepalive_close_handler;
+    cc->write->handler = ngx_rtmp_netcall_keepalive_dummy;
+
+    ngx_add_timer(cc->read, up->timeout);
+
+    if (cc->read->ready) {
+        ngx_rtmp_netcall_keepalive_close_handler(cc->read);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_netcall_connect(ngx_rtmp_netcall_session_t *cs)
+{
+    ngx_peer_connection_t          *pc;
+    ngx_connection_t               *cc;
+    ngx_chain_t                    *cl;
+    ngx_uint_t                      n;
+    ngx_int_t                       rc;
+
+    pc = cs->pc;
+
+    /* a retried request always gets a new connection */
+    cc = (cs->keepalive && cs->request == NULL)
+         ? ngx_rtmp_netcall_keepalive_get(cs->upstream) : NULL;
+
+    if (cc) {
+
+        /* the server may have closed it meanwhile;
+         * remember the request to resend it on a new connection */
+        for (n = 0, cl = cs->out; cl; cl = cl->next, n++);
+
+        cs->request_pos = ngx_palloc(cs->pool, n * sizeof(u_char *));
+        if (cs->request_pos == NULL) {
+            ngx_close_connection(cc);
+            return NGX_ERROR;
+        }
+
+        cs->request = cs->out;
+        for (n = 0, cl = cs->out; cl; cl = cl->next, n++) {
+            cs->request_pos[n] = cl->buf->pos;
+        }
+
+        cc->log = pc->log;
+        cc->read->log = pc->log;
+        cc->write->log = pc->log;
+        pc->connection = cc;
+        cs->reused = 1;
+
+    } else {
+        rc = ngx_event_connect_peer(pc);
+        if (rc != NGX_OK && rc != NGX_AGAIN) {
+            ngx_log_debug0(NGX_LOG_DEBUG_RTMP, pc->log, 0,
+                    "netcall: connection failed");
+            return NGX_ERROR;
+        }
+
+        cc = pc->connection;
+        cs->reused = 0;
+    }
+
+    cc->data = cs;
+    cc->pool = cs->pool;
+
+    cc->write->handler = ngx_rtmp_netcall_send;
+    cc->read->handler = ngx_rtmp_netcall_recv;
+
+    if (cs->upstream) {
+        cs->upstream->active++;
+    }
+
+    ngx_rtmp_netcall_send(cc->write);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_netcall_finalize(ngx_rtmp_netcall_session_t *cs)
+{
+    ngx_rtmp_netcall_session_t        **css;
+    ngx_rtmp_session_t                 *s;
+    ngx_rtmp_netcall_ctx_t             *ctx;
+    ngx_buf_t                          *b;
+
+    if (cs->detached) {
+        return;
+    }
+
+    s = cs->session;
+
+    if (s == NULL) {
+        cs->handle(NULL, cs->arg, cs->in);
+        return;
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_netcall_module);
+
+    if (cs->in && cs->sink) {
+        cs->sink(cs->session, cs->in);
+
+        b = cs->in->buf;
+        b->pos = b->last = b->start;
+
+    }
+
+    for(css = &ctx->cs; *css; css = &((*css)->next)) {
+        if (*css == cs) {
+            *css = cs->next;
+            break;
+        }
+    }
+
+    if (cs->handle && cs->handle(s, cs->arg, cs->in) != NGX_OK) {
+        s->status_code = ngx_rtmp_netcall_err;
+        ngx_rtmp_finalize_session(s);
+    }
+}
+
+
+/* start queued netcalls while the upstream has free slots */
+static void
+ngx_rtmp_netcall_next(ngx_rtmp_netcall_upstream_t *up)
+{
+    ngx_rtmp_netcall_session_t         *cs;
+    ngx_queue_t                        *q;
+
+    while (!ngx_queue_empty(&up->waiting)
+           && (up->max_conns == 0 || up->active < up->max_conns))
+    {
+        q = ngx_queue_head(&up->waiting);
+        ngx_queue_remove(q);
+
+        cs = ngx_queue_data(q, ngx_rtmp_netcall_session_t, queue);
+
+        if (cs->wait.timer_set) {
+            ngx_del_timer(&cs->wait);
+        }
+
+        if (ngx_rtmp_netcall_connect(cs) != NGX_OK) {
+            ngx_rtmp_netcall_finalize(cs);
+            ngx_destroy_pool(cs->pool);
+        }
+    }
+}
+
+
+static void
+ngx_rtmp_netcall_wait_timeout(ngx_event_t *ev)
+{
+    ngx_rtmp_netcall_session_t         *cs;
+
+    cs = ev->data;
+
+    ngx_log_error(NGX_LOG_INFO, ev->log, NGX_ETIMEDOUT,
+            "netcall: no free connection to \"%V\"", &cs->url->url);
+
+    ngx_queue_remove(&cs->queue);
+
+    ngx_rtmp_netcall_finalize(cs);
+    ngx_destroy_pool(cs->pool);
+}
+
+
+static ngx_int_t
+ngx_rtmp_netcall_create_handler(ngx_rtmp_session_t *s, void **srv_conf,
+        ngx_rtmp_netcall_init_t *ci)
 {
     ngx_rtmp_netcall_ctx_t         *ctx;
     ngx_peer_connection_t          *pc;
     ngx_rtmp_netcall_session_t     *cs;
     ngx_rtmp_netcall_srv_conf_t    *nscf;
-    ngx_connection_t               *c, *cc;
+    ngx_rtmp_netcall_upstream_t    *up;
+    ngx_connection_t               *c;
     ngx_pool_t                     *pool;
-    ngx_int_t                       rc;
 
     pool = NULL;
-    c = s->connection;
+    ctx = NULL;
+    c = s ? s->connection : NULL;
 
-    nscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_netcall_module);
+    nscf = srv_conf[ngx_rtmp_netcall_module.ctx_index];
     if (nscf == NULL) {
         goto error;
     }
 
     /* get module context */
-    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_netcall_module);
-    if (ctx == NULL) {
-        ctx = ngx_pcalloc(c->pool,
-                sizeof(ngx_rtmp_netcall_ctx_t));
+    if (s) {
+        ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_netcall_module);
         if (ctx == NULL) {
-            return NGX_ERROR;
+            ctx = ngx_pcalloc(c->pool,
+                    sizeof(ngx_rtmp_netcall_ctx_t));
+            if (ctx == NULL) {
+                return NGX_ERROR;
+            }
+            ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_netcall_module);
         }
-        ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_netcall_module);
     }
 
     /* Create netcall pool, connection, session.
@@ -239,44 +649,56 @@ ngx_rtmp_netcall_create(ngx_rtmp_session_t *s, ngx_rtmp_netcall_init_t *ci)
     if (cs->handle == NULL) {
         cs->detached = 1;
     }
+    cs->pool = pool;
+    cs->pc = pc;
 
-    pc->log = nscf->log;
-    pc->get = ngx_rtmp_netcall_get_peer;
-    pc->free = ngx_rtmp_netcall_free_peer;
-    pc->data = cs;
-
-    /* connect */
-    rc = ngx_event_connect_peer(pc);
-    if (rc != NGX_OK && rc != NGX_AGAIN ) {
-        ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                "netcall: connection failed");
-        goto error;
+    if (nscf->keepalive || nscf->max_conns) {
+        cs->upstream = ngx_rtmp_netcall_upstream(ci->url, nscf->keepalive,
+                                                 nscf->keepalive_timeout,
+                                                 nscf->max_conns);
     }
 
-    cc = pc->connection;
-    cc->data = cs;
-    cc->pool = pool;
-    cs->pc = pc;
+    up = cs->upstream;
+
+    /* create asks for keepalive by ngx_rtmp_netcall_http_keepalive(),
+     * only plain http replies have a known end */
+    cs->keepalive = (nscf->keepalive && ci->filter == NULL
+                     && ci->sink == NULL);
 
     cs->out = ci->create(s, ci->arg, pool);
+
     if (cs->out == NULL) {
-        ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+        ngx_log_debug0(NGX_LOG_DEBUG_RTMP, nscf->log, 0,
                 "netcall: creation failed");
-        ngx_close_connection(pc->connection);
         goto error;
     }
 
-    cc->write->handler = ngx_rtmp_netcall_send;
-    cc->read->handler = ngx_rtmp_netcall_recv;
+    pc->log = nscf->log;
+    pc->get = ngx_rtmp_netcall_get_peer;
+    pc->free = ngx_rtmp_netcall_free_peer;
+    pc->data = cs;
 
-    if (!cs->detached) {
+    if (ctx && !cs->detached) {
         cs->next = ctx->cs;
         ctx->cs = cs;
     }
 
-    ngx_rtmp_netcall_send(cc->write);
+    if (up && up->max_conns && up->active >= up->max_conns) {
+        cs->wait.handler = ngx_rtmp_netcall_wait_timeout;
+        cs->wait.data = cs;
+        cs->wait.log = nscf->log;
+        ngx_add_timer(&cs->wait, cs->timeout);
+
+        ngx_queue_insert_tail(&up->waiting, &cs->queue);
+
+    } else if (ngx_rtmp_netcall_connect(cs) != NGX_OK) {
+        if (ctx && !cs->detached) {
+            ctx->cs = cs->next;
+        }
+        goto error;
+    }
 
-    return c->destroyed ? NGX_ERROR : NGX_OK;
+    return (c && c->destroyed) ? NGX_ERROR : NGX_OK;
 
 error:
     if (pool) {
@@ -287,14 +709,27 @@ error:
 }
 
 
+ngx_int_t
+ngx_rtmp_netcall_create(ngx_rtmp_session_t *s, ngx_rtmp_netcall_init_t *ci)
+{
+    return ngx_rtmp_netcall_create_handler(s, s->srv_conf, ci);
+}
+
+
+ngx_int_t
+ngx_rtmp_netcall_create_sessionless(void **srv_conf,
+        ngx_rtmp_netcall_init_t *ci)
+{
+    return ngx_rtmp_netcall_create_handler(NULL, srv_conf, ci);
+}
+
+
 static void
 ngx_rtmp_netcall_close(ngx_connection_t *cc)
 {
-    ngx_rtmp_netcall_session_t         *cs, **css;
+    ngx_rtmp_netcall_session_t         *cs;
+    ngx_rtmp_netcall_upstream_t        *up;
     ngx_pool_t                         *pool;
-    ngx_rtmp_session_t                 *s;
-    ngx_rtmp_netcall_ctx_t             *ctx;
-    ngx_buf_t                          *b;
 
     cs = cc->data;
 
@@ -304,44 +739,67 @@ ngx_rtmp_netcall_close(ngx_connection_t *cc)
 
     cc->destroyed = 1;
 
-    if (!cs->detached) {
-        s = cs->session;
-        ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_netcall_module);
-
-        if (cs->in && cs->sink) {
-            cs->sink(cs->session, cs->in);
-
-            b = cs->in->buf;
-            b->pos = b->last = b->start;
-
-        }
+    ngx_rtmp_netcall_finalize(cs);
 
-        for(css = &ctx->cs; *css; css = &((*css)->next)) {
-            if (*css == cs) {
-                *css = cs->next;
-                break;
-            }
-        }
+    up = cs->upstream;
+    pool = cs->pool;
 
-        if (cs->handle && cs->handle(s, cs->arg, cs->in) != NGX_OK) {
-            s->status_code = ngx_rtmp_netcall_err;
-            ngx_rtmp_finalize_session(s);
-        }
+    if (!cs->reuse || ngx_rtmp_netcall_keepalive_put(up, cc) != NGX_OK) {
+        ngx_close_connection(cc);
     }
 
-    pool = cc->pool;
-    ngx_close_connection(cc);
     ngx_destroy_pool(pool);
+
+    if (up) {
+        up->active--;
+        ngx_rtmp_netcall_next(up);
+    }
 }
 
 
-static void
-ngx_rtmp_netcall_detach(ngx_connection_t *cc)
+/* the server has closed a reused keepalive connection
+ * before answering; send the request again on a new one */
+static ngx_int_t
+ngx_rtmp_netcall_retry(ngx_connection_t *cc)
 {
     ngx_rtmp_netcall_session_t         *cs;
+    ngx_rtmp_netcall_upstream_t        *up;
+    ngx_chain_t                        *cl;
+    ngx_uint_t                          n;
 
     cs = cc->data;
-    cs->detached = 1;
+
+    if (!cs->reused || cs->received) {
+        return NGX_DECLINED;
+    }
+
+    up = cs->upstream;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_RTMP, cc->log, 0,
+            "netcall: keepalive connection closed, retrying");
+
+    ngx_close_connection(cc);
+
+    if (up) {
+        up->active--;
+    }
+
+    for (n = 0, cl = cs->request; cl; cl = cl->next, n++) {
+        cl->buf->pos = cs->request_pos[n];
+    }
+
+    cs->out = cs->request;
+
+    if (ngx_rtmp_netcall_connect(cs) != NGX_OK) {
+        ngx_rtmp_netcall_finalize(cs);
+        ngx_destroy_pool(cs->pool);
+
+        if (up) {
+            ngx_rtmp_netcall_next(up);
+        }
+    }
+
+    return NGX_OK;
 }
 
 
@@ -353,6 +811,7 @@ ngx_rtmp_netcall_recv(ngx_event_t *rev)
     ngx_chain_t                        *cl;
     ngx_int_t                           n;
     ngx_buf_t                          *b;
+    ngx_flag_t                          keepalive;
 
     cc = rev->data;
     cs = cc->data;
@@ -417,7 +876,9 @@ ngx_rtmp_netcall_recv(ngx_event_t *rev)
         n = cc->recv(cc, b->last, b->end - b->last);
 
         if (n == NGX_ERROR || n == 0) {
-            ngx_rtmp_netcall_close(cc);
+            if (ngx_rtmp_netcall_retry(cc) != NGX_OK) {
+                ngx_rtmp_netcall_close(cc);
+            }
             return;
         }
 
@@ -437,6 +898,22 @@ ngx_rtmp_netcall_recv(ngx_event_t *rev)
         }
 
         b->last += n;
+        cs->received = 1;
+
+        /* keepalive server won't close the connection after reply */
+        if (cs->keepalive) {
+            switch (ngx_rtmp_netcall_http_complete(cs->in, &keepalive)) {
+
+            case NGX_OK:
+                cs->reuse = keepalive ? 1 : 0;
+                ngx_rtmp_netcall_close(cc);
+                return;
+
+            case NGX_DECLINED:
+                cs->keepalive = 0;
+                break;
+            }
+        }
     }
 }
 
@@ -470,7 +947,9 @@ ngx_rtmp_netcall_send(ngx_event_t *wev)
     cl = cc->send_chain(cc, cs->out, 0);
 
     if (cl == NGX_CHAIN_ERROR) {
-        ngx_rtmp_netcall_close(cc);
+        if (ngx_rtmp_netcall_retry(cc) != NGX_OK) {
+            ngx_rtmp_netcall_close(cc);
+        }
         return;
     }
 
@@ -493,11 +972,23 @@ ngx_rtmp_netcall_send(ngx_event_t *wev)
 }
 
 
+ngx_flag_t
+ngx_rtmp_netcall_http_keepalive(void **srv_conf)
+{
+    ngx_rtmp_netcall_srv_conf_t    *nscf;
+
+    nscf = srv_conf[ngx_rtmp_netcall_module.ctx_index];
+
+    return nscf && nscf->keepalive;
+}
+
+
 ngx_chain_t *
 ngx_rtmp_netcall_http_format_request(ngx_int_t method, ngx_str_t *host,
                                      ngx_str_t *uri, ngx_chain_t *args,
                                      ngx_chain_t *body, ngx_pool_t *pool,
-                                     ngx_str_t *content_type)
+                                     ngx_str_t *content_type,
+                                     ngx_flag_t keepalive)
 {
     ngx_chain_t                    *al, *bl, *ret;
     ngx_buf_t                      *b;
@@ -506,9 +997,13 @@ ngx_rtmp_netcall_http_format_request(ngx_int_t method, ngx_str_t *host,
     static const char               rq_tmpl[] = " HTTP/1.0\r\n"
                                                 "Host: %V\r\n"
                                                 "Content-Type: %V\r\n"
-                                                "Connection: Close\r\n"
+                                                "Connection: %s\r\n"
                                                 "Content-Length: %uz\r\n"
                                                 "\r\n";
+    const char                     *connection;
+
+    /* HTTP/1.0 keepalive: the reply always has Content-Length */
+    connection = keepalive ? "keep-alive" : "Close";
 
     content_length = 0;
     for (al = body; al; al = al->next) {
@@ -550,7 +1045,8 @@ ngx_rtmp_netcall_http_format_request(ngx_int_t method, ngx_str_t *host,
     }
 
     b = ngx_create_temp_buf(pool, sizeof(rq_tmpl) + host->len +
-                            content_type->len + NGX_SIZE_T_LEN);
+                            content_type->len + sizeof("keep-alive") +
+                            NGX_SIZE_T_LEN);
     if (b == NULL) {
         return NULL;
     }
@@ -558,7 +1054,7 @@ ngx_rtmp_netcall_http_format_request(ngx_int_t method, ngx_str_t *host,
     bl->buf = b;
 
     b->last = ngx_snprintf(b->last, b->end - b->last, rq_tmpl,
-                           host, content_type, content_length);
+                           host, content_type, connection, content_length);
 
     al->next = bl;
     bl->next = body;
@@ -681,6 +1177,116 @@ ngx_rtmp_netcall_http_skip_header(ngx_chain_t *in)
 }
 
 
+ngx_int_t
+ngx_rtmp_netcall_http_complete(ngx_chain_t *in, ngx_flag_t *keepalive)
+{
+    ngx_buf_t      *b;
+    u_char         *p, line[64];
+    size_t          len, n;
+    off_t           body, length;
+    ngx_int_t       status;
+    ngx_uint_t      http11, chunked, conn_close, conn_keepalive;
+
+    b = NULL;
+    p = NULL;
+    len = 0;
+    status = -1;
+    length = -1;
+    http11 = 0;
+    chunked = 0;
+    conn_close = 0;
+    conn_keepalive = 0;
+
+    /* scan header lines without consuming the chain;
+     * only the start of each line matters */
+    for ( ; in; in = in->next) {
+        b = in->buf;
+
+        for (p = b->pos; p < b->last; p++) {
+
+            if (*p == '\r') {
+                continue;
+            }
+
+            if (*p != '\n') {
+                if (len < sizeof(line)) {
+                    line[len++] = ngx_tolower(*p);
+                }
+                continue;
+            }
+
+            if (status == -1) {
+                if (len < sizeof("http/1.x 000") - 1
+                    || ngx_strncmp(line, "http/1.", 7) != 0)
+                {
+                    return NGX_DECLINED;
+                }
+
+                http11 = (line[7] == '1');
+                status = ngx_atoi(&line[9], 3);
+                if (status == NGX_ERROR) {
+                    return NGX_DECLINED;
+                }
+
+            } else if (len == 0) {
+                goto header_done;
+
+            } else if (len > 15
+                       && ngx_strncmp(line, "content-length:", 15) == 0)
+            {
+                for (n = 15; n < len && line[n] == ' '; n++);
+                for ( /* void */ ; len > n && line[len - 1] == ' '; len--);
+                length = ngx_atoof(&line[n], len - n);
+
+            } else if (len > 18
+                       && ngx_strncmp(line, "transfer-encoding:", 18) == 0)
+            {
+                chunked = 1;
+
+            } else if (len > 11
+                       && ngx_strncmp(line, "connection:", 11) == 0)
+            {
+                conn_close = (ngx_strlcasestrn(&line[11], &line[len],
+                                               (u_char *) "close", 5 - 1)
+                              != NULL);
+                conn_keepalive = (ngx_strlcasestrn(&line[11], &line[len],
+                                                   (u_char *) "keep-alive",
+                                                   10 - 1)
+                                  != NULL);
+            }
+
+            len = 0;
+        }
+    }
+
+    return NGX_AGAIN;
+
+header_done:
+
+    /* count body bytes after the blank line */
+    body = b->last - p - 1;
+    for (in = in->next; in; in = in->next) {
+        body += in->buf->last - in->buf->pos;
+    }
+
+    if (status < 200 || status == 204 || status == 304) {
+        length = 0;
+
+    } else if (chunked || length < 0) {
+        return NGX_DECLINED;
+    }
+
+    if (body < length) {
+        return NGX_AGAIN;
+    }
+
+    *keepalive = (body == length && !conn_close
+                  && (http11 || conn_keepalive));
+
+    return NGX_OK;
+}
+
+
 ngx_chain_t *
 ngx_rtmp_netcall_memcache_set(ngx_rtmp_session_t *s, ngx_pool_t *pool,
         ngx_str_t *key, ngx_str_t *value, ngx_uint_t flags, ngx_uint_t sec)
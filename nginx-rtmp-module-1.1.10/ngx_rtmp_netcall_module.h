@@ -48,15 +48,46 @@ typedef struct {
 ngx_int_t ngx_rtmp_netcall_create(ngx_rtmp_session_t *s,
         ngx_rtmp_netcall_init_t *ci);
 
+/* Netcall which is not bound to any RTMP session, e.g. made from
+ * a timer. Settings are taken from srv_conf; create and handle
+ * are called with NULL session and handle result is ignored */
+ngx_int_t ngx_rtmp_netcall_create_sessionless(void **srv_conf,
+        ngx_rtmp_netcall_init_t *ci);
+
+
+/* Keepalive connections to callback servers, one upstream per url
+ * in each worker. Idle connections are closed on keepalive timeout
+ * or when the server closes them. Limits of the first caller for
+ * the url apply; max_conns 0 means unlimited */
+typedef struct ngx_rtmp_netcall_upstream_s ngx_rtmp_netcall_upstream_t;
+
+ngx_rtmp_netcall_upstream_t * ngx_rtmp_netcall_upstream(ngx_url_t *url,
+        ngx_uint_t keepalive, ngx_msec_t timeout, ngx_uint_t max_conns);
+ngx_connection_t * ngx_rtmp_netcall_keepalive_get(
+        ngx_rtmp_netcall_upstream_t *up);
+ngx_int_t ngx_rtmp_netcall_keepalive_put(ngx_rtmp_netcall_upstream_t *up,
+        ngx_connection_t *cc);
+
 
 /* HTTP handling */
 ngx_chain_t * ngx_rtmp_netcall_http_format_session(ngx_rtmp_session_t *s,
         ngx_pool_t *pool);
 ngx_chain_t * ngx_rtmp_netcall_http_format_request(ngx_int_t method,
         ngx_str_t *host, ngx_str_t *uri, ngx_chain_t *args, ngx_chain_t *body,
-        ngx_pool_t *pool, ngx_str_t *content_type);
+        ngx_pool_t *pool, ngx_str_t *content_type, ngx_flag_t keepalive);
+
+/* Whether create callbacks should format keepalive requests, i.e.
+ * netcall_keepalive is on in srv_conf. Netcalls with filter or sink
+ * always read the reply until close and must pass 0 instead */
+ngx_flag_t ngx_rtmp_netcall_http_keepalive(void **srv_conf);
 ngx_chain_t * ngx_rtmp_netcall_http_skip_header(ngx_chain_t *in);
 
+/* NGX_OK when the whole response is in the chain; keepalive is set if
+ * the connection can be reused. NGX_DECLINED if the response is only
+ * delimited by connection close */
+ngx_int_t ngx_rtmp_netcall_http_complete(ngx_chain_t *in,
+        ngx_flag_t *keepalive);
+
 
 /* Memcache handling */
 ngx_chain_t * ngx_rtmp_netcall_memcache_set(ngx_rtmp_session_t *s,
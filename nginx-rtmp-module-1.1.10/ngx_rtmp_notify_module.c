@@ -42,6 +42,9 @@ static ngx_int_t ngx_rtmp_notify_done(ngx_rtmp_session_t *s, char *cbname,
 ngx_str_t   ngx_rtmp_notify_urlencoded =
             ngx_string("application/x-www-form-urlencoded");
 
+ngx_str_t   ngx_rtmp_notify_json =
+            ngx_string("application/json");
+
 
 #define NGX_RTMP_NOTIFY_PUBLISHING              0x01
 #define NGX_RTMP_NOTIFY_PLAYING                 0x02
@@ -73,6 +76,9 @@ typedef struct {
     ngx_msec_t                                  update_timeout;
     ngx_flag_t                                  update_strict;
     ngx_flag_t                                  relay_redirect;
+    ngx_flag_t                                  batch;
+    ngx_msec_t                                  batch_interval;
+    size_t                                      batch_buffer;
 } ngx_rtmp_notify_app_conf_t;
 
 
@@ -97,6 +103,29 @@ typedef struct {
 } ngx_rtmp_notify_done_t;
 
 
+/* Events waiting to be posted to one callback url in this worker.
+ * The buffer holds comma-terminated JSON objects; the first
+ * 'sent' bytes are in flight and stay until the server accepts them */
+typedef struct ngx_rtmp_notify_batch_s ngx_rtmp_notify_batch_t;
+
+struct ngx_rtmp_notify_batch_s {
+    ngx_url_t                                  *url;
+    void                                      **srv_conf;
+    u_char                                     *start;
+    u_char                                     *last;
+    u_char                                     *end;
+    size_t                                      sent;
+    ngx_uint_t                                  dropped;
+    ngx_msec_t                                  interval;
+    ngx_event_t                                 evt;
+    unsigned                                    busy:1;
+    ngx_rtmp_notify_batch_t                    *next;
+};
+
+
+static ngx_rtmp_notify_batch_t                 *ngx_rtmp_notify_batches;
+
+
 static ngx_command_t  ngx_rtmp_notify_commands[] = {
 
     { ngx_string("on_connect"),
@@ -191,6 +220,27 @@ static ngx_command_t  ngx_rtmp_notify_commands[] = {
       offsetof(ngx_rtmp_notify_app_conf_t, relay_redirect),
       NULL },
 
+    { ngx_string("notify_batch"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_notify_app_conf_t, batch),
+      NULL },
+
+    { ngx_string("notify_batch_interval"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_notify_app_conf_t, batch_interval),
+      NULL },
+
+    { ngx_string("notify_batch_buffer"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_notify_app_conf_t, batch_buffer),
+      NULL },
+
       ngx_null_command
 };
 
@@ -242,6 +292,9 @@ ngx_rtmp_notify_create_app_conf(ngx_conf_t *cf)
     nacf->update_timeout = NGX_CONF_UNSET_MSEC;
     nacf->update_strict = NGX_CONF_UNSET;
     nacf->relay_redirect = NGX_CONF_UNSET;
+    nacf->batch = NGX_CONF_UNSET;
+    nacf->batch_interval = NGX_CONF_UNSET_MSEC;
+    nacf->batch_buffer = NGX_CONF_UNSET_SIZE;
 
     return nacf;
 }
@@ -271,6 +324,11 @@ ngx_rtmp_notify_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
                               30000);
     ngx_conf_merge_value(conf->update_strict, prev->update_strict, 0);
     ngx_conf_merge_value(conf->relay_redirect, prev->relay_redirect, 0);
+    ngx_conf_merge_value(conf->batch, prev->batch, 0);
+    ngx_conf_merge_msec_value(conf->batch_interval, prev->batch_interval,
+                              1000);
+    ngx_conf_merge_size_value(conf->batch_buffer, prev->batch_buffer,
+                              1024 * 1024);
 
     return NGX_CONF_OK;
 }
@@ -343,8 +401,8 @@ ngx_rtmp_notify_create_request(ngx_rtmp_session_t *s, ngx_pool_t *pool,
     }
 
     return ngx_rtmp_netcall_http_format_request(nacf->method, &url->host,
-                                                &url->uri, al, bl, pool,
-                                                &ngx_rtmp_notify_urlencoded);
+                &url->uri, al, bl, pool, &ngx_rtmp_notify_urlencoded,
+                ngx_rtmp_netcall_http_keepalive(s->srv_conf));
 }
 
 
@@ -450,8 +508,8 @@ ngx_rtmp_notify_connect_create(ngx_rtmp_session_t *s, void *arg,
     }
 
     return ngx_rtmp_netcall_http_format_request(nscf->method, &url->host,
-                                                &url->uri, al, bl, pool,
-                                                &ngx_rtmp_notify_urlencoded);
+                &url->uri, al, bl, pool, &ngx_rtmp_notify_urlencoded,
+                ngx_rtmp_netcall_http_keepalive(s->srv_conf));
 }
 
 
@@ -511,8 +569,8 @@ ngx_rtmp_notify_disconnect_create(ngx_rtmp_session_t *s, void *arg,
     }
 
     return ngx_rtmp_netcall_http_format_request(nscf->method, &url->host,
-                                                &url->uri, al, bl, pool,
-                                                &ngx_rtmp_notify_urlencoded);
+                &url->uri, al, bl, pool, &ngx_rtmp_notify_urlencoded,
+                ngx_rtmp_netcall_http_keepalive(s->srv_conf));
 }
 
 
@@ -797,9 +855,9 @@ ngx_rtmp_notify_record_done_create(ngx_rtmp_session_t *s, void *arg,
 }
 
 
-static ngx_int_t
-ngx_rtmp_notify_parse_http_retcode(ngx_rtmp_session_t *s,
-        ngx_chain_t *in)
+/* returns the first digit of the HTTP status code, 0 if there is none */
+static ngx_uint_t
+ngx_rtmp_notify_http_status(ngx_log_t *log, ngx_chain_t *in)
 {
     ngx_buf_t      *b;
     ngx_int_t       n;
@@ -813,28 +871,21 @@ ngx_rtmp_notify_parse_http_retcode(ngx_rtmp_session_t *s,
         if (b->last - b->pos > n) {
             c = b->pos[n];
             if (c >= (u_char)'0' && c <= (u_char)'9') {
-                ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                ngx_log_debug1(NGX_LOG_DEBUG_RTMP, log, 0,
                     "notify: HTTP retcode: %dxx", (int)(c - '0'));
-                switch (c) {
-                    case (u_char) '2':
-                        return NGX_OK;
-                    case (u_char) '3':
-                        return NGX_AGAIN;
-                    default:
-                        return NGX_ERROR;
-                }
+                return c - '0';
             }
 
-            ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+            ngx_log_error(NGX_LOG_INFO, log, 0,
                     "notify: invalid HTTP retcode: %d..", (int)c);
 
-            return NGX_ERROR;
+            return 0;
         }
         n -= (b->last - b->pos);
         in = in->next;
     }
 
-    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+    ngx_log_error(NGX_LOG_INFO, log, 0,
             "notify: empty or broken HTTP response");
 
     /*
@@ -842,7 +893,21 @@ ngx_rtmp_notify_parse_http_retcode(ngx_rtmp_session_t *s,
      * it can happen in case of empty or broken reply
      */
 
-    return NGX_ERROR;
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_rtmp_notify_parse_http_retcode(ngx_log_t *log, ngx_chain_t *in)
+{
+    switch (ngx_rtmp_notify_http_status(log, in)) {
+        case 2:
+            return NGX_OK;
+        case 3:
+            return NGX_AGAIN;
+        default:
+            return NGX_ERROR;
+    }
 }
 
 
@@ -962,7 +1027,7 @@ ngx_rtmp_notify_connect_handle(ngx_rtmp_session_t *s,
 
     static ngx_str_t    location = ngx_string("location");
 
-    rc = ngx_rtmp_notify_parse_http_retcode(s, in);
+    rc = ngx_rtmp_notify_parse_http_retcode(s->connection->log, in);
     if (rc == NGX_ERROR) {
         return NGX_ERROR;
     }
@@ -1014,7 +1079,7 @@ ngx_rtmp_notify_publish_handle(ngx_rtmp_session_t *s,
 
     static ngx_str_t    location = ngx_string("location");
 
-    rc = ngx_rtmp_notify_parse_http_retcode(s, in);
+    rc = ngx_rtmp_notify_parse_http_retcode(s->connection->log, in);
     if (rc == NGX_ERROR) {
         ngx_rtmp_notify_clear_flag(s, NGX_RTMP_NOTIFY_PUBLISHING);
         return NGX_ERROR;
@@ -1093,7 +1158,7 @@ ngx_rtmp_notify_play_handle(ngx_rtmp_session_t *s,
 
     static ngx_str_t            location = ngx_string("location");
 
-    rc = ngx_rtmp_notify_parse_http_retcode(s, in);
+    rc = ngx_rtmp_notify_parse_http_retcode(s->connection->log, in);
     if (rc == NGX_ERROR) {
         ngx_rtmp_notify_clear_flag(s, NGX_RTMP_NOTIFY_PLAYING);
         return NGX_ERROR;
@@ -1168,7 +1233,7 @@ ngx_rtmp_notify_update_handle(ngx_rtmp_session_t *s,
 
     nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
 
-    rc = ngx_rtmp_notify_parse_http_retcode(s, in);
+    rc = ngx_rtmp_notify_parse_http_retcode(s->connection->log, in);
 
     if ((!nacf->update_strict && rc == NGX_ERROR) ||
          (nacf->update_strict && rc != NGX_OK))
@@ -1191,12 +1256,257 @@ ngx_rtmp_notify_update_handle(ngx_rtmp_session_t *s,
 }
 
 
+static ngx_chain_t *
+ngx_rtmp_notify_batch_create(ngx_rtmp_session_t *s, void *arg,
+        ngx_pool_t *pool)
+{
+    ngx_rtmp_notify_batch_t        *batch;
+    ngx_chain_t                    *pl;
+    ngx_buf_t                      *b;
+    size_t                          len;
+
+    batch = *(ngx_rtmp_notify_batch_t **) arg;
+
+    /* skip trailing comma */
+    len = batch->last - batch->start - 1;
+
+    pl = ngx_alloc_chain_link(pool);
+    if (pl == NULL) {
+        return NULL;
+    }
+
+    b = ngx_create_temp_buf(pool, sizeof("{\"events\":[]}") - 1 + len);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    pl->buf = b;
+    pl->next = NULL;
+
+    b->last = ngx_cpymem(b->last, (u_char *) "{\"events\":[",
+                         sizeof("{\"events\":[") - 1);
+    b->last = ngx_cpymem(b->last, batch->start, len);
+    b->last = ngx_cpymem(b->last, (u_char *) "]}", sizeof("]}") - 1);
+
+    batch->sent = len + 1;
+
+    return ngx_rtmp_netcall_http_format_request(NGX_RTMP_NETCALL_HTTP_POST,
+                &batch->url->host, &batch->url->uri, NULL, pl, pool,
+                &ngx_rtmp_notify_json,
+                ngx_rtmp_netcall_http_keepalive(batch->srv_conf));
+}
+
+
+static ngx_int_t
+ngx_rtmp_notify_batch_handle(ngx_rtmp_session_t *s,
+        void *arg, ngx_chain_t *in)
+{
+    ngx_rtmp_notify_batch_t        *batch;
+    ngx_uint_t                      status;
+
+    batch = *(ngx_rtmp_notify_batch_t **) arg;
+
+    batch->busy = 0;
+
+    status = ngx_rtmp_notify_http_status(ngx_cycle->log, in);
+
+    /* no response (connect error, timeout) or 5xx: keep for retry */
+    if (status == 0 || status == 5) {
+        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                      "notify: batch '%V' failed, %uz bytes kept for retry",
+                      &batch->url->url, (size_t) (batch->last - batch->start));
+
+        return NGX_OK;
+    }
+
+    /* the server rejected the events, resending would not help */
+    if (status != 2) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "notify: batch '%V' rejected with %uixx, "
+                      "%uz bytes dropped",
+                      &batch->url->url, status, batch->sent);
+    }
+
+    ngx_memmove(batch->start, batch->start + batch->sent,
+                batch->last - batch->start - batch->sent);
+
+    batch->last -= batch->sent;
+    batch->sent = 0;
+
+    if (batch->dropped) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "notify: batch '%V' dropped %ui events",
+                      &batch->url->url, batch->dropped);
+
+        batch->dropped = 0;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_notify_batch_flush(ngx_event_t *e)
+{
+    ngx_rtmp_notify_batch_t        *batch;
+    ngx_rtmp_netcall_init_t         ci;
+
+    batch = e->data;
+
+    if (!batch->busy && batch->last != batch->start) {
+
+        ngx_log_debug2(NGX_LOG_DEBUG_RTMP, e->log, 0,
+                       "notify: batch '%V' %uz bytes",
+                       &batch->url->url, (size_t) (batch->last - batch->start));
+
+        ngx_memzero(&ci, sizeof(ci));
+
+        ci.url = batch->url;
+        ci.create = ngx_rtmp_notify_batch_create;
+        ci.handle = ngx_rtmp_notify_batch_handle;
+        ci.arg = &batch;
+        ci.argsize = sizeof(batch);
+
+        batch->busy = 1;
+
+        if (ngx_rtmp_netcall_create_sessionless(batch->srv_conf, &ci)
+            != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_INFO, e->log, 0,
+                          "notify: batch '%V' failed", &batch->url->url);
+
+            batch->busy = 0;
+        }
+    }
+
+    /* events stay buffered until the server accepts them;
+     * on worker shutdown this was the last attempt */
+    if (batch->last != batch->start && !ngx_exiting && !ngx_terminate) {
+        ngx_add_timer(e, batch->interval);
+    }
+}
+
+
+static ngx_rtmp_notify_batch_t *
+ngx_rtmp_notify_batch_get(ngx_rtmp_session_t *s, ngx_url_t *url)
+{
+    ngx_rtmp_notify_app_conf_t     *nacf;
+    ngx_rtmp_notify_batch_t        *batch;
+
+    for (batch = ngx_rtmp_notify_batches; batch; batch = batch->next) {
+        if (batch->url == url) {
+            return batch;
+        }
+    }
+
+    nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
+
+    batch = ngx_pcalloc(ngx_cycle->pool, sizeof(ngx_rtmp_notify_batch_t));
+    if (batch == NULL) {
+        return NULL;
+    }
+
+    batch->start = ngx_palloc(ngx_cycle->pool, nacf->batch_buffer);
+    if (batch->start == NULL) {
+        return NULL;
+    }
+
+    batch->last = batch->start;
+    batch->end = batch->start + nacf->batch_buffer;
+    batch->url = url;
+    batch->srv_conf = s->srv_conf;
+    batch->interval = nacf->batch_interval;
+
+    batch->evt.data = batch;
+    batch->evt.log = ngx_cycle->log;
+    batch->evt.handler = ngx_rtmp_notify_batch_flush;
+    batch->evt.cancelable = 1;
+
+    batch->next = ngx_rtmp_notify_batches;
+    ngx_rtmp_notify_batches = batch;
+
+    return batch;
+}
+
+
+/* Queue event for the batched post to url; settings of the
+ * first app batching to the url apply in this worker */
+static void
+ngx_rtmp_notify_batch_event(ngx_rtmp_session_t *s, ngx_url_t *url,
+        char *call)
+{
+    ngx_rtmp_notify_ctx_t          *ctx;
+    ngx_rtmp_notify_batch_t        *batch;
+    ngx_str_t                      *addr;
+    size_t                          len, name_len, args_len;
+    u_char                         *p;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_notify_module);
+    if (ctx == NULL) {
+        return;
+    }
+
+    batch = ngx_rtmp_notify_batch_get(s, url);
+    if (batch == NULL) {
+        return;
+    }
+
+    addr = &s->connection->addr_text;
+    name_len = ngx_strlen(ctx->name);
+    args_len = ngx_strlen(ctx->args);
+
+    len = sizeof("{\"call\":\"\",\"app\":\"\",\"name\":\"\",\"args\":\"\","
+                 "\"addr\":\"\",\"clientid\":,\"time\":,\"timestamp\":,"
+                 "\"ts\":},") - 1 +
+          ngx_strlen(call) +
+          s->app.len + ngx_escape_json(NULL, s->app.data, s->app.len) +
+          name_len + ngx_escape_json(NULL, ctx->name, name_len) +
+          args_len + ngx_escape_json(NULL, ctx->args, args_len) +
+          addr->len + ngx_escape_json(NULL, addr->data, addr->len) +
+          NGX_INT_T_LEN + NGX_TIME_T_LEN + NGX_INT32_LEN + NGX_TIME_T_LEN;
+
+    if ((size_t) (batch->end - batch->last) < len) {
+        if (batch->dropped++ == 0) {
+            ngx_log_error(NGX_LOG_WARN, s->connection->log, 0,
+                          "notify: batch '%V' buffer full, dropping events",
+                          &url->url);
+        }
+
+        return;
+    }
+
+    p = ngx_sprintf(batch->last, "{\"call\":\"%s\",\"app\":\"", call);
+    p = (u_char *) ngx_escape_json(p, s->app.data, s->app.len);
+    p = ngx_cpymem(p, (u_char *) "\",\"name\":\"",
+                   sizeof("\",\"name\":\"") - 1);
+    p = (u_char *) ngx_escape_json(p, ctx->name, name_len);
+    p = ngx_cpymem(p, (u_char *) "\",\"args\":\"",
+                   sizeof("\",\"args\":\"") - 1);
+    p = (u_char *) ngx_escape_json(p, ctx->args, args_len);
+    p = ngx_cpymem(p, (u_char *) "\",\"addr\":\"",
+                   sizeof("\",\"addr\":\"") - 1);
+    p = (u_char *) ngx_escape_json(p, addr->data, addr->len);
+
+    batch->last = ngx_sprintf(p, "\",\"clientid\":%ui,\"time\":%T,"
+                              "\"timestamp\":%D,\"ts\":%T},",
+                              (ngx_uint_t) s->connection->number,
+                              ctx->start ? ngx_cached_time->sec - ctx->start
+                                         : (time_t) 0,
+                              s->current_time, ngx_cached_time->sec);
+
+    if (!batch->evt.timer_set && !ngx_exiting && !ngx_terminate) {
+        ngx_add_timer(&batch->evt, batch->interval);
+    }
+}
+
+
 static void
 ngx_rtmp_notify_update(ngx_event_t *e)
 {
     ngx_connection_t           *c;
     ngx_rtmp_session_t         *s;
     ngx_rtmp_notify_app_conf_t *nacf;
+    ngx_rtmp_notify_ctx_t      *ctx;
     ngx_rtmp_netcall_init_t     ci;
     ngx_url_t                  *url;
 
@@ -1207,6 +1517,19 @@ ngx_rtmp_notify_update(ngx_event_t *e)
 
     url = nacf->url[NGX_RTMP_NOTIFY_UPDATE];
 
+    if (nacf->batch) {
+        ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_notify_module);
+
+        ngx_rtmp_notify_batch_event(s, url,
+                (ctx->flags & NGX_RTMP_NOTIFY_PUBLISHING) ? "update_publish" :
+                (ctx->flags & NGX_RTMP_NOTIFY_PLAYING) ? "update_play" :
+                "update");
+
+        ngx_add_timer(e, nacf->update_timeout);
+
+        return;
+    }
+
     ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
                   "notify: update '%V'", &url->url);
 
@@ -1532,6 +1855,11 @@ ngx_rtmp_notify_done(ngx_rtmp_session_t *s, char *cbname, ngx_uint_t url_idx)
     ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
                   "notify: %s '%V'", cbname, &url->url);
 
+    if (nacf->batch) {
+        ngx_rtmp_notify_batch_event(s, url, cbname);
+        return NGX_OK;
+    }
+
     ds.cbname = (u_char *) cbname;
     ds.url_idx = url_idx;
 
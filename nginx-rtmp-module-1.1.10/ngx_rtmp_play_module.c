@@ -875,6 +875,17 @@ ngx_rtmp_play_next_entry(ngx_rtmp_session_t *s, ngx_rtmp_play_t *v)
         ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                        "play: open local file '%s'", path);
 
+        /* formats look up sidecar files by name */
+
+        ctx->file.name.len = p - path;
+        ctx->file.name.data = ngx_pnalloc(s->connection->pool,
+                                          ctx->file.name.len + 1);
+        if (ctx->file.name.data) {
+            ngx_memcpy(ctx->file.name.data, path, ctx->file.name.len + 1);
+        } else {
+            ctx->file.name.len = 0;
+        }
+
         if (ngx_rtmp_play_open(s, v->start) != NGX_OK) {
             return NGX_ERROR;
         }
@@ -1000,7 +1011,8 @@ ngx_rtmp_play_remote_create(ngx_rtmp_session_t *s, void *arg, ngx_pool_t *pool)
 
     return ngx_rtmp_netcall_http_format_request(NGX_RTMP_NETCALL_HTTP_GET,
                                                 &pe->url->host, &uri,
-                                                NULL, NULL, pool, &text_plain);
+                                                NULL, NULL, pool, &text_plain,
+                                                0);
 }
 
 
@@ -42,6 +42,55 @@ static ngx_int_t ngx_rtmp_record_node_close(ngx_rtmp_session_t *s,
 static void  ngx_rtmp_record_make_path(ngx_rtmp_session_t *s,
        ngx_rtmp_record_rec_ctx_t *rctx, ngx_str_t *path);
 static ngx_int_t ngx_rtmp_record_init(ngx_rtmp_session_t *s);
+static void ngx_rtmp_record_finish(ngx_log_t *log,
+       ngx_rtmp_record_app_conf_t *rracf, ngx_fd_t fd, u_char av,
+       ngx_str_t *path, ngx_rtmp_record_index_t *index, ngx_uint_t nindex,
+       ngx_uint_t index_append);
+static ngx_int_t ngx_rtmp_record_closed(ngx_rtmp_session_t *s,
+       ngx_rtmp_record_app_conf_t *rracf, ngx_str_t *path);
+
+
+#if (NGX_THREADS)
+
+struct ngx_rtmp_record_writer_s {
+    ngx_rtmp_session_t                 *session; /* NULL once it's gone */
+    ngx_queue_t                         queue;   /* in ctx->writers */
+    ngx_queue_t                         jobs;
+    ngx_rtmp_record_app_conf_t         *conf;
+    ngx_fd_t                            fd;
+    size_t                              backlog;
+
+    /* closed file, finished when the last write is done */
+    ngx_str_t                           path;
+    u_char                              pbuf[NGX_MAX_PATH + 1];
+    ngx_rtmp_record_index_t            *index;
+    ngx_uint_t                          nindex;
+    u_char                              av;
+    unsigned                            closing:1;
+    unsigned                            finished:1;
+    unsigned                            reported:1;
+    unsigned                            initialized:1;
+    unsigned                            index_append:1;
+};
+
+
+typedef struct {
+    ngx_rtmp_thread_job_t               job;
+    ngx_queue_t                         queue;   /* in writer->jobs */
+    ngx_rtmp_record_writer_t           *writer;
+    ngx_fd_t                            fd;
+    off_t                               offset;
+    size_t                              size;
+} ngx_rtmp_record_job_t;
+
+#endif
+
+
+static ngx_conf_enum_t  ngx_rtmp_record_backlog_policy[] = {
+    { ngx_string("block"),              NGX_RTMP_RECORD_BACKLOG_BLOCK },
+    { ngx_string("drop"),               NGX_RTMP_RECORD_BACKLOG_DROP  },
+    { ngx_null_string,                  0                             }
+};
 
 
 static ngx_conf_bitmask_t  ngx_rtmp_record_mask[] = {
@@ -138,6 +187,48 @@ static ngx_command_t  ngx_rtmp_record_commands[] = {
       offsetof(ngx_rtmp_record_app_conf_t, notify),
       NULL },
 
+    { ngx_string("record_index"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|
+                         NGX_RTMP_REC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_record_app_conf_t, index),
+      NULL },
+
+    { ngx_string("record_buffer"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|
+                         NGX_RTMP_REC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_record_app_conf_t, buffer),
+      NULL },
+
+    { ngx_string("record_backlog"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|
+                         NGX_RTMP_REC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_record_app_conf_t, backlog),
+      NULL },
+
+    { ngx_string("record_backlog_policy"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|
+                         NGX_RTMP_REC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_record_app_conf_t, backlog_policy),
+      &ngx_rtmp_record_backlog_policy },
+
+#if (NGX_THREADS)
+    { ngx_string("record_thread_pool"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|
+                         NGX_RTMP_REC_CONF|NGX_CONF_TAKE1,
+      ngx_rtmp_thread_pool_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_record_app_conf_t, thread_pool),
+      NULL },
+#endif
+
     { ngx_string("recorder"),
       NGX_RTMP_APP_CONF|NGX_CONF_BLOCK|NGX_CONF_TAKE1,
       ngx_rtmp_record_recorder,
@@ -197,6 +288,13 @@ ngx_rtmp_record_create_app_conf(ngx_conf_t *cf)
     racf->lock_file = NGX_CONF_UNSET;
     racf->notify = NGX_CONF_UNSET;
     racf->url = NGX_CONF_UNSET_PTR;
+    racf->index = NGX_CONF_UNSET;
+    racf->buffer = NGX_CONF_UNSET_SIZE;
+    racf->backlog = NGX_CONF_UNSET_SIZE;
+    racf->backlog_policy = NGX_CONF_UNSET_UINT;
+#if (NGX_THREADS)
+    racf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
 
     if (ngx_array_init(&racf->rec, cf->pool, 1, sizeof(void *)) != NGX_OK) {
         return NULL;
@@ -225,6 +323,21 @@ ngx_rtmp_record_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
                               (ngx_msec_t) NGX_CONF_UNSET);
     ngx_conf_merge_bitmask_value(conf->flags, prev->flags, 0);
     ngx_conf_merge_ptr_value(conf->url, prev->url, NULL);
+    ngx_conf_merge_value(conf->index, prev->index, 0);
+    ngx_conf_merge_size_value(conf->buffer, prev->buffer, 0);
+    ngx_conf_merge_size_value(conf->backlog, prev->backlog, 4 * 1024 * 1024);
+    ngx_conf_merge_uint_value(conf->backlog_policy, prev->backlog_policy,
+                              NGX_RTMP_RECORD_BACKLOG_BLOCK);
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+
+    if (conf->thread_pool && conf->buffer == 0) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "\"record_thread_pool\" requires "
+                           "\"record_buffer\", ignored");
+        conf->thread_pool = NULL;
+    }
+#endif
 
     if (conf->flags) {
         rracf = ngx_array_push(&conf->rec);
@@ -239,8 +352,643 @@ ngx_rtmp_record_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
 }
 
 
+#if (NGX_THREADS)
+
+static void
+ngx_rtmp_record_job_handler(ngx_rtmp_thread_job_t *job, ngx_log_t *log)
+{
+    ngx_rtmp_record_job_t      *rj = (ngx_rtmp_record_job_t *) job;
+    ngx_file_t                  file;
+
+    ngx_memzero(&file, sizeof(file));
+
+    file.fd = rj->fd;
+    file.log = log;
+    ngx_str_set(&file.name, "recorded");
+
+    job->rc = NGX_OK;
+
+    if (ngx_write_file(&file, (u_char *) &rj[1], rj->size, rj->offset)
+        == NGX_ERROR)
+    {
+        job->rc = NGX_ERROR;
+    }
+}
+
+
+static ngx_rtmp_record_writer_t *
+ngx_rtmp_record_writer(ngx_rtmp_session_t *s, ngx_rtmp_record_rec_ctx_t *rctx)
+{
+    ngx_rtmp_record_ctx_t      *ctx;
+    ngx_rtmp_record_writer_t   *w;
+
+    if (rctx->writer) {
+        return rctx->writer;
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_record_module);
+
+    w = ngx_calloc(sizeof(ngx_rtmp_record_writer_t), s->connection->log);
+    if (w == NULL) {
+        return NULL;
+    }
+
+    w->session = s;
+    w->conf = rctx->conf;
+    w->fd = rctx->file.fd;
+
+    ngx_queue_init(&w->jobs);
+    ngx_queue_insert_tail(&ctx->writers, &w->queue);
+
+    rctx->writer = w;
+
+    return w;
+}
+
+
+static void
+ngx_rtmp_record_writer_free(ngx_rtmp_record_writer_t *w)
+{
+    if (w->session) {
+        ngx_queue_remove(&w->queue);
+    }
+
+    if (w->index) {
+        ngx_free(w->index);
+    }
+
+    ngx_free(w);
+}
+
+
+static void
+ngx_rtmp_record_writer_report(ngx_rtmp_record_writer_t *w)
+{
+    if (w->reported) {
+        return;
+    }
+
+    w->reported = 1;
+
+    if (w->session) {
+        (void) ngx_rtmp_record_closed(w->session, w->conf, &w->path);
+    }
+}
+
+
+/*
+ * Complete a closed file: keyframe index, av mask and record_done,
+ * the descriptor is closed once no write uses it
+ */
+static void
+ngx_rtmp_record_writer_finish(ngx_rtmp_record_writer_t *w)
+{
+    ngx_log_t                  *log;
+    ngx_uint_t                  busy;
+
+    log = w->session ? w->session->connection->log : ngx_cycle->log;
+    busy = !ngx_queue_empty(&w->jobs);
+
+    if (!w->finished) {
+        w->finished = 1;
+
+        if (w->initialized) {
+            ngx_rtmp_record_finish(log, w->conf, w->fd, w->av, &w->path,
+                                   w->index, w->nindex, w->index_append);
+        }
+
+        if (busy) {
+            /* all data is on disk, threads rewrite the same bytes */
+            ngx_rtmp_record_writer_report(w);
+        }
+    }
+
+    if (busy) {
+        return;
+    }
+
+    if (ngx_close_file(w->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      "record: %V error closing file", &w->conf->id);
+    }
+
+    ngx_rtmp_record_writer_report(w);
+    ngx_rtmp_record_writer_free(w);
+}
+
+
+/*
+ * The session is going away and record_done cannot wait for the thread
+ * pool: write the data still in flight once more in place
+ */
+static void
+ngx_rtmp_record_writer_takeover(ngx_rtmp_record_writer_t *w, ngx_log_t *log)
+{
+    ngx_rtmp_record_job_t      *rj;
+    ngx_queue_t                *q;
+    ngx_file_t                  file;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, log, 0,
+                   "record: %V writing %uz bytes in flight in place",
+                   &w->conf->id, w->backlog);
+
+    ngx_memzero(&file, sizeof(file));
+
+    file.fd = w->fd;
+    file.log = log;
+    ngx_str_set(&file.name, "recorded");
+
+    for (q = ngx_queue_head(&w->jobs);
+         q != ngx_queue_sentinel(&w->jobs);
+         q = ngx_queue_next(q))
+    {
+        rj = ngx_queue_data(q, ngx_rtmp_record_job_t, queue);
+
+        if (ngx_write_file(&file, (u_char *) &rj[1], rj->size, rj->offset)
+            == NGX_ERROR)
+        {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          "record: %V error writing file", &w->conf->id);
+        }
+    }
+}
+
+
+static void
+ngx_rtmp_record_job_done(ngx_rtmp_thread_job_t *job, void *data)
+{
+    ngx_rtmp_record_job_t      *rj = (ngx_rtmp_record_job_t *) job;
+    ngx_rtmp_record_writer_t   *w;
+
+    w = rj->writer;
+
+    ngx_queue_remove(&rj->queue);
+    w->backlog -= rj->size;
+
+    if (w->closing && ngx_queue_empty(&w->jobs)) {
+        ngx_rtmp_record_writer_finish(w);
+    }
+}
+
+
+static void
+ngx_rtmp_record_writer_cleanup(void *data)
+{
+    ngx_rtmp_record_ctx_t      *ctx = data;
+    ngx_rtmp_record_writer_t   *w;
+    ngx_queue_t                *q;
+
+    /* writes outlive the session, nothing is reported after this */
+
+    while (!ngx_queue_empty(&ctx->writers)) {
+        q = ngx_queue_head(&ctx->writers);
+        ngx_queue_remove(q);
+
+        w = ngx_queue_data(q, ngx_rtmp_record_writer_t, queue);
+
+        w->session = NULL;
+        w->closing = 1;
+
+        if (!w->finished) {
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "record: %V file closed with the session, "
+                          "record_done not called", &w->conf->id);
+
+            w->finished = 1;
+            w->reported = 1;
+        }
+
+        if (ngx_queue_empty(&w->jobs)) {
+            ngx_rtmp_record_writer_finish(w);
+        }
+    }
+}
+
+
+/* closed files still waiting for writes are finished before the session */
+static ngx_int_t
+ngx_rtmp_record_disconnect(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+    ngx_chain_t *in)
+{
+    ngx_rtmp_record_ctx_t      *ctx;
+    ngx_rtmp_record_writer_t   *w;
+    ngx_queue_t                *q, *next;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_record_module);
+    if (ctx == NULL) {
+        return NGX_OK;
+    }
+
+    for (q = ngx_queue_head(&ctx->writers);
+         q != ngx_queue_sentinel(&ctx->writers);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        w = ngx_queue_data(q, ngx_rtmp_record_writer_t, queue);
+
+        if (w->closing && !w->finished) {
+            ngx_rtmp_record_writer_takeover(w, s->connection->log);
+            ngx_rtmp_record_writer_finish(w);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Hand the closed file over to its writer, returns NGX_DECLINED if
+ * nothing is in flight and the file can be finished in place
+ */
+static ngx_int_t
+ngx_rtmp_record_writer_close(ngx_rtmp_session_t *s,
+    ngx_rtmp_record_rec_ctx_t *rctx, u_char av, ngx_str_t *path)
+{
+    ngx_rtmp_record_writer_t   *w;
+
+    w = rctx->writer;
+    rctx->writer = NULL;
+
+    if (ngx_queue_empty(&w->jobs)) {
+        ngx_rtmp_record_writer_free(w);
+        return NGX_DECLINED;
+    }
+
+    w->path.data = w->pbuf;
+    w->path.len = ngx_min(path->len, NGX_MAX_PATH);
+    ngx_memcpy(w->pbuf, path->data, w->path.len);
+    w->pbuf[w->path.len] = 0;
+
+    w->index = rctx->index;
+    w->nindex = rctx->nindex;
+    w->av = av;
+    w->initialized = rctx->initialized;
+    w->index_append = rctx->index_append;
+    w->closing = 1;
+
+    rctx->index = NULL;
+    rctx->nindex = 0;
+    rctx->index_alloc = 0;
+    rctx->file.fd = NGX_INVALID_FILE;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "record: %V closing, %uz bytes in flight",
+                   &rctx->conf->id, w->backlog);
+
+    if (s->connection->destroyed) {
+        ngx_rtmp_record_writer_takeover(w, s->connection->log);
+        ngx_rtmp_record_writer_finish(w);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_record_post(ngx_rtmp_session_t *s, ngx_rtmp_record_rec_ctx_t *rctx,
+    size_t size)
+{
+    ngx_rtmp_record_app_conf_t *rracf;
+    ngx_rtmp_record_writer_t   *w;
+    ngx_rtmp_record_job_t      *rj;
+
+    rracf = rctx->conf;
+
+    w = ngx_rtmp_record_writer(s, rctx);
+    if (w == NULL) {
+        return NGX_ERROR;
+    }
+
+    rj = ngx_rtmp_thread_job_alloc(sizeof(ngx_rtmp_record_job_t) + size,
+                                   s->connection->log);
+    if (rj == NULL) {
+        return NGX_ERROR;
+    }
+
+    rj->job.handler = ngx_rtmp_record_job_handler;
+    rj->job.done = ngx_rtmp_record_job_done;
+    rj->writer = w;
+    rj->fd = rctx->file.fd;
+    rj->offset = rctx->file.offset;
+    rj->size = size;
+
+    ngx_memcpy(&rj[1], rctx->buf_start, size);
+
+    if (ngx_rtmp_thread_job_run(rracf->thread_pool, &rj->job,
+                                s->connection->log)
+        != NGX_OK)
+    {
+        ngx_free(rj);
+        return NGX_ERROR;
+    }
+
+    ngx_queue_insert_tail(&w->jobs, &rj->queue);
+    w->backlog += size;
+
+    rctx->file.offset += size;
+
+    return NGX_OK;
+}
+
+#endif
+
+
+/* bytes handed to the thread pool and not yet written */
+static size_t
+ngx_rtmp_record_backlog(ngx_rtmp_record_rec_ctx_t *rctx)
+{
+#if (NGX_THREADS)
+    if (rctx->writer) {
+        return rctx->writer->backlog;
+    }
+#endif
+
+    return 0;
+}
+
+
+/*
+ * Staged data is written in buffer-sized chunks, in the thread pool while
+ * the backlog permits, otherwise in place
+ */
+static ngx_int_t
+ngx_rtmp_record_flush(ngx_rtmp_session_t *s, ngx_rtmp_record_rec_ctx_t *rctx)
+{
+    size_t                      size;
+#if (NGX_THREADS)
+    ngx_rtmp_record_app_conf_t *rracf = rctx->conf;
+#endif
+
+    size = rctx->buf_last - rctx->buf_start;
+    if (size == 0) {
+        return NGX_OK;
+    }
+
+    rctx->buf_last = rctx->buf_start;
+
+#if (NGX_THREADS)
+    if (rracf->thread_pool
+        && (rracf->backlog_policy == NGX_RTMP_RECORD_BACKLOG_DROP
+            || ngx_rtmp_record_backlog(rctx) + size <= rracf->backlog)
+        && ngx_rtmp_record_post(s, rctx, size) == NGX_OK)
+    {
+        return NGX_OK;
+    }
+#endif
+
+    if (ngx_write_file(&rctx->file, rctx->buf_start, size, rctx->file.offset)
+        == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_record_write(ngx_rtmp_session_t *s, ngx_rtmp_record_rec_ctx_t *rctx,
+    u_char *data, size_t len)
+{
+    size_t                      n;
+
+    if (rctx->buf_start == NULL) {
+        return ngx_write_file(&rctx->file, data, len, rctx->file.offset)
+               == NGX_ERROR ? NGX_ERROR : NGX_OK;
+    }
+
+    while (len) {
+        n = ngx_min(len, (size_t) (rctx->buf_end - rctx->buf_last));
+
+        rctx->buf_last = ngx_cpymem(rctx->buf_last, data, n);
+        data += n;
+        len -= n;
+
+        if (rctx->buf_last == rctx->buf_end
+            && ngx_rtmp_record_flush(s, rctx) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/* drop the file after a write error, writes in flight keep the descriptor */
+static void
+ngx_rtmp_record_abort(ngx_rtmp_session_t *s, ngx_rtmp_record_rec_ctx_t *rctx)
+{
+#if (NGX_THREADS)
+    ngx_rtmp_record_writer_t   *w;
+
+    w = rctx->writer;
+
+    if (w) {
+        rctx->writer = NULL;
+
+        if (ngx_queue_empty(&w->jobs)) {
+            ngx_rtmp_record_writer_free(w);
+
+        } else {
+            w->closing = 1;
+            w->finished = 1;
+            w->reported = 1;
+
+            rctx->file.fd = NGX_INVALID_FILE;
+        }
+    }
+#endif
+
+    if (rctx->file.fd != NGX_INVALID_FILE) {
+        ngx_close_file(rctx->file.fd);
+        rctx->file.fd = NGX_INVALID_FILE;
+    }
+
+    if (rctx->index) {
+        ngx_free(rctx->index);
+        rctx->index = NULL;
+        rctx->nindex = 0;
+        rctx->index_alloc = 0;
+    }
+}
+
+
 static ngx_int_t
-ngx_rtmp_record_write_header(ngx_file_t *file)
+ngx_rtmp_record_index_add(ngx_rtmp_session_t *s,
+                          ngx_rtmp_record_rec_ctx_t *rctx,
+                          uint32_t timestamp, off_t offset)
+{
+    ngx_rtmp_record_index_t    *idx;
+    ngx_uint_t                  n;
+
+    if (rctx->nindex == rctx->index_alloc) {
+        n = rctx->index_alloc ? rctx->index_alloc * 2 : 256;
+
+        idx = ngx_alloc(n * sizeof(ngx_rtmp_record_index_t),
+                        s->connection->log);
+        if (idx == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (rctx->index) {
+            ngx_memcpy(idx, rctx->index,
+                       rctx->nindex * sizeof(ngx_rtmp_record_index_t));
+            ngx_free(rctx->index);
+        }
+
+        rctx->index = idx;
+        rctx->index_alloc = n;
+    }
+
+    idx = &rctx->index[rctx->nindex++];
+
+    idx->timestamp = timestamp;
+    idx->offset = offset;
+
+    return NGX_OK;
+}
+
+
+/* write collected keyframes to the sidecar index, called on close */
+static void
+ngx_rtmp_record_write_index(ngx_log_t *log, ngx_rtmp_record_app_conf_t *rracf,
+    ngx_str_t *path, ngx_rtmp_record_index_t *index, ngx_uint_t nindex,
+    ngx_uint_t append)
+{
+    ngx_rtmp_record_index_t    *idx;
+    ngx_fd_t                    fd;
+    ngx_uint_t                  n;
+    uint64_t                    offset;
+    u_char                     *buf, *p;
+
+    static u_char               ipath[NGX_MAX_PATH + 1];
+
+    if (!rracf->index) {
+        return;
+    }
+
+    p = ngx_snprintf(ipath, sizeof(ipath) - 1, "%V%s", path,
+                     NGX_RTMP_RECORD_INDEX_SUFFIX);
+    *p = 0;
+
+    fd = ngx_open_file(ipath, append ? NGX_FILE_APPEND : NGX_FILE_WRONLY,
+                       append ? NGX_FILE_CREATE_OR_OPEN : NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      "record: %V failed to open index '%s'",
+                      &rracf->id, ipath);
+        return;
+    }
+
+    if (nindex == 0) {
+        goto done;
+    }
+
+    buf = ngx_alloc(nindex * NGX_RTMP_RECORD_INDEX_ENTRY, log);
+    if (buf == NULL) {
+        goto done;
+    }
+
+    p = buf;
+    idx = index;
+
+    for (n = 0; n < nindex; n++, idx++) {
+        *p++ = (u_char) (idx->timestamp >> 24);
+        *p++ = (u_char) (idx->timestamp >> 16);
+        *p++ = (u_char) (idx->timestamp >> 8);
+        *p++ = (u_char) idx->timestamp;
+
+        offset = (uint64_t) idx->offset;
+
+        *p++ = (u_char) (offset >> 56);
+        *p++ = (u_char) (offset >> 48);
+        *p++ = (u_char) (offset >> 40);
+        *p++ = (u_char) (offset >> 32);
+        *p++ = (u_char) (offset >> 24);
+        *p++ = (u_char) (offset >> 16);
+        *p++ = (u_char) (offset >> 8);
+        *p++ = (u_char) offset;
+    }
+
+    if (ngx_write_fd(fd, buf, p - buf) != p - buf) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      "record: %V failed to write index '%s'",
+                      &rracf->id, ipath);
+    }
+
+    ngx_free(buf);
+
+done:
+
+    ngx_close_file(fd);
+}
+
+
+/* complete a closed file with its keyframe index and av mask */
+static void
+ngx_rtmp_record_finish(ngx_log_t *log, ngx_rtmp_record_app_conf_t *rracf,
+    ngx_fd_t fd, u_char av, ngx_str_t *path, ngx_rtmp_record_index_t *index,
+    ngx_uint_t nindex, ngx_uint_t index_append)
+{
+    ngx_file_t                  file;
+
+    ngx_rtmp_record_write_index(log, rracf, path, index, nindex,
+                                index_append);
+
+    ngx_memzero(&file, sizeof(file));
+
+    file.fd = fd;
+    file.log = log;
+    ngx_str_set(&file.name, "recorded");
+
+    if (ngx_write_file(&file, &av, 1, 4) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      "record: %V error writing av mask", &rracf->id);
+    }
+}
+
+
+/* report a closed file */
+static ngx_int_t
+ngx_rtmp_record_closed(ngx_rtmp_session_t *s,
+    ngx_rtmp_record_app_conf_t *rracf, ngx_str_t *path)
+{
+    void                      **app_conf;
+    ngx_int_t                   rc;
+    ngx_rtmp_record_done_t      v;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "record: %V closed", &rracf->id);
+
+    if (rracf->notify) {
+        ngx_rtmp_send_status(s, "NetStream.Record.Stop", "status",
+                             rracf->id.data ? (char *) rracf->id.data : "");
+    }
+
+    app_conf = s->app_conf;
+
+    if (rracf->rec_conf) {
+        s->app_conf = rracf->rec_conf;
+    }
+
+    v.recorder = rracf->id;
+    v.path = *path;
+
+    rc = ngx_rtmp_record_done(s, &v);
+
+    s->app_conf = app_conf;
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_rtmp_record_write_header(ngx_rtmp_session_t *s,
+                             ngx_rtmp_record_rec_ctx_t *rctx)
 {
     static u_char       flv_header[] = {
         0x46, /* 'F' */
@@ -258,9 +1006,7 @@ ngx_rtmp_record_write_header(ngx_file_t *file)
         0x00  /* PreviousTagSize0 (not actually a header) */
     };
 
-    return ngx_write_file(file, flv_header, sizeof(flv_header), 0) == NGX_ERROR
-           ? NGX_ERROR
-           : NGX_OK;
+    return ngx_rtmp_record_write(s, rctx, flv_header, sizeof(flv_header));
 }
 
 
@@ -364,6 +1110,93 @@ ngx_rtmp_record_find(ngx_rtmp_record_app_conf_t *racf, ngx_str_t *id)
 }
 
 
+ngx_int_t
+ngx_rtmp_record_index_lookup(ngx_str_t *name, uint32_t timestamp,
+    off_t *offset, ngx_log_t *log)
+{
+    u_char                          buf[NGX_RTMP_RECORD_INDEX_ENTRY], *p;
+    ngx_file_t                      file;
+    ngx_file_info_t                 fi;
+    ngx_uint_t                      lo, hi, mid;
+    ngx_int_t                       rc;
+    uint32_t                        t;
+    uint64_t                        off;
+
+    static u_char                   path[NGX_MAX_PATH + 1];
+
+    if (name->len == 0) {
+        return NGX_DECLINED;
+    }
+
+    p = ngx_snprintf(path, sizeof(path) - 1, "%V%s", name,
+                     NGX_RTMP_RECORD_INDEX_SUFFIX);
+    *p = 0;
+
+    ngx_memzero(&file, sizeof(file));
+
+    file.log = log;
+    file.name.data = path;
+    file.name.len = p - path;
+    file.fd = ngx_open_file(path, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        return NGX_DECLINED;
+    }
+
+    rc = NGX_DECLINED;
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        goto done;
+    }
+
+    lo = 0;
+    hi = (ngx_uint_t) (ngx_file_size(&fi) / NGX_RTMP_RECORD_INDEX_ENTRY);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, log, 0,
+                   "record: lookup index file '%s' nelts=%ui", path, hi);
+
+    /* entries [0, lo) are not after timestamp, [hi, n) are after */
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if (ngx_read_file(&file, buf, sizeof(buf),
+                          (off_t) mid * NGX_RTMP_RECORD_INDEX_ENTRY)
+            != (ssize_t) sizeof(buf))
+        {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "record: could not read index file '%s'", path);
+            rc = NGX_DECLINED;
+            goto done;
+        }
+
+        t = ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16)
+            | ((uint32_t) buf[2] << 8) | buf[3];
+
+        if (t > timestamp) {
+            hi = mid;
+            continue;
+        }
+
+        lo = mid + 1;
+
+        off = ((uint64_t) buf[4] << 56) | ((uint64_t) buf[5] << 48)
+              | ((uint64_t) buf[6] << 40) | ((uint64_t) buf[7] << 32)
+              | ((uint64_t) buf[8] << 24) | ((uint64_t) buf[9] << 16)
+              | ((uint64_t) buf[10] << 8) | buf[11];
+
+        *offset = (off_t) off;
+        rc = NGX_OK;
+    }
+
+done:
+
+    ngx_close_file(file.fd);
+
+    return rc;
+}
+
+
 /* This funcion returns pointer to a static buffer */
 static void
 ngx_rtmp_record_make_path(ngx_rtmp_session_t *s,
@@ -439,7 +1272,7 @@ ngx_rtmp_record_node_open(ngx_rtmp_session_t *s,
     ngx_err_t                   err;
     ngx_str_t                   path;
     ngx_int_t                   mode, create_mode;
-    u_char                      buf[8], *p;
+    u_char                      buf[8], *p, *buf_start;
     off_t                       file_size;
     uint32_t                    tag_size, mlen, timestamp;
 
@@ -453,8 +1286,13 @@ ngx_rtmp_record_node_open(ngx_rtmp_session_t *s,
     ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "record: %V opening", &rracf->id);
 
+    buf_start = rctx->buf_start;
+
     ngx_memzero(rctx, sizeof(*rctx));
     rctx->conf = rracf;
+    rctx->buf_start = buf_start;
+    rctx->buf_last = buf_start;
+    rctx->buf_end = buf_start ? buf_start + rracf->buffer : NULL;
     rctx->last = *ngx_cached_time;
     rctx->timestamp = ngx_cached_time->sec;
 
@@ -576,6 +1414,7 @@ ngx_rtmp_record_node_open(ngx_rtmp_session_t *s,
 done:
         rctx->file.offset = file_size;
         rctx->time_shift = timestamp;
+        rctx->index_append = (file_size > 0);
 
         ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                        "record: append offset=%O, time=%uD, tag_size=%uD",
@@ -593,6 +1432,9 @@ ngx_rtmp_record_init(ngx_rtmp_session_t *s)
     ngx_rtmp_record_rec_ctx_t      *rctx;
     ngx_rtmp_record_ctx_t          *ctx;
     ngx_uint_t                      n;
+#if (NGX_THREADS)
+    ngx_pool_cleanup_t             *cln;
+#endif
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_record_module);
 
@@ -614,6 +1456,18 @@ ngx_rtmp_record_init(ngx_rtmp_session_t *s)
 
     ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_record_module);
 
+#if (NGX_THREADS)
+    ngx_queue_init(&ctx->writers);
+
+    cln = ngx_pool_cleanup_add(s->connection->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_rtmp_record_writer_cleanup;
+    cln->data = ctx;
+#endif
+
     if (ngx_array_init(&ctx->rec, s->connection->pool, racf->rec.nelts,
                        sizeof(ngx_rtmp_record_rec_ctx_t))
         != NGX_OK)
@@ -634,6 +1488,17 @@ ngx_rtmp_record_init(ngx_rtmp_session_t *s)
 
         rctx->conf = *rracf;
         rctx->file.fd = NGX_INVALID_FILE;
+
+        if ((*rracf)->buffer) {
+            rctx->buf_start = ngx_palloc(s->connection->pool,
+                                         (*rracf)->buffer);
+            if (rctx->buf_start == NULL) {
+                return NGX_ERROR;
+            }
+
+            rctx->buf_last = rctx->buf_start;
+            rctx->buf_end = rctx->buf_start + (*rracf)->buffer;
+        }
     }
 
     return NGX_OK;
@@ -787,10 +1652,11 @@ ngx_rtmp_record_node_close(ngx_rtmp_session_t *s,
 {
     ngx_rtmp_record_app_conf_t *rracf;
     ngx_err_t                   err;
-    void                      **app_conf;
-    ngx_int_t                   rc;
-    ngx_rtmp_record_done_t      v;
+    ngx_str_t                   path;
     u_char                      av;
+#if (NGX_THREADS)
+    ngx_int_t                   rc;
+#endif
 
     rracf = rctx->conf;
 
@@ -798,22 +1664,44 @@ ngx_rtmp_record_node_close(ngx_rtmp_session_t *s,
         return NGX_AGAIN;
     }
 
-    if (rctx->initialized) {
-        av = 0;
+    if (ngx_rtmp_record_flush(s, rctx) != NGX_OK) {
+        ngx_log_error(NGX_LOG_CRIT, s->connection->log, ngx_errno,
+                      "record: %V error flushing file", &rracf->id);
+    }
 
-        if (rctx->video) {
-            av |= 0x01;
-        }
+    av = 0;
 
-        if (rctx->audio) {
-            av |= 0x04;
-        }
+    if (rctx->video) {
+        av |= 0x01;
+    }
 
-        if (ngx_write_file(&rctx->file, &av, 1, 4) == NGX_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, s->connection->log, ngx_errno,
-                          "record: %V error writing av mask", &rracf->id);
+    if (rctx->audio) {
+        av |= 0x04;
+    }
+
+    ngx_rtmp_record_make_path(s, rctx, &path);
+
+#if (NGX_THREADS)
+    if (rctx->writer) {
+        rc = ngx_rtmp_record_writer_close(s, rctx, av, &path);
+        if (rc != NGX_DECLINED) {
+            return rc;
         }
     }
+#endif
+
+    if (rctx->initialized) {
+        ngx_rtmp_record_finish(s->connection->log, rracf, rctx->file.fd, av,
+                               &path, rctx->index, rctx->nindex,
+                               rctx->index_append);
+    }
+
+    if (rctx->index) {
+        ngx_free(rctx->index);
+        rctx->index = NULL;
+        rctx->nindex = 0;
+        rctx->index_alloc = 0;
+    }
 
     if (ngx_close_file(rctx->file.fd) == NGX_FILE_ERROR) {
         err = ngx_errno;
@@ -825,28 +1713,7 @@ ngx_rtmp_record_node_close(ngx_rtmp_session_t *s,
 
     rctx->file.fd = NGX_INVALID_FILE;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                   "record: %V closed", &rracf->id);
-
-    if (rracf->notify) {
-        ngx_rtmp_send_status(s, "NetStream.Record.Stop", "status",
-                             rracf->id.data ? (char *) rracf->id.data : "");
-    }
-
-    app_conf = s->app_conf;
-
-    if (rracf->rec_conf) {
-        s->app_conf = rracf->rec_conf;
-    }
-
-    v.recorder = rracf->id;
-    ngx_rtmp_record_make_path(s, rctx, &v.path);
-
-    rc = ngx_rtmp_record_done(s, &v);
-
-    s->app_conf = app_conf;
-
-    return rc;
+    return ngx_rtmp_record_closed(s, rracf, &path);
 }
 
 
@@ -921,12 +1788,9 @@ ngx_rtmp_record_write_frame(ngx_rtmp_session_t *s,
 
     tag_size = (ph - hdr) + h->mlen;
 
-    if (ngx_write_file(&rctx->file, hdr, ph - hdr, rctx->file.offset)
-        == NGX_ERROR)
-    {
+    if (ngx_rtmp_record_write(s, rctx, hdr, ph - hdr) != NGX_OK) {
         ngx_rtmp_record_notify_error(s, rctx);
-
-        ngx_close_file(rctx->file.fd);
+        ngx_rtmp_record_abort(s, rctx);
 
         return NGX_ERROR;
     }
@@ -942,9 +1806,9 @@ ngx_rtmp_record_write_frame(ngx_rtmp_session_t *s,
             continue;
         }
 
-        if (ngx_write_file(&rctx->file, in->buf->pos, in->buf->last
-                           - in->buf->pos, rctx->file.offset)
-            == NGX_ERROR)
+        if (ngx_rtmp_record_write(s, rctx, in->buf->pos,
+                                  in->buf->last - in->buf->pos)
+            != NGX_OK)
         {
             return NGX_ERROR;
         }
@@ -959,17 +1823,16 @@ ngx_rtmp_record_write_frame(ngx_rtmp_session_t *s,
     *ph++ = p[1];
     *ph++ = p[0];
 
-    if (ngx_write_file(&rctx->file, hdr, ph - hdr,
-                       rctx->file.offset)
-        == NGX_ERROR)
-    {
+    if (ngx_rtmp_record_write(s, rctx, hdr, ph - hdr) != NGX_OK) {
         return NGX_ERROR;
     }
 
     rctx->nframes += inc_nframes;
 
     /* watch max size */
-    if ((rracf->max_size && rctx->file.offset >= (ngx_int_t) rracf->max_size) ||
+    if ((rracf->max_size &&
+         rctx->file.offset + (rctx->buf_last - rctx->buf_start)
+         >= (off_t) rracf->max_size) ||
         (rracf->max_frames && rctx->nframes >= rracf->max_frames))
     {
         ngx_rtmp_record_node_close(s, rctx);
@@ -1023,8 +1886,10 @@ ngx_rtmp_record_node_av(ngx_rtmp_session_t *s, ngx_rtmp_record_rec_ctx_t *rctx,
     ngx_time_t                      next;
     ngx_rtmp_header_t               ch;
     ngx_rtmp_codec_ctx_t           *codec_ctx;
+    ngx_rtmp_codec_au_t            *au;
     ngx_int_t                       keyframe, brkframe;
     ngx_rtmp_record_app_conf_t     *rracf;
+    uint32_t                        timestamp;
 
     rracf = rctx->conf;
 
@@ -1033,9 +1898,9 @@ ngx_rtmp_record_node_av(ngx_rtmp_session_t *s, ngx_rtmp_record_rec_ctx_t *rctx,
         return NGX_OK;
     }
 
-    keyframe = (h->type == NGX_RTMP_MSG_VIDEO)
-             ? (ngx_rtmp_get_video_frame_type(in) == NGX_RTMP_VIDEO_KEY_FRAME)
-             : 0;
+    au = ngx_rtmp_codec_get_au(s, h, in);
+
+    keyframe = (h->type == NGX_RTMP_MSG_VIDEO && au) ? au->key : 0;
 
     brkframe = (h->type == NGX_RTMP_MSG_VIDEO)
              ? keyframe
@@ -1092,7 +1957,7 @@ ngx_rtmp_record_node_av(ngx_rtmp_session_t *s, ngx_rtmp_record_rec_ctx_t *rctx,
         rctx->epoch = h->timestamp - rctx->time_shift;
 
         if (rctx->file.offset == 0 &&
-            ngx_rtmp_record_write_header(&rctx->file) != NGX_OK)
+            ngx_rtmp_record_write_header(s, rctx) != NGX_OK)
         {
             ngx_rtmp_record_node_close(s, rctx);
             return NGX_OK;
@@ -1177,6 +2042,47 @@ ngx_rtmp_record_node_av(ngx_rtmp_session_t *s, ngx_rtmp_record_rec_ctx_t *rctx,
         }
     }
 
+#if (NGX_THREADS)
+    if (rracf->thread_pool
+        && rracf->backlog_policy == NGX_RTMP_RECORD_BACKLOG_DROP)
+    {
+        /* disk is behind: drop frames, resume on a keyframe */
+
+        if (ngx_rtmp_record_backlog(rctx) >= rracf->backlog) {
+            if (!rctx->dropping) {
+                ngx_log_error(NGX_LOG_WARN, s->connection->log, 0,
+                              "record: %V backlog full, dropping frames",
+                              &rracf->id);
+            }
+
+            rctx->dropping = 1;
+        }
+
+        if (rctx->dropping) {
+            if (ngx_rtmp_record_backlog(rctx) >= rracf->backlog
+                || (h->type == NGX_RTMP_MSG_VIDEO && !keyframe)
+                || (h->type == NGX_RTMP_MSG_AUDIO && rctx->video))
+            {
+                return NGX_OK;
+            }
+
+            rctx->dropping = 0;
+        }
+    }
+#endif
+
+    if (rracf->index && keyframe) {
+        timestamp = h->timestamp - rctx->epoch;
+
+        if ((int32_t) timestamp < 0) {
+            timestamp = 0;
+        }
+
+        (void) ngx_rtmp_record_index_add(s, rctx, timestamp,
+                                         rctx->file.offset
+                                         + (rctx->buf_last - rctx->buf_start));
+    }
+
     return ngx_rtmp_record_write_frame(s, rctx, h, in, 1);
 }
 
@@ -1291,6 +2197,11 @@ ngx_rtmp_record_postconfiguration(ngx_conf_t *cf)
     h = ngx_array_push(&cmcf->events[NGX_RTMP_MSG_VIDEO]);
     *h = ngx_rtmp_record_av;
 
+#if (NGX_THREADS)
+    h = ngx_array_push(&cmcf->events[NGX_RTMP_DISCONNECT]);
+    *h = ngx_rtmp_record_disconnect;
+#endif
+
     next_publish = ngx_rtmp_publish;
     ngx_rtmp_publish = ngx_rtmp_record_publish;
 
@@ -11,6 +11,8 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include "ngx_rtmp.h"
+#include "ngx_rtmp_cmd_module.h"
+#include "ngx_rtmp_thread.h"
 
 
 #define NGX_RTMP_RECORD_OFF             0x01
@@ -20,6 +22,19 @@
 #define NGX_RTMP_RECORD_MANUAL          0x10
 
 
+#define NGX_RTMP_RECORD_BACKLOG_BLOCK   0
+#define NGX_RTMP_RECORD_BACKLOG_DROP    1
+
+
+/*
+ * Keyframe index stored next to a recorded file as <path>.idx:
+ * big-endian entries of 32-bit timestamp (msec) and 64-bit tag offset,
+ * in file order
+ */
+#define NGX_RTMP_RECORD_INDEX_SUFFIX    ".idx"
+#define NGX_RTMP_RECORD_INDEX_ENTRY     12
+
+
 typedef struct {
     ngx_str_t                           id;
     ngx_uint_t                          flags;
@@ -33,15 +48,46 @@ typedef struct {
     ngx_flag_t                          lock_file;
     ngx_flag_t                          notify;
     ngx_url_t                          *url;
+    ngx_flag_t                          index;
+    size_t                              buffer;
+    size_t                              backlog;
+    ngx_uint_t                          backlog_policy;
+#if (NGX_THREADS)
+    ngx_thread_pool_t                  *thread_pool;
+#endif
 
     void                              **rec_conf;
     ngx_array_t                         rec; /* ngx_rtmp_record_app_conf_t * */
 } ngx_rtmp_record_app_conf_t;
 
 
+typedef struct {
+    uint32_t                            timestamp;
+    off_t                               offset;
+} ngx_rtmp_record_index_t;
+
+
+/* owns the descriptor of a recorded file while thread pool writes run */
+typedef struct ngx_rtmp_record_writer_s  ngx_rtmp_record_writer_t;
+
+
 typedef struct {
     ngx_rtmp_record_app_conf_t         *conf;
     ngx_file_t                          file;
+
+    /* keyframes of the current file, heap allocated */
+    ngx_rtmp_record_index_t            *index;
+    ngx_uint_t                          nindex;
+    ngx_uint_t                          index_alloc;
+
+    /* staging buffer, file.offset does not include staged bytes */
+    u_char                             *buf_start;
+    u_char                             *buf_last;
+    u_char                             *buf_end;
+
+    /* thread pool writes of the current file */
+    ngx_rtmp_record_writer_t           *writer;
+
     ngx_uint_t                          nframes;
     uint32_t                            epoch, time_shift;
     ngx_time_t                          last;
@@ -53,11 +99,14 @@ typedef struct {
     unsigned                            video_key_sent:1;
     unsigned                            audio:1;
     unsigned                            video:1;
+    unsigned                            dropping:1;
+    unsigned                            index_append:1;
 } ngx_rtmp_record_rec_ctx_t;
 
 
 typedef struct {
     ngx_array_t                         rec; /* ngx_rtmp_record_rec_ctx_t */
+    ngx_queue_t                         writers; /* ngx_rtmp_record_writer_t */
     u_char                              name[NGX_RTMP_MAX_NAME];
     u_char                              args[NGX_RTMP_MAX_ARGS];
 } ngx_rtmp_record_ctx_t;
@@ -67,6 +116,14 @@ ngx_uint_t ngx_rtmp_record_find(ngx_rtmp_record_app_conf_t *racf,
            ngx_str_t *id);
 
 
+/* Binary search in the keyframe index next to the recorded file 'name';
+ * sets offset of the last keyframe not after timestamp.
+ * Returns NGX_DECLINED if there's no index or no such keyframe */
+
+ngx_int_t ngx_rtmp_record_index_lookup(ngx_str_t *name, uint32_t timestamp,
+          off_t *offset, ngx_log_t *log);
+
+
 /* Manual recording control,
  * 'n' is record node index in config array.
  * Note: these functions allocate path in static buffer */
@@ -13,6 +13,8 @@
 #include "ngx_rtmp_live_module.h"
 #include "ngx_rtmp_play_module.h"
 #include "ngx_rtmp_codec_module.h"
+#include "http/ngx_rtmp_to_flv_packet.h"
+#include "ngx_rtmp_counter_module.h"
 
 
 static ngx_int_t ngx_rtmp_stat_init_process(ngx_cycle_t *cycle);
@@ -31,6 +33,7 @@ static time_t                       start_time;
 #define NGX_RTMP_STAT_LIVE          0x02
 #define NGX_RTMP_STAT_CLIENTS       0x04
 #define NGX_RTMP_STAT_PLAY          0x08
+#define NGX_RTMP_STAT_COUNTERS      0x10
 
 /*
  * global: stat-{bufs-{total,free,used}, total bytes in/out, bw in/out} - cscf
@@ -48,6 +51,7 @@ static ngx_conf_bitmask_t           ngx_rtmp_stat_masks[] = {
     { ngx_string("global"),         NGX_RTMP_STAT_GLOBAL        },
     { ngx_string("live"),           NGX_RTMP_STAT_LIVE          },
     { ngx_string("clients"),        NGX_RTMP_STAT_CLIENTS       },
+    { ngx_string("counters"),       NGX_RTMP_STAT_COUNTERS      },
     { ngx_null_string,              0 }
 };
 
@@ -722,6 +726,152 @@ ngx_rtmp_stat_server(ngx_http_request_t *r, ngx_chain_t ***lll,
 }
 
 
+static void
+ngx_rtmp_stat_flv_pool(ngx_http_request_t *r, ngx_chain_t ***lll)
+{
+    ngx_http_flv_pool_stat_t   *st = &ngx_http_flv_pool_stat;
+    u_char                      buf[NGX_INT_T_LEN];
+
+    NGX_RTMP_STAT_L("<flv_pool>\r\n");
+
+    NGX_RTMP_STAT_L("<tag_alloc>");
+    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                  "%ui", st->tag_alloc) - buf);
+    NGX_RTMP_STAT_L("</tag_alloc>\r\n");
+
+    NGX_RTMP_STAT_L("<tag_hit_rate>");
+    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%ui",
+                  st->tag_alloc ? st->tag_hit * 100 / st->tag_alloc : 0)
+                  - buf);
+    NGX_RTMP_STAT_L("</tag_hit_rate>\r\n");
+
+    NGX_RTMP_STAT_L("<bytes_in_use>");
+    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                  "%uz", st->bytes_in_use) - buf);
+    NGX_RTMP_STAT_L("</bytes_in_use>\r\n");
+
+    NGX_RTMP_STAT_L("<bytes_in_use_max>");
+    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                  "%uz", st->bytes_in_use_max) - buf);
+    NGX_RTMP_STAT_L("</bytes_in_use_max>\r\n");
+
+    NGX_RTMP_STAT_L("<bytes_cached>");
+    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                  "%uz", st->bytes_cached) - buf);
+    NGX_RTMP_STAT_L("</bytes_cached>\r\n");
+
+    NGX_RTMP_STAT_L("<frame_alloc>");
+    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                  "%ui", st->frame_alloc) - buf);
+    NGX_RTMP_STAT_L("</frame_alloc>\r\n");
+
+    NGX_RTMP_STAT_L("<frame_hit_rate>");
+    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%ui",
+                  st->frame_alloc ? st->frame_hit * 100 / st->frame_alloc : 0)
+                  - buf);
+    NGX_RTMP_STAT_L("</frame_hit_rate>\r\n");
+
+    NGX_RTMP_STAT_L("<frames_in_use>");
+    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                  "%ui", st->frames_in_use) - buf);
+    NGX_RTMP_STAT_L("</frames_in_use>\r\n");
+
+    NGX_RTMP_STAT_L("<frames_in_use_max>");
+    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                  "%ui", st->frames_in_use_max) - buf);
+    NGX_RTMP_STAT_L("</frames_in_use_max>\r\n");
+
+    NGX_RTMP_STAT_L("</flv_pool>\r\n");
+}
+
+
+typedef struct {
+    ngx_http_request_t             *r;
+    ngx_chain_t                  ***lll;
+    ngx_flag_t                      app_open;
+} ngx_rtmp_stat_counters_ctx_t;
+
+
+static char  *ngx_rtmp_stat_counter_names[] = {
+    "in_video_bytes",
+    "in_audio_bytes",
+    "in_video_frames",
+    "out_video_bytes",
+    "out_audio_bytes",
+    "out_video_frames",
+    "drop_video_frames",
+    "publishers",
+    "players"
+};
+
+
+static void
+ngx_rtmp_stat_counters_visit(void *data, u_char *app, u_char *name,
+        ngx_atomic_uint_t *v)
+{
+    ngx_rtmp_stat_counters_ctx_t   *sc = data;
+    ngx_http_request_t             *r = sc->r;
+    ngx_chain_t                  ***lll = sc->lll;
+    ngx_uint_t                      n;
+    u_char                          buf[NGX_INT64_LEN + 1];
+
+    if (name == NULL) {
+        if (sc->app_open) {
+            NGX_RTMP_STAT_L("</application>\r\n");
+        }
+        sc->app_open = 1;
+
+        NGX_RTMP_STAT_L("<application>\r\n<name>");
+        NGX_RTMP_STAT_ECS(app);
+        NGX_RTMP_STAT_L("</name>\r\n");
+
+    } else {
+        NGX_RTMP_STAT_L("<stream>\r\n<name>");
+        NGX_RTMP_STAT_ECS(name);
+        NGX_RTMP_STAT_L("</name>\r\n");
+    }
+
+    for (n = 0; n < NGX_RTMP_COUNTER_N; n++) {
+        NGX_RTMP_STAT_L("<");
+        NGX_RTMP_STAT_CS(ngx_rtmp_stat_counter_names[n]);
+        NGX_RTMP_STAT_L(">");
+        /* publishers/players是当前值, 按有符号输出 */
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                      n >= NGX_RTMP_COUNTER_PUBLISHERS ? "%A" : "%uA",
+                      v[n]) - buf);
+        NGX_RTMP_STAT_L("</");
+        NGX_RTMP_STAT_CS(ngx_rtmp_stat_counter_names[n]);
+        NGX_RTMP_STAT_L(">\r\n");
+    }
+
+    if (name) {
+        NGX_RTMP_STAT_L("</stream>\r\n");
+    }
+}
+
+
+/* 所有worker的计数汇总, 直接读共享内存, 不遍历会话 */
+static void
+ngx_rtmp_stat_counters(ngx_http_request_t *r, ngx_chain_t ***lll)
+{
+    ngx_rtmp_stat_counters_ctx_t    sc;
+
+    sc.r = r;
+    sc.lll = lll;
+    sc.app_open = 0;
+
+    NGX_RTMP_STAT_L("<counters>\r\n");
+
+    (void) ngx_rtmp_counter_walk(r->pool, ngx_rtmp_stat_counters_visit, &sc);
+
+    if (sc.app_open) {
+        NGX_RTMP_STAT_L("</application>\r\n");
+    }
+
+    NGX_RTMP_STAT_L("</counters>\r\n");
+}
+
+
 static ngx_int_t
 ngx_rtmp_stat_handler(ngx_http_request_t *r)
 {
@@ -788,6 +938,12 @@ ngx_rtmp_stat_handler(ngx_http_request_t *r)
     ngx_rtmp_stat_bw(r, lll, &ngx_rtmp_bw_in, "in", NGX_RTMP_STAT_BW_BYTES);
     ngx_rtmp_stat_bw(r, lll, &ngx_rtmp_bw_out, "out", NGX_RTMP_STAT_BW_BYTES);
 
+    ngx_rtmp_stat_flv_pool(r, lll);
+
+    if (slcf->stat & NGX_RTMP_STAT_COUNTERS) {
+        ngx_rtmp_stat_counters(r, lll);
+    }
+
     cscf = cmcf->servers.elts;
     for (n = 0; n < cmcf->servers.nelts; ++n, ++cscf) {
         ngx_rtmp_stat_server(r, lll, *cscf);
@@ -0,0 +1,271 @@
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp_thread.h"
+
+
+#if (NGX_THREADS)
+
+
+typedef struct {
+    ngx_rtmp_thread_job_t               job;
+    u_char                             *src;
+    u_char                             *dst;
+} ngx_rtmp_thread_rename_t;
+
+
+static void ngx_rtmp_thread_queue_run(ngx_rtmp_thread_queue_t *q);
+
+
+static void
+ngx_rtmp_thread_task_handler(void *data, ngx_log_t *log)
+{
+    ngx_rtmp_thread_queue_t    *q = data;
+
+    q->head->handler(q->head, log);
+}
+
+
+static void
+ngx_rtmp_thread_complete(ngx_rtmp_thread_queue_t *q)
+{
+    ngx_rtmp_thread_job_t      *job;
+
+    job = q->head;
+
+    q->head = job->next;
+    if (q->head == NULL) {
+        q->last = &q->head;
+    }
+
+    /* done中提交的任务只排队, 由调用方继续执行 */
+
+    if (job->done) {
+        job->done(job, q->data);
+    }
+
+    ngx_free(job);
+
+    q->njobs--;
+}
+
+
+static void
+ngx_rtmp_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_rtmp_thread_queue_t    *q = ev->data;
+
+    ngx_rtmp_thread_complete(q);
+
+    ngx_rtmp_thread_queue_run(q);
+
+    if (q->head == NULL && q->data == NULL) {
+        ngx_free(q);
+    }
+}
+
+
+static void
+ngx_rtmp_thread_queue_run(ngx_rtmp_thread_queue_t *q)
+{
+    while (q->head) {
+        if (ngx_thread_task_post(q->pool, &q->task) == NGX_OK) {
+            return;
+        }
+
+        /* 线程池队列满, 直接执行, 不能打乱顺序 */
+
+        q->head->handler(q->head, q->task.event.log);
+
+        ngx_rtmp_thread_complete(q);
+    }
+}
+
+
+static void
+ngx_rtmp_thread_queue_detach(void *data)
+{
+    ngx_rtmp_thread_queue_t    *q = data;
+
+    q->data = NULL;
+
+    if (q->head == NULL) {
+        ngx_free(q);
+    }
+}
+
+
+ngx_rtmp_thread_queue_t *
+ngx_rtmp_thread_queue_create(ngx_thread_pool_t *tp, void *data,
+    ngx_pool_t *pool)
+{
+    ngx_rtmp_thread_queue_t    *q;
+    ngx_pool_cleanup_t         *cln;
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    q = ngx_calloc(sizeof(ngx_rtmp_thread_queue_t), pool->log);
+    if (q == NULL) {
+        return NULL;
+    }
+
+    cln->handler = ngx_rtmp_thread_queue_detach;
+    cln->data = q;
+
+    q->pool = tp;
+    q->data = data;
+    q->last = &q->head;
+
+    q->task.ctx = q;
+    q->task.handler = ngx_rtmp_thread_task_handler;
+    q->task.event.handler = ngx_rtmp_thread_event_handler;
+    q->task.event.data = q;
+    q->task.event.log = ngx_cycle->log;
+
+    return q;
+}
+
+
+void *
+ngx_rtmp_thread_job_alloc(size_t size, ngx_log_t *log)
+{
+    return ngx_calloc(size, log);
+}
+
+
+void
+ngx_rtmp_thread_job_post(ngx_rtmp_thread_queue_t *q,
+    ngx_rtmp_thread_job_t *job)
+{
+    job->next = NULL;
+
+    *q->last = job;
+    q->last = &job->next;
+
+    if (q->njobs++ == 0) {
+        ngx_rtmp_thread_queue_run(q);
+    }
+}
+
+
+static void
+ngx_rtmp_thread_run_handler(void *data, ngx_log_t *log)
+{
+    ngx_rtmp_thread_job_t      *job = data;
+
+    job->handler(job, log);
+}
+
+
+static void
+ngx_rtmp_thread_run_event_handler(ngx_event_t *ev)
+{
+    ngx_thread_task_t          *task = ev->data;
+    ngx_rtmp_thread_job_t      *job = task->ctx;
+
+    if (job->done) {
+        job->done(job, NULL);
+    }
+
+    ngx_free(job);
+    ngx_free(task);
+}
+
+
+ngx_int_t
+ngx_rtmp_thread_job_run(ngx_thread_pool_t *tp, ngx_rtmp_thread_job_t *job,
+    ngx_log_t *log)
+{
+    ngx_thread_task_t          *task;
+
+    task = ngx_calloc(sizeof(ngx_thread_task_t), log);
+    if (task == NULL) {
+        return NGX_ERROR;
+    }
+
+    task->ctx = job;
+    task->handler = ngx_rtmp_thread_run_handler;
+    task->event.handler = ngx_rtmp_thread_run_event_handler;
+    task->event.data = task;
+    task->event.log = ngx_cycle->log;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        ngx_free(task);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_thread_rename_handler(ngx_rtmp_thread_job_t *job, ngx_log_t *log)
+{
+    ngx_rtmp_thread_rename_t   *rn = (ngx_rtmp_thread_rename_t *) job;
+
+    if (ngx_rename_file(rn->src, rn->dst) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      rn->src, rn->dst);
+        job->rc = NGX_ERROR;
+        return;
+    }
+
+    job->rc = NGX_OK;
+}
+
+
+ngx_int_t
+ngx_rtmp_thread_rename(ngx_rtmp_thread_queue_t *q, ngx_str_t *src,
+    ngx_str_t *dst, ngx_rtmp_thread_done_pt done, ngx_log_t *log)
+{
+    ngx_rtmp_thread_rename_t   *rn;
+
+    rn = ngx_rtmp_thread_job_alloc(sizeof(ngx_rtmp_thread_rename_t)
+                                   + src->len + 1 + dst->len + 1, log);
+    if (rn == NULL) {
+        return NGX_ERROR;
+    }
+
+    rn->src = (u_char *) &rn[1];
+    rn->dst = ngx_cpymem(rn->src, src->data, src->len) + 1;
+    ngx_memcpy(rn->dst, dst->data, dst->len);
+
+    rn->job.handler = ngx_rtmp_thread_rename_handler;
+    rn->job.done = done;
+
+    ngx_rtmp_thread_job_post(q, &rn->job);
+
+    return NGX_OK;
+}
+
+
+char *
+ngx_rtmp_thread_pool_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    char  *p = conf;
+
+    ngx_str_t           *value;
+    ngx_thread_pool_t  **tp;
+
+    tp = (ngx_thread_pool_t **) (p + cmd->offset);
+
+    if (*tp != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    *tp = ngx_thread_pool_add(cf, &value[1]);
+    if (*tp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+#endif
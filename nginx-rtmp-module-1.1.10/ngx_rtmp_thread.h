@@ -0,0 +1,80 @@
+
+#ifndef _NGX_RTMP_THREAD_H_INCLUDED_
+#define _NGX_RTMP_THREAD_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#if (NGX_THREADS)
+
+#include <ngx_thread_pool.h>
+
+
+typedef struct ngx_rtmp_thread_job_s    ngx_rtmp_thread_job_t;
+typedef struct ngx_rtmp_thread_queue_s  ngx_rtmp_thread_queue_t;
+
+
+/*
+ * 任务在线程中执行handler, 完成后在事件循环中执行done,
+ * data为队列所有者, 所有者已经释放时为NULL;
+ * 任务只能引用自己分配的内存, 由ngx_rtmp_thread_job_alloc分配, 完成后释放
+ */
+typedef void (*ngx_rtmp_thread_handler_pt)(ngx_rtmp_thread_job_t *job,
+        ngx_log_t *log);
+typedef void (*ngx_rtmp_thread_done_pt)(ngx_rtmp_thread_job_t *job,
+        void *data);
+
+
+struct ngx_rtmp_thread_job_s {
+    ngx_rtmp_thread_job_t              *next;
+    ngx_rtmp_thread_handler_pt          handler;
+    ngx_rtmp_thread_done_pt             done;
+    ngx_int_t                           rc;
+};
+
+
+/* 一个流一个队列, 同一时刻只有一个任务在线程池中, 保证按提交顺序执行 */
+struct ngx_rtmp_thread_queue_s {
+    ngx_thread_pool_t                  *pool;
+    ngx_thread_task_t                   task;
+    ngx_rtmp_thread_job_t              *head;
+    ngx_rtmp_thread_job_t             **last;
+    void                               *data;
+    ngx_uint_t                          njobs;
+};
+
+
+/*
+ * pool为所有者所在的内存池, 内存池释放时队列与所有者分离,
+ * 剩余的任务继续执行, 全部完成后队列自己释放
+ */
+ngx_rtmp_thread_queue_t *ngx_rtmp_thread_queue_create(ngx_thread_pool_t *tp,
+        void *data, ngx_pool_t *pool);
+
+void *ngx_rtmp_thread_job_alloc(size_t size, ngx_log_t *log);
+
+/* 线程池队列满时在当前进程中直接执行 */
+void ngx_rtmp_thread_job_post(ngx_rtmp_thread_queue_t *q,
+        ngx_rtmp_thread_job_t *job);
+
+/*
+ * 不排队, 直接提交到线程池, 适合写不同偏移这类互不依赖的任务,
+ * 完成后以data为NULL调用done并释放; 线程池队列满时返回NGX_ERROR, 任务不释放
+ */
+ngx_int_t ngx_rtmp_thread_job_run(ngx_thread_pool_t *tp,
+        ngx_rtmp_thread_job_t *job, ngx_log_t *log);
+
+/* 在前面的任务全部完成后把src改名为dst, 用于播放列表 */
+ngx_int_t ngx_rtmp_thread_rename(ngx_rtmp_thread_queue_t *q, ngx_str_t *src,
+        ngx_str_t *dst, ngx_rtmp_thread_done_pt done, ngx_log_t *log);
+
+/* 配置thread_pool名字, 保存在ngx_thread_pool_t *字段中 */
+char *ngx_rtmp_thread_pool_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+
+#endif
+
+
+#endif /* _NGX_RTMP_THREAD_H_INCLUDED_ */